@@ -6,6 +6,9 @@
 #include <condition_variable>
 #include <mutex>
 #include <queue>
+#include <deque>
+#include <string>
+#include <memory>
 #include <vector>
 #include <chrono>
 #include <algorithm>
@@ -14,114 +17,279 @@
 
 #include "../../include/rowPacket.h"
 #include "../../include/libppm.h"   
-
-
-const bool USE_HASH = true;         
+#include "../../include/batchTuner.h"
+#include "../../include/placement.h"
+#include "../../include/coPipeline.h"
+#include "../../include/checksum.h"
+#include "../../include/imageStages.h"
+#include "../../include/memoryBudget.h"
+#include "../../include/integrity.h"
+#include "../../include/merkle.h"
+
+
+const integrity_policy_t INTEGRITY_POLICY = INTEGRITY_THREADS;  // checksums on S1->S2 and S2->S3, off: the rows never leave the process
+const checksum_algo CHECKSUM_ALGO = CHECKSUM_CRC32C;
 const int MAX_ITERATIONS = 1;
-const int MAX_QUEUE_SIZE = 512;
-const int PROCESSED_ROW_COUNT = 8;   // number of rows batched per rowPacket
+const size_t EDGE_BUDGET_BYTES = 16 << 20;      // bytes S1->S2 or S2->S3 may hold before the producer blocks
+const size_t PIPELINE_BUDGET_BYTES = 24 << 20;  // both queues together
+const int PROCESSED_ROW_COUNT = 8;   // number of rows batched per rowPacket (when ADAPTIVE_BATCH is off)
+const bool ADAPTIVE_BATCH = true;    // let S1 tune rows per packet from latency and queue occupancy
+const size_t TARGET_PACKET_BYTES = 64 * 1024;   // starting point for the tuner
 const int SCALING_FACTOR = 2;
+const bool USE_PINNING = true;       // pin S1/S2/S3 to neighbouring cores of one cache domain / numa node
+const bool DESCRIPTOR_PACKETS = true; // stages share row buffers, queues only carry (start_row, num_rows, sequence)
+const int MAX_EPOCHS_IN_FLIGHT = 2;  // how far S1 may run ahead of S3, in jobs
+const int SHUTDOWN_EPOCH = -1;
+const bool USE_COROUTINES = false;    // run S1/S2/S3 as coroutines that hand packets over by resuming each other, no queues
+const bool COROUTINE_THREADS = false; // coroutine mode only: S1 and S2 each on their own thread, same stage code
+const int COROUTINE_CHANNEL_SIZE = 64;  // packets an offloaded coroutine stage may run ahead
+const int MERKLE_BAND_ROWS = 32;      // rows per leaf of the hash tree over each output image
+const int MERKLE_THREADS = 2;         // threads hashing bands while S3 is still writing
+const bool MERKLE_SIDECAR = false;    // also write the tree to <output>.merkle
 // ---------------------------------------------------------------------------------
 
 
 std::queue<rowPacket> q_s1_s2, q_s2_s3;
 std::mutex mtx_s1_s2, mtx_s2_s3;
-std::condition_variable cv_empty_s1_s2, cv_fill_s1_s2;
-std::condition_variable cv_empty_s2_s3, cv_fill_s2_s3;
+std::condition_variable cv_fill_s1_s2, cv_fill_s2_s3;
+
+// backpressure for both queues, counted in bytes (see queued_bytes)
+enum { EDGE_S1_S2, EDGE_S2_S3 };
+memoryBudget g_budget(2, EDGE_BUDGET_BYTES, PIPELINE_BUDGET_BYTES);
+
+// sender and receiver share one counter set per link
+linkIntegrity g_link_s1_s2("S1->S2", INTEGRITY_POLICY, CHECKSUM_ALGO);
+linkIntegrity g_link_s2_s3("S2->S3", INTEGRITY_POLICY, CHECKSUM_ALGO);
+
+static size_t packet_bytes(const rowPacket &rp) {
+    return static_cast<size_t>(rp.num_rows) * rp.cols_per_row * 3;
+}
+
+// what a queued packet holds on to: its own pixels, or for a descriptor the rows of the
+// job's stage buffer it stands for, which its consumer has yet to read
+static size_t queued_bytes(const rowPacket &rp) {
+    size_t pinned = rp.pixels.empty() ? packet_bytes(rp) : 0;
+    return sizeof(rowPacket) + rp.pixels.capacity() + pinned;
+}
+
+// one pass of the pipeline over one image, the stage threads stay up across jobs
+typedef struct pipelineJob {
+    int epoch;
+    image_t* input_image;
+    image_t* output_image;
+    imageMerkle* merkle;    // fed by S3 with the rows it wrote, only on the last job of an image
 
-// using FNV hash function
-static std::size_t calculate_hash_for_packet(const rowPacket &rp) {
-    if (rp.pixels.empty()) return 0;
+    // intermediate images for descriptor packets, indexed by image row (row r at r * cols_per_row * 3)
+    std::vector<uint8_t> smooth_rows;   // written by S1, read by S2
+    std::vector<uint8_t> detail_rows;   // written by S2, read by S3
 
-    const std::size_t FNV_offset = 1469598103934665603ULL;
-    const std::size_t FNV_prime  = 1099511628211ULL;
-    std::size_t h = FNV_offset;
+    bool failed;            // a packet of it was dropped, some rows of output_image never got written
 
-    for (uint8_t b : rp.pixels) {
-        h ^= static_cast<std::size_t>(b);
-        h *= FNV_prime;
+    std::chrono::steady_clock::time_point finished;
+} pipelineJob;
+
+// indexed by epoch; a deque so references stay valid while main keeps submitting
+std::deque<pipelineJob> g_jobs;
+std::mutex mtx_jobs;
+std::condition_variable cv_jobs;
+int g_jobs_done = 0;
+bool g_shutdown = false;
+
+static pipelineJob& job_for_epoch(int epoch) {
+    std::lock_guard<std::mutex> lock(mtx_jobs);
+    return g_jobs[epoch];
+}
+
+static int submit_job(image_t* input_image, image_t* output_image, imageMerkle* merkle) {
+    int epoch;
+    {
+        std::lock_guard<std::mutex> lock(mtx_jobs);
+        epoch = static_cast<int>(g_jobs.size());
+        g_jobs.push_back(pipelineJob{epoch, input_image, output_image, merkle, {}, {}, false, {}});
     }
+    cv_jobs.notify_all();
+    return epoch;
+}
 
-    // incorporate position ,so that identical pixels in different rows are distinct
-    h ^= static_cast<std::size_t>(rp.start_row + 0x9e3779b9);
-    h *= FNV_prime;
-    h ^= static_cast<std::size_t>(rp.num_rows + 0x9e3779b9);
-    h *= FNV_prime;
+static void wait_for_jobs(int count) {
+    std::unique_lock<std::mutex> lock(mtx_jobs);
+    cv_jobs.wait(lock, [count]{ return g_jobs_done >= count; });
+}
 
-    return h;
+// rows a packet carries: its own pixels, or its slice of the shared stage buffer
+static uint8_t* packet_payload(rowPacket &rp, std::vector<uint8_t> &stage_rows) {
+    if (!rp.pixels.empty() || rp.num_rows == 0) 
+        return rp.pixels.data();
+    return stage_rows.data() + static_cast<size_t>(rp.start_row) * rp.cols_per_row * 3;
 }
 
 
-void S1_smoothen(image_t *input_image){
-    int width = input_image->width;
-    int height = input_image->height;
+// the stage kernels below are shared by the thread pipeline and the coroutine pipeline
+
+// allocates the intermediate rows of a job, S1 calls it before the first packet
+static void prepare_job(pipelineJob &job) {
+    if (DESCRIPTOR_PACKETS) {
+        size_t stage_bytes = static_cast<size_t>(job.input_image->height) * std::max(0, job.input_image->width - 2) * 3;
+        job.smooth_rows.assign(stage_bytes, 0);
+        job.detail_rows.assign(stage_bytes, 0);
+    }
+}
+
+// a stage dropped a corrupted packet of the job, main won't write its image
+static void fail_job(pipelineJob &job) {
+    std::lock_guard<std::mutex> lock(mtx_jobs);
+    job.failed = true;
+}
+
+// S3 saw the end of the job: drop its intermediate rows and let main / S1 know
+static void finish_job(int epoch) {
+    pipelineJob &job = job_for_epoch(epoch);
+    std::vector<uint8_t>().swap(job.smooth_rows);
+    std::vector<uint8_t>().swap(job.detail_rows);
+    {
+        std::lock_guard<std::mutex> lock(mtx_jobs);
+        job.finished = std::chrono::steady_clock::now();
+        g_jobs_done++;
+    }
+    cv_jobs.notify_all();
+}
+
+// fills rpkt with the smoothened rows it describes and sets its hash
+static void smoothen_packet(pipelineJob &job, rowPacket &rpkt) {
+    smoothen_rows(job.input_image, rpkt.start_row, rpkt.num_rows, packet_payload(rpkt, job.smooth_rows));
+
+    g_link_s1_s2.seal(rpkt, packet_payload(rpkt, job.smooth_rows), packet_bytes(rpkt));
+}
+
+// verifies a smooth packet and builds its difference packet, false if rpkt is corrupted
+static bool find_details_packet(pipelineJob &job, rowPacket &rpkt, rowPacket &out_rpkt) {
+    if (!g_link_s1_s2.check(rpkt, packet_payload(rpkt, job.smooth_rows), packet_bytes(rpkt))) {
+        // drop it, the other jobs in flight are unaffected
+        std::cerr << "Data Corrupted in rowPacket(start_row=" << rpkt.start_row << ", epoch=" << rpkt.epoch << ")!!\n";
+        fail_job(job);
+        return false;
+    }
+
+    // produce difference packet
+    out_rpkt = rowPacket(rpkt.start_row, rpkt.num_rows, rpkt.cols_per_row, DESCRIPTOR_PACKETS);
+    out_rpkt.sequence = rpkt.sequence;
+    out_rpkt.epoch = rpkt.epoch;
+
+    find_details_rows(job.input_image, rpkt.start_row, rpkt.num_rows, packet_payload(rpkt, job.smooth_rows), packet_payload(out_rpkt, job.detail_rows));
+
+    g_link_s2_s3.seal(out_rpkt, packet_payload(out_rpkt, job.detail_rows), packet_bytes(out_rpkt));
+
+    return true;
+}
+
+// verifies a difference packet and writes its sharpened rows to the output image
+static void sharpen_packet(pipelineJob &job, rowPacket &rpkt) {
+    if (!g_link_s2_s3.check(rpkt, packet_payload(rpkt, job.detail_rows), packet_bytes(rpkt))) {
+        std::cerr << "Data Corrupted in rowPacket(start_row=" << rpkt.start_row << ", epoch=" << rpkt.epoch << ")!!\n";
+        fail_job(job);
+        return;
+    }
+
+    sharpen_rows(job.input_image, job.output_image, rpkt.start_row, rpkt.num_rows, packet_payload(rpkt, job.detail_rows), SCALING_FACTOR);
+
+    if (job.merkle)
+        job.merkle->rows_done(rpkt.start_row, rpkt.num_rows);
+}
+
+
+// emits the packets of one job followed by its end-of-epoch marker, returns the tuned packet size
+static size_t S1_smoothen_job(pipelineJob &job, size_t target_bytes){
+    int height = job.input_image->height;
 
     // number of columns 
-    const int cols_per_row = std::max(0, width - 2);
+    const int cols_per_row = std::max(0, job.input_image->width - 2);
 
-    int dir[9][2] = {
-        {-1,-1}, {-1, 0}, {-1, 1},
-        {0 ,-1}, {0 , 0}, {0 , 1},
-        {1 ,-1}, {1 , 0}, {1 , 1}
-    };
+    prepare_job(job);
+
+    batchTuner tuner(target_bytes, static_cast<size_t>(cols_per_row) * 3, std::max(1, height - 2));
+    int sequence = 0;
 
     // process rows 1 .. height-2 (interior rows)
     for (int i = 1; i <= height - 2; ) {
         int batch_start = i;
-        int take = std::min(PROCESSED_ROW_COUNT, (height - 1) - i + 0); // ensure we don't go beyond height-2
+        int rows = ADAPTIVE_BATCH ? tuner.next_rows() : PROCESSED_ROW_COUNT;
+        int take = std::min(rows, (height - 1) - i + 0); // ensure we don't go beyond height-2
         if (take <= 0) break;
 
-        rowPacket rpkt(batch_start, take, cols_per_row);
-
-        for (int r_off = 0; r_off < take; r_off++) {
-            int r = batch_start + r_off;
-            for (int col = 1, cidx = 0; col <= width - 2; col++, cidx++) {
-                int sumR = 0, sumG = 0, sumB = 0;
-                for (int k = 0; k < 9; ++k) {
-                    int ii = r + dir[k][0];
-                    int jj = col + dir[k][1];
-                    sumR += input_image->image_pixels[ii][jj][0];
-                    sumG += input_image->image_pixels[ii][jj][1];
-                    sumB += input_image->image_pixels[ii][jj][2];
-                }
-                uint8_t sr = static_cast<uint8_t>(sumR / 9);
-                uint8_t sg = static_cast<uint8_t>(sumG / 9);
-                uint8_t sb = static_cast<uint8_t>(sumB / 9);
-                uint8_t *p = rpkt.pixel_ptr(r_off, cidx);
-                p[0] = sr; p[1] = sg; p[2] = sb;
-            }
-        }
+        auto start_pkt = std::chrono::steady_clock::now();
+
+        rowPacket rpkt(batch_start, take, cols_per_row, DESCRIPTOR_PACKETS);
+        rpkt.sequence = sequence++;
+        rpkt.epoch = job.epoch;
 
-        // compute and set hash (if enabled)
-        if (USE_HASH) 
-            rpkt.hash = calculate_hash_for_packet(rpkt);
+        smoothen_packet(job, rpkt);
 
-        // push to queue q_s1_s2 (wait if full)
+        std::chrono::duration<double, std::micro> latency = std::chrono::steady_clock::now() - start_pkt;
+        size_t occupancy = g_budget.in_flight(EDGE_S1_S2);
+
+        // push to queue q_s1_s2 (wait while it is over budget)
+        g_budget.acquire(EDGE_S1_S2, queued_bytes(rpkt));
         {
-            std::unique_lock<std::mutex> lock(mtx_s1_s2);
-            cv_empty_s1_s2.wait(lock, []{ return q_s1_s2.size() < MAX_QUEUE_SIZE; });
+            std::lock_guard<std::mutex> lock(mtx_s1_s2);
             q_s1_s2.push(std::move(rpkt));
         }
         cv_fill_s1_s2.notify_one();
 
+        tuner.observe(take, latency.count(), occupancy, EDGE_BUDGET_BYTES);
+
         i += take;
     }
 
-    // push terminal packet
+    if (ADAPTIVE_BATCH)
+        tuner.report(("S1[epoch " + std::to_string(job.epoch) + "]").c_str());
+
+    // push end of epoch packet
+    rowPacket term{true};
+    term.epoch = job.epoch;
+    g_budget.acquire(EDGE_S1_S2, queued_bytes(term));
     {
         std::lock_guard<std::mutex> lock(mtx_s1_s2);
-        q_s1_s2.push(rowPacket{true});
+        q_s1_s2.push(std::move(term));
     }
     cv_fill_s1_s2.notify_one();
+
+    return tuner.target_bytes();
 }
 
+void S1_smoothen(){
+    size_t target_bytes = TARGET_PACKET_BYTES;
+
+    for (int epoch = 0; ; epoch++) {
+        pipelineJob *job;
+        {
+            // wait for the next job, without running more than MAX_EPOCHS_IN_FLIGHT ahead of S3
+            std::unique_lock<std::mutex> lock(mtx_jobs);
+            cv_jobs.wait(lock, [epoch]{
+                bool ready = epoch < static_cast<int>(g_jobs.size()) && epoch - g_jobs_done < MAX_EPOCHS_IN_FLIGHT;
+                return ready || (g_shutdown && epoch >= static_cast<int>(g_jobs.size()));
+            });
+            if (epoch >= static_cast<int>(g_jobs.size())) 
+                break;
+            job = &g_jobs[epoch];
+        }
 
-void S2_find_details(image_t *input_image){
-    int width = input_image->width;
-    int height = input_image->height;
+        // keep what the tuner learnt for the next job
+        target_bytes = S1_smoothen_job(*job, target_bytes);
+    }
+
+    // push shutdown packet
+    rowPacket term{true};
+    term.epoch = SHUTDOWN_EPOCH;
+    g_budget.acquire(EDGE_S1_S2, queued_bytes(term));
+    {
+        std::lock_guard<std::mutex> lock(mtx_s1_s2);
+        q_s1_s2.push(std::move(term));
+    }
+    cv_fill_s1_s2.notify_one();
+}
 
-    const int cols_per_row = std::max(0, width - 2);
 
+void S2_find_details(){
     while (true) {
         rowPacket rpkt(false);
 
@@ -131,79 +299,38 @@ void S2_find_details(image_t *input_image){
             rpkt = std::move(q_s1_s2.front());
             q_s1_s2.pop();
         }
-        cv_empty_s1_s2.notify_one();
+        g_budget.release(EDGE_S1_S2, queued_bytes(rpkt));
 
         if (rpkt.is_last) {
-            // forward terminal
+            // forward end of epoch / shutdown
+            int epoch = rpkt.epoch;
+            g_budget.acquire(EDGE_S2_S3, queued_bytes(rpkt));
             {
                 std::lock_guard<std::mutex> lock(mtx_s2_s3);
-                q_s2_s3.push(rowPacket{true});
+                q_s2_s3.push(std::move(rpkt));
             }
             cv_fill_s2_s3.notify_one();
-            return;
-        }
 
-        // verify hash (if USE_HASH)
-        if (USE_HASH) {
-            std::size_t expected = calculate_hash_for_packet(rpkt);
-            if (expected != rpkt.hash) {
-                std::cerr << "Data Corrupted in rowPacket(start_row=" << rpkt.start_row << ")!!\n";
-
-                // forward treminate and exit
-                {
-                    std::lock_guard<std::mutex> lock(mtx_s2_s3);
-                    q_s2_s3.push(rowPacket{true});
-                }
-                cv_fill_s2_s3.notify_one();
+            if (epoch == SHUTDOWN_EPOCH) 
                 return;
-            }
+            continue;
         }
 
-        // produce difference packet
-        rowPacket out_rpkt(rpkt.start_row, rpkt.num_rows, rpkt.cols_per_row);
-
-        for (int r_off = 0; r_off < rpkt.num_rows; r_off++) {
-            int row_idx = rpkt.start_row + r_off;
-            for (int cidx = 0; cidx < rpkt.cols_per_row; cidx++) {
-
-                uint8_t* smooth_p = rpkt.pixel_ptr(r_off, cidx);
+        rowPacket out_rpkt(false);
+        if (!find_details_packet(job_for_epoch(rpkt.epoch), rpkt, out_rpkt)) 
+            continue;
 
-                int orig_col = 1 + cidx;
-
-                int diffR = input_image->image_pixels[row_idx][orig_col][0] - static_cast<int>(smooth_p[0]);
-                int diffG = input_image->image_pixels[row_idx][orig_col][1] - static_cast<int>(smooth_p[1]);
-                int diffB = input_image->image_pixels[row_idx][orig_col][2] - static_cast<int>(smooth_p[2]);
-                
-                if (diffR < 0) diffR = 0;
-                if (diffG < 0) diffG = 0;
-                if (diffB < 0) diffB = 0;
-                
-                uint8_t* out_p = out_rpkt.pixel_ptr(r_off, cidx);
-
-                out_p[0] = static_cast<uint8_t>(diffR);
-                out_p[1] = static_cast<uint8_t>(diffG);
-                out_p[2] = static_cast<uint8_t>(diffB);
-            }
-        }
-
-        // compute hash (if USE_HASH)
-        if (USE_HASH) 
-            out_rpkt.hash = calculate_hash_for_packet(out_rpkt);
-
-        // push to q_s2_s3
+        // push to q_s2_s3 (wait while it is over budget)
+        g_budget.acquire(EDGE_S2_S3, queued_bytes(out_rpkt));
         {
-            std::unique_lock<std::mutex> lock(mtx_s2_s3);
-            cv_empty_s2_s3.wait(lock, []{ return q_s2_s3.size() < MAX_QUEUE_SIZE; });
+            std::lock_guard<std::mutex> lock(mtx_s2_s3);
             q_s2_s3.push(std::move(out_rpkt));
         }
         cv_fill_s2_s3.notify_one();
     }
 }
 
-void S3_sharpen (image_t *input_image, image_t *output_image) {
-    int width = input_image->width;
-    int height = input_image->height;
-
+void S3_sharpen () {
     while (true) {
         rowPacket rpkt(false);
 
@@ -214,97 +341,238 @@ void S3_sharpen (image_t *input_image, image_t *output_image) {
             q_s2_s3.pop();
         }
 
-        cv_empty_s2_s3.notify_one();
+        g_budget.release(EDGE_S2_S3, queued_bytes(rpkt));
 
-        if (rpkt.is_last) 
-            return;
-
-        if (USE_HASH) {
-            std::size_t expected = calculate_hash_for_packet(rpkt);
-            if (expected != rpkt.hash) {
-                std::cerr << "Data Corrupted in rowPacket(start_row=" << rpkt.start_row << ")!!\n";
+        if (rpkt.is_last) {
+            if (rpkt.epoch == SHUTDOWN_EPOCH) 
                 return;
-            }
+
+            finish_job(rpkt.epoch);
+            continue;
         }
 
-        for (int r_off = 0; r_off < rpkt.num_rows; ++r_off) {
-            int i = rpkt.start_row + r_off;
-            for (int cidx = 0; cidx < rpkt.cols_per_row; ++cidx) {
-
-                uint8_t* diff_p = rpkt.pixel_ptr(r_off, cidx);
-                
-                int j = 1 + cidx;
-                
-                int newR = input_image->image_pixels[i][j][0] + (SCALING_FACTOR * static_cast<int>(diff_p[0]));
-                int newG = input_image->image_pixels[i][j][1] + (SCALING_FACTOR * static_cast<int>(diff_p[1]));
-                int newB = input_image->image_pixels[i][j][2] + (SCALING_FACTOR * static_cast<int>(diff_p[2]));
-                
-                output_image->image_pixels[i][j][0] = static_cast<uint8_t>(newR > 255 ? 255 : newR);
-                output_image->image_pixels[i][j][1] = static_cast<uint8_t>(newG > 255 ? 255 : newG);
-                output_image->image_pixels[i][j][2] = static_cast<uint8_t>(newB > 255 ? 255 : newB);
-            }
+        sharpen_packet(job_for_epoch(rpkt.epoch), rpkt);
+    }
+}
+
+
+// coroutine pipeline -----------------------------------------------------------------
+// same kernels, but each stage is a generator pulled by the next one, so on a single
+// thread a packet goes S1 -> S2 -> S3 as a chain of resumes while it is still in cache
+
+// smoothened packets of every submitted job, each job closed by its end-of-epoch marker
+static coGenerator<rowPacket> S1_smoothen_co(int num_jobs) {
+    size_t target_bytes = TARGET_PACKET_BYTES;
+
+    for (int epoch = 0; epoch < num_jobs; epoch++) {
+        pipelineJob &job = job_for_epoch(epoch);
+        int height = job.input_image->height;
+        const int cols_per_row = std::max(0, job.input_image->width - 2);
+
+        prepare_job(job);
+
+        batchTuner tuner(target_bytes, static_cast<size_t>(cols_per_row) * 3, std::max(1, height - 2));
+        int sequence = 0;
+
+        for (int i = 1; i <= height - 2; ) {
+            int rows = ADAPTIVE_BATCH ? tuner.next_rows() : PROCESSED_ROW_COUNT;
+            int take = std::min(rows, (height - 1) - i);
+            if (take <= 0) break;
+
+            auto start_pkt = std::chrono::steady_clock::now();
+
+            rowPacket rpkt(i, take, cols_per_row, DESCRIPTOR_PACKETS);
+            rpkt.sequence = sequence++;
+            rpkt.epoch = epoch;
+
+            smoothen_packet(job, rpkt);
+
+            // no queue to look at, the tuner only goes by the per packet latency
+            std::chrono::duration<double, std::micro> latency = std::chrono::steady_clock::now() - start_pkt;
+            tuner.observe(take, latency.count(), 0, COROUTINE_CHANNEL_SIZE);
+
+            co_yield std::move(rpkt);
+            i += take;
         }
+
+        if (ADAPTIVE_BATCH)
+            tuner.report(("S1[epoch " + std::to_string(epoch) + "]").c_str());
+        target_bytes = tuner.target_bytes();
+
+        rowPacket term{true};
+        term.epoch = epoch;
+        co_yield std::move(term);
+    }
+}
+
+static coGenerator<rowPacket> S2_find_details_co(coGenerator<rowPacket> smooth) {
+    for (rowPacket &rpkt : smooth) {
+        if (rpkt.is_last) {
+            co_yield std::move(rpkt);
+            continue;
+        }
+
+        rowPacket out_rpkt(false);
+        if (find_details_packet(job_for_epoch(rpkt.epoch), rpkt, out_rpkt)) 
+            co_yield std::move(out_rpkt);
+    }
+}
+
+// the sink, drives the whole chain from the calling thread
+static void S3_sharpen_co(coGenerator<rowPacket> details) {
+    for (rowPacket &rpkt : details) {
+        if (rpkt.is_last) 
+            finish_job(rpkt.epoch);
+        else 
+            sharpen_packet(job_for_epoch(rpkt.epoch), rpkt);
     }
 }
 
+// runs every submitted job through the coroutine stages, returns once all are written
+static void run_coroutine_pipeline(int num_jobs, const stage_placement_t &placement) {
+    if (!COROUTINE_THREADS) {
+        if (USE_PINNING) 
+            pin_thread_to_cpu(pthread_self(), placement.stage_cpus[0]);
+        S3_sharpen_co(S2_find_details_co(S1_smoothen_co(num_jobs)));
+        return;
+    }
+
+    // S1 and S2 driven by their own threads, S3 by the caller
+    int cpu_s1 = USE_PINNING ? placement.stage_cpus[0] : -1;
+    int cpu_s2 = USE_PINNING ? placement.stage_cpus[1] : -1;
+    if (USE_PINNING) 
+        pin_thread_to_cpu(pthread_self(), placement.stage_cpus[2]);
+
+    S3_sharpen_co(co_offload(S2_find_details_co(co_offload(S1_smoothen_co(num_jobs), COROUTINE_CHANNEL_SIZE, cpu_s1)), COROUTINE_CHANNEL_SIZE, cpu_s2));
+}
 
 int main(int argc, char **argv)
 {
-    if(argc != 3){
-        std::cout << "usage: ./a.out <path-to-original-image> <path-to-transformed-image>\n\n";
+    // more than one image can be pushed through the same (persistent) pipeline
+    if(argc < 3 || argc % 2 != 1){
+        std::cout << "usage: ./a.out <path-to-original-image> <path-to-transformed-image> [<original> <transformed> ...]\n\n";
         exit(0);
     }
+    int num_images = (argc - 1) / 2;
 
     std::cout << "\nProcessing Image..." <<std::endl;
     std::cout << "----------------------------------------------------------------------------------------------------------" << std::endl;
 
 
-    auto start_r = std::chrono::steady_clock::now();
-    image_t *input_image = read_ppm_file(argv[1]);
-    auto finish_r = std::chrono::steady_clock::now();
+    // decide placement before touching any image memory so the pages land on the stages' node
+    const char* const stage_names[] = {"S1", "S2", "S3"};
+    stage_placement_t placement;
+
+    if (USE_PINNING) {
+        placement = plan_stage_placement(3);
+        pin_process_to_cpus(0, placement.all_cpus);     // inherited by the stage threads
+        print_placement(placement, stage_names);
+    }
+
+    std::vector<image_t*> input_images, output_images;
+    std::vector<std::unique_ptr<imageMerkle>> merkles;
 
-    int height = input_image->height , width = input_image->width;
+    for (int img = 0; img < num_images; img++) {
+        image_t *input_image = read_ppm_file(argv[1 + 2 * img]);
 
-    image_t* output_image = new image_t;
+        int height = input_image->height , width = input_image->width;
 
-    output_image->height = height;  
-    output_image->width = width;
+        image_t* output_image = new image_t;
 
-    output_image->image_pixels = new uint8_t**[height];
-    for(int i = 0;i < height;i++){
-        output_image->image_pixels[i] = new uint8_t*[width];
-        for(int j = 0;j < width;j++)
-            output_image->image_pixels[i][j] = new uint8_t[3]();
+        output_image->height = height;  
+        output_image->width = width;
+
+        output_image->image_pixels = new uint8_t**[height];
+        for(int i = 0;i < height;i++){
+            output_image->image_pixels[i] = new uint8_t*[width];
+            for(int j = 0;j < width;j++)
+                output_image->image_pixels[i][j] = new uint8_t[3]();
+        }
+
+        input_images.push_back(input_image);
+        output_images.push_back(output_image);
+        merkles.push_back(std::make_unique<imageMerkle>(output_image, MERKLE_BAND_ROWS, MERKLE_THREADS));
+    }
+
+    // stage threads are started once and serve every iteration of every image
+    std:: thread t1, t2, t3;
+
+    if (!USE_COROUTINES) {
+        t1 = std::thread(S1_smoothen);
+        t2 = std::thread(S2_find_details);
+        t3 = std::thread(S3_sharpen);
+
+        if (USE_PINNING) {
+            pin_thread_to_cpu(t1.native_handle(), placement.stage_cpus[0]);
+            pin_thread_to_cpu(t2.native_handle(), placement.stage_cpus[1]);
+            pin_thread_to_cpu(t3.native_handle(), placement.stage_cpus[2]);
+        }
     }
 
     // for total time
     auto start_p = std::chrono::steady_clock::now();
 
-    for(int i = 0;i < MAX_ITERATIONS;i++){
-        std:: thread t1(S1_smoothen,input_image);
-        std:: thread t2(S2_find_details,input_image);
-        std:: thread t3(S3_sharpen,input_image,output_image);
+    // submit everything up front, consecutive jobs overlap in the pipeline
+    int total_jobs = 0;
+    for (int img = 0; img < num_images; img++) {
+        for(int i = 0;i < MAX_ITERATIONS;i++){
+            submit_job(input_images[img], output_images[img], i == MAX_ITERATIONS - 1 ? merkles[img].get() : nullptr);
+            total_jobs++;
+        }
+    }
+
+    if (USE_COROUTINES) 
+        run_coroutine_pipeline(total_jobs, placement);
+    else 
+        wait_for_jobs(total_jobs);
+
+    auto finish_p = std::chrono::steady_clock::now();
+
+    if (!USE_COROUTINES) {
+        {
+            std::lock_guard<std::mutex> lock(mtx_jobs);
+            g_shutdown = true;
+        }
+        cv_jobs.notify_all();
 
         t1.join();
         t2.join();
         t3.join();
-    }
 
-    auto finish_p = std::chrono::steady_clock::now();
+        g_budget.report("queues");
+    }
+    g_link_s1_s2.report();
+    g_link_s2_s3.report();
 
-    // for write time
-    auto start_w = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = finish_p - start_p;
 
-    write_ppm_file(argv[2],output_image);
+    std::cout << "Total Processing time per iteration " << elapsed.count()*1000/total_jobs << " ms\n";
 
-    auto finish_w = std::chrono::steady_clock::now();
+    // completion to completion, i.e. without the pipeline fill of the first job
+    if (total_jobs > 1) {
+        std::chrono::duration<double> steady = g_jobs[total_jobs - 1].finished - g_jobs[0].finished;
+        std::cout << "Steady-state time per iteration " << steady.count()*1000/(total_jobs - 1) << " ms\n";
+    }
 
-    std::chrono::duration<double> elapsed_seconds_write = finish_w - start_w;
+    // an image is only as good as every iteration over it, one with a dropped packet is not written
+    bool failed = false;
+    for (int img = 0; img < num_images; img++) {
+        bool image_failed = false;
+        for (int i = 0; i < MAX_ITERATIONS; i++)
+            image_failed = image_failed || g_jobs[img * MAX_ITERATIONS + i].failed;
+        if (image_failed) {
+            std::cerr << "Image " << argv[1 + 2 * img] << " had corrupted packets, " << argv[2 + 2 * img] << " not written\n";
+            failed = true;
+            continue;
+        }
 
-    std::chrono::duration<double> elapsed = finish_p - start_p;
+        write_ppm_file(argv[2 + 2 * img], output_images[img]);
+        std::cout << "Image written to " << argv[2 + 2 * img] << std::endl;
 
-    
-    std::cout << "Total Processing time per iteration " << elapsed.count()*1000/MAX_ITERATIONS << " ms\n";
-    std::cout << "Image written to " << argv[2] << std::endl;
-    return 0;
-}
+        const merkleTree& tree = merkles[img]->finish();
+        merkles[img]->report(argv[2 + 2 * img]);
+        if (MERKLE_SIDECAR)
+            write_merkle_sidecar(std::string(argv[2 + 2 * img]) + ".merkle", tree);
+    }
+    return failed ? 1 : 0;
+}
\ No newline at end of file
@@ -3,441 +3,462 @@
 #include <cstddef>
 #include <vector>
 #include <algorithm>
+#include <initializer_list>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <cstdlib>
 #include <chrono>
 #include <cstring>
 #include <cerrno>
+#include <string>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 
 #include "../../include/rowPacket.h"
 #include "../../include/libppm.h"   
-
-int fd_S1_S2[2], fd_S2_S3[2], fd_S3_P[2];
-
-const bool USE_HASH = true;         
+#include "../../include/packetIO.h"
+#include "../../include/imageStages.h"
+#include "../../include/checksum.h"
+#include "../../include/integrity.h"
+#include "../../include/merkle.h"
+#include "../../include/batchTuner.h"
+#include "../../include/placement.h"
+#include "../../include/stageJob.h"
+#include "../../include/mappedPPM.h"
+#include "../../include/bandPool.h"
+#include "../../include/frameHeader.h"
+
+int fd_S1_S2[2], fd_S2_S3[2], fd_S3_P[2];   // S3 -> parent only carries row notices, S3 writes into the mapped output
+int ctl_S1[2], ctl_S2[2], ctl_S3[2];    // parent -> stage job descriptors
+int g_input_fd = -1;                    // memfd the parent stages each job's input in, the stages map it
+
+// checksums per pipe, sampled: same machine, the kernel only copies
+const integrity_policy_t INTEGRITY_S1_S2 = INTEGRITY_LOCAL_IPC;
+const integrity_policy_t INTEGRITY_S2_S3 = INTEGRITY_LOCAL_IPC;
+const checksum_algo CHECKSUM_ALGO = CHECKSUM_CRC32C;   // engine for the packets we send, receivers go by the header
 const int MAX_ITERATIONS = 1;
-const int PROCESSED_ROW_COUNT = 32; 
+const int PROCESSED_ROW_COUNT = 32;    // max rows per packet, sizes the largest pipe frame
+const bool ADAPTIVE_BATCH = true;      // let S1 tune rows per packet from latency and pipe occupancy
+const size_t TARGET_PACKET_BYTES = 64 * 1024;
 const int SCALING_FACTOR = 2;
-
-// FNV hash function
-static std::size_t calculate_hash_for_packet(const rowPacket &rp) {
-
-    if (rp.pixels.empty()) 
-        return 0;
-
-    const std::size_t FNV_offset = 1469598103934665603ULL;
-    const std::size_t FNV_prime  = 1099511628211ULL;
-    
-    std::size_t h = FNV_offset;
-
-    for (uint8_t b : rp.pixels){
-        h ^= static_cast<std::size_t>(b);
-        h *= FNV_prime;
-    }
-    h ^= static_cast<std::size_t>(rp.start_row + 0x9e3779b9);
-    h *= FNV_prime;
-    h ^= static_cast<std::size_t>(rp.num_rows + 0x9e3779b9);
-    h *= FNV_prime;
-    return h;
-}
-
-// read/write helpers to counter partial reads/writes
-static ssize_t write_all(int fd, const void *buf, size_t count) {
-
-    const char *p = static_cast<const char*>(buf);
-    size_t written = 0;
-    while (written < count) {
-        ssize_t w = write(fd, p + written, count - written);
-        if (w < 0) {
-            if (errno == EINTR) continue;
-            return -1;
-        }
-        written += static_cast<size_t>(w);
-    }
-    return static_cast<ssize_t>(written);
-}
-
-static ssize_t read_all(int fd, void *buf, size_t count) {
-    char *p = static_cast<char*>(buf);
-    size_t got = 0;
-    while (got < count) {
-        ssize_t r = read(fd, p + got, count - got);
-        if (r < 0) {
-            if (errno == EINTR) continue;
-            return -1;
-        }
-        if (r == 0) return static_cast<ssize_t>(got); // EOF
-        got += static_cast<size_t>(r);
-    }
-    return static_cast<ssize_t>(got);
-}
-
-//**  header formate: int32_t start_row, int32_t num_rows, int32_t cols_per_row, uint64_t hash, uint8_t is_last
-
-static const size_t HDR_SIZE = sizeof(int32_t)*3 + sizeof(uint64_t) + sizeof(uint8_t);
-
-static void serialize_header(char *dst, int32_t start_row, int32_t num_rows, int32_t cols_per_row, uint64_t hash, uint8_t is_last) {
-
-    size_t off = 0;
-    
-    memcpy(dst + off, &start_row, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(dst + off, &num_rows, sizeof(int32_t));  off += sizeof(int32_t);
-    memcpy(dst + off, &cols_per_row, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(dst + off, &hash, sizeof(uint64_t)); off += sizeof(uint64_t);
-    memcpy(dst + off, &is_last, sizeof(uint8_t)); off += sizeof(uint8_t);
-
-    (void)off;
-}
-
-static void deserialize_header(const char *src, int32_t &start_row, int32_t &num_rows, int32_t &cols_per_row, uint64_t &hash, uint8_t &is_last) {
-    size_t off = 0;
-
-    memcpy(&start_row, src + off, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(&num_rows, src + off, sizeof(int32_t));  off += sizeof(int32_t);
-    memcpy(&cols_per_row, src + off, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(&hash, src + off, sizeof(uint64_t)); off += sizeof(uint64_t);
-    memcpy(&is_last, src + off, sizeof(uint8_t)); off += sizeof(uint8_t);
-
-    (void)off;
-}
-
-void S1_smoothen(image_t* input_image) {
+const bool USE_PINNING = true;         // pin each stage process to neighbouring cores of one cache domain / numa node
+const int S1_THREADS = 2;              // threads splitting each band inside a stage process, S1 has the heaviest kernel
+const int S2_THREADS = 1;
+const int S3_THREADS = 1;
+const int32_t SHUTDOWN_EPOCH = -1;     // epoch of the terminal marker that stops the stage processes
+const bool ZERO_COPY_PIPES = true;     // stages build frames in place and gift their pages to the pipe (vmsplice), falls back to write
+const int PIPE_PACKETS = 4;            // pipes are grown (F_SETPIPE_SZ) to hold this many full packets, 0 keeps the default 64 KiB
+const int MERKLE_BAND_ROWS = 32;       // rows per leaf of the hash tree over the output image
+const int MERKLE_THREADS = 2;          // threads hashing bands while the output is still being written
+const bool MERKLE_SIDECAR = false;     // also write the tree to <output>.merkle
+
+//**  frames are a part2 stage header (include/frameHeader.h) and its payload_len bytes
+//    is_last marks the end of an epoch (iteration), or with epoch == SHUTDOWN_EPOCH the end of the run
+//    S3 sends the parent headers only: rows [start_row, start_row + num_rows) are in the output, cols_per_row = 0
+
+// this process's end of each link, every stage process gets its own copy at fork and keeps
+// counting over all the jobs it serves
+linkIntegrity g_link_s1_s2("S1->S2", INTEGRITY_S1_S2, CHECKSUM_ALGO);
+linkIntegrity g_link_s2_s3("S2->S3", INTEGRITY_S2_S3, CHECKSUM_ALGO);
+
+// iterations of the jobs this stage process saw through, its pipe calls are reported per iteration
+static int g_epochs_served = 0;
+
+// one iteration over the image, closed by an end of epoch marker
+static void S1_smoothen_epoch(image_t* input_image, int32_t epoch, pipeFrameWriter& out, bandPool& pool) {
 
     int width = input_image->width;
     int height = input_image->height;
 
     if (height < 3 || width < 3) {
-        char hdr[HDR_SIZE];
-        serialize_header(hdr, -1, 0, 0, 0ULL, 1);
-        write_all(fd_S1_S2[1], hdr, HDR_SIZE);
+        char hdr[STAGE_HDR_SIZE];
+        serialize_stage_header(hdr, -1, 0, 0, 0ULL, CHECKSUM_NONE, 1, epoch);
+        write_all(fd_S1_S2[1], hdr, STAGE_HDR_SIZE);
         return;
     }
 
     const int cols_per_row = std::max(0, width - 2);
-    const size_t fixed_payload = static_cast<size_t>(PROCESSED_ROW_COUNT) * cols_per_row * 3;
 
-    int dir[9][2] = {
-        {-1,-1}, {-1,0}, {-1,1},
-        {0,-1}, {0,0}, {0,1},
-        {1,-1}, {1,0}, {1,1}
-    };
+    batchTuner tuner(TARGET_PACKET_BYTES, static_cast<size_t>(cols_per_row) * 3, PROCESSED_ROW_COUNT);
+
+    // bytes the S1->S2 pipe can hold, used to judge how far ahead of S2 we are
+    int pipe_capacity = fcntl(fd_S1_S2[1], F_GETPIPE_SZ);
+    if (pipe_capacity < 0) 
+        pipe_capacity = 0;
 
     for (int i = 1; i <= height - 2; ) {
         int batch_start = i;
-        int take = std::min(PROCESSED_ROW_COUNT, (height - 1) - i + 0);
+        int rows = ADAPTIVE_BATCH ? tuner.next_rows() : PROCESSED_ROW_COUNT;
+        int take = std::min(rows, (height - 1) - i + 0);
         if (take <= 0) break;
 
-        rowPacket rpkt(batch_start, take, cols_per_row);
-
-        for (int r_off = 0; r_off < take; ++r_off) {
-            int r = batch_start + r_off;
-
-            for (int c = 1, cidx = 0; c <= width - 2; c++, cidx++) {
-                int sumR=0, sumG=0, sumB=0;
-                for (int k=0;k<9;++k) {
-                    int rr = r + dir[k][0], cc = c + dir[k][1];
-
-                    sumR += input_image->image_pixels[rr][cc][0];
-                    sumG += input_image->image_pixels[rr][cc][1];
-                    sumB += input_image->image_pixels[rr][cc][2];
-                }
+        auto start_pkt = std::chrono::steady_clock::now();
 
-                uint8_t sr = static_cast<uint8_t>(sumR / 9);
-                uint8_t sg = static_cast<uint8_t>(sumG / 9);
-                uint8_t sb = static_cast<uint8_t>(sumB / 9);
+        // smoothen straight into the frame that goes into the pipe
+        char* frame = out.frame();
+        uint8_t* payload = reinterpret_cast<uint8_t*>(frame + STAGE_HDR_SIZE);
+        size_t actual_bytes = static_cast<size_t>(take) * cols_per_row * 3;
+        pool.run(take, [&](int first, int count) {
+            smoothen_rows(input_image, batch_start + first, count, payload + static_cast<size_t>(first) * cols_per_row * 3);
+        });
 
-                uint8_t *p = rpkt.pixel_ptr(r_off, cidx);
-                
-                p[0]=sr; p[1]=sg; p[2]=sb;
-            }
-        }
+        rowPacket rpkt(batch_start, take, cols_per_row, true);
+        g_link_s1_s2.seal(rpkt, payload, actual_bytes);
 
-        if (USE_HASH) 
-            rpkt.hash = calculate_hash_for_packet(rpkt);
+        std::chrono::duration<double, std::micro> latency = std::chrono::steady_clock::now() - start_pkt;
 
-        std::vector<char> outbuf(HDR_SIZE + fixed_payload);
-        serialize_header(outbuf.data(), rpkt.start_row, rpkt.num_rows, rpkt.cols_per_row, (uint64_t)rpkt.hash, rpkt.is_last ? 1 : 0);
+        // bytes still queued in the pipe (FIONREAD works on either end)
+        int queued = 0;
+        if (ioctl(fd_S1_S2[1], FIONREAD, &queued) < 0) 
+            queued = 0;
 
-        size_t actual_bytes = static_cast<size_t>(take) * cols_per_row * 3;
-        if (actual_bytes > 0) {
-            memcpy(outbuf.data() + HDR_SIZE, rpkt.pixels.data(), actual_bytes);
-        }
-        if (fixed_payload > actual_bytes) {
-            memset(outbuf.data() + HDR_SIZE + actual_bytes, 0, fixed_payload - actual_bytes);
-        }
+        serialize_stage_header(frame, rpkt.start_row, rpkt.num_rows, rpkt.cols_per_row, (uint64_t)rpkt.hash, rpkt.hash_algo, rpkt.is_last ? 1 : 0, epoch);
 
-        if (write_all(fd_S1_S2[1], outbuf.data(), outbuf.size()) < 0) {
-            perror("S1 write_all");
+        if (out.commit(STAGE_HDR_SIZE + actual_bytes) < 0) {
+            perror("S1 write");
             _exit(1);
         }
 
+        tuner.observe(take, latency.count(), static_cast<size_t>(queued), static_cast<size_t>(pipe_capacity));
+
         i += take;
     }
 
+    if (ADAPTIVE_BATCH)
+        tuner.report(("S1[epoch " + std::to_string(epoch) + "]").c_str());
+
 
     {
         int32_t start_row = -1, num_rows = 0, cols = 0;
         uint64_t hash = 0;
         uint8_t is_last = 1;
-        std::vector<char> termbuf(HDR_SIZE + (size_t)PROCESSED_ROW_COUNT * std::max(0, (int)( (input_image->width>2) ? input_image->width-2 : 0)) * 3 );
-        serialize_header(termbuf.data(), start_row, num_rows, cols, hash, is_last);
+        std::vector<char> termbuf(STAGE_HDR_SIZE);
+        serialize_stage_header(termbuf.data(), start_row, num_rows, cols, hash, CHECKSUM_NONE, is_last, epoch);
         
         write_all(fd_S1_S2[1], termbuf.data(), termbuf.size());
     }
 }
 
-void S2_find_details(image_t* input_image) {
+// a 32 row packet of a wide image alone overflows a default pipe, the writer would block (and
+// the reader wake up) several times per packet. every stage sizes the pipe it writes to when a
+// job comes in, all pipes are drained between jobs
+static int size_pipe_for_job(int fd, int width) {
+    size_t frame_bytes = STAGE_HDR_SIZE + static_cast<size_t>(PROCESSED_ROW_COUNT) * std::max(0, width - 2) * 3;
+    if (PIPE_PACKETS <= 0)
+        return fcntl(fd, F_GETPIPE_SZ);
+    return set_pipe_capacity(fd, PIPE_PACKETS * frame_bytes);
+}
 
-    int width = input_image->width;
-    int height = input_image->height;
+// tells everything downstream of fd to exit
+static void send_shutdown(int fd) {
+    char thdr[STAGE_HDR_SIZE];
+    serialize_stage_header(thdr, -1, 0, 0, 0ULL, CHECKSUM_NONE, 1, SHUTDOWN_EPOCH);
+    write_all(fd, thdr, STAGE_HDR_SIZE);
+}
 
-    if (height < 3 || width < 3) {
-        // forward terminal
-        char hdr[HDR_SIZE];
-        serialize_header(hdr, -1, 0, 0, 0ULL, 1);
-        write_all(fd_S2_S3[1], hdr, HDR_SIZE);
-        return;
+// S1 stays up for all iterations of a job, S2/S3/parent drain epoch e while S1 is already on e+1
+static void S1_smoothen_job(image_t* input_image, const stage_job_t& job, bandPool& pool) {
+
+    int capacity = size_pipe_for_job(fd_S1_S2[1], input_image->width);
+    const size_t fixed_payload = static_cast<size_t>(PROCESSED_ROW_COUNT) * std::max(0, input_image->width - 2) * 3;
+    if (PIPE_PACKETS > 0)
+        std::cout << "job " << job.job << ": pipe capacity " << capacity / 1024 << " KiB (" << PIPE_PACKETS << " x " << (STAGE_HDR_SIZE + fixed_payload) / 1024 << " KiB packets)" << std::endl;
+
+    pipeFrameWriter out(fd_S1_S2[1], STAGE_HDR_SIZE + fixed_payload, ZERO_COPY_PIPES);
+
+    for (int32_t epoch = 0; epoch < job.iterations; epoch++) 
+        S1_smoothen_epoch(input_image, epoch, out, pool);
+}
+
+// resident S1, one job per descriptor until the parent closes the control pipe
+void S1_smoothen(int ctl_fd, bandPool& pool) {
+    stage_job_t job;
+
+    while (recv_stage_job(ctl_fd, job)) {
+        image_t* input_image = map_job_image(job);
+        if (!input_image) {
+            send_shutdown(fd_S1_S2[1]);
+            return;
+        }
+        S1_smoothen_job(input_image, job, pool);
+        unmap_job_image(job, input_image);
+        g_epochs_served += job.iterations;
     }
+}
 
-    const int cols_per_row = std::max(0, width - 2);
+// one job, up to the marker of its last epoch. false once the pipeline shuts down
+static bool S2_find_details_job(image_t* input_image, const stage_job_t& job, bandPool& pool) {
+
+    const int cols_per_row = std::max(0, input_image->width - 2);
     const size_t fixed_payload = static_cast<size_t>(PROCESSED_ROW_COUNT) * cols_per_row * 3;
 
-    std::vector<char> hdrbuf(HDR_SIZE);
+    std::vector<char> hdrbuf(STAGE_HDR_SIZE);
     std::vector<uint8_t> payloadbuf(fixed_payload);
+    size_pipe_for_job(fd_S2_S3[1], input_image->width);
+    pipeFrameWriter out(fd_S2_S3[1], STAGE_HDR_SIZE + fixed_payload, ZERO_COPY_PIPES);
 
     while (true) {
         
-        ssize_t got = read_all(fd_S1_S2[0], hdrbuf.data(), HDR_SIZE);
+        ssize_t got = read_all(fd_S1_S2[0], hdrbuf.data(), STAGE_HDR_SIZE);
         if (got <= 0) { 
             // forward terminal and exit
-            char thdr[HDR_SIZE];
-            serialize_header(thdr, -1, 0, 0, 0ULL, 1);
-            write_all(fd_S2_S3[1], thdr, HDR_SIZE);
-            return;
+            send_shutdown(fd_S2_S3[1]);
+            return false;
         }
+        uint32_t payload_len;
         int32_t start_row, num_rows, cols;
         uint64_t hash;
+        uint8_t hash_algo;
         uint8_t is_last;
-        deserialize_header(hdrbuf.data(), start_row, num_rows, cols, hash, is_last);
+        int32_t epoch, sequence;
+        deserialize_stage_header(hdrbuf.data(), payload_len, start_row, num_rows, cols, hash, hash_algo, is_last, epoch, sequence);
 
         // read payload
-        if (read_all(fd_S1_S2[0], payloadbuf.data(), fixed_payload) != (ssize_t)fixed_payload) {
+        if (payload_len > fixed_payload || read_all(fd_S1_S2[0], payloadbuf.data(), payload_len) != (ssize_t)payload_len) {
             perror("S2 payload read");
             _exit(1);
         }
 
         if (is_last) {
-            // forward terminal header + zero payload
-            char thdr[HDR_SIZE];
-            serialize_header(thdr, -1, 0, 0, 0ULL, 1);
-            std::vector<char> termbuf(HDR_SIZE + fixed_payload);
-            memcpy(termbuf.data(), thdr, HDR_SIZE);
+            // forward end of epoch / shutdown header + zero payload
+            char thdr[STAGE_HDR_SIZE];
+            serialize_stage_header(thdr, -1, 0, 0, 0ULL, CHECKSUM_NONE, 1, epoch);
            
-            write_all(fd_S2_S3[1], termbuf.data(), termbuf.size());
-            return;
+            write_all(fd_S2_S3[1], thdr, STAGE_HDR_SIZE);
+            if (epoch == SHUTDOWN_EPOCH) 
+                return false;
+            if (epoch == job.iterations - 1)
+                return true;
+            continue;
         }
 
-        // construct rpkt from payload 
-        rowPacket rpkt(start_row, num_rows, cols);
+        // the rows stay in payloadbuf, rpkt only describes them
+        rowPacket rpkt(start_row, num_rows, cols, true);
         size_t actual_bytes = static_cast<size_t>(num_rows) * cols * 3;
-        if (actual_bytes > 0) {
-            memcpy(rpkt.pixels.data(), payloadbuf.data(), actual_bytes);
-        }
         rpkt.hash = (std::size_t)hash;
+        rpkt.hash_algo = hash_algo;
 
-        if (USE_HASH) {
-            std::size_t expected = calculate_hash_for_packet(rpkt);
-            if (expected != rpkt.hash) {
-                std::cerr << "S2: Data Corrupted in rowPacket(start_row=" << rpkt.start_row << ")!!\n";
-                
-                char thdr[HDR_SIZE];
-                serialize_header(thdr, -1, 0, 0, 0ULL, 1);
-                std::vector<char> termbuf(HDR_SIZE + fixed_payload);
-                memcpy(termbuf.data(), thdr, HDR_SIZE);
-                write_all(fd_S2_S3[1], termbuf.data(), termbuf.size());
-                return;
-            }
-        }
-
-        
-        rowPacket out_rpkt(rpkt.start_row, rpkt.num_rows, rpkt.cols_per_row);
-
-        for (int r_off = 0; r_off < rpkt.num_rows; ++r_off) {
-        
-            int row_idx = rpkt.start_row + r_off;
-            for (int cidx = 0; cidx < rpkt.cols_per_row; ++cidx) {
-
-                uint8_t* sp = rpkt.pixel_ptr(r_off, cidx);
-                int orig_col = 1 + cidx;
-
-                int dR = input_image->image_pixels[row_idx][orig_col][0] - (int)sp[0];
-                int dG = input_image->image_pixels[row_idx][orig_col][1] - (int)sp[1];
-                int dB = input_image->image_pixels[row_idx][orig_col][2] - (int)sp[2];
-                
-                if (dR < 0) dR = 0;
-                if (dG < 0) dG = 0; 
-                if (dB < 0) dB = 0;
-
-                uint8_t* op = out_rpkt.pixel_ptr(r_off, cidx);
-
-                op[0] = (uint8_t)dR; 
-                op[1] = (uint8_t)dG; 
-                op[2] = (uint8_t)dB;
-            }
+        if (!g_link_s1_s2.check(rpkt, payloadbuf.data(), actual_bytes)) {
+            std::cerr << "S2: Data Corrupted in rowPacket(start_row=" << rpkt.start_row << ")!!\n";
+            send_shutdown(fd_S2_S3[1]);
+            return false;
         }
 
-        if (USE_HASH) 
-            out_rpkt.hash = calculate_hash_for_packet(out_rpkt);
-
-        std::vector<char> outbuf(HDR_SIZE + fixed_payload);
+        // difference rows straight into the outgoing frame
+        char* frame = out.frame();
+        uint8_t* out_payload = reinterpret_cast<uint8_t*>(frame + STAGE_HDR_SIZE);
+        pool.run(rpkt.num_rows, [&](int first, int count) {
+            size_t off = static_cast<size_t>(first) * cols * 3;
+            find_details_rows(input_image, rpkt.start_row + first, count, payloadbuf.data() + off, out_payload + off);
+        });
 
-        serialize_header(outbuf.data(), out_rpkt.start_row, out_rpkt.num_rows, out_rpkt.cols_per_row, (uint64_t)out_rpkt.hash, out_rpkt.is_last ? 1 : 0);
-        size_t out_actual = static_cast<size_t>(out_rpkt.num_rows) * out_rpkt.cols_per_row * 3;
+        rowPacket out_rpkt(rpkt.start_row, rpkt.num_rows, rpkt.cols_per_row, true);
+        g_link_s2_s3.seal(out_rpkt, out_payload, actual_bytes);
 
-        if (out_actual > 0) 
-            memcpy(outbuf.data() + HDR_SIZE, out_rpkt.pixels.data(), out_actual);
-        if (fixed_payload > out_actual) 
-            memset(outbuf.data() + HDR_SIZE + out_actual, 0, fixed_payload - out_actual);
+        serialize_stage_header(frame, out_rpkt.start_row, out_rpkt.num_rows, out_rpkt.cols_per_row, (uint64_t)out_rpkt.hash, out_rpkt.hash_algo, out_rpkt.is_last ? 1 : 0, epoch);
 
-        if (write_all(fd_S2_S3[1], outbuf.data(), outbuf.size()) < 0) {
-            perror("S2 write_all");
+        if (out.commit(STAGE_HDR_SIZE + actual_bytes) < 0) {
+            perror("S2 write");
             _exit(1);
         }
     }
 }
 
-void S3_sharpen(image_t* input_image) {
-    int width = input_image->width;
-    int height = input_image->height;
-    if (height < 3 || width < 3) {
-        // forward terminal
-        char thdr[HDR_SIZE];
-        serialize_header(thdr, -1, 0, 0, 0ULL, 1);
-        write_all(fd_S3_P[1], thdr, HDR_SIZE);
-        return;
+// resident S2, one job per descriptor until the parent closes the control pipe
+void S2_find_details(int ctl_fd, bandPool& pool) {
+    stage_job_t job;
+
+    while (recv_stage_job(ctl_fd, job)) {
+        image_t* input_image = map_job_image(job);
+        if (!input_image) {
+            send_shutdown(fd_S2_S3[1]);
+            return;
+        }
+        bool more = S2_find_details_job(input_image, job, pool);
+        unmap_job_image(job, input_image);
+        if (!more)
+            return;
+        g_epochs_served += job.iterations;
     }
+}
 
-    const int cols_per_row = std::max(0, width - 2);
+// one job, up to the marker of its last epoch. false once the pipeline shuts down.
+// the sharpened rows go straight into the output file the parent created, the parent only
+// hears which rows are done
+static bool S3_sharpen_job(image_t* input_image, const stage_job_t& job, bandPool& pool) {
+
+    const int cols_per_row = std::max(0, input_image->width - 2);
     const size_t fixed_payload = static_cast<size_t>(PROCESSED_ROW_COUNT) * cols_per_row * 3;
 
-    std::vector<char> hdrbuf(HDR_SIZE);
+    std::vector<char> hdrbuf(STAGE_HDR_SIZE);
     std::vector<uint8_t> payloadbuf(fixed_payload);
+    mappedPPM output(job.output, job.height, job.width, false);
 
     while (true) {
-        if (read_all(fd_S2_S3[0], hdrbuf.data(), HDR_SIZE) != (ssize_t)HDR_SIZE) {
+        if (read_all(fd_S2_S3[0], hdrbuf.data(), STAGE_HDR_SIZE) != (ssize_t)STAGE_HDR_SIZE) {
             // forward terminal and exit
-            char thdr[HDR_SIZE];
-            serialize_header(thdr, -1, 0, 0, 0ULL, 1);
-            write_all(fd_S3_P[1], thdr, HDR_SIZE);
-            return;
+            send_shutdown(fd_S3_P[1]);
+            return false;
         }
+        uint32_t payload_len;
         int32_t start_row, num_rows, cols;
         uint64_t hash;
+        uint8_t hash_algo;
         uint8_t is_last;
-        deserialize_header(hdrbuf.data(), start_row, num_rows, cols, hash, is_last);
+        int32_t epoch, sequence;
+        deserialize_stage_header(hdrbuf.data(), payload_len, start_row, num_rows, cols, hash, hash_algo, is_last, epoch, sequence);
 
-        if (read_all(fd_S2_S3[0], payloadbuf.data(), fixed_payload) != (ssize_t)fixed_payload) {
+        if (payload_len > fixed_payload || read_all(fd_S2_S3[0], payloadbuf.data(), payload_len) != (ssize_t)payload_len) {
             perror("S3 payload read");
             _exit(1);
         }
 
         if (is_last) {
-            char thdr[HDR_SIZE];
-
-            serialize_header(thdr, -1, 0, 0, 0ULL, 1);
-            std::vector<char> termbuf(HDR_SIZE + fixed_payload);
-            memcpy(termbuf.data(), thdr, HDR_SIZE);
-            write_all(fd_S3_P[1], termbuf.data(), termbuf.size());
-            return;
+            char thdr[STAGE_HDR_SIZE];
+
+            serialize_stage_header(thdr, -1, 0, 0, 0ULL, CHECKSUM_NONE, 1, epoch);
+            write_all(fd_S3_P[1], thdr, STAGE_HDR_SIZE);
+            if (epoch == SHUTDOWN_EPOCH) 
+                return false;
+            if (epoch == job.iterations - 1)
+                return true;
+            continue;
         }
 
-        rowPacket rpkt(start_row, num_rows, cols);
+        rowPacket rpkt(start_row, num_rows, cols, true);
         size_t actual = static_cast<size_t>(num_rows) * cols * 3;
-
-        if (actual > 0) memcpy(rpkt.pixels.data(), payloadbuf.data(), actual);
         rpkt.hash = (std::size_t)hash;
+        rpkt.hash_algo = hash_algo;
 
-        if (USE_HASH) {
-            std::size_t expected = calculate_hash_for_packet(rpkt);
-            if (expected != rpkt.hash) {
-                std::cerr << "S3: Data Corrupted in rowPacket(start_row=" << rpkt.start_row << ")!!\n";
-                char thdr[HDR_SIZE];
-                serialize_header(thdr, -1, 0, 0, 0ULL, 1);
-                std::vector<char> termbuf(HDR_SIZE + fixed_payload);
-                memcpy(termbuf.data(), thdr, HDR_SIZE);
-                write_all(fd_S3_P[1], termbuf.data(), termbuf.size());
-                return;
-            }
+        if (!g_link_s2_s3.check(rpkt, payloadbuf.data(), actual)) {
+            std::cerr << "S3: Data Corrupted in rowPacket(start_row=" << rpkt.start_row << ")!!\n";
+            send_shutdown(fd_S3_P[1]);
+            return false;
         }
 
-        // compute sharpened packet
-        rowPacket out_rpkt(rpkt.start_row, rpkt.num_rows, rpkt.cols_per_row);
+        pool.run(rpkt.num_rows, [&](int first, int count) {
+            sharpen_rows(input_image, output.image(), rpkt.start_row + first, count, payloadbuf.data() + static_cast<size_t>(first) * cols * 3, SCALING_FACTOR);
+        });
 
-        for (int r_off = 0; r_off < rpkt.num_rows; ++r_off) {
-            int i = rpkt.start_row + r_off;
+        char notice[STAGE_HDR_SIZE];
+        serialize_stage_header(notice, rpkt.start_row, rpkt.num_rows, 0, 0ULL, CHECKSUM_NONE, 0, epoch);
 
-            for (int cidx = 0; cidx < rpkt.cols_per_row; ++cidx) {
-                uint8_t* d = rpkt.pixel_ptr(r_off, cidx);
-                int j = 1 + cidx;
-
-                int newR = input_image->image_pixels[i][j][0] + SCALING_FACTOR * (int)d[0];
-                int newG = input_image->image_pixels[i][j][1] + SCALING_FACTOR * (int)d[1];
-                int newB = input_image->image_pixels[i][j][2] + SCALING_FACTOR * (int)d[2];
+        if (write_all(fd_S3_P[1], notice, STAGE_HDR_SIZE) < 0) {
+            perror("S3 write");
+            _exit(1);
+        }
+    }
+}
 
-                uint8_t* o = out_rpkt.pixel_ptr(r_off, cidx);
+// resident S3, one job per descriptor until the parent closes the control pipe
+void S3_sharpen(int ctl_fd, bandPool& pool) {
+    stage_job_t job;
 
-                o[0] = (uint8_t)(newR > 255 ? 255 : (newR < 0 ? 0 : newR));
-                o[1] = (uint8_t)(newG > 255 ? 255 : (newG < 0 ? 0 : newG));
-                o[2] = (uint8_t)(newB > 255 ? 255 : (newB < 0 ? 0 : newB));
-            }
+    while (recv_stage_job(ctl_fd, job)) {
+        image_t* input_image = map_job_image(job);
+        if (!input_image) {
+            send_shutdown(fd_S3_P[1]);
+            return;
         }
-        if (USE_HASH) out_rpkt.hash = calculate_hash_for_packet(out_rpkt);
+        bool more = S3_sharpen_job(input_image, job, pool);
+        unmap_job_image(job, input_image);
+        if (!more)
+            return;
+        g_epochs_served += job.iterations;
+    }
+}
 
-        // write header+payload once
-        std::vector<char> outbuf(HDR_SIZE + fixed_payload);
-        serialize_header(outbuf.data(), out_rpkt.start_row, out_rpkt.num_rows, out_rpkt.cols_per_row, (uint64_t)out_rpkt.hash, out_rpkt.is_last ? 1 : 0);
-        size_t out_actual = static_cast<size_t>(out_rpkt.num_rows) * out_rpkt.cols_per_row * 3;
+// read / write / vmsplice calls this process made per iteration, the system call side of the context switches
+static void report_pipe_calls(const char* who, int epochs) {
+    if (epochs <= 0)
+        return;
+    pipe_call_counts_t calls = pipe_call_counts();
+    std::cout << who << ": pipe calls per iteration " << calls.reads / epochs << " read, " << calls.writes / epochs << " write, "
+              << calls.vmsplices / epochs << " vmsplice" << std::endl;    // stage processes leave with _exit
+}
 
-        if (out_actual > 0) 
-            memcpy(outbuf.data() + HDR_SIZE, out_rpkt.pixels.data(), out_actual);
-        if (fixed_payload > out_actual) 
-            memset(outbuf.data() + HDR_SIZE + out_actual, 0, fixed_payload - out_actual);
+// closes every pipe end of this process but keep, right after fork
+static void keep_only_fds(std::initializer_list<int> keep) {
+    for (int* fds : {fd_S1_S2, fd_S2_S3, fd_S3_P, ctl_S1, ctl_S2, ctl_S3})
+        for (int k = 0; k < 2; k++)
+            if (std::find(keep.begin(), keep.end(), fds[k]) == keep.end())
+                close(fds[k]);
+}
 
-        if (write_all(fd_S3_P[1], outbuf.data(), outbuf.size()) < 0) {
-            perror("S3 write_all");
-            _exit(1);
+// parent side of one job: waits for S3's notices until the marker of the job's last epoch,
+// false if the pipeline shut down (or broke) first. the rows themselves are already in the
+// output mapping
+static bool collect_job(const stage_job_t& job, imageMerkle& merkle, std::vector<std::chrono::steady_clock::time_point>& epoch_done) {
+
+    char hdr[STAGE_HDR_SIZE];
+
+    while (true) {
+        if (read_all(fd_S3_P[0], hdr, STAGE_HDR_SIZE) != (ssize_t)STAGE_HDR_SIZE) 
+            return false;
+        uint32_t payload_len;
+        int32_t start_row, num_rows, cols;
+        uint64_t hash;
+        uint8_t hash_algo;
+        uint8_t is_last;
+        int32_t epoch, sequence;
+        deserialize_stage_header(hdr, payload_len, start_row, num_rows, cols, hash, hash_algo, is_last, epoch, sequence);
+
+        if (payload_len != 0) {
+            std::cerr << "Parent: unexpected payload from S3\n";
+            return false;
         }
+
+        if (is_last) {
+            if (epoch == SHUTDOWN_EPOCH) 
+                return false;
+            epoch_done.push_back(std::chrono::steady_clock::now());
+            if (epoch == job.iterations - 1)
+                return true;
+            continue;
+        }
+
+        if (start_row < 1 || num_rows < 0 || start_row + num_rows > job.height - 1) {
+            std::cerr << "Parent: bad notice for rows " << start_row << " + " << num_rows << "\n";
+            return false;
+        }
+
+        if (epoch == job.iterations - 1)
+            merkle.rows_done(start_row, num_rows);
     }
 }
 
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        std::cout << "usage: ./a.out <input.ppm> <output.ppm>\n";
+    if (argc < 3 || argc % 2 == 0) {
+        std::cout << "usage: ./a.out <input.ppm> <output.ppm> [<input.ppm> <output.ppm> ...]\n";
         return 0;
     }
 
     std::cout << "\nProcessing Image..." <<std::endl;
     std::cout << "----------------------------------------------------------------------------------------------------------" << std::endl;
 
-    image_t* input_image = read_ppm_file(argv[1]);
-    if (!input_image) { std::cerr << "Failed to read input\n"; return 1; }
-
-    int height = input_image->height, width = input_image->width;
-
-    // prepare output image (copy input to preserve edges)
-    image_t* output_image = new image_t;
-    output_image->height = height; output_image->width = width;
-    output_image->image_pixels = new uint8_t**[height];
-    for (int i = 0; i < height; ++i) {
-        output_image->image_pixels[i] = new uint8_t*[width];
-        for (int j = 0; j < width; ++j) {
-            output_image->image_pixels[i][j] = new uint8_t[3];
-            
-            output_image->image_pixels[i][j][0] = input_image->image_pixels[i][j][0];
-            output_image->image_pixels[i][j][1] = input_image->image_pixels[i][j][1];
-            output_image->image_pixels[i][j][2] = input_image->image_pixels[i][j][2];
-        }
+    // decide placement before touching any image memory so the pages land on the stages' node.
+    // a cpu per thread, each stage's on neighbouring ones
+    const int stage_threads[] = {S1_THREADS, S2_THREADS, S3_THREADS};
+    std::vector<std::string> names;
+    for (int k = 0; k < 3; k++)
+        for (int t = 0; t < stage_threads[k]; t++)
+            names.push_back("S" + std::to_string(k + 1) + (t == 0 ? "" : "#" + std::to_string(t)));
+    std::vector<const char*> stage_names;
+    for (const std::string& name : names)
+        stage_names.push_back(name.c_str());
+
+    std::vector<int> stage_cpus[3];     // the cpus of stage k's threads, empty without pinning
+
+    if (USE_PINNING) {
+        stage_placement_t placement = plan_stage_placement(static_cast<int>(names.size()));
+        pin_process_to_cpus(0, placement.all_cpus);
+        print_placement(placement, stage_names.data());
+
+        size_t next = 0;
+        for (int k = 0; k < 3; k++)
+            for (int t = 0; t < stage_threads[k]; t++)
+                stage_cpus[k].push_back(placement.stage_cpus[next++]);
     }
 
     // create pipes
@@ -453,107 +474,151 @@ int main(int argc, char **argv) {
         perror("pipe3"); 
         exit(1); 
     }
+    if (pipe(ctl_S1) < 0 || pipe(ctl_S2) < 0 || pipe(ctl_S3) < 0) {
+        perror("control pipe");
+        exit(1);
+    }
 
-    auto start_p = std::chrono::steady_clock::now();
-
-    for(int i = 0;i < MAX_ITERATIONS;i++){
-        // fork S1
-        pid_t pid1 = fork();
-        if (pid1 < 0) { perror("fork1"); exit(1); }
-        if (pid1 == 0) {
-            close(fd_S1_S2[0]);
-            close(fd_S2_S3[0]); close(fd_S2_S3[1]);
-            close(fd_S3_P[0]); close(fd_S3_P[1]);
-            S1_smoothen(input_image);
-            _exit(0);
-        }
+    g_input_fd = create_stage_input("stage_input");
+
+    // stage processes are forked once, before any image is loaded, and serve every job.
+    // each one only keeps its own pipe ends, so a stage that dies breaks the pipes around it
+    // fork S1
+    pid_t pid1 = fork();
+    if (pid1 < 0) { perror("fork1"); exit(1); }
+    if (pid1 == 0) {
+        if (USE_PINNING) 
+            pin_process_to_cpus(0, stage_cpus[0]);
+        keep_only_fds({fd_S1_S2[1], ctl_S1[0]});
+        bandPool pool(stage_threads[0], stage_cpus[0]);
+        S1_smoothen(ctl_S1[0], pool);
+        report_pipe_calls("S1", g_epochs_served);
+        _exit(0);
+    }
 
-        // fork S2
-        pid_t pid2 = fork();
-        if (pid2 < 0) { perror("fork2"); exit(1); }
-        if (pid2 == 0) {
-            close(fd_S1_S2[1]);
-            close(fd_S2_S3[0]);
-            close(fd_S3_P[0]); close(fd_S3_P[1]);
-            S2_find_details(input_image);
-            _exit(0);
-        }
+    // fork S2
+    pid_t pid2 = fork();
+    if (pid2 < 0) { perror("fork2"); exit(1); }
+    if (pid2 == 0) {
+        if (USE_PINNING) 
+            pin_process_to_cpus(0, stage_cpus[1]);
+        keep_only_fds({fd_S1_S2[0], fd_S2_S3[1], ctl_S2[0]});
+        bandPool pool(stage_threads[1], stage_cpus[1]);
+        S2_find_details(ctl_S2[0], pool);
+        g_link_s1_s2.report();
+        report_pipe_calls("S2", g_epochs_served);
+        _exit(0);
+    }
+
+    // fork S3
+    pid_t pid3 = fork();
+    if (pid3 < 0) { perror("fork3"); exit(1); }
+    if (pid3 == 0) {
+        if (USE_PINNING) 
+            pin_process_to_cpus(0, stage_cpus[2]);
+        keep_only_fds({fd_S2_S3[0], fd_S3_P[1], ctl_S3[0]});
+        bandPool pool(stage_threads[2], stage_cpus[2]);
+        S3_sharpen(ctl_S3[0], pool);
+        g_link_s2_s3.report();
+        report_pipe_calls("S3", g_epochs_served);
+        _exit(0);
+    }
+
+    keep_only_fds({fd_S3_P[0], ctl_S1[1], ctl_S2[1], ctl_S3[1]});
+
+    int iterations_done = 0;
+    bool failed = false;
 
-        // fork S3
-        pid_t pid3 = fork();
-        if (pid3 < 0) { perror("fork3"); exit(1); }
-        if (pid3 == 0) {
-            close(fd_S1_S2[0]); close(fd_S1_S2[1]);
-            close(fd_S2_S3[1]);
-            close(fd_S3_P[0]);
-            S3_sharpen(input_image);
-            _exit(0);
+    for (int32_t job_id = 0; 2 * job_id + 2 < argc; job_id++) {
+        char* input_path = argv[2 * job_id + 1];
+        char* output_path = argv[2 * job_id + 2];
+
+        image_t* input_image = read_ppm_file(input_path);
+        if (!input_image) { std::cerr << "Failed to read input\n"; failed = true; break; }
+
+        int height = input_image->height, width = input_image->width;
+
+        // S3 maps the output file, so it has to exist (at its final size) before the job goes out.
+        // only the border is ours to fill, S3 writes every interior pixel
+        mappedPPM output(output_path, height, width, true);
+        image_t* output_image = output.image();
+        for (int i = 0; i < height; ++i)
+            for (int j = 0; j < width; ++j)
+                if (i == 0 || i == height - 1 || j == 0 || j == width - 1)
+                    memcpy(output_image->image_pixels[i][j], input_image->image_pixels[i][j], 3);
+
+        // the stages are done reading the previous job's input once all of its rows are in
+        bool staged = stage_job_input(g_input_fd, input_image);
+        free_job_image(input_image);
+        if (!staged) {
+            failed = true;
+            break;
         }
 
-        
-        const int cols_per_row = std::max(0, width - 2);
-        const size_t fixed_payload = static_cast<size_t>(PROCESSED_ROW_COUNT) * cols_per_row * 3;
-        
-        std::vector<char> hdrbuf(HDR_SIZE);
-        std::vector<uint8_t> payloadbuf(fixed_payload);
-
-        while (true) {
-            if (read_all(fd_S3_P[0], hdrbuf.data(), HDR_SIZE) != (ssize_t)HDR_SIZE) 
-                break;
-            int32_t start_row, num_rows, cols;
-            uint64_t hash;
-            uint8_t is_last;
-            deserialize_header(hdrbuf.data(), start_row, num_rows, cols, hash, is_last);
-
-            if (read_all(fd_S3_P[0], payloadbuf.data(), fixed_payload) != (ssize_t)fixed_payload) {
-                perror("parent payload read");
-                break;
-            }
-
-            if (is_last) break;
-
-            rowPacket rpkt(start_row, num_rows, cols);
-            size_t actual = static_cast<size_t>(num_rows) * cols * 3;
-            if (actual > 0) memcpy(rpkt.pixels.data(), payloadbuf.data(), actual);
-
-            if (USE_HASH) {
-                if (calculate_hash_for_packet(rpkt) != (std::size_t)hash) {
-                    std::cerr << "Parent: data corrupted for row " << rpkt.start_row << "\n";
-                    break;
-                }
-            }
-
-            // copy into output_image
-            for (int r_off = 0; r_off < rpkt.num_rows; ++r_off) {
-                int r = rpkt.start_row + r_off;
-                for (int cidx = 0; cidx < rpkt.cols_per_row; ++cidx) {
-                    int j = 1 + cidx;
-                    uint8_t* src = rpkt.pixel_ptr(r_off, cidx);
-                    output_image->image_pixels[r][j][0] = src[0];
-                    output_image->image_pixels[r][j][1] = src[1];
-                    output_image->image_pixels[r][j][2] = src[2];
-                }
-            }
+        stage_job_t job = make_stage_job(job_id, input_path, output_path, g_input_fd, height, width, MAX_ITERATIONS);
+
+        auto start_p = std::chrono::steady_clock::now();
+        std::vector<std::chrono::steady_clock::time_point> epoch_done;
+
+        if (!send_stage_job(ctl_S1[1], job) || !send_stage_job(ctl_S2[1], job) || !send_stage_job(ctl_S3[1], job)) {
+            perror("send job");
+            failed = true;
+            break;
         }
 
+        // hashes output bands as the last iteration completes them
+        imageMerkle merkle(output_image, MERKLE_BAND_ROWS, MERKLE_THREADS);
 
-        waitpid(pid1, nullptr, 0);
-        waitpid(pid2, nullptr, 0);
-        waitpid(pid3, nullptr, 0);
-    }
+        bool ok = collect_job(job, merkle, epoch_done);
+
+        auto finish_p = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed = finish_p - start_p;
+
+        if (!ok) {
+            std::cerr << "job " << job_id << ": pipeline shut down before " << input_path << " was done\n";
+            failed = true;
+            break;
+        }
+        iterations_done += job.iterations;
 
-    auto finish_p = std::chrono::steady_clock::now();
+        std::cout << "job " << job_id << ": Total Processing time per iteration " << elapsed.count()*1000/MAX_ITERATIONS << " ms\n";
 
-    close(fd_S1_S2[0]); close(fd_S1_S2[1]);
-    close(fd_S2_S3[0]); close(fd_S2_S3[1]);
-    close(fd_S3_P[1]); close(fd_S3_P[0]);
+        // completion to completion, i.e. without the stages mapping the input and pipeline fill
+        if (epoch_done.size() > 1) {
+            std::chrono::duration<double> steady = epoch_done.back() - epoch_done.front();
+            std::cout << "job " << job_id << ": Steady-state time per iteration " << steady.count()*1000/(epoch_done.size() - 1) << " ms\n";
+        }
 
-    std::chrono::duration<double> elapsed = finish_p - start_p;
+        // S3 wrote it in place, nothing left to copy
+        std::cout << "Image written to " << output_path << std::endl;
 
-    std::cout << "Total Processing time per iteration " << elapsed.count()*1000/MAX_ITERATIONS << " ms\n";
+        const merkleTree& tree = merkle.finish();
+        merkle.report(output_path);
+        if (MERKLE_SIDECAR)
+            write_merkle_sidecar(std::string(output_path) + ".merkle", tree);
+        std::cout.flush();
+    }
 
-    write_ppm_file(argv[2], output_image);
-    std::cout << "Image written to " << argv[2] << std::endl;
+    // no more jobs: the stages exit once their control pipe reads EOF, a stage still
+    // writing to us after a failed job gets EPIPE
+    close(ctl_S1[1]); close(ctl_S2[1]); close(ctl_S3[1]);
+    close(fd_S3_P[0]);
+
+    waitpid(pid1, nullptr, 0);
+    waitpid(pid2, nullptr, 0);
+    waitpid(pid3, nullptr, 0);
+
+    // every block on a full or empty pipe is a voluntary switch, counted over all four processes
+    if (iterations_done > 0) {
+        struct rusage self_usage, child_usage;
+        getrusage(RUSAGE_SELF, &self_usage);
+        getrusage(RUSAGE_CHILDREN, &child_usage);
+        long voluntary = self_usage.ru_nvcsw + child_usage.ru_nvcsw;
+        long involuntary = self_usage.ru_nivcsw + child_usage.ru_nivcsw;
+
+        report_pipe_calls("Parent", iterations_done);
+        std::cout << "Context switches per iteration " << voluntary / iterations_done << " voluntary, " << involuntary / iterations_done << " involuntary\n";
+    }
 
-    return 0;
-}
\ No newline at end of file
+    return failed ? 1 : 0;
+}
@@ -7,6 +7,7 @@
 #include <algorithm>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <cstdlib>
 #include <chrono>
 #include <cstring>
@@ -14,428 +15,384 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
-#include <semaphore.h>
+#include <signal.h>
+#include <atomic>
+#include <new>
 
 #include "../../include/rowPacket.h"
 #include "../../include/libppm.h"   
-
-
-const bool USE_HASH = true;
+#include "../../include/packetIO.h"
+#include "../../include/checksum.h"
+#include "../../include/integrity.h"
+#include "../../include/merkle.h"
+#include "../../include/batchTuner.h"
+#include "../../include/placement.h"
+#include "../../include/stageJob.h"
+#include "../../include/mappedPPM.h"
+#include "../../include/shmRing.h"
+#include "../../include/imageStages.h"
+#include "../../include/bandPool.h"
+#include "../../include/frameHeader.h"
+
+
+// checksums per shm block, sampled: same machine, nothing but our own processes touch the pages
+const integrity_policy_t INTEGRITY_S1_S2 = INTEGRITY_LOCAL_IPC;
+const integrity_policy_t INTEGRITY_S2_S3 = INTEGRITY_LOCAL_IPC;
+const checksum_algo CHECKSUM_ALGO = CHECKSUM_CRC32C;   // engine for the packets we send, receivers go by the header
 const int MAX_ITERATIONS = 10;
-const int PROCESSED_ROW_COUNT = 32;
+const int PROCESSED_ROW_COUNT = 32;    // max rows per packet (shm slots are sized for this)
+const int SHM_RING_SLOTS = 8;          // slots per shm edge, producers run at most this many blocks ahead of the consumers, -slots N overrides
+const int S1_WORKERS = 1;              // processes claiming S1's bands, -s1 K overrides
+const int S2_WORKERS = 1;              // processes sharing S2's ring, -s2 K overrides
+const int S3_WORKERS = 1;              // processes sharing S3's ring, -s3 K overrides
+const int S1_THREADS = 2;              // threads splitting each band inside an S1 worker (the heaviest kernel), -t1 N overrides
+const int S2_THREADS = 1;              // per S2 worker, -t2 N overrides
+const int S3_THREADS = 1;              // per S3 worker, -t3 N overrides
+const shm_sync_mode SHM_SYNC = SHM_SYNC_ADAPTIVE;  // how a stage waits on a full / empty ring: block | adaptive | poll
+const bool ADAPTIVE_BATCH = true;      // let S1 tune rows per packet from latency and slot occupancy
+const size_t TARGET_PACKET_BYTES = 64 * 1024;
 const int SCALING_FACTOR = 2;
-
-// header formate: int32_t start_row, int32_t num_rows, int32_t cols_per_row, uint64_t hash, uint8_t is_last
-static const size_t HDR_SIZE = sizeof(int32_t)*3 + sizeof(uint64_t) + sizeof(uint8_t);
-
-// named shared memory & semaphores 
-static const char* SHM_S1_S2_NAME = "/shm_s1_s2";
-static const char* SHM_S2_S3_NAME = "/shm_s2_s3";
-static const char* SHM_S3_P_NAME  = "/shm_s3_p";
-
-static const char* SEM_S1S2_EMPTY = "/sem_s1s2_empty";
-static const char* SEM_S1S2_FULL  = "/sem_s1s2_full";
-static const char* SEM_S2S3_EMPTY = "/sem_s2s3_empty";
-static const char* SEM_S2S3_FULL  = "/sem_s2s3_full";
-static const char* SEM_S3P_EMPTY  = "/sem_s3p_empty";
-static const char* SEM_S3P_FULL   = "/sem_s3p_full";
-
-// inherited by children
+const bool USE_PINNING = true;         // pin each stage process to neighbouring cores of one cache domain / numa node
+const int32_t SHUTDOWN_EPOCH = -1;     // epoch of the notice that tells the parent a stage gave up
+const int MERKLE_BAND_ROWS = 32;       // rows per leaf of the hash tree over the output image
+const int MERKLE_THREADS = 2;          // threads hashing bands while the output is still being written
+const bool MERKLE_SIDECAR = false;     // also write the tree to <output>.merkle
+
+// blocks are a part2 stage header (include/frameHeader.h) and its payload.
+// is_last marks the end of a job (one marker per worker of the next stage), or with epoch == SHUTDOWN_EPOCH
+// a stage that gave up. shm_s3_p slots only hold a header: S3 writes into the mapped output and tells
+// the parent which rows of which epoch are done
+// this process's end of each link, every stage process gets its own copy at fork and keeps
+// counting over all the jobs it serves
+linkIntegrity g_link_s1_s2("S1->S2", INTEGRITY_S1_S2, CHECKSUM_ALGO);
+linkIntegrity g_link_s2_s3("S2->S3", INTEGRITY_S2_S3, CHECKSUM_ALGO);
+
+// shared memory. every region is a ring of g_ring_slots blocks that synchronizes itself
+// (include/shmRing.h), shared by all workers on either side of it. the regions are anonymous memfds the stages inherit at fork, nothing
+// is named in /dev/shm, so any number of runs can share a host. the names only label the fds
+static const char* SHM_S1_S2_NAME = "shm_s1_s2";
+static const char* SHM_S2_S3_NAME = "shm_s2_s3";
+static const char* SHM_S3_P_NAME  = "shm_s3_p";
+
+static int shm_fd_s1_s2 = -1;
+static int shm_fd_s2_s3 = -1;
+static int shm_fd_s3_p  = -1;
+static int g_input_fd = -1;             // memfd the parent stages each job's input in, the stages map it
+
+// one per stage process, its control pipe carries the parent's job descriptors
+typedef struct stage_proc_t {
+    int stage;      // 1, 2 or 3
+    int worker;     // 0 .. workers of its stage - 1
+    int ctl[2];
+    pid_t pid;
+    std::vector<int> cpus;      // one per thread of its bandPool when pinning
+} stage_proc_t;
+
+static std::vector<stage_proc_t> g_procs;
+
+// the S1 workers' band counter: rows of the job claimed so far, counted over all its epochs.
+// and how many workers of S1 / S2 / S3 saw the end of the current job, the last one in passes
+// the end on. anonymous shared memory mapped before the stages fork, the parent resets it per job
+typedef struct job_sync_t {
+    std::atomic<int64_t> s1_next;
+    std::atomic<int32_t> s1_ended;
+    std::atomic<int32_t> s2_ended;
+    std::atomic<int32_t> s3_ended;
+} job_sync_t;
+
+static job_sync_t* g_job_sync = nullptr;
+static int g_s1_workers = S1_WORKERS;
+static int g_s2_workers = S2_WORKERS;
+static int g_s3_workers = S3_WORKERS;
+static int g_ring_slots = SHM_RING_SLOTS;
+static int g_stage_threads[4] = {0, S1_THREADS, S2_THREADS, S3_THREADS};  // by stage number
+
+// block geometry and mappings of the current job, every process sets them up per job
 static size_t g_cols_per_row = 0;
 static size_t g_fixed_payload = 0;  // = PROCESSED_ROW_COUNT * cols_per_row * 3
-static size_t g_shm_size = 0;       // HDR_SIZE + fixed_payload
+static size_t g_shm_size = 0;       // STAGE_HDR_SIZE + fixed_payload
 
-static char* shm_s1_s2 = nullptr;
-static char* shm_s2_s3 = nullptr;
-static char* shm_s3_p  = nullptr;
-
-static sem_t* sem_s1s2_empty = nullptr;
-static sem_t* sem_s1s2_full  = nullptr;
-static sem_t* sem_s2s3_empty = nullptr;
-static sem_t* sem_s2s3_full  = nullptr;
-static sem_t* sem_s3p_empty  = nullptr;
-static sem_t* sem_s3p_full   = nullptr;
-
-// FNV hash generating function
-
-static std::size_t calculate_hash_for_packet(const rowPacket &rp) {
-    if (rp.pixels.empty()) 
-        return 0;
-    const std::size_t FNV_offset = 1469598103934665603ULL;
-    const std::size_t FNV_prime  = 1099511628211ULL;
-    std::size_t h = FNV_offset;
-
-    for (uint8_t b : rp.pixels){
-        h ^= static_cast<std::size_t>(b);
-        h *= FNV_prime;
-    }
+static shm_ring_t* shm_s1_s2 = nullptr;
+static shm_ring_t* shm_s2_s3 = nullptr;
+static shm_ring_t* shm_s3_p  = nullptr;     // STAGE_HDR_SIZE blocks, notices only
 
-    h ^= static_cast<std::size_t>(rp.start_row + 0x9e3779b9);
-    h *= FNV_prime;
-    h ^= static_cast<std::size_t>(rp.num_rows + 0x9e3779b9);
-    h *= FNV_prime;
-
-    return h;
+// a marker is a header alone, it never touches the payload part of its slot
+static void send_marker(shm_ring_t* ring, int32_t epoch) {
+    char* slot = shm_ring_acquire(ring);
+    serialize_stage_header(slot, -1, 0, 0, 0ULL, CHECKSUM_NONE, 1, epoch);
+    shm_ring_publish(ring, slot);
 }
 
-static void serialize_header(char *dst, int32_t start_row, int32_t num_rows, int32_t cols_per_row, uint64_t hash, uint8_t is_last) {
-
-    size_t off = 0;
-
-    memcpy(dst + off, &start_row, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(dst + off, &num_rows, sizeof(int32_t));  off += sizeof(int32_t);
-    memcpy(dst + off, &cols_per_row, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(dst + off, &hash, sizeof(uint64_t)); off += sizeof(uint64_t);
-    memcpy(dst + off, &is_last, sizeof(uint8_t)); off += sizeof(uint8_t);
-
-    (void)off;
+// a stage gave up: straight to the parent, the other workers may be stuck behind it
+static void send_shutdown() {
+    send_marker(shm_s3_p, SHUTDOWN_EPOCH);
 }
 
-static void deserialize_header(const char *src, int32_t &start_row, int32_t &num_rows, int32_t &cols_per_row, uint64_t &hash, uint8_t &is_last) {
-    
-    size_t off = 0;
-
-    memcpy(&start_row, src + off, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(&num_rows, src + off, sizeof(int32_t));  off += sizeof(int32_t);
-    memcpy(&cols_per_row, src + off, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(&hash, src + off, sizeof(uint64_t)); off += sizeof(uint64_t);
-    memcpy(&is_last, src + off, sizeof(uint8_t)); off += sizeof(uint8_t);
-
-    (void)off;
+// claims the next band for an S1 worker: rows [row, row + take) of epoch, at most rows of them
+// and never past the end of the epoch. false once every band of the job is taken
+static bool claim_band(int interior, int32_t iterations, int rows, int32_t& epoch, int& row, int& take) {
+    const int64_t total = static_cast<int64_t>(interior) * iterations;
+    int64_t pos = g_job_sync->s1_next.load(std::memory_order_relaxed);
+    do {
+        if (pos >= total)
+            return false;
+        epoch = static_cast<int32_t>(pos / interior);
+        int offset = static_cast<int>(pos % interior);
+        take = std::min(rows, interior - offset);
+        row = 1 + offset;
+    } while (!g_job_sync->s1_next.compare_exchange_weak(pos, pos + take, std::memory_order_relaxed));
+    return true;
 }
 
-// write a block into a shared buffer using semaphores
-static void write_shm_block(char* shm_ptr, sem_t* sem_empty, sem_t* sem_full, const std::vector<char>& buf) {
-    // wait for empty slot
-    if (sem_wait(sem_empty) == -1) {
-        perror("sem_wait empty");
-        _exit(1);
-    }
-    // copy entire buffer into shared memory of size shm_size
-    memcpy(shm_ptr, buf.data(), g_shm_size);
-
-    // increment full
-    if (sem_post(sem_full) == -1) {
-        perror("sem_post full");
-        _exit(1);
-    }
-}
-
-// read a block from shared buffer into local buffer
-static void read_shm_block(char* shm_ptr, sem_t* sem_empty, sem_t* sem_full, std::vector<char>& outbuf) {
-    if (sem_wait(sem_full) == -1) {
-        perror("sem_wait full");
-        _exit(1);
-    }
-    memcpy(outbuf.data(), shm_ptr, g_shm_size);
-
-    // increment empty
-    if (sem_post(sem_empty) == -1) {
-        perror("sem_post empty");
-        _exit(1);
-    }
-}
-
-void S1_smoothen(image_t* input_image) {
+// every iteration over the image, shared with the other S1 workers band by band. every band
+// is smoothened straight into the slot an S2 worker will read it from and carries its epoch,
+// so neither the S1 workers nor the stages after them have to agree on an order: S3 places
+// rows by start_row and the parent counts them per epoch. each worker tunes its own batch
+static void S1_smoothen_job(image_t* input_image, const stage_job_t& job, int worker, bandPool& pool) {
     
     int width = input_image->width;
     int height = input_image->height;
 
-    if (height < 3 || width < 3) {
-        // write terminal into S1_S2
-        std::vector<char> termbuf(g_shm_size);
-        char hdr[HDR_SIZE];
-
-        serialize_header(hdr, -1, 0, 0, 0ULL, 1);
-        memcpy(termbuf.data(), hdr, HDR_SIZE);
-
-        write_shm_block(shm_s1_s2, sem_s1s2_empty, sem_s1s2_full, termbuf);
-        
+    if (height < 3 || width < 3)
         return;
-    }
 
     const int cols_per_row = std::max(0, width - 2);
-    const size_t fixed_payload = g_fixed_payload; // PROCESSED_ROW_COUNT * cols_per_row * 3
 
-    int dir[9][2] = {
-        {-1,-1}, {-1,0}, {-1,1},
-        {0,-1}, {0,0}, {0,1},
-        {1,-1}, {1,0}, {1,1}
-    };
+    batchTuner tuner(TARGET_PACKET_BYTES, static_cast<size_t>(cols_per_row) * 3, PROCESSED_ROW_COUNT);
 
-    for (int i = 1; i <= height - 2; ) {
-        int batch_start = i;
-        int take = std::min(PROCESSED_ROW_COUNT, (height - 1) - i );
+    while (true) {
+        int rows = ADAPTIVE_BATCH ? tuner.next_rows() : PROCESSED_ROW_COUNT;
+        int32_t epoch;
+        int batch_start, take;
 
-        if (take <= 0) 
+        if (!claim_band(height - 2, job.iterations, rows, epoch, batch_start, take)) 
             break;
 
-        rowPacket rpkt(batch_start, take, cols_per_row);
+        char* slot = shm_ring_acquire(shm_s1_s2);
 
-        for (int r_off = 0; r_off < take; ++r_off) {
-            int r = batch_start + r_off;
-            for (int c = 1, cidx = 0; c <= width - 2; c++, cidx++) {
-                int sumR=0, sumG=0, sumB=0;
-                for (int k=0;k<9;++k) {
-
-                    int rr = r + dir[k][0], cc = c + dir[k][1];
-
-                    sumR += input_image->image_pixels[rr][cc][0];
-                    sumG += input_image->image_pixels[rr][cc][1];
-                    sumB += input_image->image_pixels[rr][cc][2];
-                }
-
-                uint8_t sr = static_cast<uint8_t>(sumR / 9);
-                uint8_t sg = static_cast<uint8_t>(sumG / 9);
-                uint8_t sb = static_cast<uint8_t>(sumB / 9);
-                
-                uint8_t *p = rpkt.pixel_ptr(r_off, cidx);
-                
-                p[0]=sr; p[1]=sg; p[2]=sb;
-            }
-        }
-
-        if (USE_HASH)
-            rpkt.hash = calculate_hash_for_packet(rpkt);
-
-        std::vector<char> outbuf(g_shm_size);
-        serialize_header(outbuf.data(), rpkt.start_row, rpkt.num_rows, rpkt.cols_per_row, (uint64_t)rpkt.hash, rpkt.is_last ? 1 : 0);
+        // latency of the band itself, not of waiting for S2 to free a slot
+        auto start_pkt = std::chrono::steady_clock::now();
 
+        uint8_t* payload = reinterpret_cast<uint8_t*>(slot + STAGE_HDR_SIZE);
         size_t actual_bytes = static_cast<size_t>(take) * cols_per_row * 3;
+        pool.run(take, [&](int first, int count) {
+            smoothen_rows(input_image, batch_start + first, count, payload + static_cast<size_t>(first) * cols_per_row * 3);
+        });
 
-        if (actual_bytes > 0) 
-            memcpy(outbuf.data() + HDR_SIZE, rpkt.pixels.data(), actual_bytes);
+        rowPacket rpkt(batch_start, take, cols_per_row, true);
+        g_link_s1_s2.seal(rpkt, payload, actual_bytes);
+        serialize_stage_header(slot, rpkt.start_row, rpkt.num_rows, rpkt.cols_per_row, (uint64_t)rpkt.hash, rpkt.hash_algo, 0, epoch);
 
-        if (g_shm_size > HDR_SIZE + actual_bytes) 
-            memset(outbuf.data() + HDR_SIZE + actual_bytes, 0, g_shm_size - HDR_SIZE - actual_bytes);
+        std::chrono::duration<double, std::micro> latency = std::chrono::steady_clock::now() - start_pkt;
 
-        write_shm_block(shm_s1_s2, sem_s1s2_empty, sem_s1s2_full, outbuf);
+        // blocks S2 has not picked up yet
+        size_t occupied = shm_ring_occupancy(shm_s1_s2);
 
-        i += take;
-    }
+        shm_ring_publish(shm_s1_s2, slot);
 
-    // send terminal 
-    std::vector<char> termbuf(g_shm_size);
-    char thdr[HDR_SIZE];
-    serialize_header(thdr, -1, 0, 0, 0ULL, 1);
-    memcpy(termbuf.data(), thdr, HDR_SIZE);
+        tuner.observe(take, latency.count(), occupied, shm_s1_s2->slots);
+    }
 
-    write_shm_block(shm_s1_s2, sem_s1s2_empty, sem_s1s2_full, termbuf);
+    if (ADAPTIVE_BATCH)
+        tuner.report(("S1." + std::to_string(worker) + "[job " + std::to_string(job.job) + "]").c_str());
 }
 
-void S2_find_details(image_t* input_image) {
-    int width = input_image->width;
-    int height = input_image->height;
+static bool map_job_regions(const stage_job_t& job, bool create);
+static void unmap_job_regions();
 
-    if (height < 3 || width < 3) {
-        // forward terminal
-        std::vector<char> termbuf(g_shm_size);
-        char hdr[HDR_SIZE];
-        serialize_header(hdr, -1, 0, 0, 0ULL, 1);
-        memcpy(termbuf.data(), hdr, HDR_SIZE);
+// resident S1 worker, one job per descriptor until the parent closes the control pipe.
+// S1 stays up for all iterations of a job, S2/S3/parent drain epoch e while S1 is already on e+1.
+// once the last S1 worker is out of bands every S2 worker gets an end marker of its own
+void S1_smoothen(int ctl_fd, int worker, bandPool& pool) {
+    stage_job_t job;
 
-        write_shm_block(shm_s2_s3, sem_s2s3_empty, sem_s2s3_full, termbuf);
+    while (recv_stage_job(ctl_fd, job)) {
+        if (!map_job_regions(job, false))
+            return;
+        image_t* input_image = map_job_image(job);
+        if (!input_image) {
+            send_shutdown();
+            return;
+        }
 
-        return;
-    }
+        S1_smoothen_job(input_image, job, worker, pool);
 
-    const int cols_per_row = std::max(0, width - 2);
+        // every worker has published all its bands before it counts itself out
+        if (g_job_sync->s1_ended.fetch_add(1) + 1 == g_s1_workers)
+            for (int k = 0; k < g_s2_workers; k++)
+                send_marker(shm_s1_s2, job.iterations - 1);
+
+        unmap_job_image(job, input_image);
+        unmap_job_regions();
+    }
+}
 
-    std::vector<char> hdrbuf(g_shm_size);
+// one job, up to this worker's end marker. false once the pipeline shuts down.
+// the smoothened band is read where S1 left it and the details go straight into the next
+// ring, S2 holds its input slot until the output slot is published
+static bool S2_find_details_job(image_t* input_image, bandPool& pool) {
 
     while (true) {
-        read_shm_block(shm_s1_s2, sem_s1s2_empty, sem_s1s2_full, hdrbuf);
+        const char* in = shm_ring_peek(shm_s1_s2);
 
+        uint32_t payload_len;
         int32_t start_row, num_rows, cols;
         uint64_t hash;
+        uint8_t hash_algo;
         uint8_t is_last;
-        deserialize_header(hdrbuf.data(), start_row, num_rows, cols, hash, is_last);
+        int32_t epoch, sequence;
+        deserialize_stage_header(in, payload_len, start_row, num_rows, cols, hash, hash_algo, is_last, epoch, sequence);
 
-        // payload is part of hdrbuf (readed full block already)
         if (is_last) {
-            // forward terminal header + 0- payload
-            std::vector<char> termbuf(g_shm_size);
-            char thdr[HDR_SIZE];
-            serialize_header(thdr, -1, 0, 0, 0ULL, 1);
-            memcpy(termbuf.data(), thdr, HDR_SIZE);
-
-            write_shm_block(shm_s2_s3, sem_s2s3_empty, sem_s2s3_full, termbuf);
-            return;
+            shm_ring_release(shm_s1_s2, in);
+
+            // every worker has published all it took before its marker, so once the last one
+            // is here nothing of the job is left upstream of S3
+            if (g_job_sync->s2_ended.fetch_add(1) + 1 == g_s2_workers)
+                for (int k = 0; k < g_s3_workers; k++)
+                    send_marker(shm_s2_s3, epoch);
+            return true;
         }
 
-        rowPacket rpkt(start_row, num_rows, cols);
+        const uint8_t* smooth = reinterpret_cast<const uint8_t*>(in + STAGE_HDR_SIZE);
         size_t actual_bytes = static_cast<size_t>(num_rows) * cols * 3;
-        if (actual_bytes > 0)
-            memcpy(rpkt.pixels.data(), hdrbuf.data() + HDR_SIZE, actual_bytes);
 
+        rowPacket rpkt(start_row, num_rows, cols, true);
         rpkt.hash = (std::size_t)hash;
+        rpkt.hash_algo = hash_algo;
 
-        if (USE_HASH) {
-            std::size_t expected = calculate_hash_for_packet(rpkt);
-            if (expected != rpkt.hash) {
-                std::cerr << "S2: Data Corrupted in rowPacket(start_row=" << rpkt.start_row << ")!!\n";
-
-                std::vector<char> termbuf(g_shm_size);
-                char thdr[HDR_SIZE];
-                serialize_header(thdr, -1, 0, 0, 0ULL, 1);
-                memcpy(termbuf.data(), thdr, HDR_SIZE);
-
-                write_shm_block(shm_s2_s3, sem_s2s3_empty, sem_s2s3_full, termbuf);
-
-                return;
-            }
+        if (!g_link_s1_s2.check(rpkt, smooth, actual_bytes)) {
+            std::cerr << "S2: Data Corrupted in rowPacket(start_row=" << rpkt.start_row << ")!!\n";
+            shm_ring_release(shm_s1_s2, in);
+            send_shutdown();
+            return false;
         }
 
-        rowPacket out_rpkt(rpkt.start_row, rpkt.num_rows, rpkt.cols_per_row);
-
-        for (int r_off = 0; r_off < rpkt.num_rows; ++r_off) {
-            int row_idx = rpkt.start_row + r_off;
-            for (int cidx = 0; cidx < rpkt.cols_per_row; ++cidx) {
-
-                uint8_t* sp = rpkt.pixel_ptr(r_off, cidx);
-                int orig_col = 1 + cidx;
-                
-                int dR = input_image->image_pixels[row_idx][orig_col][0] - (int)sp[0];
-                int dG = input_image->image_pixels[row_idx][orig_col][1] - (int)sp[1];
-                int dB = input_image->image_pixels[row_idx][orig_col][2] - (int)sp[2];
-                
-                if (dR < 0) 
-                    dR = 0;
-                if (dG < 0) 
-                    dG = 0; 
-                if (dB < 0) 
-                    dB = 0;
-
-                uint8_t* op = out_rpkt.pixel_ptr(r_off, cidx);
-
-                op[0] = (uint8_t)dR; op[1] = (uint8_t)dG; op[2] = (uint8_t)dB;
-            }
-        }
+        char* out = shm_ring_acquire(shm_s2_s3);
+        uint8_t* details = reinterpret_cast<uint8_t*>(out + STAGE_HDR_SIZE);
 
-        if (USE_HASH) out_rpkt.hash = calculate_hash_for_packet(out_rpkt);
+        pool.run(num_rows, [&](int first, int count) {
+            size_t off = static_cast<size_t>(first) * cols * 3;
+            find_details_rows(input_image, start_row + first, count, smooth + off, details + off);
+        });
+        shm_ring_release(shm_s1_s2, in);
 
-        std::vector<char> outbuf(g_shm_size);
-        serialize_header(outbuf.data(), out_rpkt.start_row, out_rpkt.num_rows, out_rpkt.cols_per_row, (uint64_t)out_rpkt.hash, out_rpkt.is_last ? 1 : 0);
-        size_t out_actual = static_cast<size_t>(out_rpkt.num_rows) * out_rpkt.cols_per_row * 3;
+        rowPacket out_rpkt(start_row, num_rows, cols, true);
+        g_link_s2_s3.seal(out_rpkt, details, actual_bytes);
+        serialize_stage_header(out, out_rpkt.start_row, out_rpkt.num_rows, out_rpkt.cols_per_row, (uint64_t)out_rpkt.hash, out_rpkt.hash_algo, 0, epoch);
 
-        if (out_actual > 0) 
-            memcpy(outbuf.data() + HDR_SIZE, out_rpkt.pixels.data(), out_actual);
-        if (g_shm_size > HDR_SIZE + out_actual) 
-            memset(outbuf.data() + HDR_SIZE + out_actual, 0, g_shm_size - HDR_SIZE - out_actual);
-
-        write_shm_block(shm_s2_s3, sem_s2s3_empty, sem_s2s3_full, outbuf);
+        shm_ring_publish(shm_s2_s3, out);
     }
 }
 
-void S3_sharpen(image_t* input_image) {
-    int width = input_image->width;
-    int height = input_image->height;
+// resident S2 worker, one job per descriptor until the parent closes the control pipe
+void S2_find_details(int ctl_fd, bandPool& pool) {
+    stage_job_t job;
 
-    if (height < 3 || width < 3) {
-        // forward terminal
-        std::vector<char> termbuf(g_shm_size);
-        char hdr[HDR_SIZE];
-        serialize_header(hdr, -1, 0, 0, 0ULL, 1);
-        memcpy(termbuf.data(), hdr, HDR_SIZE);
-
-        write_shm_block(shm_s3_p, sem_s3p_empty, sem_s3p_full, termbuf);
-        return;
+    while (recv_stage_job(ctl_fd, job)) {
+        if (!map_job_regions(job, false))
+            return;
+        image_t* input_image = map_job_image(job);
+        if (!input_image) {
+            send_shutdown();
+            return;
+        }
+        bool more = S2_find_details_job(input_image, pool);
+        unmap_job_image(job, input_image);
+        unmap_job_regions();
+        if (!more)
+            return;
     }
+}
 
-    std::vector<char> blockbuf(g_shm_size);
+// one job, up to this worker's end marker. false once the pipeline shuts down.
+// the details are read in place and the sharpened rows go straight into the output file the
+// parent created, at their start_row, so the workers need no order among themselves. the
+// parent only hears which rows are done
+static bool S3_sharpen_job(image_t* input_image, const stage_job_t& job, bandPool& pool) {
+    mappedPPM output(job.output, job.height, job.width, false);
+    image_t* output_image = output.image();
 
     while (true) {
 
-        read_shm_block(shm_s2_s3, sem_s2s3_empty, sem_s2s3_full, blockbuf);
+        const char* in = shm_ring_peek(shm_s2_s3);
 
+        uint32_t payload_len;
         int32_t start_row, num_rows, cols;
         uint64_t hash;
+        uint8_t hash_algo;
         uint8_t is_last;
-        deserialize_header(blockbuf.data(), start_row, num_rows, cols, hash, is_last);
+        int32_t epoch, sequence;
+        deserialize_stage_header(in, payload_len, start_row, num_rows, cols, hash, hash_algo, is_last, epoch, sequence);
 
         if (is_last) {
-            std::vector<char> termbuf(g_shm_size);
-            char thdr[HDR_SIZE];
-            serialize_header(thdr, -1, 0, 0, 0ULL, 1);
-            memcpy(termbuf.data(), thdr, HDR_SIZE);
-
-            write_shm_block(shm_s3_p, sem_s3p_empty, sem_s3p_full, termbuf);
+            shm_ring_release(shm_s2_s3, in);
 
-            return;
+            // the notices of every worker are out, the parent may close the job
+            if (g_job_sync->s3_ended.fetch_add(1) + 1 == g_s3_workers)
+                send_marker(shm_s3_p, epoch);
+            return true;
         }
 
-        rowPacket rpkt(start_row, num_rows, cols);
+        const uint8_t* details = reinterpret_cast<const uint8_t*>(in + STAGE_HDR_SIZE);
         size_t actual = static_cast<size_t>(num_rows) * cols * 3;
-        if (actual > 0) 
-            memcpy(rpkt.pixels.data(), blockbuf.data() + HDR_SIZE, actual);
 
+        rowPacket rpkt(start_row, num_rows, cols, true);
         rpkt.hash = (std::size_t)hash;
+        rpkt.hash_algo = hash_algo;
 
-        if (USE_HASH) {
-            std::size_t expected = calculate_hash_for_packet(rpkt);
-            if (expected != rpkt.hash) {
-                std::cerr << "S3: Data Corrupted in rowPacket(start_row=" << rpkt.start_row << ")!!\n";
-
-                std::vector<char> termbuf(g_shm_size);
-                char thdr[HDR_SIZE];
-                serialize_header(thdr, -1, 0, 0, 0ULL, 1);
-                memcpy(termbuf.data(), thdr, HDR_SIZE);
-
-                write_shm_block(shm_s3_p, sem_s3p_empty, sem_s3p_full, termbuf);
-
-                return;
-            }
-        }
-
-        rowPacket out_rpkt(rpkt.start_row, rpkt.num_rows, rpkt.cols_per_row);
-
-        for (int r_off = 0; r_off < rpkt.num_rows; ++r_off) {
-            int i = rpkt.start_row + r_off;
-            for (int cidx = 0; cidx < rpkt.cols_per_row; ++cidx) {
-
-                uint8_t* d = rpkt.pixel_ptr(r_off, cidx);
-                int j = 1 + cidx;
-                
-                int newR = input_image->image_pixels[i][j][0] + SCALING_FACTOR * (int)d[0];
-                int newG = input_image->image_pixels[i][j][1] + SCALING_FACTOR * (int)d[1];
-                int newB = input_image->image_pixels[i][j][2] + SCALING_FACTOR * (int)d[2];
-                
-                uint8_t* o = out_rpkt.pixel_ptr(r_off, cidx);
-                
-                o[0] = (uint8_t)(newR > 255 ? 255 : (newR < 0 ? 0 : newR));
-                o[1] = (uint8_t)(newG > 255 ? 255 : (newG < 0 ? 0 : newG));
-                o[2] = (uint8_t)(newB > 255 ? 255 : (newB < 0 ? 0 : newB));
-            }
+        if (!g_link_s2_s3.check(rpkt, details, actual)) {
+            std::cerr << "S3: Data Corrupted in rowPacket(start_row=" << rpkt.start_row << ")!!\n";
+            shm_ring_release(shm_s2_s3, in);
+            send_shutdown();
+            return false;
         }
 
-        if (USE_HASH) out_rpkt.hash = calculate_hash_for_packet(out_rpkt);
+        pool.run(num_rows, [&](int first, int count) {
+            sharpen_rows(input_image, output_image, start_row + first, count, details + static_cast<size_t>(first) * cols * 3, SCALING_FACTOR);
+        });
+        shm_ring_release(shm_s2_s3, in);
 
-        std::vector<char> outbuf(g_shm_size);
-
-        serialize_header(outbuf.data(), out_rpkt.start_row, out_rpkt.num_rows, out_rpkt.cols_per_row, (uint64_t)out_rpkt.hash, out_rpkt.is_last ? 1 : 0);
-        size_t out_actual = static_cast<size_t>(out_rpkt.num_rows) * out_rpkt.cols_per_row * 3;
+        // rows [start_row, start_row + num_rows) of epoch are in the output
+        char* notice = shm_ring_acquire(shm_s3_p);
+        serialize_stage_header(notice, start_row, num_rows, 0, 0ULL, CHECKSUM_NONE, 0, epoch);
+        shm_ring_publish(shm_s3_p, notice);
+    }
+}
 
-        if (out_actual > 0) 
-            memcpy(outbuf.data() + HDR_SIZE, out_rpkt.pixels.data(), out_actual);
-        if (g_shm_size > HDR_SIZE + out_actual) 
-            memset(outbuf.data() + HDR_SIZE + out_actual, 0, g_shm_size - HDR_SIZE - out_actual);
+// resident S3 worker, one job per descriptor until the parent closes the control pipe
+void S3_sharpen(int ctl_fd, bandPool& pool) {
+    stage_job_t job;
 
-        write_shm_block(shm_s3_p, sem_s3p_empty, sem_s3p_full, outbuf);
+    while (recv_stage_job(ctl_fd, job)) {
+        if (!map_job_regions(job, false))
+            return;
+        image_t* input_image = map_job_image(job);
+        if (!input_image) {
+            send_shutdown();
+            return;
+        }
+        bool more = S3_sharpen_job(input_image, job, pool);
+        unmap_job_image(job, input_image);
+        unmap_job_regions();
+        if (!more)
+            return;
     }
 }
 
-// helper to create shared mem and map of size bytes, return pointer
-static char* create_and_map_shm(const char* name, size_t size) {
-    
-    int fd = shm_open(name, O_CREAT | O_RDWR, 0666);
-    if (fd == -1) { 
-        perror("shm_open"); 
-        return nullptr; 
-    }
+// anonymous shared memory, -1 on failure. the fd stays open for the children forked after it
+static int create_shm_fd(const char* name) {
+    int fd = memfd_create(name, MFD_CLOEXEC);
+    if (fd == -1)
+        perror("memfd_create");
+    return fd;
+}
+
+// helper to size the shared mem of fd to size bytes and map it, return pointer
+static char* create_and_map_shm(int fd, size_t size) {
 
     if (ftruncate(fd, (off_t)size) == -1) {
         perror("ftruncate"); 
-        close(fd); 
         return nullptr; 
     }
 
@@ -443,216 +400,386 @@ static char* create_and_map_shm(const char* name, size_t size) {
 
     if (p == MAP_FAILED) { 
         perror("mmap"); 
-        close(fd); 
         return nullptr; 
     }
-
-    close(fd);
     return static_cast<char*>(p);
 }
 
-int main(int argc, char **argv) {
-    if (argc != 3) {
-        std::cout << "usage: ./a.out <input.ppm> <output.ppm>\n";
-        return 0;
-    }
+// same for a stage, the parent has already sized the region
+static char* open_and_map_shm(int fd, size_t size) {
 
-    std::cout << "\nProcessing Image..." <<std::endl;
-    std::cout << "----------------------------------------------------------------------------------------------------------" << std::endl;
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
-    image_t* input_image = read_ppm_file(argv[1]);
-    if (!input_image) { 
-        std::cerr << "Failed to read input\n"; 
-        return 1; 
+    if (p == MAP_FAILED) { 
+        perror("mmap"); 
+        return nullptr; 
     }
+    return static_cast<char*>(p);
+}
 
-    int height = input_image->height, width = input_image->width;
-
-    // prepare output image 
-    image_t* output_image = new image_t;
-
-    output_image->height = height; output_image->width = width;
-    output_image->image_pixels = new uint8_t**[height];
-    
-    for (int i = 0; i < height; ++i) {
-        output_image->image_pixels[i] = new uint8_t*[width];
-        for (int j = 0; j < width; ++j) {
-            output_image->image_pixels[i][j] = new uint8_t[3];
-    
-            output_image->image_pixels[i][j][0] = input_image->image_pixels[i][j][0];
-            output_image->image_pixels[i][j][1] = input_image->image_pixels[i][j][1];
-            output_image->image_pixels[i][j][2] = input_image->image_pixels[i][j][2];
-        }
+static shm_ring_t* map_ring(int fd, size_t block_bytes, bool create) {
+    size_t bytes = shm_ring_bytes(g_ring_slots, block_bytes);
+    char* p = create ? create_and_map_shm(fd, bytes) : open_and_map_shm(fd, bytes);
+    if (!p)
+        return nullptr;
+
+    // all stages share one node, so faulting the slots in from the parent places them next to
+    // their consumers. first_touch writes, so it goes before the ring head is laid out
+    shm_ring_t* ring = reinterpret_cast<shm_ring_t*>(p);
+    if (create) {
+        if (USE_PINNING)
+            first_touch(p, bytes);
+        shm_ring_init(ring, g_ring_slots, block_bytes, SHM_SYNC);
     }
+    return ring;
+}
 
-    // set global varibales
+// blocks are sized for the job's width. the parent (create) resizes the regions before it
+// hands the job out, so nobody still touches them: every access of the previous job happened
+// before the last S3 worker sent the parent that job's end marker
+static bool map_job_regions(const stage_job_t& job, bool create) {
 
-    g_cols_per_row = static_cast<size_t>(std::max(0, width - 2));
+    g_cols_per_row = static_cast<size_t>(std::max(0, job.width - 2));
     g_fixed_payload = static_cast<size_t>(PROCESSED_ROW_COUNT) * g_cols_per_row * 3;
-    g_shm_size = HDR_SIZE + g_fixed_payload;
+    g_shm_size = STAGE_HDR_SIZE + g_fixed_payload;
 
-    // create shared memory regions using helper
-    shm_s1_s2 = create_and_map_shm(SHM_S1_S2_NAME, g_shm_size);
-    shm_s2_s3 = create_and_map_shm(SHM_S2_S3_NAME, g_shm_size);
-    shm_s3_p  = create_and_map_shm(SHM_S3_P_NAME,  g_shm_size);
+    shm_s1_s2 = map_ring(shm_fd_s1_s2, g_shm_size, create);
+    shm_s2_s3 = map_ring(shm_fd_s2_s3, g_shm_size, create);
+    shm_s3_p  = map_ring(shm_fd_s3_p,  STAGE_HDR_SIZE, create);
 
     if (!shm_s1_s2 || !shm_s2_s3 || !shm_s3_p) { 
-        std::cerr << "Failed to create shared memory\n"; 
-        return 1; 
+        std::cerr << "Failed to map shared memory for job " << job.job << "\n"; 
+        return false; 
     }
+    return true;
+}
 
-    // create semaphores (initially empty=1, full=0)
-    sem_unlink(SEM_S1S2_EMPTY); sem_unlink(SEM_S1S2_FULL);
-    sem_unlink(SEM_S2S3_EMPTY); sem_unlink(SEM_S2S3_FULL);
-    sem_unlink(SEM_S3P_EMPTY);  sem_unlink(SEM_S3P_FULL);
-
-    // create semaphores
-    sem_s1s2_empty = sem_open(SEM_S1S2_EMPTY, O_CREAT, 0666, 1);
-    sem_s1s2_full  = sem_open(SEM_S1S2_FULL,  O_CREAT, 0666, 0);
-    sem_s2s3_empty = sem_open(SEM_S2S3_EMPTY, O_CREAT, 0666, 1);
-    sem_s2s3_full  = sem_open(SEM_S2S3_FULL,  O_CREAT, 0666, 0);
-    sem_s3p_empty  = sem_open(SEM_S3P_EMPTY,  O_CREAT, 0666, 1);
-    sem_s3p_full   = sem_open(SEM_S3P_FULL,   O_CREAT, 0666, 0);
-
-    if (sem_s1s2_empty == SEM_FAILED || sem_s1s2_full == SEM_FAILED || sem_s2s3_empty == SEM_FAILED || sem_s2s3_full == SEM_FAILED || sem_s3p_empty  == SEM_FAILED || sem_s3p_full  == SEM_FAILED) {
-        perror("sem_open"); return 1;
+static void unmap_job_regions() {
+    if (shm_s1_s2) munmap(shm_s1_s2, shm_ring_bytes(g_ring_slots, g_shm_size));
+    if (shm_s2_s3) munmap(shm_s2_s3, shm_ring_bytes(g_ring_slots, g_shm_size));
+    if (shm_s3_p)  munmap(shm_s3_p,  shm_ring_bytes(g_ring_slots, STAGE_HDR_SIZE));
+    shm_s1_s2 = shm_s2_s3 = shm_s3_p = nullptr;
+}
+
+// the control pipes a stage does not need, right after fork
+static void close_stage_handles(size_t own) {
+    for (size_t p = 0; p < g_procs.size(); p++) {
+        close(g_procs[p].ctl[1]);
+        if (p != own)
+            close(g_procs[p].ctl[0]);
     }
+}
 
-    auto start_p = std::chrono::steady_clock::now();
+// parent side of one job: counts the rows S3's workers report per epoch until the end marker,
+// false if the pipeline shut down first or the counts don't add up. the workers finish bands
+// in any order, an epoch is done once all its rows are. the rows themselves are already in
+// the output mapping
+static bool collect_job(const stage_job_t& job, imageMerkle& merkle, std::vector<std::chrono::steady_clock::time_point>& epoch_done) {
+    const int rows_per_epoch = std::max(0, job.height - 2);
+    std::vector<int> rows_done(job.iterations, 0);
 
-    for(int i = 0;i < MAX_ITERATIONS;i++){
-        pid_t pid1 = fork();
+    while (true) {
+        const char* notice = shm_ring_peek(shm_s3_p);
 
-        if (pid1 < 0) { 
-            perror("fork1"); 
-            exit(1); 
+        uint32_t payload_len;
+        int32_t start_row, num_rows, cols;
+        uint64_t hash;
+        uint8_t hash_algo;
+        uint8_t is_last;
+        int32_t epoch, sequence;
+        
+        deserialize_stage_header(notice, payload_len, start_row, num_rows, cols, hash, hash_algo, is_last, epoch, sequence);
+        shm_ring_release(shm_s3_p, notice);
+
+        if (is_last) {
+            if (epoch == SHUTDOWN_EPOCH) 
+                return false;
+            for (int32_t e = 0; e < job.iterations; e++) {
+                if (rows_done[e] != rows_per_epoch) {
+                    std::cerr << "Parent: epoch " << e << " ended with " << rows_done[e] << " of " << rows_per_epoch << " rows\n";
+                    return false;
+                }
+            }
+            return true;
         }
-        if (pid1 == 0) {
-            S1_smoothen(input_image);
-            
-            // cleanup
-            munmap(shm_s1_s2, g_shm_size);
-            munmap(shm_s2_s3, g_shm_size);
-            munmap(shm_s3_p,  g_shm_size);
-            sem_close(sem_s1s2_empty); sem_close(sem_s1s2_full);
-            sem_close(sem_s2s3_empty); sem_close(sem_s2s3_full);
-            sem_close(sem_s3p_empty);  sem_close(sem_s3p_full);
-            _exit(0);
+
+        if (epoch < 0 || epoch >= job.iterations || start_row < 1 || num_rows < 0 || start_row + num_rows > job.height - 1
+            || rows_done[epoch] + num_rows > rows_per_epoch) {
+            std::cerr << "Parent: bad notice for rows " << start_row << " + " << num_rows << " of epoch " << epoch << "\n";
+            return false;
         }
 
-        // fork S2
-        pid_t pid2 = fork();
+        rows_done[epoch] += num_rows;
+        if (rows_done[epoch] == rows_per_epoch)
+            epoch_done.push_back(std::chrono::steady_clock::now());
+
+        if (epoch == job.iterations - 1)
+            merkle.rows_done(start_row, num_rows);
+    }
+}
 
-        if (pid2 < 0) { 
-            perror("fork2"); 
-            exit(1); 
+// forks one resident process per stage worker, the S1 workers first, then the S2 and S3 ones.
+// each one starts its own bandPool. false (in the parent) if a fork failed
+static bool fork_stages() {
+    for (size_t p = 0; p < g_procs.size(); p++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return false;
         }
-        if (pid2 == 0) {
-            S2_find_details(input_image);
-
-            //cleanup
-            munmap(shm_s1_s2, g_shm_size);
-            munmap(shm_s2_s3, g_shm_size);
-            munmap(shm_s3_p,  g_shm_size);
-            sem_close(sem_s1s2_empty); sem_close(sem_s1s2_full);
-            sem_close(sem_s2s3_empty); sem_close(sem_s2s3_full);
-            sem_close(sem_s3p_empty);  sem_close(sem_s3p_full);
-            _exit(0);
+        if (pid > 0) {
+            g_procs[p].pid = pid;
+            continue;
         }
 
-        // fork S3
-        pid_t pid3 = fork();
+        if (USE_PINNING)
+            pin_process_to_cpus(0, g_procs[p].cpus);
+
+        int ctl_fd = g_procs[p].ctl[0];
+        close_stage_handles(p);
+
+        bandPool pool(g_stage_threads[g_procs[p].stage], g_procs[p].cpus);
 
-        if (pid3 < 0) { 
-            perror("fork3"); 
-            exit(1); 
+        switch (g_procs[p].stage) {
+        case 1:
+            S1_smoothen(ctl_fd, g_procs[p].worker, pool);
+            break;
+        case 2:
+            S2_find_details(ctl_fd, pool);
+            g_link_s1_s2.report();
+            break;
+        default:
+            S3_sharpen(ctl_fd, pool);
+            g_link_s2_s3.report();
+            break;
         }
-        if (pid3 == 0) {
-            S3_sharpen(input_image);
-
-            //cleanup
-            munmap(shm_s1_s2, g_shm_size);
-            munmap(shm_s2_s3, g_shm_size);
-            munmap(shm_s3_p,  g_shm_size);
-            sem_close(sem_s1s2_empty); sem_close(sem_s1s2_full);
-            sem_close(sem_s2s3_empty); sem_close(sem_s2s3_full);
-            sem_close(sem_s3p_empty);  sem_close(sem_s3p_full);
-            _exit(0);
+
+        //cleanup
+        unmap_job_regions();
+        _exit(0);
+    }
+    return true;
+}
+
+// leading -s1 K / -s2 K / -s3 K (workers), -t1 N / -t2 N / -t3 N (threads per worker) and -slots N
+// (per shm ring, at least 2), returns the index of the first image argument or -1
+static int parse_stage_counts(int argc, char** argv) {
+    int arg = 1;
+    while (arg + 1 < argc && argv[arg][0] == '-') {
+        int* count = nullptr;
+        if (strcmp(argv[arg], "-s1") == 0) count = &g_s1_workers;
+        else if (strcmp(argv[arg], "-s2") == 0) count = &g_s2_workers;
+        else if (strcmp(argv[arg], "-s3") == 0) count = &g_s3_workers;
+        else if (strcmp(argv[arg], "-slots") == 0) count = &g_ring_slots;
+        else if (strcmp(argv[arg], "-t1") == 0) count = &g_stage_threads[1];
+        else if (strcmp(argv[arg], "-t2") == 0) count = &g_stage_threads[2];
+        else if (strcmp(argv[arg], "-t3") == 0) count = &g_stage_threads[3];
+
+        int k = std::atoi(argv[arg + 1]);
+        if (!count || k < 1)
+            return -1;
+        *count = k;
+        arg += 2;
+    }
+    // with a single slot a published block and a free one read the same sequence
+    if (g_ring_slots < 2)
+        return -1;
+    return arg;
+}
+
+int main(int argc, char **argv) {
+    int first = parse_stage_counts(argc, argv);
+    if (first < 0 || argc - first < 2 || (argc - first) % 2 != 0) {
+        std::cout << "usage: ./a.out [-s1 K] [-s2 K] [-s3 K] [-slots N] [-t1 N] [-t2 N] [-t3 N] <input.ppm> <output.ppm> [<input.ppm> <output.ppm> ...]\n";
+        return 0;
+    }
+
+    std::cout << "\nProcessing Image (" << g_s1_workers << " S1, " << g_s2_workers << " S2, " << g_s3_workers << " S3 workers, " << g_ring_slots << " slots per ring; " << g_stage_threads[1] << "/" << g_stage_threads[2] << "/" << g_stage_threads[3] << " threads per S1/S2/S3 process)..." <<std::endl;
+    std::cout << "----------------------------------------------------------------------------------------------------------" << std::endl;
+
+    for (int k = 0; k < g_s1_workers; k++)
+        g_procs.push_back(stage_proc_t{1, k, {-1, -1}, -1, {}});
+    for (int k = 0; k < g_s2_workers; k++)
+        g_procs.push_back(stage_proc_t{2, k, {-1, -1}, -1, {}});
+    for (int k = 0; k < g_s3_workers; k++)
+        g_procs.push_back(stage_proc_t{3, k, {-1, -1}, -1, {}});
+
+    // decide placement before touching any image or shm memory so the pages land on the stages' node.
+    // every thread gets a cpu of its own, a process's threads on neighbouring ones
+    std::vector<std::string> names;
+    for (const stage_proc_t& proc : g_procs) {
+        std::string name = "S" + std::to_string(proc.stage) + "." + std::to_string(proc.worker);
+        for (int t = 0; t < g_stage_threads[proc.stage]; t++)
+            names.push_back(t == 0 ? name : name + "#" + std::to_string(t));
+    }
+    std::vector<const char*> stage_names;
+    for (const std::string& name : names)
+        stage_names.push_back(name.c_str());
+
+    if (USE_PINNING) {
+        stage_placement_t placement = plan_stage_placement(static_cast<int>(names.size()));
+        pin_process_to_cpus(0, placement.all_cpus);
+        print_placement(placement, stage_names.data());
+
+        size_t next = 0;
+        for (stage_proc_t& proc : g_procs)
+            for (int t = 0; t < g_stage_threads[proc.stage]; t++)
+                proc.cpus.push_back(placement.stage_cpus[next++]);
+    }
+
+    shm_fd_s1_s2 = create_shm_fd(SHM_S1_S2_NAME);
+    shm_fd_s2_s3 = create_shm_fd(SHM_S2_S3_NAME);
+    shm_fd_s3_p  = create_shm_fd(SHM_S3_P_NAME);
+
+    if (shm_fd_s1_s2 == -1 || shm_fd_s2_s3 == -1 || shm_fd_s3_p == -1) {
+        std::cerr << "Failed to create shared memory\n";
+        return 1;
+    }
+    g_input_fd = create_stage_input("stage_input");
+
+    void* sync_mem = mmap(nullptr, sizeof(job_sync_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sync_mem == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    g_job_sync = new (sync_mem) job_sync_t;
+
+    for (stage_proc_t& proc : g_procs) {
+        if (pipe(proc.ctl) < 0) {
+            perror("control pipe");
+            return 1;
         }
+    }
 
-        // parent: read from shm_s3_p and write to output_image
-        std::vector<char> blockbuf(g_shm_size);
+    // stage processes are forked once, before any image is loaded, and serve every job.
+    // the shm regions are sized and their rings laid out afresh per job
+    bool failed = !fork_stages();
 
-        while (true) {
-            read_shm_block(shm_s3_p, sem_s3p_empty, sem_s3p_full, blockbuf);
+    for (stage_proc_t& proc : g_procs)
+        close(proc.ctl[0]);
 
-            int32_t start_row, num_rows, cols;
-            uint64_t hash;
-            uint8_t is_last;
-            
-            deserialize_header(blockbuf.data(), start_row, num_rows, cols, hash, is_last);
+    int iterations_done = 0;
 
-            if (is_last) 
-                break;
+    for (int32_t job_id = 0; !failed && first + 2 * job_id + 1 < argc; job_id++) {
+        char* input_path = argv[first + 2 * job_id];
+        char* output_path = argv[first + 2 * job_id + 1];
+
+        image_t* input_image = read_ppm_file(input_path);
+        if (!input_image) { 
+            std::cerr << "Failed to read input\n"; 
+            failed = true;
+            break; 
+        }
 
-            rowPacket rpkt(start_row, num_rows, cols);
-            size_t actual = static_cast<size_t>(num_rows) * cols * 3;
+        int height = input_image->height, width = input_image->width;
 
-            if (actual > 0) 
-                memcpy(rpkt.pixels.data(), blockbuf.data() + HDR_SIZE, actual);
+        // S3 maps the output file, so it has to exist (at its final size) before the job goes out.
+        // only the border is ours to fill, S3 writes every interior pixel
+        mappedPPM output(output_path, height, width, true);
+        image_t* output_image = output.image();
 
-            if (USE_HASH) {
-                if (calculate_hash_for_packet(rpkt) != (std::size_t)hash) {
-                    std::cerr << "Parent: data corrupted for row " << rpkt.start_row << "\n";
-                    break;
-                }
-            }
+        for (int i = 0; i < height; ++i)
+            for (int j = 0; j < width; ++j)
+                if (i == 0 || i == height - 1 || j == 0 || j == width - 1)
+                    memcpy(output_image->image_pixels[i][j], input_image->image_pixels[i][j], 3);
 
-            for (int r_off = 0; r_off < rpkt.num_rows; ++r_off) {
-                int r = rpkt.start_row + r_off;
-                for (int cidx = 0; cidx < rpkt.cols_per_row; ++cidx) {
-                    int j = 1 + cidx;
+        // the stages are done reading the previous job's input once all of its rows are in
+        bool staged = stage_job_input(g_input_fd, input_image);
+        free_job_image(input_image);
+        if (!staged) {
+            failed = true;
+            break;
+        }
 
-                    uint8_t* src = rpkt.pixel_ptr(r_off, cidx);
-                    
-                    output_image->image_pixels[r][j][0] = src[0];
-                    output_image->image_pixels[r][j][1] = src[1];
-                    output_image->image_pixels[r][j][2] = src[2];
-                }
+        stage_job_t job = make_stage_job(job_id, input_path, output_path, g_input_fd, height, width, MAX_ITERATIONS);
+
+        // create (or resize) the shared memory regions for this job's block size
+        unmap_job_regions();
+        if (!map_job_regions(job, true)) {
+            failed = true;
+            break;
+        }
+
+        // every worker of the previous job is past its end marker
+        g_job_sync->s1_next.store(0);
+        g_job_sync->s1_ended.store(0);
+        g_job_sync->s2_ended.store(0);
+        g_job_sync->s3_ended.store(0);
+
+        auto start_p = std::chrono::steady_clock::now();
+        std::vector<std::chrono::steady_clock::time_point> epoch_done;
+
+        for (stage_proc_t& proc : g_procs) {
+            if (!send_stage_job(proc.ctl[1], job)) {
+                perror("send job");
+                failed = true;
+                break;
             }
         }
+        if (failed)
+            break;
 
-        waitpid(pid1, nullptr, 0);
-        waitpid(pid2, nullptr, 0);
-        waitpid(pid3, nullptr, 0);
-    }
+        // hashes output bands as the last iteration completes them
+        imageMerkle merkle(output_image, MERKLE_BAND_ROWS, MERKLE_THREADS);
 
-    auto finish_p = std::chrono::steady_clock::now();
+        bool ok = collect_job(job, merkle, epoch_done);
 
+        auto finish_p = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed = finish_p - start_p;
 
-    munmap(shm_s1_s2, g_shm_size);
-    munmap(shm_s2_s3, g_shm_size);
-    munmap(shm_s3_p,  g_shm_size);
+        if (!ok) {
+            std::cerr << "job " << job_id << ": pipeline shut down before " << input_path << " was done\n";
+            failed = true;
+            break;
+        }
+        iterations_done += job.iterations;
 
-    std::chrono::duration<double> elapsed = finish_p - start_p;
+        std::cout << "job " << job_id << ": Total Processing time per iteration " << elapsed.count()*1000/MAX_ITERATIONS << " ms\n";
 
-    std::cout << "Total Processing time per iteration " << elapsed.count()*1000/MAX_ITERATIONS << " ms\n";
+        // completion to completion, i.e. without the stages mapping the input and pipeline fill
+        if (epoch_done.size() > 1) {
+            std::chrono::duration<double> steady = epoch_done.back() - epoch_done.front();
+            std::cout << "job " << job_id << ": Steady-state time per iteration " << steady.count()*1000/(epoch_done.size() - 1) << " ms\n";
+        }
+
+        // S3 wrote it in place, nothing left to copy
+        std::cout << "Image written to " << output_path << std::endl;
 
-    write_ppm_file(argv[2], output_image);
-    std::cout << "Image written to " << argv[2] << std::endl;
+        const merkleTree& tree = merkle.finish();
+        merkle.report(output_path);
+        if (MERKLE_SIDECAR)
+            write_merkle_sidecar(std::string(output_path) + ".merkle", tree);
+        std::cout.flush();
+    }
 
-    // unlink and close semaphores 
-    sem_close(sem_s1s2_empty); sem_close(sem_s1s2_full);
-    sem_close(sem_s2s3_empty); sem_close(sem_s2s3_full);
-    sem_close(sem_s3p_empty);  sem_close(sem_s3p_full);
+    // no more jobs: the stages exit once their control pipe reads EOF. after a failed job a
+    // stage may still wait on a ring nobody will fill
+    for (stage_proc_t& proc : g_procs) {
+        close(proc.ctl[1]);
+        if (failed && proc.pid > 0)
+            kill(proc.pid, SIGTERM);
+    }
+    for (stage_proc_t& proc : g_procs)
+        if (proc.pid > 0)
+            waitpid(proc.pid, nullptr, 0);
+
+    // every wait on a full or empty ring is a voluntary switch, counted over every process
+    if (iterations_done > 0) {
+        struct rusage self_usage, child_usage;
+        getrusage(RUSAGE_SELF, &self_usage);
+        getrusage(RUSAGE_CHILDREN, &child_usage);
+        long voluntary = self_usage.ru_nvcsw + child_usage.ru_nvcsw;
+        long involuntary = self_usage.ru_nivcsw + child_usage.ru_nivcsw;
+
+        std::cout << "Context switches per iteration " << voluntary / iterations_done << " voluntary, " << involuntary / iterations_done << " involuntary\n";
+    }
 
-    sem_unlink(SEM_S1S2_EMPTY); sem_unlink(SEM_S1S2_FULL);
-    sem_unlink(SEM_S2S3_EMPTY); sem_unlink(SEM_S2S3_FULL);
-    sem_unlink(SEM_S3P_EMPTY);  sem_unlink(SEM_S3P_FULL);
+    unmap_job_regions();
+    munmap(g_job_sync, sizeof(job_sync_t));
 
-    shm_unlink(SHM_S1_S2_NAME);
-    shm_unlink(SHM_S2_S3_NAME);
-    shm_unlink(SHM_S3_P_NAME);
+    close(shm_fd_s1_s2);
+    close(shm_fd_s2_s3);
+    close(shm_fd_s3_p);
 
-    return 0;
+    return failed ? 1 : 0;
 }
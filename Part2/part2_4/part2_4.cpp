@@ -0,0 +1,165 @@
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include "../../include/rowPacket.h"
+#include "../../include/libppm.h"
+#include "../../include/placement.h"
+#include "../../include/imageStages.h"
+#include "../../include/pipeline.h"
+#include "../../include/merkle.h"
+
+// S1 -> S2 -> S3 on the generic pipeline, with the transport picked on the command line,
+// so the same kernels can be timed over every transport
+
+
+const checksum_algo CHECKSUM_ALGO = CHECKSUM_CRC32C;
+const int MAX_ITERATIONS = 1;
+const int PROCESSED_ROW_COUNT = 32;
+const int SCALING_FACTOR = 2;
+const int EDGE_CAPACITY = 64;           // slots per shm edge
+const shm_sync_mode SHM_SYNC = SHM_SYNC_ADAPTIVE;  // how a shm edge waits: block | adaptive | poll
+const size_t EDGE_BUDGET_BYTES = 16 << 20;      // bytes per queue edge before the producer blocks
+const size_t PIPELINE_BUDGET_BYTES = 24 << 20;  // all queue edges together
+const bool USE_PINNING = true;
+const int MERKLE_BAND_ROWS = 32;       // rows per leaf of the hash tree over the output image
+const int MERKLE_THREADS = 2;          // threads hashing bands while the output is still being written
+const bool MERKLE_SIDECAR = false;     // also write the tree to <output>.merkle
+// ---------------------------------------------------------------------------------
+
+
+// S1, emits the interior rows PROCESSED_ROW_COUNT at a time
+struct smoothenStage {
+    const image_t* input_image;
+    int next_row;
+
+    bool operator()(rowPacket& out) {
+        int height = input_image->height;
+        if (next_row > height - 2)
+            return false;
+
+        int take = std::min(PROCESSED_ROW_COUNT, (height - 1) - next_row);
+        out = rowPacket(next_row, take, input_image->width - 2);
+        smoothen_rows(input_image, out.start_row, out.num_rows, out.pixels.data());
+
+        next_row += take;
+        return true;
+    }
+};
+
+// S2
+struct detailsStage {
+    const image_t* input_image;
+
+    bool operator()(rowPacket& in, rowPacket& out) {
+        out = rowPacket(in.start_row, in.num_rows, in.cols_per_row);
+        find_details_rows(input_image, in.start_row, in.num_rows, in.pixels.data(), out.pixels.data());
+        return true;
+    }
+};
+
+// S3, runs on the calling process
+struct sharpenStage {
+    const image_t* input_image;
+    image_t* output_image;
+    imageMerkle* merkle;    // hashes the bands this run completes, may be null
+
+    void operator()(rowPacket& in) {
+        sharpen_rows(input_image, output_image, in.start_row, in.num_rows, in.pixels.data(), SCALING_FACTOR);
+        if (merkle)
+            merkle->rows_done(in.start_row, in.num_rows);
+    }
+};
+
+
+int main(int argc, char **argv)
+{
+    if (argc < 3 || argc > 5) {
+        std::cout << "usage: ./a.out <path-to-original-image> <path-to-transformed-image> [queue|pipe|shm|unix|tcp] [threads|processes]\n\n";
+        exit(0);
+    }
+
+    pipeline_config_t config;
+    config.transport = TRANSPORT_QUEUE;
+    config.use_processes = argc > 4 && strcmp(argv[4], "processes") == 0;
+    config.checksum = CHECKSUM_ALGO;
+    config.capacity = EDGE_CAPACITY;
+    config.shm_sync = SHM_SYNC;
+    config.edge_budget_bytes = EDGE_BUDGET_BYTES;
+    config.pipeline_budget_bytes = PIPELINE_BUDGET_BYTES;
+
+    if (argc > 3 && !parse_transport_kind(argv[3], config.transport)) {
+        std::cerr << "unknown transport " << argv[3] << "\n";
+        exit(1);
+    }
+    config.integrity = default_integrity(config.transport);
+
+    std::cout << "\nProcessing Image over " << transport_name(config.transport) << " (" << (config.use_processes ? "processes" : "threads") << ")..." << std::endl;
+    std::cout << "----------------------------------------------------------------------------------------------------------" << std::endl;
+
+    // decide placement before touching any image memory so the pages land on the stages' node
+    const char* const stage_names[] = {"S1", "S2", "S3"};
+
+    if (USE_PINNING) {
+        stage_placement_t placement = plan_stage_placement(3);
+        pin_process_to_cpus(0, placement.all_cpus);
+        print_placement(placement, stage_names);
+        config.stage_cpus = placement.stage_cpus;
+    }
+
+    image_t *input_image = read_ppm_file(argv[1]);
+
+    int height = input_image->height , width = input_image->width;
+
+    image_t* output_image = new image_t;
+
+    output_image->height = height;
+    output_image->width = width;
+
+    output_image->image_pixels = new uint8_t**[height];
+    for(int i = 0;i < height;i++){
+        output_image->image_pixels[i] = new uint8_t*[width];
+        for(int j = 0;j < width;j++)
+            output_image->image_pixels[i][j] = new uint8_t[3]();
+    }
+
+    config.max_packet_bytes = static_cast<size_t>(PROCESSED_ROW_COUNT) * std::max(0, width - 2) * 3;
+
+    // the sink runs on the caller with either executor, its hashers stay idle until the
+    // last run (and its forks) is under way
+    imageMerkle merkle(output_image, MERKLE_BAND_ROWS, MERKLE_THREADS);
+
+    auto start_p = std::chrono::steady_clock::now();
+
+    for(int i = 0;i < MAX_ITERATIONS;i++){
+        pipeline<smoothenStage, detailsStage, sharpenStage> p(config,
+            smoothenStage{input_image, 1},
+            detailsStage{input_image},
+            sharpenStage{input_image, output_image, i == MAX_ITERATIONS - 1 ? &merkle : nullptr});
+        // a stage died, the image has rows nobody wrote
+        if (!p.run()) {
+            std::cerr << "pipeline broke in iteration " << i << ", " << argv[2] << " not written\n";
+            exit(1);
+        }
+
+        if (config.transport == TRANSPORT_QUEUE && i == MAX_ITERATIONS - 1)
+            p.memory().report("queues");
+    }
+
+    auto finish_p = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = finish_p - start_p;
+
+    std::cout << "Total Processing time per iteration " << elapsed.count()*1000/MAX_ITERATIONS << " ms\n";
+
+    write_ppm_file(argv[2], output_image);
+    std::cout << "Image written to " << argv[2] << std::endl;
+
+    const merkleTree& tree = merkle.finish();
+    merkle.report(argv[2]);
+    if (MERKLE_SIDECAR)
+        write_merkle_sidecar(std::string(argv[2]) + ".merkle", tree);
+    return 0;
+}
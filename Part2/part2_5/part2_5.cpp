@@ -0,0 +1,321 @@
+#include <iostream>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <cstdlib>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <signal.h>
+
+#include "../../include/libppm.h"
+#include "../../include/packetIO.h"
+#include "../../include/imageStages.h"
+#include "../../include/merkle.h"
+#include "../../include/placement.h"
+#include "../../include/stageJob.h"
+#include "../../include/mappedPPM.h"
+
+// data parallel instead of pipelined: the interior rows are cut into one horizontal stripe per
+// worker process and every worker runs S1, S2 and S3 fused over its own stripe. the rows just
+// above and below a stripe (its halo) are read straight from the shared input, the results go
+// straight into the shared output, so no rows travel between processes at all.
+
+
+const int MAX_ITERATIONS = 10;
+const int STRIPE_WORKERS = 0;          // worker processes, 0 = one per online cpu, -w N overrides
+const int STRIPE_BAND_ROWS = 32;       // a stripe is run in bands of this many rows, so the smoothened and detail rows stay in cache
+const int SCALING_FACTOR = 2;
+const bool USE_PINNING = true;         // pin each worker to a core of its own, neighbours on one cache domain / numa node
+const int32_t SHUTDOWN_EPOCH = -1;     // epoch of the notice a worker that gave up sends
+const int MERKLE_BAND_ROWS = 32;       // rows per leaf of the hash tree over the output image
+const int MERKLE_THREADS = 2;          // threads hashing bands while the output is still being written
+const bool MERKLE_SIDECAR = false;     // also write the tree to <output>.merkle
+
+// worker -> parent, one per worker and epoch: rows [start_row, start_row + num_rows) of epoch
+// are in the output. smaller than PIPE_BUF, so the workers can share one pipe
+typedef struct stripe_notice_t {
+    int32_t worker;
+    int32_t epoch;
+    int32_t start_row;
+    int32_t num_rows;
+} stripe_notice_t;
+
+// the input pixels of the current job, height * width * 3 bytes. an anonymous memfd the parent
+// fills once per job and every worker maps, instead of each one reading the file again
+static int g_input_fd = -1;
+
+static int g_workers = 0;
+static std::vector<pid_t> g_pids;
+static std::vector<int> g_ctl;         // parent's end of each worker's control pipe
+int fd_done[2];                         // workers -> parent notices
+
+// rows of the interior (1 .. height-2) that make up worker's stripe
+static void stripe_rows(int height, int workers, int worker, int& first_row, int& num_rows) {
+    int interior = std::max(0, height - 2);
+    int begin = static_cast<int>(static_cast<long>(interior) * worker / workers);
+    int end = static_cast<int>(static_cast<long>(interior) * (worker + 1) / workers);
+    first_row = 1 + begin;
+    num_rows = end - begin;
+}
+
+static void send_notice(int worker, int32_t epoch, int start_row, int num_rows) {
+    stripe_notice_t notice = {worker, epoch, start_row, num_rows};
+    if (write_all(fd_done[1], &notice, sizeof(notice)) != static_cast<ssize_t>(sizeof(notice))) {
+        perror("notice");
+        _exit(1);
+    }
+}
+
+// every iteration of one job over this worker's stripe. a band is smoothened, differenced and
+// sharpened before the next one starts, its halo rows come from the neighbouring stripes'
+// part of the input, which nobody writes
+static void stripe_job(int worker, const stage_job_t& job, const image_t* input_image, image_t* output_image) {
+    int first_row, num_rows;
+    stripe_rows(job.height, g_workers, worker, first_row, num_rows);
+
+    size_t band_bytes = static_cast<size_t>(STRIPE_BAND_ROWS) * std::max(0, job.width - 2) * 3;
+    std::vector<uint8_t> smooth(band_bytes), details(band_bytes);
+
+    for (int32_t epoch = 0; epoch < job.iterations; epoch++) {
+        if (job.width >= 3) {
+            for (int r = first_row; r < first_row + num_rows; r += STRIPE_BAND_ROWS) {
+                int take = std::min(STRIPE_BAND_ROWS, first_row + num_rows - r);
+                smoothen_rows(input_image, r, take, smooth.data());
+                find_details_rows(input_image, r, take, smooth.data(), details.data());
+                sharpen_rows(input_image, output_image, r, take, details.data(), SCALING_FACTOR);
+            }
+        }
+        send_notice(worker, epoch, first_row, job.width >= 3 ? num_rows : 0);
+    }
+}
+
+// resident worker, one job per descriptor until the parent closes the control pipe
+static void stripe_worker(int worker, int ctl_fd) {
+    stage_job_t job;
+
+    while (recv_stage_job(ctl_fd, job)) {
+        image_t* input_image = map_job_image(job);
+        if (!input_image) {
+            send_notice(worker, SHUTDOWN_EPOCH, 0, 0);
+            return;
+        }
+
+        {
+            mappedPPM output(job.output, job.height, job.width, false);
+            stripe_job(worker, job, input_image, output.image());
+        }
+
+        unmap_job_image(job, input_image);
+    }
+}
+
+// parent side of one job: every worker reports every epoch. an epoch is done once all
+// workers reported it, false if one gave up or the notices don't add up
+static bool collect_job(const stage_job_t& job, imageMerkle& merkle, std::vector<std::chrono::steady_clock::time_point>& epoch_done) {
+    std::vector<int> reported(job.iterations, 0);
+
+    for (int n = 0; n < g_workers * job.iterations; n++) {
+        stripe_notice_t notice;
+        if (read_all(fd_done[0], &notice, sizeof(notice)) != static_cast<ssize_t>(sizeof(notice))) {
+            std::cerr << "Parent: notice pipe broke\n";
+            return false;
+        }
+        if (notice.epoch == SHUTDOWN_EPOCH)
+            return false;
+        if (notice.epoch < 0 || notice.epoch >= job.iterations || notice.worker < 0 || notice.worker >= g_workers) {
+            std::cerr << "Parent: bad notice from worker " << notice.worker << " for epoch " << notice.epoch << "\n";
+            return false;
+        }
+
+        if (++reported[notice.epoch] == g_workers)
+            epoch_done.push_back(std::chrono::steady_clock::now());
+        if (notice.epoch == job.iterations - 1)
+            merkle.rows_done(notice.start_row, notice.num_rows);
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    int first = 1;
+    g_workers = STRIPE_WORKERS > 0 ? STRIPE_WORKERS : static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN));
+    if (argc > 2 && strcmp(argv[1], "-w") == 0) {
+        g_workers = std::atoi(argv[2]);
+        first = 3;
+    }
+    if (g_workers < 1 || argc - first < 2 || (argc - first) % 2 != 0) {
+        std::cout << "usage: ./a.out [-w N] <input.ppm> <output.ppm> [<input.ppm> <output.ppm> ...]\n";
+        return 0;
+    }
+
+    std::cout << "\nProcessing Image (" << g_workers << " stripe workers)..." <<std::endl;
+    std::cout << "----------------------------------------------------------------------------------------------------------" << std::endl;
+
+    // decide placement before touching any image memory so the pages land on the workers' node
+    std::vector<std::string> names;
+    for (int w = 0; w < g_workers; w++)
+        names.push_back("W" + std::to_string(w));
+    std::vector<const char*> stage_names;
+    for (const std::string& name : names)
+        stage_names.push_back(name.c_str());
+    stage_placement_t placement;
+
+    if (USE_PINNING) {
+        placement = plan_stage_placement(g_workers);
+        pin_process_to_cpus(0, placement.all_cpus);
+        print_placement(placement, stage_names.data());
+    }
+
+    g_input_fd = create_stage_input("stripe_input");
+    if (pipe(fd_done) < 0) {
+        perror("notice pipe");
+        return 1;
+    }
+
+    // workers are forked once, before any image is loaded, and serve every job
+    bool failed = false;
+
+    for (int w = 0; w < g_workers; w++) {
+        int ctl[2];
+        if (pipe(ctl) < 0) {
+            perror("control pipe");
+            failed = true;
+            break;
+        }
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            close(ctl[0]);
+            close(ctl[1]);
+            failed = true;
+            break;
+        }
+        if (pid == 0) {
+            if (USE_PINNING)
+                pin_process_to_cpus(0, {placement.stage_cpus[w]});
+
+            close(ctl[1]);
+            close(fd_done[0]);
+            for (int fd : g_ctl)
+                close(fd);
+
+            stripe_worker(w, ctl[0]);
+            _exit(0);
+        }
+
+        close(ctl[0]);
+        g_ctl.push_back(ctl[1]);
+        g_pids.push_back(pid);
+    }
+    close(fd_done[1]);
+
+    int iterations_done = 0;
+
+    for (int32_t job_id = 0; !failed && first + 2 * job_id + 1 < argc; job_id++) {
+        char* input_path = argv[first + 2 * job_id];
+        char* output_path = argv[first + 2 * job_id + 1];
+
+        image_t* input_image = read_ppm_file(input_path);
+        if (!input_image) {
+            std::cerr << "Failed to read input\n";
+            failed = true;
+            break;
+        }
+
+        int height = input_image->height, width = input_image->width;
+
+        // the workers map the output file, so it has to exist (at its final size) before the
+        // job goes out. only the border is ours to fill, the stripes cover every interior pixel
+        mappedPPM output(output_path, height, width, true);
+        image_t* output_image = output.image();
+
+        for (int i = 0; i < height; ++i)
+            for (int j = 0; j < width; ++j)
+                if (i == 0 || i == height - 1 || j == 0 || j == width - 1)
+                    memcpy(output_image->image_pixels[i][j], input_image->image_pixels[i][j], 3);
+
+        // every notice of the previous job has been read, so no worker still maps the input
+        bool staged = stage_job_input(g_input_fd, input_image);
+        free_job_image(input_image);
+        if (!staged) {
+            failed = true;
+            break;
+        }
+
+        stage_job_t job = make_stage_job(job_id, input_path, output_path, g_input_fd, height, width, MAX_ITERATIONS);
+
+        auto start_p = std::chrono::steady_clock::now();
+        std::vector<std::chrono::steady_clock::time_point> epoch_done;
+
+        for (int fd : g_ctl) {
+            if (!send_stage_job(fd, job)) {
+                perror("send job");
+                failed = true;
+                break;
+            }
+        }
+        if (failed)
+            break;
+
+        // hashes output bands as the last iteration completes them
+        imageMerkle merkle(output_image, MERKLE_BAND_ROWS, MERKLE_THREADS);
+
+        bool ok = collect_job(job, merkle, epoch_done);
+
+        auto finish_p = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed = finish_p - start_p;
+
+        if (!ok) {
+            std::cerr << "job " << job_id << ": a worker gave up before " << input_path << " was done\n";
+            failed = true;
+            break;
+        }
+        iterations_done += job.iterations;
+
+        std::cout << "job " << job_id << ": Total Processing time per iteration " << elapsed.count()*1000/MAX_ITERATIONS << " ms\n";
+
+        // completion to completion, i.e. without the workers mapping the image
+        if (epoch_done.size() > 1) {
+            std::chrono::duration<double> steady = epoch_done.back() - epoch_done.front();
+            std::cout << "job " << job_id << ": Steady-state time per iteration " << steady.count()*1000/(epoch_done.size() - 1) << " ms\n";
+        }
+
+        // the workers wrote it in place, nothing left to copy
+        std::cout << "Image written to " << output_path << std::endl;
+
+        const merkleTree& tree = merkle.finish();
+        merkle.report(output_path);
+        if (MERKLE_SIDECAR)
+            write_merkle_sidecar(std::string(output_path) + ".merkle", tree);
+        std::cout.flush();
+    }
+
+    // no more jobs: the workers exit once their control pipe reads EOF
+    for (int fd : g_ctl)
+        close(fd);
+    if (failed)
+        for (pid_t pid : g_pids)
+            kill(pid, SIGTERM);
+    for (pid_t pid : g_pids)
+        waitpid(pid, nullptr, 0);
+
+    if (iterations_done > 0) {
+        struct rusage self_usage, child_usage;
+        getrusage(RUSAGE_SELF, &self_usage);
+        getrusage(RUSAGE_CHILDREN, &child_usage);
+        long voluntary = self_usage.ru_nvcsw + child_usage.ru_nvcsw;
+        long involuntary = self_usage.ru_nivcsw + child_usage.ru_nivcsw;
+
+        std::cout << "Context switches per iteration " << voluntary / iterations_done << " voluntary, " << involuntary / iterations_done << " involuntary\n";
+    }
+
+    close(fd_done[0]);
+    close(g_input_fd);
+    return failed ? 1 : 0;
+}
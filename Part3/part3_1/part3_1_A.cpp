@@ -14,7 +14,6 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
-#include <semaphore.h>
 
 // sockets
 #include <sys/socket.h>
@@ -23,133 +22,70 @@
 
 #include "../../include/rowPacket.h"
 #include "../../include/libppm.h"   
-
-const bool USE_HASH = true;
+#include "../../include/packetIO.h"
+#include "../../include/checksum.h"
+#include "../../include/integrity.h"
+#include "../../include/netCodec.h"
+#include "../../include/frameHeader.h"
+#include "../../include/shmRing.h"
+#include "../../include/imageStages.h"
+#include "../../include/tcpStripes.h"
+#include "../../include/remoteInput.h"
+#include "../../include/bandServer.h"
+
+const integrity_policy_t INTEGRITY_S1_S2 = INTEGRITY_LOCAL_IPC;   // shm, sampled
+const integrity_policy_t INTEGRITY_S2_S3 = INTEGRITY_NETWORK;     // tcp to B, every packet
+const checksum_algo CHECKSUM_ALGO = CHECKSUM_CRC32C;   // engine for the packets we send, receivers go by the header
 const int PROCESSED_ROW_COUNT = 32;
+const int SHM_RING_SLOTS = 4;          // slots of the S1 -> S2 ring, S1 runs at most this many blocks ahead of S2
+const shm_sync_mode SHM_SYNC = SHM_SYNC_ADAPTIVE;  // how S1 / S2 wait on a full / empty ring: block | adaptive | poll
 const int SCALING_FACTOR = 2;
-
-// header formate: int32_t start_row, int32_t num_rows, int32_t cols_per_row, uint64_t hash, uint8_t is_last
-static const size_t HDR_SIZE = sizeof(int32_t)*3 + sizeof(uint64_t) + sizeof(uint8_t);
-
-// named shared memory & semaphores 
-static const char* SHM_S1_S2_NAME = "/shm_s1_s2";
-
-static const char* SEM_S1S2_EMPTY = "/sem_s1s2_empty";
-static const char* SEM_S1S2_FULL  = "/sem_s1s2_full";
+const int TCP_MAX_CONNECTIONS = 8;     // most connections B may stripe the S2 -> S3 link over, B asks for how many it wants
+const stripe_policy STRIPE_POLICY = STRIPE_LEAST_QUEUED;  // which connection a frame goes out on: round robin | least queued
+const bool NET_COMPRESS = true;        // send each detail band with the smallest codec of include/netCodec.h, false sends it raw
+const size_t NET_COMPRESS_BACKLOG = 64 * 1024;  // only while this many bytes wait unsent on every connection, 0 compresses always
+// server mode (a [clients] argument): one process serves many B's, include/bandServer.h
+const int SERVER_WORKERS = 4;          // threads running S1 + S2 on the bands of every client
+const size_t SERVER_CLIENT_QUEUE = 1024 * 1024;  // bytes queued for one client before its bands wait for it to read
+const int SERVER_LISTEN_BACKLOG = 64;  // clients connecting at once
+const double SERVER_REPORT_SECONDS = 1.0;  // between the images/s and bytes/s lines
+
+// this process's end of each link, every stage process gets its own copy at fork
+linkIntegrity g_link_s1_s2("S1->S2", INTEGRITY_S1_S2, CHECKSUM_ALGO);
+linkIntegrity g_link_s2_s3("S2->S3", INTEGRITY_S2_S3, CHECKSUM_ALGO);
+netEncoder g_codec_s2_s3("S2->S3", NET_COMPRESS);
+netEncoder g_codec_input("input->S3", NET_COMPRESS);
+
+// shared memory, the ring in it synchronizes itself (include/shmRing.h). S1 and S2 inherit
+// the mapping at fork, so it is an anonymous memfd without a global name another A could clobber
+static const char* SHM_S1_S2_NAME = "shm_s1_s2";
 
 // inherited by children
 static size_t g_cols_per_row = 0;
 static size_t g_fixed_payload = 0;  // = PROCESSED_ROW_COUNT * cols_per_row * 3
-static size_t g_shm_size = 0;       // HDR_SIZE + fixed_payload
-
-static char* shm_s1_s2 = nullptr;
-
-static sem_t* sem_s1s2_empty = nullptr;
-static sem_t* sem_s1s2_full  = nullptr;
-
-// global accepted socket for S2
-static int g_client_fd = -1;
-
-// helper to send buffer
-
-static bool send_all(int fd, const void* buf, size_t len) {
-
-    const char* p = static_cast<const char*>(buf);
-    while (len) {
-        ssize_t n = ::send(fd, p, len, 0);
-        if (n < 0) {
-            if (errno == EINTR) 
-                continue;
-            perror("send");
-            return false;
-        }
-        p += n;
-        len -= static_cast<size_t>(n);
-    }
-    return true;
-}
-
-// FNV hash generating function
-static std::size_t calculate_hash_for_packet(const rowPacket &rp) {
-    if (rp.pixels.empty()) 
-        return 0;
-    const std::size_t FNV_offset = 1469598103934665603ULL;
-    const std::size_t FNV_prime  = 1099511628211ULL;
-    std::size_t h = FNV_offset;
-
-    for (uint8_t b : rp.pixels){
-        h ^= static_cast<std::size_t>(b);
-        h *= FNV_prime;
-    }
-
-    h ^= static_cast<std::size_t>(rp.start_row + 0x9e3779b9);
-    h *= FNV_prime;
-    h ^= static_cast<std::size_t>(rp.num_rows + 0x9e3779b9);
-    h *= FNV_prime;
-
-    return h;
-}
+static size_t g_shm_size = 0;       // NET_HDR_SIZE + fixed_payload
+static size_t g_frame_size = 0;     // largest frame to B, g_shm_size + the band's input rows when forwarding
+static bool g_forward_input = false;    // B has no copy of the input, the rows go with the bands (include/remoteInput.h)
 
-static void serialize_header(char *dst, int32_t start_row, int32_t num_rows, int32_t cols_per_row, uint64_t hash, uint8_t is_last) {
+static shm_ring_t* shm_s1_s2 = nullptr;
 
-    size_t off = 0;
+// accepted connections of the S2 -> S3 link, S2 stripes its frames over them
+static std::vector<int> g_client_fds;
 
-    memcpy(dst + off, &start_row, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(dst + off, &num_rows, sizeof(int32_t));  off += sizeof(int32_t);
-    memcpy(dst + off, &cols_per_row, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(dst + off, &hash, sizeof(uint64_t)); off += sizeof(uint64_t);
-    memcpy(dst + off, &is_last, sizeof(uint8_t)); off += sizeof(uint8_t);
-
-    (void)off;
-}
-
-static void deserialize_header(const char *src, int32_t &start_row, int32_t &num_rows, int32_t &cols_per_row, uint64_t &hash, uint8_t &is_last) {
-    
-    size_t off = 0;
-
-    memcpy(&start_row, src + off, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(&num_rows, src + off, sizeof(int32_t));  off += sizeof(int32_t);
-    memcpy(&cols_per_row, src + off, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(&hash, src + off, sizeof(uint64_t)); off += sizeof(uint64_t);
-    memcpy(&is_last, src + off, sizeof(uint8_t)); off += sizeof(uint8_t);
-
-    (void)off;
-}
-
-// write a block into a shared buffer using semaphores
-
-static void write_shm_block(char* shm_ptr, sem_t* sem_empty, sem_t* sem_full, const std::vector<char>& buf) {
-    // wait for empty slot
-    if (sem_wait(sem_empty) == -1) {
-        perror("sem_wait empty");
-        _exit(1);
-    }
-    // copy entire buffer into shared memory of size shm_size
-    memcpy(shm_ptr, buf.data(), g_shm_size);
-
-    // increment full
-    if (sem_post(sem_full) == -1) {
-        perror("sem_post full");
-        _exit(1);
-    }
+// a marker is a header alone, it never touches the payload part of its slot
+static void send_marker(shm_ring_t* ring) {
+    char* slot = shm_ring_acquire(ring);
+    serialize_net_header(slot, -1, 0, 0, 0, 0ULL, CHECKSUM_NONE, NET_CODEC_RAW, 1);
+    shm_ring_publish(ring, slot);
 }
 
-// read a block from shared buffer into local buffer
-
-static void read_shm_block(char* shm_ptr, sem_t* sem_empty, sem_t* sem_full, std::vector<char>& outbuf) {
-    if (sem_wait(sem_full) == -1) {
-        perror("sem_wait full");
-        _exit(1);
-    }
-    memcpy(outbuf.data(), shm_ptr, g_shm_size);
-
-    // increment empty
-    if (sem_post(sem_empty) == -1) {
-        perror("sem_post empty");
-        _exit(1);
-    }
+// the terminal is a header alone on every connection and tells B how many frames to expect in all
+static void send_terminal(stripeSender& sender, std::vector<char>& frame, int32_t sent) {
+    serialize_net_header(frame.data(), -1, 0, 0, sent, 0ULL, CHECKSUM_NONE, NET_CODEC_RAW, 1);
+    sender.send_to_all(frame.data(), NET_HDR_SIZE);
 }
 
+// every band is smoothened straight into the slot S2 will read it from
 void S1_smoothen(image_t* input_image) {
     
     int width = input_image->width;
@@ -157,25 +93,12 @@ void S1_smoothen(image_t* input_image) {
 
     if (height < 3 || width < 3) {
         // write terminal into S1_S2
-        std::vector<char> termbuf(g_shm_size);
-        char hdr[HDR_SIZE];
-
-        serialize_header(hdr, -1, 0, 0, 0ULL, 1);
-        memcpy(termbuf.data(), hdr, HDR_SIZE);
-
-        write_shm_block(shm_s1_s2, sem_s1s2_empty, sem_s1s2_full, termbuf);
-        
+        send_marker(shm_s1_s2);
         return;
     }
 
     const int cols_per_row = std::max(0, width - 2);
 
-    int dir[9][2] = {
-        {-1,-1}, {-1,0}, {-1,1},
-        {0,-1}, {0,0}, {0,1},
-        {1,-1}, {1,0}, {1,1}
-    };
-
     for (int i = 1; i <= height - 2; ) {
         int batch_start = i;
         int take = std::min(PROCESSED_ROW_COUNT, (height - 1) - i );
@@ -183,170 +106,167 @@ void S1_smoothen(image_t* input_image) {
         if (take <= 0) 
             break;
 
-        rowPacket rpkt(batch_start, take, cols_per_row);
-
-        for (int r_off = 0; r_off < take; ++r_off) {
-            int r = batch_start + r_off;
-            for (int c = 1, cidx = 0; c <= width - 2; c++, cidx++) {
-                int sumR=0, sumG=0, sumB=0;
-                for (int k=0;k<9;++k) {
-
-                    int rr = r + dir[k][0], cc = c + dir[k][1];
-
-                    sumR += input_image->image_pixels[rr][cc][0];
-                    sumG += input_image->image_pixels[rr][cc][1];
-                    sumB += input_image->image_pixels[rr][cc][2];
-                }
-
-                uint8_t sr = static_cast<uint8_t>(sumR / 9);
-                uint8_t sg = static_cast<uint8_t>(sumG / 9);
-                uint8_t sb = static_cast<uint8_t>(sumB / 9);
-                
-                uint8_t *p = rpkt.pixel_ptr(r_off, cidx);
-                
-                p[0]=sr; p[1]=sg; p[2]=sb;
-            }
-        }
-
-        if (USE_HASH)
-            rpkt.hash = calculate_hash_for_packet(rpkt);
-
-        std::vector<char> outbuf(g_shm_size);
-        serialize_header(outbuf.data(), rpkt.start_row, rpkt.num_rows, rpkt.cols_per_row, (uint64_t)rpkt.hash, rpkt.is_last ? 1 : 0);
-
+        char* slot = shm_ring_acquire(shm_s1_s2);
+        uint8_t* payload = reinterpret_cast<uint8_t*>(slot + NET_HDR_SIZE);
         size_t actual_bytes = static_cast<size_t>(take) * cols_per_row * 3;
 
-        if (actual_bytes > 0) 
-            memcpy(outbuf.data() + HDR_SIZE, rpkt.pixels.data(), actual_bytes);
+        smoothen_rows(input_image, batch_start, take, payload);
 
-        if (g_shm_size > HDR_SIZE + actual_bytes) 
-            memset(outbuf.data() + HDR_SIZE + actual_bytes, 0, g_shm_size - HDR_SIZE - actual_bytes);
+        rowPacket rpkt(batch_start, take, cols_per_row, true);
+        g_link_s1_s2.seal(rpkt, payload, actual_bytes);
+        serialize_net_header(slot, rpkt.start_row, rpkt.num_rows, rpkt.cols_per_row, 0, (uint64_t)rpkt.hash, rpkt.hash_algo, NET_CODEC_RAW, 0);
 
-        write_shm_block(shm_s1_s2, sem_s1s2_empty, sem_s1s2_full, outbuf);
+        shm_ring_publish(shm_s1_s2, slot);
 
         i += take;
     }
 
     // send terminal 
-    std::vector<char> termbuf(g_shm_size);
-    char thdr[HDR_SIZE];
-    serialize_header(thdr, -1, 0, 0, 0ULL, 1);
-    memcpy(termbuf.data(), thdr, HDR_SIZE);
-
-    write_shm_block(shm_s1_s2, sem_s1s2_empty, sem_s1s2_full, termbuf);
+    send_marker(shm_s1_s2);
 }
 
+// the smoothened band is read where S1 left it, the details are computed into a buffer of S2's
+// own and encoded into the frame that goes out to S3
 void S2_find_details(image_t* input_image) {
     int width = input_image->width;
     int height = input_image->height;
 
-    if (height < 3 || width < 3) {
-
-        // forward terminal
-        std::vector<char> termbuf(g_shm_size);
-        char hdr[HDR_SIZE];
-        serialize_header(hdr, -1, 0, 0, 0ULL, 1);
-        memcpy(termbuf.data(), hdr, HDR_SIZE);
-
-        // send terminal to S3 over TCP
-        if (g_client_fd >= 0) 
-            send_all(g_client_fd, termbuf.data(), g_shm_size);
+    // frames to B are the header, the band's input rows if B needs them and the payload, each
+    // as encoded, at most g_frame_size bytes
+    std::vector<char> frame(g_frame_size, 0);
+    std::vector<uint8_t> details(g_fixed_payload);
+    std::vector<uint8_t> rows;
+    stripeSender sender(g_client_fds, STRIPE_POLICY);
+    int32_t sent = 0;
 
+    if (height < 3 || width < 3) {
+        send_terminal(sender, frame, sent);
         return;
     }
 
-    std::vector<char> hdrbuf(g_shm_size);
-
     while (true) {
 
-        // read block from S1 over shared memory
-        read_shm_block(shm_s1_s2, sem_s1s2_empty, sem_s1s2_full, hdrbuf);
+        // next block from S1, in place
+        const char* in = shm_ring_peek(shm_s1_s2);
 
-        int32_t start_row, num_rows, cols;
+        int32_t start_row, num_rows, cols, sequence;
         uint64_t hash;
+        uint8_t hash_algo;
+        uint8_t codec;
         uint8_t is_last;
 
-        deserialize_header(hdrbuf.data(), start_row, num_rows, cols, hash, is_last);
+        deserialize_net_header(in, start_row, num_rows, cols, sequence, hash, hash_algo, codec, is_last);
 
         if (is_last) {
-
-            // forward terminal header + zero payload to S3
-            std::vector<char> termbuf(g_shm_size, 0);
-            char thdr[HDR_SIZE];
-
-            serialize_header(thdr, -1, 0, 0, 0ULL, 1);
-            memcpy(termbuf.data(), thdr, HDR_SIZE);
-
-            if (g_client_fd >= 0) 
-                send_all(g_client_fd, termbuf.data(), g_shm_size);
+            shm_ring_release(shm_s1_s2, in);
+            send_terminal(sender, frame, sent);
             return;
         }
 
-        rowPacket rpkt(start_row, num_rows, cols);
+        const uint8_t* smooth = reinterpret_cast<const uint8_t*>(in + NET_HDR_SIZE);
         size_t actual_bytes = static_cast<size_t>(num_rows) * cols * 3;
 
-        if (actual_bytes > 0)
-            memcpy(rpkt.pixels.data(), hdrbuf.data() + HDR_SIZE, actual_bytes);
-
+        rowPacket rpkt(start_row, num_rows, cols, true);
         rpkt.hash = (std::size_t)hash;
+        rpkt.hash_algo = hash_algo;
 
-        if (USE_HASH) {
-            std::size_t expected = calculate_hash_for_packet(rpkt);
-            if (expected != rpkt.hash) {
-                std::cerr << "S2: Data Corrupted in rowPacket(start_row=" << rpkt.start_row << ")!!\n";
-
-                std::vector<char> termbuf(g_shm_size, 0);
-                char thdr[HDR_SIZE];
-                serialize_header(thdr, -1, 0, 0, 0ULL, 1);
-                memcpy(termbuf.data(), thdr, HDR_SIZE);
-
-                if (g_client_fd >= 0) 
-                    send_all(g_client_fd, termbuf.data(), g_shm_size);
-                return;
-            }
+        if (!g_link_s1_s2.check(rpkt, smooth, actual_bytes)) {
+            std::cerr << "S2: Data Corrupted in rowPacket(start_row=" << rpkt.start_row << ")!!\n";
+            shm_ring_release(shm_s1_s2, in);
+            send_terminal(sender, frame, sent);
+            return;
         }
 
         // details
-        rowPacket out_rpkt(rpkt.start_row, rpkt.num_rows, rpkt.cols_per_row);
-
-        for (int r_off = 0; r_off < rpkt.num_rows; ++r_off) {
-            int row_idx = rpkt.start_row + r_off;
-
-            for (int cidx = 0; cidx < rpkt.cols_per_row; ++cidx) {
-                uint8_t* sp = rpkt.pixel_ptr(r_off, cidx);
-                int orig_col = 1 + cidx;
-                
-                int dR = input_image->image_pixels[row_idx][orig_col][0] - (int)sp[0];
-                int dG = input_image->image_pixels[row_idx][orig_col][1] - (int)sp[1];
-                int dB = input_image->image_pixels[row_idx][orig_col][2] - (int)sp[2];
-                
-                if (dR < 0) dR = 0;
-                if (dG < 0) dG = 0; 
-                if (dB < 0) dB = 0;
-
-                uint8_t* op = out_rpkt.pixel_ptr(r_off, cidx);
-                op[0] = (uint8_t)dR; op[1] = (uint8_t)dG; op[2] = (uint8_t)dB;
-            }
-        }
+        find_details_rows(input_image, start_row, num_rows, smooth, details.data());
+        shm_ring_release(shm_s1_s2, in);
 
-        if (USE_HASH) 
-            out_rpkt.hash = calculate_hash_for_packet(out_rpkt);
+        // the checksum covers the decoded rows, so B's check also catches a codec going wrong
+        rowPacket out_rpkt(start_row, num_rows, cols, true);
+        g_link_s2_s3.seal(out_rpkt, details.data(), actual_bytes);
 
-        std::vector<char> outbuf(g_shm_size, 0);
-        serialize_header(outbuf.data(), out_rpkt.start_row, out_rpkt.num_rows, out_rpkt.cols_per_row, (uint64_t)out_rpkt.hash, out_rpkt.is_last ? 1 : 0);
+        size_t encoded = 0;
+        // a link that keeps up gains nothing from the codec but its cpu time
+        bool link_busy = sender.backlog() >= NET_COMPRESS_BACKLOG;
+        uint8_t* body = reinterpret_cast<uint8_t*>(frame.data() + NET_HDR_SIZE);
+        size_t input_bytes = 0;
+        if (g_forward_input)
+            input_bytes = put_input_rows(input_image, start_row, num_rows, g_codec_input, link_busy, body, rows);
 
-        size_t out_actual = static_cast<size_t>(out_rpkt.num_rows) * out_rpkt.cols_per_row * 3;
-
-        if (out_actual > 0) 
-            memcpy(outbuf.data() + HDR_SIZE, out_rpkt.pixels.data(), out_actual);
+        net_codec codec_used = g_codec_s2_s3.encode(details.data(), actual_bytes, body + input_bytes, encoded, link_busy);
+        serialize_net_header(frame.data(), out_rpkt.start_row, out_rpkt.num_rows, out_rpkt.cols_per_row, sent, (uint64_t)out_rpkt.hash, out_rpkt.hash_algo, codec_used, 0);
 
         // send to S3 over TCP
-        if (g_client_fd >= 0) {
-            if (!send_all(g_client_fd, outbuf.data(), g_shm_size)) {
-                std::cerr << "S2: send failed\n";
-                return;
-            }
+        if (!sender.send(frame.data(), NET_HDR_SIZE + input_bytes + encoded)) {
+            std::cerr << "S2: send failed\n";
+            return;
         }
+        sent++;
+    }
+}
+
+
+// a pool thread of the server, S1 and S2 of a band straight after each other. the encoders keep
+// scratch buffers, so every thread has its own
+typedef struct server_worker_t {
+    std::vector<uint8_t> smooth;
+    std::vector<uint8_t> details;
+    std::vector<uint8_t> rows;
+    netEncoder codec;
+    netEncoder codec_input;
+} server_worker_t;
+
+static size_t S1_S2_band(server_worker_t& w, const image_t* input_image, const band_job_t& job, char* frame) {
+    size_t actual_bytes = static_cast<size_t>(job.num_rows) * g_cols_per_row * 3;
+    w.smooth.resize(actual_bytes);
+    w.details.resize(actual_bytes);
+
+    smoothen_rows(input_image, job.start_row, job.num_rows, w.smooth.data());
+    find_details_rows(input_image, job.start_row, job.num_rows, w.smooth.data(), w.details.data());
+
+    rowPacket out_rpkt(job.start_row, job.num_rows, static_cast<int>(g_cols_per_row), true);
+    g_link_s2_s3.seal(out_rpkt, w.details.data(), actual_bytes);
+
+    uint8_t* body = reinterpret_cast<uint8_t*>(frame + NET_HDR_SIZE);
+    size_t input_bytes = 0;
+    if (job.forward)
+        input_bytes = put_input_rows(input_image, job.start_row, job.num_rows, w.codec_input, job.compress, body, w.rows);
+
+    size_t encoded = 0;
+    net_codec codec_used = w.codec.encode(w.details.data(), actual_bytes, body + input_bytes, encoded, job.compress);
+    serialize_net_header(frame, out_rpkt.start_row, out_rpkt.num_rows, out_rpkt.cols_per_row, job.sequence, (uint64_t)out_rpkt.hash, out_rpkt.hash_algo, codec_used, 0);
+    return NET_HDR_SIZE + input_bytes + encoded;
+}
+
+// serves input_image to max_clients B's (0: until interrupted), every one of them gets what the
+// one-shot A would send it
+static void serve_clients(int server_fd, const image_t* input_image, int max_clients) {
+    std::vector<server_worker_t> workers;
+    for (int w = 0; w < SERVER_WORKERS; w++)
+        workers.push_back({{}, {}, {}, netEncoder("S2->S3 #" + std::to_string(w), NET_COMPRESS), netEncoder("input->S3 #" + std::to_string(w), NET_COMPRESS)});
+
+    band_server_config_t config;
+    config.workers = SERVER_WORKERS;
+    config.band_rows = PROCESSED_ROW_COUNT;
+    config.max_frame_bytes = g_shm_size + input_section_bytes(PROCESSED_ROW_COUNT, input_image->width);
+    config.client_queue_bytes = SERVER_CLIENT_QUEUE;
+    config.compress_backlog = NET_COMPRESS_BACKLOG;
+    config.max_clients = max_clients;
+    config.report_seconds = SERVER_REPORT_SECONDS;
+
+    serve_bands(server_fd, config, input_image,
+        [&workers, input_image](int worker, const band_job_t& job, char* frame) {
+            return S1_S2_band(workers[worker], input_image, job, frame);
+        },
+        [](int32_t total, char* frame) {
+            serialize_net_header(frame, -1, 0, 0, total, 0ULL, CHECKSUM_NONE, NET_CODEC_RAW, 1);
+            return NET_HDR_SIZE;
+        });
+
+    g_link_s2_s3.report();
+    for (const server_worker_t& w : workers) {
+        w.codec.report();
+        w.codec_input.report();
     }
 }
 
@@ -354,9 +274,9 @@ void S2_find_details(image_t* input_image) {
 // helper to create shared mem and map of size bytes, returns pointer
 static char* create_and_map_shm(const char* name, size_t size) {
     
-    int fd = shm_open(name, O_CREAT | O_RDWR, 0666);
+    int fd = memfd_create(name, MFD_CLOEXEC);
     if (fd == -1) { 
-        perror("shm_open"); 
+        perror("memfd_create"); 
         return nullptr; 
     }
 
@@ -381,17 +301,19 @@ static char* create_and_map_shm(const char* name, size_t size) {
 
 int main(int argc, char **argv) {
 
-    // usage: ./a.out <input.ppm> [port]
-    // specifing port is optional
-    if (argc != 2 && argc != 3) {
-        std::cout << "usage: ./a.out <input.ppm> [port]\n";
+    // usage: ./a.out <input.ppm> [port] [clients]
+    // specifing port is optional, clients runs A as a server for that many B's (0: until interrupted)
+    if (argc < 2 || argc > 4) {
+        std::cout << "usage: ./a.out <input.ppm> [port] [clients]\n";
         return 0;
     }
 
     std::cout << "\nProcessing S1 and S2..." <<std::endl;
     std::cout << "----------------------------------------------------------------------------------------------------------" << std::endl;
 
-    int listen_port = (argc == 3) ? std::atoi(argv[2]) : 9090;
+    int listen_port = (argc >= 3) ? std::atoi(argv[2]) : 9090;
+    bool serve = argc == 4;
+    int max_clients = serve ? std::max(0, std::atoi(argv[3])) : 0;
 
     image_t* input_image = read_ppm_file(argv[1]);
     if (!input_image) { 
@@ -405,30 +327,19 @@ int main(int argc, char **argv) {
     // set global varibales
     g_cols_per_row = static_cast<size_t>(std::max(0, width - 2));
     g_fixed_payload = static_cast<size_t>(PROCESSED_ROW_COUNT) * g_cols_per_row * 3;
-    g_shm_size = HDR_SIZE + g_fixed_payload;
+    g_shm_size = NET_HDR_SIZE + g_fixed_payload;
 
     // create shared memory regions using helper
-    shm_s1_s2 = create_and_map_shm(SHM_S1_S2_NAME, g_shm_size);
+    const size_t ring_size = shm_ring_bytes(SHM_RING_SLOTS, g_shm_size);
+    shm_s1_s2 = reinterpret_cast<shm_ring_t*>(create_and_map_shm(SHM_S1_S2_NAME, ring_size));
 
     if (!shm_s1_s2) { 
         std::cerr << "Failed to create shared memory\n";
         return 1; 
     }
+    shm_ring_init(shm_s1_s2, SHM_RING_SLOTS, g_shm_size, SHM_SYNC);
 
-    // unlinking semaphores if any attached
-    sem_unlink(SEM_S1S2_EMPTY); 
-    sem_unlink(SEM_S1S2_FULL);
-
-    // create semaphores 
-    // initially empty=1, full=0
-    sem_s1s2_empty = sem_open(SEM_S1S2_EMPTY, O_CREAT, 0666, 1);
-    sem_s1s2_full  = sem_open(SEM_S1S2_FULL,  O_CREAT, 0666, 0);
-
-    if (sem_s1s2_empty == SEM_FAILED || sem_s1s2_full == SEM_FAILED ) {
-        perror("sem_open"); return 1;
-    }
-
-    // TCP server setup (single client)
+    // TCP server setup (single client, over as many connections as it asks for)
 
     int server_fd = ::socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd < 0) { 
@@ -448,23 +359,36 @@ int main(int argc, char **argv) {
         perror("bind"); 
         return 1; 
     }
-    if (listen(server_fd, 1) < 0) { 
+    // B opens its connections back to back, the backlog has to hold all of them
+    if (listen(server_fd, serve ? SERVER_LISTEN_BACKLOG : TCP_MAX_CONNECTIONS) < 0) { 
         perror("listen"); 
         return 1; 
     }
 
+    if (serve) {
+        // S1 and S2 run on the server's threads, the ring between their processes goes unused
+        munmap(shm_s1_s2, ring_size);
+        std::cout << "A: serving clients on port " << listen_port << "...\n";
+        serve_clients(server_fd, input_image, max_clients);
+        close(server_fd);
+        return 0;
+    }
+
     std::cout << "A: Listening on port " << listen_port << " for S3...\n";
 
-    sockaddr_in cli{};
-    socklen_t cl = sizeof(cli);
-    g_client_fd = accept(server_fd, (sockaddr*)&cli, &cl);
-    
-    if (g_client_fd < 0) { 
-        perror("accept"); 
-        return 1; 
+    if (!stripes_accept(server_fd, TCP_MAX_CONNECTIONS, g_client_fds)) {
+        std::cerr << "A: S3 failed to connect\n";
+        return 1;
     }
 
-    std::cout << "A: S3 connected.\n";
+    std::cout << "A: S3 connected over " << g_client_fds.size() << " connection(s).\n";
+
+    if (!serve_input(g_client_fds[0], input_image, g_forward_input)) {
+        std::cerr << "A: S3 did not ask for the input\n";
+        return 1;
+    }
+    g_frame_size = g_shm_size + (g_forward_input ? input_section_bytes(PROCESSED_ROW_COUNT, width) : 0);
+    std::cout << (g_forward_input ? "A: forwarding input rows to S3.\n" : "A: S3 has the input.\n");
 
     auto start_p = std::chrono::steady_clock::now();
 
@@ -478,8 +402,7 @@ int main(int argc, char **argv) {
         S1_smoothen(input_image);
         
         // cleanup
-        munmap(shm_s1_s2, g_shm_size);
-        sem_close(sem_s1s2_empty); sem_close(sem_s1s2_full);
+        munmap(shm_s1_s2, ring_size);
 
         _exit(0);
     }
@@ -493,20 +416,22 @@ int main(int argc, char **argv) {
     }
     if (pid2 == 0) {
         S2_find_details(input_image);
+        g_link_s1_s2.report();
+        g_codec_s2_s3.report();
+        if (g_forward_input)
+            g_codec_input.report();
 
         //cleanup
-        munmap(shm_s1_s2, g_shm_size);
-        sem_close(sem_s1s2_empty); sem_close(sem_s1s2_full);
+        munmap(shm_s1_s2, ring_size);
 
-        // close client socket 
-        if (g_client_fd >= 0) 
-            close(g_client_fd);
+        // close client sockets
+        stripes_close(g_client_fds);
 
         _exit(0);
     }
 
     // parent
-    munmap(shm_s1_s2, g_shm_size);
+    munmap(shm_s1_s2, ring_size);
 
     waitpid(pid1, nullptr, 0);
     waitpid(pid2, nullptr, 0);
@@ -516,18 +441,9 @@ int main(int argc, char **argv) {
     
     std::cout << "Total Processing time : " << elapsed.count()*1000 << " ms\n";
 
-    // unlink and close semaphores,servers
-    sem_close(sem_s1s2_empty); 
-    sem_close(sem_s1s2_full);
-
-    sem_unlink(SEM_S1S2_EMPTY);
-    sem_unlink(SEM_S1S2_FULL);
-
-    if (g_client_fd >= 0) 
-        close(g_client_fd);
+    // close servers
+    stripes_close(g_client_fds);
     close(server_fd);
 
-    shm_unlink(SHM_S1_S2_NAME);
-
     return 0;
 }
\ No newline at end of file
@@ -22,84 +22,39 @@
 
 #include "../../include/rowPacket.h"
 #include "../../include/libppm.h"   
-
-const bool USE_HASH = true;
+#include "../../include/packetIO.h"
+#include "../../include/checksum.h"
+#include "../../include/integrity.h"
+#include "../../include/netCodec.h"
+#include "../../include/imageStages.h"
+#include "../../include/frameHeader.h"
+#include "../../include/merkle.h"
+#include "../../include/tcpStripes.h"
+#include "../../include/remoteInput.h"
+
+const integrity_policy_t INTEGRITY_S2_S3 = INTEGRITY_NETWORK;     // tcp from A, every packet
+const checksum_algo CHECKSUM_ALGO = CHECKSUM_CRC32C;   // engine for the packets we send, receivers go by the header
 const int PROCESSED_ROW_COUNT = 32;
 const int SCALING_FACTOR = 2;
+const int MERKLE_BAND_ROWS = 32;       // rows per leaf of the hash tree over the output image
+const int MERKLE_THREADS = 2;          // threads hashing bands while the output is still being written
+const bool MERKLE_SIDECAR = false;     // also write the tree to <output>.merkle
+const int TCP_CONNECTIONS = 4;         // connections to stripe the link from A over (A may grant fewer), [connections] overrides
 
-// header formate: int32_t start_row, int32_t num_rows, int32_t cols_per_row, uint64_t hash, uint8_t is_last
-static const size_t HDR_SIZE = sizeof(int32_t)*3 + sizeof(uint64_t) + sizeof(uint8_t);
+// this process's end of the link from A
+linkIntegrity g_link_s2_s3("S2->S3", INTEGRITY_S2_S3, CHECKSUM_ALGO);
 
 // inherited by children
 static size_t g_cols_per_row = 0;
 static size_t g_fixed_payload = 0;  // = PROCESSED_ROW_COUNT * cols_per_row * 3
-static size_t g_shm_size = 0;       // HDR_SIZE + fixed_payload
-
-// TCP socket for S3
-static int g_sock = -1;
-
-static bool recv_all(int fd, void* buf, size_t len) {
-    char* p = static_cast<char*>(buf);
-    size_t remaining = len;
-    while (remaining) {
-        ssize_t n = ::recv(fd, p, remaining, 0);
-        if (n == 0) {
-            // connection closed
-            return false;
-        }
-        if (n < 0) {
-            if (errno == EINTR) continue;
-            perror("recv");
-            return false;
-        }
-        p += n;
-        remaining -= static_cast<size_t>(n);
-    }
-    return true;
-}
-
-static void serialize_header(char *dst, int32_t start_row, int32_t num_rows, int32_t cols_per_row, uint64_t hash, uint8_t is_last) {
-    size_t off = 0;
-    memcpy(dst + off, &start_row, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(dst + off, &num_rows, sizeof(int32_t));  off += sizeof(int32_t);
-    memcpy(dst + off, &cols_per_row, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(dst + off, &hash, sizeof(uint64_t)); off += sizeof(uint64_t);
-    memcpy(dst + off, &is_last, sizeof(uint8_t)); off += sizeof(uint8_t);
-    (void)off;
-}
-
-static void deserialize_header(const char *src, int32_t &start_row, int32_t &num_rows, int32_t &cols_per_row, uint64_t &hash, uint8_t &is_last) {
-    size_t off = 0;
-    memcpy(&start_row, src + off, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(&num_rows, src + off, sizeof(int32_t));  off += sizeof(int32_t);
-    memcpy(&cols_per_row, src + off, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(&hash, src + off, sizeof(uint64_t)); off += sizeof(uint64_t);
-    memcpy(&is_last, src + off, sizeof(uint8_t)); off += sizeof(uint8_t);
-    (void)off;
-}
+static size_t g_shm_size = 0;       // NET_HDR_SIZE + fixed_payload
+static size_t g_frame_size = 0;     // largest frame from A, g_shm_size + the band's input rows when forwarded
+static bool g_forwarded = false;    // the input rows come with the bands, into input_image and output_image
 
-// FNV hash generating function
-static std::size_t calculate_hash_for_packet(const rowPacket &rp) {
-    if (rp.pixels.empty()) 
-        return 0;
-    const std::size_t FNV_offset = 1469598103934665603ULL;
-    const std::size_t FNV_prime  = 1099511628211ULL;
-    std::size_t h = FNV_offset;
-
-    for (uint8_t b : rp.pixels){
-        h ^= static_cast<std::size_t>(b);
-        h *= FNV_prime;
-    }
+// TCP connections for S3, frames arrive on any of them in any order
+static std::vector<int> g_socks;
 
-    h ^= static_cast<std::size_t>(rp.start_row + 0x9e3779b9);
-    h *= FNV_prime;
-    h ^= static_cast<std::size_t>(rp.num_rows + 0x9e3779b9);
-    h *= FNV_prime;
-
-    return h;
-}
-
-void S3_sharpen(image_t* input_image,image_t* output_image) {
+void S3_sharpen(image_t* input_image, image_t* output_image, imageMerkle& merkle) {
     int width = input_image->width;
     int height = input_image->height;
 
@@ -107,84 +62,138 @@ void S3_sharpen(image_t* input_image,image_t* output_image) {
         _exit(1);
     }
 
-    std::vector<char> blockbuf(g_shm_size);
+    std::vector<char> blockbuf(g_frame_size);
+    std::vector<uint8_t> rows;
+    // a band has at least one row, so no stream has more of them than interior rows
+    stripeReceiver receiver(g_socks, g_frame_size, height - 2);
 
-    while (true) {
-        //  read a fixed-size block
-        if (!recv_all(g_sock, blockbuf.data(), g_shm_size)) {
+    while (!receiver.done()) {
+        //  read a block from whichever connection has one, header and encoded payload
+        int conn = receiver.next(blockbuf);
+        if (conn < 0) {
             std::cerr << "S3: connection closed/failed\n";
             return;
         }
 
-        int32_t start_row, num_rows, cols;
+        // every frame, a terminal too, is at least a header before any of it is parsed
+        if (blockbuf.size() < NET_HDR_SIZE) {
+            std::cerr << "S3: frame of " << blockbuf.size() << " bytes is shorter than a header\n";
+            return;
+        }
+
+        int32_t start_row, num_rows, cols, sequence;
         uint64_t hash;
+        uint8_t hash_algo;
+        uint8_t codec;
         uint8_t is_last;
 
-        deserialize_header(blockbuf.data(), start_row, num_rows, cols, hash, is_last);
+        deserialize_net_header(blockbuf.data(), start_row, num_rows, cols, sequence, hash, hash_algo, codec, is_last);
 
         if (is_last) {
-            // terminal marker from A
+            // terminal marker from A, one per connection
+            receiver.end_of(conn, sequence);
+            continue;
+        }
+
+        if (num_rows < 0 || cols != width - 2 || start_row < 1 || start_row + num_rows > height - 1 ||
+            static_cast<size_t>(num_rows) * cols * 3 > g_fixed_payload) {
+            std::cerr << "S3: malformed rowPacket(start_row=" << start_row << ")\n";
+            return;
+        }
+
+        if (!receiver.take(sequence)) {
+            std::cerr << "S3: rowPacket(start_row=" << start_row << ") came twice or is out of sequence\n";
             return;
         }
 
+        // the band's input rows, then its details
+        const uint8_t* body = reinterpret_cast<const uint8_t*>(blockbuf.data() + NET_HDR_SIZE);
+        size_t body_bytes = blockbuf.size() - NET_HDR_SIZE;
+        if (g_forwarded) {
+            size_t used = take_input_rows(body, body_bytes, input_image, output_image, start_row, num_rows, rows);
+            if (used == 0) {
+                std::cerr << "S3: input rows of rowPacket(start_row=" << start_row << ") are corrupted\n";
+                return;
+            }
+            body += used;
+            body_bytes -= used;
+        }
+
         rowPacket rpkt(start_row, num_rows, cols);
         size_t actual = static_cast<size_t>(num_rows) * cols * 3;
-        if (actual > 0) 
-            memcpy(rpkt.pixels.data(), blockbuf.data() + HDR_SIZE, actual);
+        if (!net_decode(static_cast<net_codec>(codec), body, body_bytes, rpkt.pixels.data(), actual)) {
+            std::cerr << "S3: rowPacket(start_row=" << start_row << ") does not decode as " << net_codec_name(static_cast<net_codec>(codec)) << "\n";
+            return;
+        }
 
         rpkt.hash = (std::size_t)hash;
+        rpkt.hash_algo = hash_algo;
 
-        if (USE_HASH) {
-            std::size_t expected = calculate_hash_for_packet(rpkt);
-            if (expected != rpkt.hash) {
-                std::cerr << "S3: Data Corrupted in rowPacket(start_row=" << rpkt.start_row << ")!!\n";
-                return;
-            }
+        if (!g_link_s2_s3.check(rpkt)) {
+            std::cerr << "S3: Data Corrupted in rowPacket(start_row=" << rpkt.start_row << ")!!\n";
+            return;
         }
 
-    
-        for (int r_off = 0; r_off < rpkt.num_rows; ++r_off) {
-            int i = rpkt.start_row + r_off;
-
-            for (int cidx = 0; cidx < rpkt.cols_per_row; ++cidx) {
-                uint8_t* d = rpkt.pixel_ptr(r_off, cidx);
-                int j = 1 + cidx;
-                
-                int newR = input_image->image_pixels[i][j][0] + SCALING_FACTOR * (int)d[0];
-                int newG = input_image->image_pixels[i][j][1] + SCALING_FACTOR * (int)d[1];
-                int newB = input_image->image_pixels[i][j][2] + SCALING_FACTOR * (int)d[2];
-
-                output_image->image_pixels[i][j][0] = (uint8_t)(newR > 255 ? 255 : (newR < 0 ? 0 : newR));
-                output_image->image_pixels[i][j][1] = (uint8_t)(newG > 255 ? 255 : (newG < 0 ? 0 : newG));
-                output_image->image_pixels[i][j][2] = (uint8_t)(newB > 255 ? 255 : (newB < 0 ? 0 : newB));
-            }
-        }
+        sharpen_rows(input_image, output_image, rpkt.start_row, rpkt.num_rows, rpkt.pixels.data(), SCALING_FACTOR);
+        merkle.rows_done(rpkt.start_row, rpkt.num_rows);
     }
+
+    if (!receiver.complete())
+        std::cerr << "S3: A announced more rowPackets than arrived\n";
 }
 
 int main(int argc, char **argv) {
-    // usage: ./b.out <input.ppm> <output.ppm> [server_ip] [port]
-    if (argc != 3 && argc != 5) {
-        std::cout << "usage: ./b.out <input.ppm> <output.ppm> [server_ip] [port]\n";
+    // usage: ./b.out <input.ppm> <output.ppm> [server_ip] [port] [connections]
+    // input "-": no copy of the input here, A sends its rows along
+    if (argc != 3 && argc != 5 && argc != 6) {
+        std::cout << "usage: ./b.out <input.ppm|-> <output.ppm> [server_ip] [port] [connections]\n";
         return 0;
     }
 
     std::cout << "\nProcessing S3 and Writing Image..." <<std::endl;
     std::cout << "----------------------------------------------------------------------------------------------------------" << std::endl;
 
-    const char* server_ip = (argc == 5) ? argv[3] : "127.0.0.1";
+    const char* server_ip = (argc >= 5) ? argv[3] : "127.0.0.1";
+
+    int server_port = (argc >= 5) ? std::atoi(argv[4]) : 9090;
+
+    int connections = (argc == 6) ? std::atoi(argv[5]) : TCP_CONNECTIONS;
+
+    // a copy of our own is checked against A's by content hash, A sends the rows if it differs
+    image_t* local_image = nullptr;
+    if (strcmp(argv[1], "-") != 0) {
+        local_image = read_ppm_file(argv[1]);
+        if (!local_image) { 
+            std::cerr << "Failed to read input\n"; 
+            return 1; 
+        }
+    }
+
+    sockaddr_in sa{};
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(server_port);
+    if (inet_pton(AF_INET, server_ip, &sa.sin_addr) <= 0) {
+        perror("inet_pton");
+        return 1;
+    }
+
+    if (!stripes_connect(sa, connections, g_socks)) {
+        std::cerr << "B: failed to connect to A\n";
+        return 1;
+    }
 
-    int server_port = (argc == 5) ? std::atoi(argv[4]) : 9090;
+    std::cout << "B: Connected to A at " << server_ip << ":" << server_port << " over " << g_socks.size() << " connection(s)\n";
 
-    image_t* input_image = read_ppm_file(argv[1]);
-    if (!input_image) { 
-        std::cerr << "Failed to read input\n"; 
-        return 1; 
+    image_t* input_image = request_input(g_socks[0], local_image, false, g_forwarded);
+    if (!input_image) {
+        std::cerr << "B: A did not send the input\n";
+        return 1;
     }
+    std::cout << (g_forwarded ? "B: input rows come from A\n" : "B: using the local input\n");
 
     int height = input_image->height, width = input_image->width;
 
-    // initilize output_image
+    // initilize output_image, rows A forwards are filled in again as they arrive
     image_t* output_image = new image_t;
 
     output_image->height = height; output_image->width = width;
@@ -203,33 +212,15 @@ int main(int argc, char **argv) {
 
     g_cols_per_row = static_cast<size_t>(std::max(0, width - 2));
     g_fixed_payload = static_cast<size_t>(PROCESSED_ROW_COUNT) * g_cols_per_row * 3;
-    g_shm_size = HDR_SIZE + g_fixed_payload;
-
-
-    g_sock = ::socket(AF_INET, SOCK_STREAM, 0);
-    if (g_sock < 0) { 
-        perror("socket"); 
-        return 1; 
-    }
-
-    sockaddr_in sa{};
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(server_port);
-    if (inet_pton(AF_INET, server_ip, &sa.sin_addr) <= 0) {
-        perror("inet_pton");
-        return 1;
-    }
-
-    if (connect(g_sock, (sockaddr*)&sa, sizeof(sa)) < 0) {
-        perror("connect");
-        return 1;
-    }
-
-    std::cout << "B: Connected to A at " << server_ip << ":" << server_port << "\n";
+    g_shm_size = NET_HDR_SIZE + g_fixed_payload;
+    g_frame_size = g_shm_size + (g_forwarded ? input_section_bytes(PROCESSED_ROW_COUNT, width) : 0);
 
     auto start_p = std::chrono::steady_clock::now();
     
-    S3_sharpen(input_image, output_image);
+    // hashes output bands as S3 completes them
+    imageMerkle merkle(output_image, MERKLE_BAND_ROWS, MERKLE_THREADS);
+    S3_sharpen(input_image, output_image, merkle);
+    g_link_s2_s3.report();
 
     auto finish_p = std::chrono::steady_clock::now();
     std::chrono::duration<double> elapsed = finish_p - start_p;
@@ -239,6 +230,11 @@ int main(int argc, char **argv) {
     write_ppm_file(argv[2], output_image);
     std::cout << "Image written to " << argv[2] << std::endl;
 
-    if (g_sock >= 0) close(g_sock);
+    const merkleTree& tree = merkle.finish();
+    merkle.report(argv[2]);
+    if (MERKLE_SIDECAR)
+        write_merkle_sidecar(std::string(argv[2]) + ".merkle", tree);
+
+    stripes_close(g_socks);
     return 0;
 }
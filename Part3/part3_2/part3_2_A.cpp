@@ -20,115 +20,67 @@
 #include <arpa/inet.h>
 #include "../../include/rowPacket.h"
 #include "../../include/libppm.h"   
-
-
-const bool USE_HASH = true;
+#include "../../include/packetIO.h"
+#include "../../include/checksum.h"
+#include "../../include/integrity.h"
+#include "../../include/netCodec.h"
+#include "../../include/frameHeader.h"
+#include "../../include/tcpStripes.h"
+#include "../../include/remoteInput.h"
+#include "../../include/imageStages.h"
+#include "../../include/bandServer.h"
+
+
+const integrity_policy_t INTEGRITY_S1_S2 = INTEGRITY_NETWORK;     // tcp to B, every packet
+const checksum_algo CHECKSUM_ALGO = CHECKSUM_CRC32C;   // engine for the packets we send, receivers go by the header
 const int PROCESSED_ROW_COUNT = 32;
 const int SCALING_FACTOR = 2;
-
-// header formate: int32_t start_row, int32_t num_rows, int32_t cols_per_row, uint64_t hash, uint8_t is_last
-static const size_t HDR_SIZE = sizeof(int32_t)*3 + sizeof(uint64_t) + sizeof(uint8_t);
+const int TCP_MAX_CONNECTIONS = 8;     // most connections B may stripe the S1 -> S2 link over
+const stripe_policy STRIPE_POLICY = STRIPE_LEAST_QUEUED;  // round robin | least queued
+const bool NET_COMPRESS = true;        // smoothed bands go out with the smallest codec of include/netCodec.h, false: raw
+const size_t NET_COMPRESS_BACKLOG = 64 * 1024;  // bytes queued on the emptiest connection before bands are compressed, 0: always
+// server mode, given a [clients] argument (include/bandServer.h)
+const int SERVER_WORKERS = 4;          // threads smoothening the bands of all clients
+const size_t SERVER_CLIENT_QUEUE = 1024 * 1024;  // per client, bytes waiting for it to read before its bands are held back
+const int SERVER_LISTEN_BACKLOG = 64;  // clients connecting at once
+const double SERVER_REPORT_SECONDS = 1.0;  // period of the throughput line
+
+// this process's end of the link to B
+linkIntegrity g_link_s1_s2("S1->S2", INTEGRITY_S1_S2, CHECKSUM_ALGO);
+netEncoder g_codec_s1_s2("S1->S2", NET_COMPRESS);
+netEncoder g_codec_input("input->S2", NET_COMPRESS);
 
 
 static size_t g_cols_per_row = 0;
 static size_t g_fixed_payload = 0;  // = PROCESSED_ROW_COUNT * cols_per_row * 3
-static size_t g_shm_size = 0;       // HDR_SIZE + fixed_payload
-
-// global accepted socket for S2
-static int g_client_fd = -1;
-
-// helper to send buffer
-
-static bool send_all(int fd, const void* buf, size_t len) {
-
-    const char* p = static_cast<const char*>(buf);
-    while (len) {
-        ssize_t n = ::send(fd, p, len, 0);
-        if (n < 0) {
-            if (errno == EINTR) 
-                continue;
-            perror("send");
-            return false;
-        }
-        p += n;
-        len -= static_cast<size_t>(n);
-    }
-    return true;
-}
+static size_t g_shm_size = 0;       // NET_HDR_SIZE + fixed_payload
+static size_t g_frame_size = 0;     // largest frame to B, g_shm_size + the band's input rows when forwarding
+static bool g_forward_input = false;    // B asked for the input rows, they go with the bands (include/remoteInput.h)
 
-// FNV hash generating function
-static std::size_t calculate_hash_for_packet(const rowPacket &rp) {
-    if (rp.pixels.empty()) 
-        return 0;
-    const std::size_t FNV_offset = 1469598103934665603ULL;
-    const std::size_t FNV_prime  = 1099511628211ULL;
-    std::size_t h = FNV_offset;
-
-    for (uint8_t b : rp.pixels){
-        h ^= static_cast<std::size_t>(b);
-        h *= FNV_prime;
-    }
-
-    h ^= static_cast<std::size_t>(rp.start_row + 0x9e3779b9);
-    h *= FNV_prime;
-    h ^= static_cast<std::size_t>(rp.num_rows + 0x9e3779b9);
-    h *= FNV_prime;
-
-    return h;
-}
-
-static void serialize_header(char *dst, int32_t start_row, int32_t num_rows, int32_t cols_per_row, uint64_t hash, uint8_t is_last) {
-
-    size_t off = 0;
-
-    memcpy(dst + off, &start_row, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(dst + off, &num_rows, sizeof(int32_t));  off += sizeof(int32_t);
-    memcpy(dst + off, &cols_per_row, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(dst + off, &hash, sizeof(uint64_t)); off += sizeof(uint64_t);
-    memcpy(dst + off, &is_last, sizeof(uint8_t)); off += sizeof(uint8_t);
-
-    (void)off;
-}
-
-static void deserialize_header(const char *src, int32_t &start_row, int32_t &num_rows, int32_t &cols_per_row, uint64_t &hash, uint8_t &is_last) {
-    
-    size_t off = 0;
-
-    memcpy(&start_row, src + off, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(&num_rows, src + off, sizeof(int32_t));  off += sizeof(int32_t);
-    memcpy(&cols_per_row, src + off, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(&hash, src + off, sizeof(uint64_t)); off += sizeof(uint64_t);
-    memcpy(&is_last, src + off, sizeof(uint8_t)); off += sizeof(uint8_t);
-
-    (void)off;
-}
+// accepted connections for S2, S1 stripes its frames over them
+static std::vector<int> g_client_fds;
 
 void S1_smoothen(image_t* input_image) {
     
     int width = input_image->width;
     int height = input_image->height;
 
-    if (height < 3 || width < 3) {
-        // write terminal into S1_S2
-        std::vector<char> termbuf(g_shm_size);
-        char hdr[HDR_SIZE];
-
-        serialize_header(hdr, -1, 0, 0, 0ULL, 1);
-        memcpy(termbuf.data(), hdr, HDR_SIZE);
+    stripeSender sender(g_client_fds, STRIPE_POLICY);
+    int32_t sent = 0;
 
-        send_all(g_client_fd, termbuf.data(),g_shm_size);
+    if (height < 3 || width < 3) {
+        // write terminal into S1_S2, a header alone
+        char hdr[NET_HDR_SIZE];
+        serialize_net_header(hdr, -1, 0, 0, sent, 0ULL, CHECKSUM_NONE, NET_CODEC_RAW, 1);
+        sender.send_to_all(hdr, NET_HDR_SIZE);
         
         return;
     }
 
     const int cols_per_row = std::max(0, width - 2);
-    const size_t fixed_payload = g_fixed_payload; // PROCESSED_ROW_COUNT * cols_per_row * 3
 
-    int dir[9][2] = {
-        {-1,-1}, {-1,0}, {-1,1},
-        {0,-1}, {0,0}, {0,1},
-        {1,-1}, {1,0}, {1,1}
-    };
+    std::vector<char> outbuf(g_frame_size);
+    std::vector<uint8_t> rows;
 
     for (int i = 1; i <= height - 2; ) {
         int batch_start = i;
@@ -138,72 +90,114 @@ void S1_smoothen(image_t* input_image) {
             break;
 
         rowPacket rpkt(batch_start, take, cols_per_row);
+        smoothen_rows(input_image, batch_start, take, rpkt.pixels.data());
 
-        for (int r_off = 0; r_off < take; ++r_off) {
-            int r = batch_start + r_off;
-            for (int c = 1, cidx = 0; c <= width - 2; c++, cidx++) {
-                int sumR=0, sumG=0, sumB=0;
-                for (int k=0;k<9;++k) {
+        // sealed before encoding, B checks the rows it decoded
+        g_link_s1_s2.seal(rpkt);
 
-                    int rr = r + dir[k][0], cc = c + dir[k][1];
+        size_t actual_bytes = static_cast<size_t>(take) * cols_per_row * 3;
+        size_t encoded = 0;
+        // raw while the link drains as fast as S1 fills it
+        bool link_busy = sender.backlog() >= NET_COMPRESS_BACKLOG;
+        uint8_t* body = reinterpret_cast<uint8_t*>(outbuf.data() + NET_HDR_SIZE);
+        size_t input_bytes = 0;
+        if (g_forward_input)
+            input_bytes = put_input_rows(input_image, batch_start, take, g_codec_input, link_busy, body, rows);
 
-                    sumR += input_image->image_pixels[rr][cc][0];
-                    sumG += input_image->image_pixels[rr][cc][1];
-                    sumB += input_image->image_pixels[rr][cc][2];
-                }
+        net_codec codec_used = g_codec_s1_s2.encode(rpkt.pixels.data(), actual_bytes, body + input_bytes, encoded, link_busy);
+        serialize_net_header(outbuf.data(), rpkt.start_row, rpkt.num_rows, rpkt.cols_per_row, sent, (uint64_t)rpkt.hash, rpkt.hash_algo, codec_used, rpkt.is_last ? 1 : 0);
 
-                uint8_t sr = static_cast<uint8_t>(sumR / 9);
-                uint8_t sg = static_cast<uint8_t>(sumG / 9);
-                uint8_t sb = static_cast<uint8_t>(sumB / 9);
-                
-                uint8_t *p = rpkt.pixel_ptr(r_off, cidx);
-                
-                p[0]=sr; p[1]=sg; p[2]=sb;
-            }
-        }
+        sender.send(outbuf.data(), NET_HDR_SIZE + input_bytes + encoded);
+        sent++;
 
-        if (USE_HASH)
-            rpkt.hash = calculate_hash_for_packet(rpkt);
+        i += take;
+    }
 
-        std::vector<char> outbuf(g_shm_size);
-        serialize_header(outbuf.data(), rpkt.start_row, rpkt.num_rows, rpkt.cols_per_row, (uint64_t)rpkt.hash, rpkt.is_last ? 1 : 0);
+    // send terminal on every connection, with the number of frames sent
+    char thdr[NET_HDR_SIZE];
+    serialize_net_header(thdr, -1, 0, 0, sent, 0ULL, CHECKSUM_NONE, NET_CODEC_RAW, 1);
+    sender.send_to_all(thdr, NET_HDR_SIZE);
 
-        size_t actual_bytes = static_cast<size_t>(take) * cols_per_row * 3;
+    g_codec_s1_s2.report();
+    if (g_forward_input)
+        g_codec_input.report();
+}
 
-        if (actual_bytes > 0) 
-            memcpy(outbuf.data() + HDR_SIZE, rpkt.pixels.data(), actual_bytes);
 
-        if (g_shm_size > HDR_SIZE + actual_bytes) 
-            memset(outbuf.data() + HDR_SIZE + actual_bytes, 0, g_shm_size - HDR_SIZE - actual_bytes);
+// a pool thread of the server, with encoders of its own since they keep scratch buffers
+typedef struct server_worker_t {
+    std::vector<uint8_t> smooth;
+    std::vector<uint8_t> rows;
+    netEncoder codec;
+    netEncoder codec_input;
+} server_worker_t;
 
-        send_all(g_client_fd,outbuf.data(),g_shm_size);
+static size_t S1_band(server_worker_t& w, const image_t* input_image, const band_job_t& job, char* frame) {
+    size_t actual_bytes = static_cast<size_t>(job.num_rows) * g_cols_per_row * 3;
+    w.smooth.resize(actual_bytes);
+    smoothen_rows(input_image, job.start_row, job.num_rows, w.smooth.data());
 
-        i += take;
-    }
+    rowPacket rpkt(job.start_row, job.num_rows, static_cast<int>(g_cols_per_row), true);
+    g_link_s1_s2.seal(rpkt, w.smooth.data(), actual_bytes);
 
-    // send terminal 
-    std::vector<char> termbuf(g_shm_size);
-    char thdr[HDR_SIZE];
-    serialize_header(thdr, -1, 0, 0, 0ULL, 1);
-    memcpy(termbuf.data(), thdr, HDR_SIZE);
+    uint8_t* body = reinterpret_cast<uint8_t*>(frame + NET_HDR_SIZE);
+    size_t input_bytes = 0;
+    if (job.forward)
+        input_bytes = put_input_rows(input_image, job.start_row, job.num_rows, w.codec_input, job.compress, body, w.rows);
 
-    send_all(g_client_fd,termbuf.data(),g_shm_size);
+    size_t encoded = 0;
+    net_codec codec_used = w.codec.encode(w.smooth.data(), actual_bytes, body + input_bytes, encoded, job.compress);
+    serialize_net_header(frame, rpkt.start_row, rpkt.num_rows, rpkt.cols_per_row, job.sequence, (uint64_t)rpkt.hash, rpkt.hash_algo, codec_used, 0);
+    return NET_HDR_SIZE + input_bytes + encoded;
+}
+
+// S1 for max_clients B's (0: until interrupted) on a shared pool of threads
+static void serve_clients(int server_fd, const image_t* input_image, int max_clients) {
+    std::vector<server_worker_t> workers;
+    for (int w = 0; w < SERVER_WORKERS; w++)
+        workers.push_back({{}, {}, netEncoder("S1->S2 #" + std::to_string(w), NET_COMPRESS), netEncoder("input->S2 #" + std::to_string(w), NET_COMPRESS)});
+
+    band_server_config_t config;
+    config.workers = SERVER_WORKERS;
+    config.band_rows = PROCESSED_ROW_COUNT;
+    config.max_frame_bytes = g_shm_size + input_section_bytes(PROCESSED_ROW_COUNT, input_image->width);
+    config.client_queue_bytes = SERVER_CLIENT_QUEUE;
+    config.compress_backlog = NET_COMPRESS_BACKLOG;
+    config.max_clients = max_clients;
+    config.report_seconds = SERVER_REPORT_SECONDS;
+
+    serve_bands(server_fd, config, input_image,
+        [&workers, input_image](int worker, const band_job_t& job, char* frame) {
+            return S1_band(workers[worker], input_image, job, frame);
+        },
+        [](int32_t total, char* frame) {
+            serialize_net_header(frame, -1, 0, 0, total, 0ULL, CHECKSUM_NONE, NET_CODEC_RAW, 1);
+            return NET_HDR_SIZE;
+        });
+
+    g_link_s1_s2.report();
+    for (const server_worker_t& w : workers) {
+        w.codec.report();
+        w.codec_input.report();
+    }
 }
 
 
 int main(int argc, char **argv) {
 
-   // usage: ./a.out <input.ppm> [port]
-    // specifing port is optional
-    if (argc != 2 && argc != 3) {
-        std::cout << "usage: ./a.out <input.ppm> [port]\n";
+   // usage: ./a.out <input.ppm> [port] [clients]
+    // specifing port is optional, clients serves that many S2_S3's in one run (0: until interrupted)
+    if (argc < 2 || argc > 4) {
+        std::cout << "usage: ./a.out <input.ppm> [port] [clients]\n";
         return 0;
     }
 
     std::cout << "\nProcessing S1... " <<std::endl;
     std::cout << "----------------------------------------------------------------------------------------------------------" << std::endl;
 
-    int listen_port = (argc == 3) ? std::atoi(argv[2]) : 9090;
+    int listen_port = (argc >= 3) ? std::atoi(argv[2]) : 9090;
+    bool serve = argc == 4;
+    int max_clients = serve ? std::max(0, std::atoi(argv[3])) : 0;
 
     image_t* input_image = read_ppm_file(argv[1]);
     if (!input_image) { 
@@ -217,7 +211,7 @@ int main(int argc, char **argv) {
 
     g_cols_per_row = static_cast<size_t>(std::max(0, width - 2));
     g_fixed_payload = static_cast<size_t>(PROCESSED_ROW_COUNT) * g_cols_per_row * 3;
-    g_shm_size = HDR_SIZE + g_fixed_payload;
+    g_shm_size = NET_HDR_SIZE + g_fixed_payload;
 
     int server_fd = ::socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd < 0) { 
@@ -237,23 +231,34 @@ int main(int argc, char **argv) {
         perror("bind"); 
         return 1; 
     }
-    if (listen(server_fd, 1) < 0) { 
+    // all of B's connections may be pending at once
+    if (listen(server_fd, serve ? SERVER_LISTEN_BACKLOG : TCP_MAX_CONNECTIONS) < 0) { 
         perror("listen"); 
         return 1; 
     }
 
+    if (serve) {
+        std::cout << "S1: serving S2_S3 clients on port " << listen_port << "...\n";
+        serve_clients(server_fd, input_image, max_clients);
+        close(server_fd);
+        return 0;
+    }
+
     std::cout << "S1: Listening on port " << listen_port << " for S2_S3...\n";
 
-    sockaddr_in cli{};
-    socklen_t cl = sizeof(cli);
-    g_client_fd = accept(server_fd, (sockaddr*)&cli, &cl);
-    
-    if (g_client_fd < 0) { 
-        perror("accept"); 
-        return 1; 
+    if (!stripes_accept(server_fd, TCP_MAX_CONNECTIONS, g_client_fds)) {
+        std::cerr << "S1: S2_S3 failed to connect\n";
+        return 1;
     }
 
-    std::cout << "A1: S2_S3 connected.\n";
+    std::cout << "A1: S2_S3 connected over " << g_client_fds.size() << " connection(s).\n";
+
+    if (!serve_input(g_client_fds[0], input_image, g_forward_input)) {
+        std::cerr << "S1: S2_S3 did not ask for the input\n";
+        return 1;
+    }
+    g_frame_size = g_shm_size + (g_forward_input ? input_section_bytes(PROCESSED_ROW_COUNT, width) : 0);
+    std::cout << (g_forward_input ? "S1: forwarding input rows to S2_S3.\n" : "S1: S2_S3 has the input.\n");
 
     auto start_p = std::chrono::steady_clock::now();
 
@@ -263,5 +268,8 @@ int main(int argc, char **argv) {
     std::chrono::duration<double> elapsed = finish_p - start_p;
     std::cout << "Total Processing time per iteration " << elapsed.count()*1000 << " ms\n";
 
+    stripes_close(g_client_fds);
+    close(server_fd);
+
     return 0;
 }
@@ -14,247 +14,172 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
-#include <semaphore.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "../../include/rowPacket.h"
 #include "../../include/libppm.h"   
-
-
-const bool USE_HASH = true;
+#include "../../include/packetIO.h"
+#include "../../include/checksum.h"
+#include "../../include/integrity.h"
+#include "../../include/netCodec.h"
+#include "../../include/frameHeader.h"
+#include "../../include/merkle.h"
+#include "../../include/shmRing.h"
+#include "../../include/imageStages.h"
+#include "../../include/tcpStripes.h"
+#include "../../include/remoteInput.h"
+
+
+const integrity_policy_t INTEGRITY_S1_S2 = INTEGRITY_NETWORK;     // tcp from A, every packet
+const integrity_policy_t INTEGRITY_S2_S3 = INTEGRITY_LOCAL_IPC;   // shm, sampled
+const checksum_algo CHECKSUM_ALGO = CHECKSUM_CRC32C;   // engine for the packets we send, receivers go by the header
 const int PROCESSED_ROW_COUNT = 32;
+const int SHM_RING_SLOTS = 4;          // slots of the S2 -> S3 ring, S2 runs at most this many blocks ahead of S3
+const shm_sync_mode SHM_SYNC = SHM_SYNC_ADAPTIVE;  // how S2 / S3 wait on a full / empty ring: block | adaptive | poll
 const int SCALING_FACTOR = 2;
+const int MERKLE_BAND_ROWS = 32;       // rows per leaf of the hash tree over the output image
+const int MERKLE_THREADS = 2;          // threads hashing bands while the output is still being written
+const bool MERKLE_SIDECAR = false;     // also write the tree to <output>.merkle
+const int TCP_CONNECTIONS = 4;         // connections asked of A for the link from S1, [connections] overrides
 
-// header formate: int32_t start_row, int32_t num_rows, int32_t cols_per_row, uint64_t hash, uint8_t is_last
-static const size_t HDR_SIZE = sizeof(int32_t)*3 + sizeof(uint64_t) + sizeof(uint8_t);
+// this process's end of each link, every stage process gets its own copy at fork
+linkIntegrity g_link_s1_s2("S1->S2", INTEGRITY_S1_S2, CHECKSUM_ALGO);
+linkIntegrity g_link_s2_s3("S2->S3", INTEGRITY_S2_S3, CHECKSUM_ALGO);
 
-// named shared memory & semaphores 
-static const char* SHM_S2_S3_NAME = "/shm_s2_s3";
-
-static const char* SEM_S2S3_EMPTY = "/sem_s2s3_empty";
-static const char* SEM_S2S3_FULL  = "/sem_s2s3_full";
+// shared memory, the ring in it synchronizes itself (include/shmRing.h). mapped before S2 is
+// forked, so it needs no global name: a memfd, the label only shows in /proc/<pid>/fd
+static const char* SHM_S2_S3_NAME = "shm_s2_s3";
 
 // inherited by children
 static size_t g_cols_per_row = 0;
 static size_t g_fixed_payload = 0;  // = PROCESSED_ROW_COUNT * cols_per_row * 3
-static size_t g_shm_size = 0;       // HDR_SIZE + fixed_payload
-
-static char* shm_s2_s3 = nullptr;
-
-static sem_t* sem_s2s3_empty = nullptr;
-static sem_t* sem_s2s3_full  = nullptr;
-
-// TCP socket for S2
-static int g_sock = -1;
-
-static bool recv_all(int fd, void* buf, size_t len) {
-    char* p = static_cast<char*>(buf);
-    size_t remaining = len;
-    while (remaining) {
-        ssize_t n = ::recv(fd, p, remaining, 0);
-        if (n == 0) {
-            // connection closed
-            return false;
-        }
-        if (n < 0) {
-            if (errno == EINTR) continue;
-            perror("recv");
-            return false;
-        }
-        p += n;
-        remaining -= static_cast<size_t>(n);
-    }
-    return true;
-}
-
-// FNV hash generating function
-
-static std::size_t calculate_hash_for_packet(const rowPacket &rp) {
-    if (rp.pixels.empty()) 
-        return 0;
-    const std::size_t FNV_offset = 1469598103934665603ULL;
-    const std::size_t FNV_prime  = 1099511628211ULL;
-    std::size_t h = FNV_offset;
-
-    for (uint8_t b : rp.pixels){
-        h ^= static_cast<std::size_t>(b);
-        h *= FNV_prime;
-    }
-
-    h ^= static_cast<std::size_t>(rp.start_row + 0x9e3779b9);
-    h *= FNV_prime;
-    h ^= static_cast<std::size_t>(rp.num_rows + 0x9e3779b9);
-    h *= FNV_prime;
-
-    return h;
-}
-
-static void serialize_header(char *dst, int32_t start_row, int32_t num_rows, int32_t cols_per_row, uint64_t hash, uint8_t is_last) {
-
-    size_t off = 0;
-
-    memcpy(dst + off, &start_row, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(dst + off, &num_rows, sizeof(int32_t));  off += sizeof(int32_t);
-    memcpy(dst + off, &cols_per_row, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(dst + off, &hash, sizeof(uint64_t)); off += sizeof(uint64_t);
-    memcpy(dst + off, &is_last, sizeof(uint8_t)); off += sizeof(uint8_t);
-
-    (void)off;
-}
-
-static void deserialize_header(const char *src, int32_t &start_row, int32_t &num_rows, int32_t &cols_per_row, uint64_t &hash, uint8_t &is_last) {
-    
-    size_t off = 0;
-
-    memcpy(&start_row, src + off, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(&num_rows, src + off, sizeof(int32_t));  off += sizeof(int32_t);
-    memcpy(&cols_per_row, src + off, sizeof(int32_t)); off += sizeof(int32_t);
-    memcpy(&hash, src + off, sizeof(uint64_t)); off += sizeof(uint64_t);
-    memcpy(&is_last, src + off, sizeof(uint8_t)); off += sizeof(uint8_t);
+static size_t g_shm_size = 0;       // NET_HDR_SIZE + fixed_payload
+static size_t g_frame_size = 0;     // largest frame from S1, g_shm_size + the band's input rows when forwarded
+static bool g_forwarded = false;    // S2 fills the band's input rows in as they come, the input image is a shared mapping
 
-    (void)off;
-}
+static shm_ring_t* shm_s2_s3 = nullptr;
 
-// write a block into a shared buffer using semaphores
-static void write_shm_block(char* shm_ptr, sem_t* sem_empty, sem_t* sem_full, const std::vector<char>& buf) {
-    // wait for empty slot
-    if (sem_wait(sem_empty) == -1) {
-        perror("sem_wait empty");
-        _exit(1);
-    }
-    // copy entire buffer into shared memory of size shm_size
-    memcpy(shm_ptr, buf.data(), g_shm_size);
+// TCP connections for S2, the bands of S1 arrive on any of them
+static std::vector<int> g_socks;
 
-    // increment full
-    if (sem_post(sem_full) == -1) {
-        perror("sem_post full");
-        _exit(1);
-    }
+// a marker is a header alone, it never touches the payload part of its slot
+static void send_marker(shm_ring_t* ring) {
+    char* slot = shm_ring_acquire(ring);
+    serialize_net_header(slot, -1, 0, 0, 0, 0ULL, CHECKSUM_NONE, NET_CODEC_RAW, 1);
+    shm_ring_publish(ring, slot);
 }
 
-// read a block from shared buffer into local buffer
-static void read_shm_block(char* shm_ptr, sem_t* sem_empty, sem_t* sem_full, std::vector<char>& outbuf) {
-    if (sem_wait(sem_full) == -1) {
-        perror("sem_wait full");
-        _exit(1);
-    }
-    memcpy(outbuf.data(), shm_ptr, g_shm_size);
-
-    // increment empty
-    if (sem_post(sem_empty) == -1) {
-        perror("sem_post empty");
-        _exit(1);
-    }
-}
-
-
+// the details of every band received from A are computed straight into the slot S3 will
+// read them from
 void S2_find_details(image_t* input_image) {
     int width = input_image->width;
     int height = input_image->height;
 
     if (height < 3 || width < 3) {
         // forward terminal
-        std::vector<char> termbuf(g_shm_size);
-        char hdr[HDR_SIZE];
-        serialize_header(hdr, -1, 0, 0, 0ULL, 1);
-        memcpy(termbuf.data(), hdr, HDR_SIZE);
-
-        write_shm_block(shm_s2_s3, sem_s2s3_empty, sem_s2s3_full, termbuf);
-
+        send_marker(shm_s2_s3);
         return;
     }
 
-    const int cols_per_row = std::max(0, width - 2);
-
-    std::vector<char> hdrbuf(g_shm_size);
+    std::vector<char> hdrbuf(g_frame_size);
+    std::vector<uint8_t> decoded(g_fixed_payload);
+    std::vector<uint8_t> rows;
+    // a band has at least one row, so no stream has more of them than interior rows
+    stripeReceiver receiver(g_socks, g_frame_size, height - 2);
+
+    while (!receiver.done()) {
+        int conn = receiver.next(hdrbuf);
+        if (conn < 0) {
+            std::cerr << "S2: connection closed/failed\n";
+            break;
+        }
 
-    while (true) {
-        recv_all(g_sock, hdrbuf.data(), g_shm_size);
+        // every frame, a terminal too, is at least a header before any of it is parsed
+        if (hdrbuf.size() < NET_HDR_SIZE) {
+            std::cerr << "S2: frame of " << hdrbuf.size() << " bytes is shorter than a header\n";
+            break;
+        }
 
-        int32_t start_row, num_rows, cols;
+        int32_t start_row, num_rows, cols, sequence;
         uint64_t hash;
+        uint8_t hash_algo;
+        uint8_t codec;
         uint8_t is_last;
-        deserialize_header(hdrbuf.data(), start_row, num_rows, cols, hash, is_last);
+        deserialize_net_header(hdrbuf.data(), start_row, num_rows, cols, sequence, hash, hash_algo, codec, is_last);
 
-        // payload is part of hdrbuf (readed full block already)
+        // payload is part of hdrbuf (readed full block already), as S1 encoded it
         if (is_last) {
-            // forward terminal header
+            // S1 ends every connection, the band count it announces is checked below
+            receiver.end_of(conn, sequence);
+            continue;
+        }
 
-            std::vector<char> termbuf(g_shm_size);
-            char thdr[HDR_SIZE];
-            serialize_header(thdr, -1, 0, 0, 0ULL, 1);
-            memcpy(termbuf.data(), thdr, HDR_SIZE);
+        if (num_rows < 0 || cols != width - 2 || start_row < 1 || start_row + num_rows > height - 1 ||
+            static_cast<size_t>(num_rows) * cols * 3 > g_fixed_payload) {
+            std::cerr << "S2: malformed rowPacket(start_row=" << start_row << ")\n";
+            break;
+        }
 
-            write_shm_block(shm_s2_s3, sem_s2s3_empty, sem_s2s3_full, termbuf);
-            return;
+        if (!receiver.take(sequence)) {
+            std::cerr << "S2: rowPacket(start_row=" << start_row << ") came twice or is out of sequence\n";
+            break;
         }
 
-        rowPacket rpkt(start_row, num_rows, cols);
+        // the band's input rows come first when forwarded, S3 reads them after the ring hand-off
+        const uint8_t* smooth = reinterpret_cast<const uint8_t*>(hdrbuf.data() + NET_HDR_SIZE);
         size_t actual_bytes = static_cast<size_t>(num_rows) * cols * 3;
-        if (actual_bytes > 0)
-            memcpy(rpkt.pixels.data(), hdrbuf.data() + HDR_SIZE, actual_bytes);
-
-        rpkt.hash = (std::size_t)hash;
-
-        if (USE_HASH) {
-            std::size_t expected = calculate_hash_for_packet(rpkt);
-            if (expected != rpkt.hash) {
-                std::cerr << "S2: Data Corrupted in rowPacket(start_row=" << rpkt.start_row << ")!!\n";
-
-                std::vector<char> termbuf(g_shm_size);
-                char thdr[HDR_SIZE];
-                serialize_header(thdr, -1, 0, 0, 0ULL, 1);
-                memcpy(termbuf.data(), thdr, HDR_SIZE);
-
-                write_shm_block(shm_s2_s3, sem_s2s3_empty, sem_s2s3_full, termbuf);
+        size_t wire_bytes = hdrbuf.size() - NET_HDR_SIZE;
 
-                return;
+        if (g_forwarded) {
+            size_t used = take_input_rows(smooth, wire_bytes, input_image, nullptr, start_row, num_rows, rows);
+            if (used == 0) {
+                std::cerr << "S2: input rows of rowPacket(start_row=" << start_row << ") are corrupted\n";
+                break;
             }
+            smooth += used;
+            wire_bytes -= used;
         }
 
-        rowPacket out_rpkt(rpkt.start_row, rpkt.num_rows, rpkt.cols_per_row);
-
-        for (int r_off = 0; r_off < rpkt.num_rows; ++r_off) {
-            int row_idx = rpkt.start_row + r_off;
-            for (int cidx = 0; cidx < rpkt.cols_per_row; ++cidx) {
-
-                uint8_t* sp = rpkt.pixel_ptr(r_off, cidx);
-                int orig_col = 1 + cidx;
-                
-                int dR = input_image->image_pixels[row_idx][orig_col][0] - (int)sp[0];
-                int dG = input_image->image_pixels[row_idx][orig_col][1] - (int)sp[1];
-                int dB = input_image->image_pixels[row_idx][orig_col][2] - (int)sp[2];
-                
-                if (dR < 0) 
-                    dR = 0;
-                if (dG < 0) 
-                    dG = 0; 
-                if (dB < 0) 
-                    dB = 0;
-
-                uint8_t* op = out_rpkt.pixel_ptr(r_off, cidx);
-
-                op[0] = (uint8_t)dR; op[1] = (uint8_t)dG; op[2] = (uint8_t)dB;
+        // a raw payload is used where it arrived, anything else is decoded first
+        if (codec != NET_CODEC_RAW || wire_bytes != actual_bytes) {
+            if (!net_decode(static_cast<net_codec>(codec), smooth, wire_bytes, decoded.data(), actual_bytes)) {
+                std::cerr << "S2: rowPacket(start_row=" << start_row << ") does not decode as " << net_codec_name(static_cast<net_codec>(codec)) << "\n";
+                break;
             }
+            smooth = decoded.data();
         }
 
-        if (USE_HASH) out_rpkt.hash = calculate_hash_for_packet(out_rpkt);
+        rowPacket rpkt(start_row, num_rows, cols, true);
+        rpkt.hash = (std::size_t)hash;
+        rpkt.hash_algo = hash_algo;
+
+        if (!g_link_s1_s2.check(rpkt, smooth, actual_bytes)) {
+            std::cerr << "S2: Data Corrupted in rowPacket(start_row=" << rpkt.start_row << ")!!\n";
+            break;
+        }
+
+        char* slot = shm_ring_acquire(shm_s2_s3);
+        uint8_t* details = reinterpret_cast<uint8_t*>(slot + NET_HDR_SIZE);
 
-        std::vector<char> outbuf(g_shm_size);
-        serialize_header(outbuf.data(), out_rpkt.start_row, out_rpkt.num_rows, out_rpkt.cols_per_row, (uint64_t)out_rpkt.hash, out_rpkt.is_last ? 1 : 0);
-        size_t out_actual = static_cast<size_t>(out_rpkt.num_rows) * out_rpkt.cols_per_row * 3;
+        find_details_rows(input_image, start_row, num_rows, smooth, details);
 
-        if (out_actual > 0) 
-            memcpy(outbuf.data() + HDR_SIZE, out_rpkt.pixels.data(), out_actual);
-        if (g_shm_size > HDR_SIZE + out_actual) 
-            memset(outbuf.data() + HDR_SIZE + out_actual, 0, g_shm_size - HDR_SIZE - out_actual);
+        rowPacket out_rpkt(start_row, num_rows, cols, true);
+        g_link_s2_s3.seal(out_rpkt, details, actual_bytes);
+        serialize_net_header(slot, out_rpkt.start_row, out_rpkt.num_rows, out_rpkt.cols_per_row, sequence, (uint64_t)out_rpkt.hash, out_rpkt.hash_algo, NET_CODEC_RAW, 0);
 
-        write_shm_block(shm_s2_s3, sem_s2s3_empty, sem_s2s3_full, outbuf);
+        shm_ring_publish(shm_s2_s3, slot);
     }
+
+    if (receiver.done() && !receiver.complete())
+        std::cerr << "S2: S1 announced more rowPackets than arrived\n";
+
+    // forward terminal header
+    send_marker(shm_s2_s3);
 }
 
-void S3_sharpen(image_t* input_image, image_t* output_image) {
+// the details are read in place and the slot goes back to S2 once the rows are sharpened
+void S3_sharpen(image_t* input_image, image_t* output_image, imageMerkle& merkle) {
     int width = input_image->width;
     int height = input_image->height;
 
@@ -263,63 +188,53 @@ void S3_sharpen(image_t* input_image, image_t* output_image) {
         return;
     }
 
-    std::vector<char> blockbuf(g_shm_size);
-
     while (true) {
 
-        read_shm_block(shm_s2_s3, sem_s2s3_empty, sem_s2s3_full, blockbuf);
+        const char* in = shm_ring_peek(shm_s2_s3);
 
-        int32_t start_row, num_rows, cols;
+        int32_t start_row, num_rows, cols, sequence;
         uint64_t hash;
+        uint8_t hash_algo;
+        uint8_t codec;
         uint8_t is_last;
-        deserialize_header(blockbuf.data(), start_row, num_rows, cols, hash, is_last);
+        deserialize_net_header(in, start_row, num_rows, cols, sequence, hash, hash_algo, codec, is_last);
 
         if (is_last) {
+            shm_ring_release(shm_s2_s3, in);
             return;
         }
 
-        rowPacket rpkt(start_row, num_rows, cols);
+        const uint8_t* details = reinterpret_cast<const uint8_t*>(in + NET_HDR_SIZE);
         size_t actual = static_cast<size_t>(num_rows) * cols * 3;
-        if (actual > 0) 
-            memcpy(rpkt.pixels.data(), blockbuf.data() + HDR_SIZE, actual);
 
+        rowPacket rpkt(start_row, num_rows, cols, true);
         rpkt.hash = (std::size_t)hash;
+        rpkt.hash_algo = hash_algo;
 
-        if (USE_HASH) {
-            std::size_t expected = calculate_hash_for_packet(rpkt);
-            if (expected != rpkt.hash) {
-                std::cerr << "S3: Data Corrupted in rowPacket(start_row=" << rpkt.start_row << ")!!\n";
-                _exit(1);
-            }
+        if (!g_link_s2_s3.check(rpkt, details, actual)) {
+            std::cerr << "S3: Data Corrupted in rowPacket(start_row=" << rpkt.start_row << ")!!\n";
+            _exit(1);
         }
 
+        // forwarded rows reached the input after output_image was initialized from it
+        if (g_forwarded)
+            for (int i = start_row; i < start_row + num_rows; i++)
+                for (int j = 0; j < width; j++)
+                    memcpy(output_image->image_pixels[i][j], input_image->image_pixels[i][j], 3);
 
-        for (int r_off = 0; r_off < rpkt.num_rows; ++r_off) {
-            int i = rpkt.start_row + r_off;
-            for (int cidx = 0; cidx < rpkt.cols_per_row; ++cidx) {
-
-                uint8_t* d = rpkt.pixel_ptr(r_off, cidx);
-                int j = 1 + cidx;
-                
-                int newR = input_image->image_pixels[i][j][0] + SCALING_FACTOR * (int)d[0];
-                int newG = input_image->image_pixels[i][j][1] + SCALING_FACTOR * (int)d[1];
-                int newB = input_image->image_pixels[i][j][2] + SCALING_FACTOR * (int)d[2];
-                
-                
-                output_image->image_pixels[i][j][0] = (uint8_t)(newR > 255 ? 255 : (newR < 0 ? 0 : newR));
-                output_image->image_pixels[i][j][1] = (uint8_t)(newG > 255 ? 255 : (newG < 0 ? 0 : newG));
-                output_image->image_pixels[i][j][2] = (uint8_t)(newB > 255 ? 255 : (newB < 0 ? 0 : newB));
-            }
-        }
+        sharpen_rows(input_image, output_image, start_row, num_rows, details, SCALING_FACTOR);
+        shm_ring_release(shm_s2_s3, in);
+
+        merkle.rows_done(start_row, num_rows);
     }
 }
 
 // helper to create shared mem and map of size bytes, return pointer
 static char* create_and_map_shm(const char* name, size_t size) {
     
-    int fd = shm_open(name, O_CREAT | O_RDWR, 0666);
+    int fd = memfd_create(name, MFD_CLOEXEC);
     if (fd == -1) { 
-        perror("shm_open"); 
+        perror("memfd_create"); 
         return nullptr; 
     }
 
@@ -343,24 +258,55 @@ static char* create_and_map_shm(const char* name, size_t size) {
 
 int main(int argc, char **argv) {
 
-    // usage: ./b.out <input.ppm> <output.ppm> [server_ip] [port]
-    if (argc != 3 && argc != 5) {
-        std::cout << "usage: ./b.out <input.ppm> <output.ppm> [server_ip] [port]\n";
+    // usage: ./b.out <input.ppm> <output.ppm> [server_ip] [port] [connections]
+    // input "-": S1 sends the input rows with the bands
+    if (argc != 3 && argc != 5 && argc != 6) {
+        std::cout << "usage: ./b.out <input.ppm|-> <output.ppm> [server_ip] [port] [connections]\n";
         return 0;
     }
 
     std::cout << "\nProcessing S2,S3 And Writing Image... " <<std::endl;
     std::cout << "----------------------------------------------------------------------------------------------------------" << std::endl;
 
-    image_t* input_image = read_ppm_file(argv[1]);
-    if (!input_image) { 
-        std::cerr << "Failed to read input\n"; 
-        return 1; 
+    // a local copy only saves the transfer if its content hash matches S1's
+    image_t* local_image = nullptr;
+    if (strcmp(argv[1], "-") != 0) {
+        local_image = read_ppm_file(argv[1]);
+        if (!local_image) { 
+            std::cerr << "Failed to read input\n"; 
+            return 1; 
+        }
+    }
+
+    const char* server_ip = (argc >= 5) ? argv[3] : "127.0.0.1";
+
+    int server_port = (argc >= 5) ? std::atoi(argv[4]) : 9090;
+
+    int connections = (argc == 6) ? std::atoi(argv[5]) : TCP_CONNECTIONS;
+
+    // server connection
+    sockaddr_in sa{};
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(server_port);
+    if (inet_pton(AF_INET, server_ip, &sa.sin_addr) <= 0) {
+        perror("inet_pton");
+        return 1;
     }
 
-    const char* server_ip = (argc == 5) ? argv[3] : "127.0.0.1";
+    if (!stripes_connect(sa, connections, g_socks)) {
+        std::cerr << "S2_S3: failed to connect to S1\n";
+        return 1;
+    }
 
-    int server_port = (argc == 5) ? std::atoi(argv[4]) : 9090;
+    std::cout << "S2_S3: Connected to S1 at " << server_ip << ":" << server_port << " over " << g_socks.size() << " connection(s)\n";
+
+    // S2 is forked below and fills in forwarded rows S3 reads, so they go in a shared mapping
+    image_t* input_image = request_input(g_socks[0], local_image, true, g_forwarded);
+    if (!input_image) {
+        std::cerr << "S2_S3: S1 did not send the input\n";
+        return 1;
+    }
+    std::cout << (g_forwarded ? "S2_S3: input rows come from S1\n" : "S2_S3: using the local input\n");
 
     int height = input_image->height, width = input_image->width;
 
@@ -385,48 +331,18 @@ int main(int argc, char **argv) {
 
     g_cols_per_row = static_cast<size_t>(std::max(0, width - 2));
     g_fixed_payload = static_cast<size_t>(PROCESSED_ROW_COUNT) * g_cols_per_row * 3;
-    g_shm_size = HDR_SIZE + g_fixed_payload;
+    g_shm_size = NET_HDR_SIZE + g_fixed_payload;
+    g_frame_size = g_shm_size + (g_forwarded ? input_section_bytes(PROCESSED_ROW_COUNT, width) : 0);
 
     // create shared memory regions using helper
-    shm_s2_s3 = create_and_map_shm(SHM_S2_S3_NAME, g_shm_size);
-
-    // server connection
-    g_sock = ::socket(AF_INET, SOCK_STREAM, 0);
-    if (g_sock < 0) { 
-        perror("socket"); 
-        return 1; 
-    }
-
-    sockaddr_in sa{};
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(server_port);
-    if (inet_pton(AF_INET, server_ip, &sa.sin_addr) <= 0) {
-        perror("inet_pton");
-        return 1;
-    }
-
-    if (connect(g_sock, (sockaddr*)&sa, sizeof(sa)) < 0) {
-        perror("connect");
-        return 1;
-    }
-
-    std::cout << "S2_S3: Connected to S1 at " << server_ip << ":" << server_port << "\n";
+    const size_t ring_size = shm_ring_bytes(SHM_RING_SLOTS, g_shm_size);
+    shm_s2_s3 = reinterpret_cast<shm_ring_t*>(create_and_map_shm(SHM_S2_S3_NAME, ring_size));
 
     if (!shm_s2_s3 ) { 
         std::cerr << "Failed to create shared memory\n"; 
         return 1; 
     }
-
-    // create semaphores (initially empty=1, full=0)
-    sem_unlink(SEM_S2S3_EMPTY); sem_unlink(SEM_S2S3_FULL);
-
-    // create semaphores
-    sem_s2s3_empty = sem_open(SEM_S2S3_EMPTY, O_CREAT, 0666, 1);
-    sem_s2s3_full  = sem_open(SEM_S2S3_FULL,  O_CREAT, 0666, 0);
-
-    if (sem_s2s3_empty == SEM_FAILED || sem_s2s3_full == SEM_FAILED) {
-        perror("sem_open"); return 1;
-    }
+    shm_ring_init(shm_s2_s3, SHM_RING_SLOTS, g_shm_size, SHM_SYNC);
 
     auto start_p = std::chrono::steady_clock::now();
 
@@ -441,22 +357,25 @@ int main(int argc, char **argv) {
     }
     if (pid2 == 0) {
         S2_find_details(input_image);
+        g_link_s1_s2.report();
 
         //cleanup
-        munmap(shm_s2_s3, g_shm_size);
-        sem_close(sem_s2s3_empty); sem_close(sem_s2s3_full);
+        munmap(shm_s2_s3, ring_size);
 
         _exit(0);
     }
 
     // Running S3 By parent Process without fork, forking will lead to loss of computed data
 
-    S3_sharpen(input_image,output_image);
+    // hashes output bands as S3 completes them
+    imageMerkle merkle(output_image, MERKLE_BAND_ROWS, MERKLE_THREADS);
+    S3_sharpen(input_image, output_image, merkle);
+    g_link_s2_s3.report();
 
-    sem_close(sem_s2s3_empty); sem_close(sem_s2s3_full);
-    munmap(shm_s2_s3, g_shm_size);
+    munmap(shm_s2_s3, ring_size);
 
     waitpid(pid2, nullptr, 0);
+    stripes_close(g_socks);
 
     auto finish_p = std::chrono::steady_clock::now();
     std::chrono::duration<double> elapsed = finish_p - start_p;
@@ -465,10 +384,10 @@ int main(int argc, char **argv) {
     write_ppm_file(argv[2], output_image);
     std::cout << "Image written to " << argv[2] << std::endl;
 
-    // unlink and close semaphores 
-    sem_close(sem_s2s3_empty); sem_close(sem_s2s3_full);
-    sem_unlink(SEM_S2S3_EMPTY); sem_unlink(SEM_S2S3_FULL);
-    shm_unlink(SHM_S2_S3_NAME);
+    const merkleTree& tree = merkle.finish();
+    merkle.report(argv[2]);
+    if (MERKLE_SIDECAR)
+        write_merkle_sidecar(std::string(argv[2]) + ".merkle", tree);
 
     return 0;
 }
\ No newline at end of file
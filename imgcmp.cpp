@@ -1,11 +1,72 @@
 #include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstring>
 #include "include/libppm.h"
+#include "include/merkle.h"
 #include <sys/wait.h>
 
+const int MERKLE_BAND_ROWS = 32;	// must match the band size the pipelines use for their sidecars
+const int MERKLE_THREADS = 4;
+
+static void print_bad_bands(const merkleTree& tree, const std::vector<int>& bad, int comparisons){
+	for(int band : bad){
+		int first_row, num_rows;
+		merkle_band_rows(tree.height, tree.band_rows, band, first_row, num_rows);
+		std::cout << "Band " << band << " (rows " << first_row << ".." << first_row + num_rows - 1 << ") corrupted" << std::endl;
+	}
+	std::cout << bad.size() << " of " << tree.bands() << " bands differ, found with " << comparisons << " node comparisons" << std::endl;
+}
+
+// both trees are hashed in parallel, a mismatch is narrowed down to bands top down
+static int merkle_compare(struct image_t* image1, struct image_t* image2, const char* path2){
+	if(image1->height != image2->height || image1->width != image2->width){
+		std::cout << "\nImages differ in size" << std::endl;
+		return 0;
+	}
+
+	merkleTree tree1;
+	std::thread other([&tree1, image1]{ tree1 = merkle_tree_of_image(image1, MERKLE_BAND_ROWS, MERKLE_THREADS / 2); });
+	merkleTree tree2 = merkle_tree_of_image(image2, MERKLE_BAND_ROWS, MERKLE_THREADS - MERKLE_THREADS / 2);
+	other.join();
+
+	std::cout << "Merkle root 1: " << merkle_hex(tree1.root()) << "\nMerkle root 2: " << merkle_hex(tree2.root()) << std::endl;
+
+	// the file against what the pipeline recorded while writing it
+	merkleTree sidecar;
+	std::string sidecar_path = std::string(path2) + ".merkle";
+	if(read_merkle_sidecar(sidecar_path, sidecar)){
+		std::vector<int> bad;
+		int comparisons;
+		if(!merkle_diff(sidecar, tree2, bad, comparisons))
+			std::cout << sidecar_path << " was built with a different band size or checksum, skipped" << std::endl;
+		else if(bad.empty())
+			std::cout << path2 << " matches its sidecar" << std::endl;
+		else{
+			std::cout << path2 << " does not match its sidecar:" << std::endl;
+			print_bad_bands(tree2, bad, comparisons);
+		}
+	}
+
+	std::vector<int> bad;
+	int comparisons;
+	merkle_diff(tree1, tree2, bad, comparisons);
+	if(!bad.empty()){
+		std::cout << std::endl;
+		print_bad_bands(tree1, bad, comparisons);
+		std::cout << "Exiting...." << std::endl;
+		return 0;
+	}
+
+	std::cout << "\nImages are identical (merkle roots match)\n" << std::endl;
+	return 0;
+}
+
 
 int main(int argc,char **argv){
-	if(argc != 3) {
-		std::cout << "usage: ./a.out <path-to-original-image> <path-to-transformed-image>" << std::endl;
+	if(argc != 3 && !(argc == 4 && strcmp(argv[3], "merkle") == 0)) {
+		std::cout << "usage: ./a.out <path-to-original-image> <path-to-transformed-image> [merkle]" << std::endl;
 		exit(0);
 	}
 
@@ -16,6 +77,9 @@ int main(int argc,char **argv){
 	struct image_t * input_image1=read_ppm_file(argv[1]);
 	struct image_t * input_image2=read_ppm_file(argv[2]);
 
+	if(argc == 4)
+		return merkle_compare(input_image1, input_image2, argv[2]);
+
 	for(int i = 1; i<input_image1->height-1; i++)
 		for(int j = 1; j<input_image1->width-1; j++)
 			for(int k=0; k<3; k++)
@@ -0,0 +1,87 @@
+#include "bandPool.h"
+#include "placement.h"
+#include <algorithm>
+
+// rows of share s out of shares over num_rows rows
+static void share_rows(int num_rows, int shares, int s, int& first, int& count) {
+    first = static_cast<int>(static_cast<long>(num_rows) * s / shares);
+    count = static_cast<int>(static_cast<long>(num_rows) * (s + 1) / shares) - first;
+}
+
+bandPool::bandPool(int threads, const std::vector<int>& cpus) {
+    // two shares of a band on one cpu only add switches: no more threads than cpus to run them
+    std::vector<int> distinct;
+    for (int cpu : cpus)
+        if (std::find(distinct.begin(), distinct.end(), cpu) == distinct.end())
+            distinct.push_back(cpu);
+    int usable = distinct.empty() ? static_cast<int>(std::thread::hardware_concurrency()) : static_cast<int>(distinct.size());
+    threads = std::min(threads, std::max(1, usable));
+
+    if (!distinct.empty())
+        pin_thread_to_cpu(pthread_self(), distinct[0]);
+
+    for (int t = 1; t < threads; t++) {
+        workers.emplace_back(&bandPool::worker, this, t);
+        if (!distinct.empty())
+            pin_thread_to_cpu(workers.back().native_handle(), distinct[t]);
+    }
+}
+
+bandPool::~bandPool() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    cv_work.notify_all();
+    for (std::thread& t : workers)
+        t.join();
+}
+
+void bandPool::worker(int index) {
+    unsigned long seen = 0;
+    std::unique_lock<std::mutex> lock(mtx);
+    while (true) {
+        cv_work.wait(lock, [this, seen]{ return generation != seen || stopping; });
+        if (stopping)
+            return;
+        seen = generation;
+        if (index >= job_shares)
+            continue;
+
+        int first, count;
+        share_rows(job_rows, job_shares, index, first, count);
+        const std::function<void(int, int)>* fn = job;
+
+        lock.unlock();
+        (*fn)(first, count);
+        lock.lock();
+
+        if (--pending == 0)
+            cv_done.notify_one();
+    }
+}
+
+void bandPool::run(int num_rows, const std::function<void(int, int)>& fn) {
+    int shares = std::min(size(), num_rows);
+    if (shares <= 1) {
+        fn(0, num_rows);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        job = &fn;
+        job_rows = num_rows;
+        job_shares = shares;
+        pending = shares - 1;
+        generation++;
+    }
+    cv_work.notify_all();
+
+    int first, count;
+    share_rows(num_rows, shares, 0, first, count);
+    fn(first, count);
+
+    std::unique_lock<std::mutex> lock(mtx);
+    cv_done.wait(lock, [this]{ return pending == 0; });
+}
@@ -0,0 +1,41 @@
+#ifndef BANDPOOL_H
+#define BANDPOOL_H
+#include <functional>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+// the threads of one stage process. run() splits a band's rows into contiguous shares, the
+// caller works on the first share itself and the resident threads on the rest, so a stage
+// still takes and hands on one packet at a time and nothing changes for its transports.
+// a pool of one thread starts no threads and runs the band inline.
+//
+// create it in the process that uses it, after any fork: threads don't survive fork.
+class bandPool {
+public:
+    // at most one thread per distinct cpu in cpus (per online cpu when it's empty), thread t
+    // (the caller is thread 0) pinned to the t-th of them
+    bandPool(int threads, const std::vector<int>& cpus);
+    ~bandPool();
+
+    int size() const { return static_cast<int>(workers.size()) + 1; }
+
+    // fn(first, count) for shares covering rows [0, num_rows), returns once all are done
+    void run(int num_rows, const std::function<void(int, int)>& fn);
+
+private:
+    void worker(int index);
+
+    std::mutex mtx;
+    std::condition_variable cv_work, cv_done;
+    const std::function<void(int, int)>* job = nullptr;
+    int job_rows = 0;
+    int job_shares = 0;
+    unsigned long generation = 0;   // bumped per run, a worker takes each generation once
+    int pending = 0;                // shares of the current run still on a worker
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
+
+#endif
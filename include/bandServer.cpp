@@ -0,0 +1,580 @@
+#include "bandServer.h"
+#include "tcpStripes.h"
+#include "remoteInput.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// epoll tags of the loop's own descriptors, a client is tagged with its id
+static const uint64_t TAG_LISTEN = 0;
+static const uint64_t TAG_WAKE = 1;
+static const uint64_t TAG_SIGNAL = 2;
+static const uint64_t FIRST_CLIENT = 3;
+
+static const int MAX_EVENTS = 64;
+static const int MAX_IOV = 64;          // queued frames per sendmsg
+static const int POOL_DEPTH = 2;        // bands handed to the pool per worker, so none idles between two
+
+typedef std::chrono::steady_clock server_clock;
+
+static double seconds_since(server_clock::time_point t) {
+    return std::chrono::duration<double>(server_clock::now() - t).count();
+}
+
+
+// a frame of job, behind its STRIPE_PREFIX_BYTES of length
+typedef struct built_frame_t {
+    band_job_t job;
+    std::vector<char> bytes;
+} built_frame_t;
+
+// the shared pool: jobs go in, frames come out and every frame done bumps the eventfd wake_fd
+class framePool {
+public:
+    framePool(int workers, size_t max_frame_bytes_, const band_frame_fn& build_, int wake_fd_)
+        : max_frame_bytes(max_frame_bytes_), build(build_), wake_fd(wake_fd_)
+    {
+        for (int w = 0; w < workers; w++)
+            threads.emplace_back(&framePool::worker, this, w);
+    }
+
+    ~framePool() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        cv_work.notify_all();
+        for (std::thread& t : threads)
+            t.join();
+    }
+
+    void submit(const band_job_t& job) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            jobs.push_back(job);
+        }
+        cv_work.notify_one();
+    }
+
+    // moves the frames done so far to out
+    void collect(std::deque<built_frame_t>& out) {
+        std::lock_guard<std::mutex> lock(mtx);
+        while (!done.empty()) {
+            out.push_back(std::move(done.front()));
+            done.pop_front();
+        }
+    }
+
+private:
+    void worker(int index) {
+        std::vector<char> scratch(STRIPE_PREFIX_BYTES + max_frame_bytes);
+        while (true) {
+            band_job_t job;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv_work.wait(lock, [this]{ return !jobs.empty() || stopping; });
+                if (stopping)
+                    return;
+                job = jobs.front();
+                jobs.pop_front();
+            }
+
+            size_t len = build(index, job, scratch.data() + STRIPE_PREFIX_BYTES);
+            uint32_t prefix = static_cast<uint32_t>(len);
+            memcpy(scratch.data(), &prefix, sizeof(prefix));
+
+            // the frame may wait in a client's queue a while, it gets a buffer of its exact size
+            built_frame_t frame{job, std::vector<char>(scratch.begin(), scratch.begin() + STRIPE_PREFIX_BYTES + len)};
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                done.push_back(std::move(frame));
+            }
+            uint64_t one = 1;
+            if (write(wake_fd, &one, sizeof(one)) < 0)
+                perror("eventfd write");
+        }
+    }
+
+    size_t max_frame_bytes;
+    band_frame_fn build;
+    int wake_fd;
+
+    std::mutex mtx;
+    std::condition_variable cv_work;
+    std::deque<band_job_t> jobs;
+    std::deque<built_frame_t> done;
+    bool stopping = false;
+    std::vector<std::thread> threads;
+};
+
+
+enum client_state {
+    CLIENT_HELLO,       // waiting for the stripes hello
+    CLIENT_REQUEST,     // waiting for the input request
+    CLIENT_STREAM,      // bands being built and sent
+    CLIENT_DRAIN        // terminal queued, closed once the queue is out
+};
+
+typedef struct client_t {
+    int fd = -1;
+    client_state state = CLIENT_HELLO;
+    std::vector<uint8_t> in;            // handshake bytes so far
+    std::deque<std::vector<char>> out;  // waiting for the socket, in order
+    size_t out_head = 0;                // bytes of out.front() already written
+    size_t queued = 0;                  // bytes of out not written yet
+    size_t building = 0;                // max_frame_bytes for each band in the pool
+    bool writable_armed = false;        // EPOLLOUT is in the interest set
+    bool forward = false;
+    int next_row = 1;                   // first row of the next band to hand out
+    int32_t issued = 0;
+    int32_t built = 0;
+    int32_t total = 0;                  // bands of the image
+    uint64_t wire_bytes = 0;
+    server_clock::time_point since;
+} client_t;
+
+
+class bandServer {
+public:
+    bandServer(int server_fd_, const band_server_config_t& config_, const image_t* img_, const band_frame_fn& build_frame, const terminal_frame_fn& build_terminal_)
+        : server_fd(server_fd_), config(config_), img(img_), build_terminal(build_terminal_)
+    {
+        content_hash = image_content_hash(img);
+        interior = std::max(0, img->height - 2);
+        if (img->width < 3)
+            interior = 0;
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_fd < 0 || wake_fd < 0) {
+            perror("epoll_create1 / eventfd");
+            exit(1);
+        }
+
+        // the pool threads inherit the mask, so the signals only ever reach signal_fd
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, &saved_mask);
+        signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (signal_fd < 0) {
+            perror("signalfd");
+            exit(1);
+        }
+
+        int flags = fcntl(server_fd, F_GETFL, 0);
+        if (flags < 0 || fcntl(server_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            perror("fcntl");
+            exit(1);
+        }
+
+        watch(server_fd, TAG_LISTEN, EPOLLIN);
+        watch(wake_fd, TAG_WAKE, EPOLLIN);
+        watch(signal_fd, TAG_SIGNAL, EPOLLIN);
+
+        pool = std::make_unique<framePool>(std::max(1, config.workers), config.max_frame_bytes, build_frame, wake_fd);
+        terminal.resize(STRIPE_PREFIX_BYTES + config.max_frame_bytes);
+    }
+
+    ~bandServer() {
+        pool.reset();
+        for (auto& [id, c] : clients)
+            close(c.fd);
+        close(signal_fd);
+        close(wake_fd);
+        close(epoll_fd);
+        pthread_sigmask(SIG_SETMASK, &saved_mask, nullptr);
+    }
+
+    void run() {
+        start = server_clock::now();
+        period_start = start;
+        printf("server: %d worker(s), %d interior rows in bands of %d, %s\n", std::max(1, config.workers), interior, config.band_rows,
+               config.max_clients > 0 ? (std::to_string(config.max_clients) + " client(s) to serve").c_str() : "until interrupted");
+        fflush(stdout);
+
+        epoll_event events[MAX_EVENTS];
+        while (!stopping && !(config.max_clients > 0 && accepted == config.max_clients && clients.empty())) {
+            int n = epoll_wait(epoll_fd, events, MAX_EVENTS, next_report_ms());
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("epoll_wait");
+                break;
+            }
+
+            for (int k = 0; k < n && !stopping; k++) {
+                uint64_t tag = events[k].data.u64;
+                if (tag == TAG_LISTEN)
+                    accept_clients();
+                else if (tag == TAG_WAKE)
+                    take_frames();
+                else if (tag == TAG_SIGNAL)
+                    stopping = true;
+                else
+                    on_client(tag, events[k].events);
+            }
+
+            dispatch();
+            if (seconds_since(period_start) >= config.report_seconds)
+                report_period();
+        }
+
+        report_total();
+    }
+
+private:
+    void watch(int fd, uint64_t tag, uint32_t events) {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.u64 = tag;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+    }
+
+    int next_report_ms() const {
+        double left = config.report_seconds - seconds_since(period_start);
+        return std::max(0, static_cast<int>(left * 1000) + 1);
+    }
+
+    void accept_clients() {
+        while (config.max_clients == 0 || accepted < config.max_clients) {
+            int fd = accept4(server_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    perror("accept4");
+                return;
+            }
+
+            // the rates count from the first client on, not from when the server came up
+            if (accepted == 0) {
+                start = server_clock::now();
+                period_start = start;
+            }
+
+            uint64_t id = next_id++;
+            client_t& c = clients[id];
+            c.fd = fd;
+            c.since = server_clock::now();
+            watch(fd, id, EPOLLIN);
+            accepted++;
+        }
+        // every client it may serve is in, the rest wait in the backlog until the server is gone.
+        // still watched, the listening socket would wake the loop for them forever
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, server_fd, nullptr) < 0) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+    }
+
+    void on_client(uint64_t id, uint32_t events) {
+        auto it = clients.find(id);
+        if (it == clients.end())
+            return;
+        client_t& c = it->second;
+
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            drop(id, "connection lost");
+            return;
+        }
+        if ((events & EPOLLIN) && !read_client(id, c))
+            return;
+        if (events & EPOLLOUT)
+            flush(id, c);
+    }
+
+    // handshake bytes, false once the client is gone
+    bool read_client(uint64_t id, client_t& c) {
+        while (true) {
+            size_t wanted = c.state == CLIENT_HELLO ? STRIPE_HELLO_BYTES : c.state == CLIENT_REQUEST ? INPUT_REQUEST_BYTES : 1;
+            size_t have = c.in.size();
+            c.in.resize(wanted);
+            ssize_t n = recv(c.fd, c.in.data() + have, wanted - have, 0);
+            if (n < 0) {
+                c.in.resize(have);
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                    return true;
+                drop(id, strerror(errno));
+                return false;
+            }
+            if (n == 0) {
+                drop(id, "closed by the client");
+                return false;
+            }
+            c.in.resize(have + n);
+            if (c.in.size() < wanted)
+                continue;
+
+            if (c.state == CLIENT_HELLO) {
+                uint32_t asked = 0;
+                if (!stripes_parse_hello(c.in.data(), asked)) {
+                    drop(id, "bad hello");
+                    return false;
+                }
+                // connections of concurrent clients can't be told apart, every client gets one
+                uint32_t reply = stripes_agreed_reply(1);
+                queue(c, reinterpret_cast<const char*>(&reply), sizeof(reply));
+                c.state = CLIENT_REQUEST;
+            }
+            else if (c.state == CLIENT_REQUEST) {
+                c.forward = input_wanted(c.in.data(), img, &content_hash);
+                std::vector<uint8_t> reply;
+                input_reply(img, c.forward, reply);
+                queue(c, reinterpret_cast<const char*>(reply.data()), reply.size());
+                c.state = CLIENT_STREAM;
+                c.total = (interior + config.band_rows - 1) / config.band_rows;
+                if (!stream_done(id, c))
+                    return false;
+            }
+            else {
+                drop(id, "sent data while streaming");
+                return false;
+            }
+            c.in.clear();
+            if (!flush(id, c))
+                return false;
+        }
+    }
+
+    void queue(client_t& c, const char* bytes, size_t len) {
+        c.out.emplace_back(bytes, bytes + len);
+        c.queued += len;
+    }
+
+    // writes what the socket takes, false once the client is gone (finished or dropped)
+    bool flush(uint64_t id, client_t& c) {
+        while (!c.out.empty()) {
+            iovec iov[MAX_IOV];
+            int count = 0;
+            for (auto it = c.out.begin(); it != c.out.end() && count < MAX_IOV; ++it, ++count) {
+                size_t skip = count == 0 ? c.out_head : 0;
+                iov[count].iov_base = it->data() + skip;
+                iov[count].iov_len = it->size() - skip;
+            }
+
+            msghdr msg{};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            ssize_t n = sendmsg(c.fd, &msg, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    drop(id, strerror(errno));
+                    return false;
+                }
+                break;
+            }
+
+            c.queued -= n;
+            c.wire_bytes += n;
+            period_bytes += n;
+            total_bytes += n;
+
+            size_t left = static_cast<size_t>(n);
+            while (left > 0) {
+                size_t rest = c.out.front().size() - c.out_head;
+                if (left < rest) {
+                    c.out_head += left;
+                    break;
+                }
+                left -= rest;
+                c.out.pop_front();
+                c.out_head = 0;
+            }
+        }
+
+        if (c.out.empty() && c.state == CLIENT_DRAIN) {
+            finish(id, c);
+            return false;
+        }
+
+        bool want = !c.out.empty();
+        if (want != c.writable_armed) {
+            epoll_event ev{};
+            ev.events = EPOLLIN | (want ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+            ev.data.u64 = id;
+            // left unarmed the queued frames would never go out, and the client would stall
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c.fd, &ev) < 0) {
+                drop(id, strerror(errno));
+                return false;
+            }
+            c.writable_armed = want;
+        }
+        return true;
+    }
+
+    // queues the terminal once every band is built, false if that finished the client
+    bool stream_done(uint64_t id, client_t& c) {
+        if (c.state != CLIENT_STREAM || c.built < c.total)
+            return true;
+
+        size_t len = build_terminal(c.total, terminal.data() + STRIPE_PREFIX_BYTES);
+        uint32_t prefix = static_cast<uint32_t>(len);
+        memcpy(terminal.data(), &prefix, sizeof(prefix));
+        queue(c, terminal.data(), STRIPE_PREFIX_BYTES + len);
+        c.state = CLIENT_DRAIN;
+        return flush(id, c);
+    }
+
+    void take_frames() {
+        uint64_t count;
+        while (read(wake_fd, &count, sizeof(count)) > 0)
+            ;
+
+        std::deque<built_frame_t> frames;
+        pool->collect(frames);
+        for (built_frame_t& f : frames) {
+            in_pool--;
+            auto it = clients.find(f.job.client);
+            if (it == clients.end())
+                continue;       // dropped while its band was built
+            client_t& c = it->second;
+
+            c.building -= config.max_frame_bytes;
+            c.built++;
+            c.queued += f.bytes.size();
+            c.out.push_back(std::move(f.bytes));
+            if (flush(f.job.client, c))
+                stream_done(f.job.client, c);
+        }
+    }
+
+    // a client may have another band built while its queue and the bands in the pool stay
+    // under client_queue_bytes. a client with nothing queued always may, however small that is
+    bool has_room(const client_t& c) const {
+        if (c.state != CLIENT_STREAM || c.issued == c.total)
+            return false;
+        size_t held = c.queued + c.building;
+        return held == 0 || held + config.max_frame_bytes <= config.client_queue_bytes;
+    }
+
+    // the first client from next_turn on, wrapping around, that has room. clients.end() if none
+    std::map<uint64_t, client_t>::iterator next_with_room() {
+        for (auto it = clients.lower_bound(next_turn); it != clients.end(); ++it)
+            if (has_room(it->second))
+                return it;
+        for (auto it = clients.begin(); it != clients.end() && it->first < next_turn; ++it)
+            if (has_room(it->second))
+                return it;
+        return clients.end();
+    }
+
+    // hands bands to the pool, a band per client in turn
+    void dispatch() {
+        while (in_pool < std::max(1, config.workers) * POOL_DEPTH) {
+            auto it = next_with_room();
+            if (it == clients.end())
+                return;
+
+            client_t& c = it->second;
+            band_job_t job;
+            job.client = it->first;
+            job.sequence = c.issued++;
+            job.start_row = c.next_row;
+            job.num_rows = std::min(config.band_rows, interior + 1 - c.next_row);
+            job.forward = c.forward;
+            job.compress = c.queued >= config.compress_backlog;
+            c.next_row += job.num_rows;
+            c.building += config.max_frame_bytes;
+
+            pool->submit(job);
+            in_pool++;
+            next_turn = it->first + 1;
+        }
+    }
+
+    void finish(uint64_t id, client_t& c) {
+        printf("server: client %llu done, %d bands, %.2f MB in %.1f ms%s\n", static_cast<unsigned long long>(id - FIRST_CLIENT),
+               c.total, c.wire_bytes / 1e6, seconds_since(c.since) * 1000, c.forward ? ", input forwarded" : "");
+        fflush(stdout);
+        close(c.fd);
+        clients.erase(id);
+        period_images++;
+        total_images++;
+    }
+
+    void drop(uint64_t id, const char* why) {
+        auto it = clients.find(id);
+        fprintf(stderr, "server: client %llu dropped: %s\n", static_cast<unsigned long long>(id - FIRST_CLIENT), why);
+        close(it->second.fd);
+        clients.erase(it);
+        dropped++;
+    }
+
+    void report_period() {
+        double secs = seconds_since(period_start);
+        if (period_images > 0 || period_bytes > 0 || !clients.empty()) {
+            printf("server: %zu client(s) connected, %.2f images/s, %.2f MB/s over the last %.1f s\n",
+                   clients.size(), period_images / secs, period_bytes / 1e6 / secs, secs);
+            fflush(stdout);
+        }
+        period_start = server_clock::now();
+        period_images = 0;
+        period_bytes = 0;
+    }
+
+    void report_total() {
+        double secs = accepted > 0 ? seconds_since(start) : 0;
+        if (secs <= 0)
+            secs = 1;
+        printf("server: %s, %llu image(s) served, %llu client(s) dropped in %.2f s: %.2f images/s, %.2f MB/s\n",
+               stopping ? "interrupted" : "done", static_cast<unsigned long long>(total_images), static_cast<unsigned long long>(dropped),
+               secs, total_images / secs, total_bytes / 1e6 / secs);
+        fflush(stdout);
+    }
+
+    int server_fd;
+    band_server_config_t config;
+    const image_t* img;
+    terminal_frame_fn build_terminal;
+    uint64_t content_hash = 0;
+    int interior = 0;                   // rows 1 .. height-2, 0 for an image too small to band
+
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    int signal_fd = -1;
+    sigset_t saved_mask;
+    std::unique_ptr<framePool> pool;
+    std::vector<char> terminal;
+
+    std::map<uint64_t, client_t> clients;
+    uint64_t next_id = FIRST_CLIENT;
+    uint64_t next_turn = FIRST_CLIENT;  // dispatch starts looking here, round robin
+    int accepted = 0;
+    int in_pool = 0;
+    bool stopping = false;
+
+    server_clock::time_point start, period_start;
+    uint64_t period_images = 0, period_bytes = 0;
+    uint64_t total_images = 0, total_bytes = 0, dropped = 0;
+};
+
+
+void serve_bands(int server_fd, const band_server_config_t& config, const image_t* img, const band_frame_fn& build_frame, const terminal_frame_fn& build_terminal) {
+    bandServer server(server_fd, config, img, build_frame, build_terminal);
+    server.run();
+}
@@ -0,0 +1,52 @@
+#ifndef BANDSERVER_H
+#define BANDSERVER_H
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include "libppm.h"
+
+// long-running A side of the split deployment (part3): one epoll loop accepts any number of B
+// clients and serves each of them the image A was started with, the bands of all of them built
+// by one shared pool of worker threads.
+//
+// a client is an ordinary B. it goes through the stripes hello (include/tcpStripes.h), which the
+// server always answers with one connection, and the input exchange (include/remoteInput.h),
+// then gets its frames behind their length and a terminal, like from the one-shot A.
+//
+// every socket is non-blocking. a client's frames queue in the server until its socket takes
+// them and bands are only built for a client with less than client_queue_bytes queued or being
+// built, so a slow receiver holds back its own bands and not the pool. the pool picks clients
+// round robin, a band each.
+
+// one band of one client, what the program builds a frame for
+typedef struct band_job_t {
+    uint64_t client;
+    int32_t sequence;       // of the frame in the client's stream
+    int start_row;
+    int num_rows;
+    bool forward;           // the client has no copy of the input, the band's rows go with it
+    bool compress;          // the client's queue backs up, worth encoding the band
+} band_job_t;
+
+// builds the frame of job into frame (room for max_frame_bytes), returns its length. runs on
+// pool thread worker (0 .. workers-1), state it keeps must be per worker
+typedef std::function<size_t(int worker, const band_job_t& job, char* frame)> band_frame_fn;
+
+// the terminal announcing total data frames into frame, returns its length. runs on the loop
+typedef std::function<size_t(int32_t total, char* frame)> terminal_frame_fn;
+
+typedef struct band_server_config_t {
+    int workers;                // pool threads building frames
+    int band_rows;              // rows per band
+    size_t max_frame_bytes;     // largest frame, with the input rows
+    size_t client_queue_bytes;  // per client, queued plus being built, before its bands wait
+    size_t compress_backlog;    // bytes queued for a client before its bands are encoded, 0: always
+    int max_clients;            // clients served before the server returns, 0: until SIGINT / SIGTERM
+    double report_seconds;      // between throughput lines
+} band_server_config_t;
+
+// serves img to clients connecting to the listening socket server_fd, returns once max_clients
+// are done or on SIGINT / SIGTERM. exits if the loop can't be set up
+void serve_bands(int server_fd, const band_server_config_t& config, const image_t* img, const band_frame_fn& build_frame, const terminal_frame_fn& build_terminal);
+
+#endif
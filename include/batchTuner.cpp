@@ -0,0 +1,53 @@
+#include "batchTuner.h"
+#include <algorithm>
+#include <iostream>
+
+// packets faster than this are mostly lock/wakeup/header overhead
+static const double MIN_PACKET_LATENCY_US = 50.0;
+// packets slower than this delay the start of the downstream stages
+static const double MAX_PACKET_LATENCY_US = 2000.0;
+
+static const std::size_t MIN_TARGET_BYTES = 4 * 1024;
+static const std::size_t MAX_TARGET_BYTES = 1024 * 1024;   // ~ L2 size, keep the packet cache resident
+
+batchTuner::batchTuner(std::size_t target_bytes_, std::size_t bytes_per_row_, int max_rows_):
+    target(std::min(std::max(target_bytes_, MIN_TARGET_BYTES), MAX_TARGET_BYTES)),
+    bytes_per_row(std::max<std::size_t>(1, bytes_per_row_)),
+    max_rows(std::max(1, max_rows_)),
+    packet_count(0), rows_sent(0), ewma_latency_us(0.0)
+{}
+
+int batchTuner::next_rows() const {
+    std::size_t rows = target / bytes_per_row;
+    return static_cast<int>(std::min<std::size_t>(std::max<std::size_t>(rows, 1), max_rows));
+}
+
+void batchTuner::observe(int rows, double latency_us, std::size_t occupancy, std::size_t capacity) {
+    packet_count++;
+    rows_sent += rows;
+
+    // smooth out scheduler noise before acting on it
+    ewma_latency_us = (packet_count == 1) ? latency_us : 0.75 * ewma_latency_us + 0.25 * latency_us;
+
+    bool starving = (occupancy == 0);
+    bool backlog  = (capacity > 0 && occupancy * 4 >= capacity * 3);
+
+    if (ewma_latency_us < MIN_PACKET_LATENCY_US || backlog) {
+        // overhead bound, or consumer is the bottleneck: fewer, larger packets
+        target = target + target / 4;
+    } else if (starving && ewma_latency_us > MAX_PACKET_LATENCY_US) {
+        // consumer waits on us: smaller packets get it going sooner
+        target = target - target / 4;
+    }
+
+    target = std::min(std::max(target, MIN_TARGET_BYTES), MAX_TARGET_BYTES);
+}
+
+double batchTuner::average_rows() const {
+    return packet_count ? static_cast<double>(rows_sent) / packet_count : 0.0;
+}
+
+void batchTuner::report(const char* who) const {
+    std::cout << who << ": adaptive batch " << next_rows() << " rows/packet (target " << target
+              << " B, avg " << average_rows() << " rows, " << packet_count << " packets)" << std::endl;
+}
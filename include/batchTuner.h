@@ -0,0 +1,37 @@
+#ifndef BATCHTUNER_H
+#define BATCHTUNER_H
+#include <cstddef>
+
+// picks the number of rows per packet at runtime.
+// the tuner steers towards a target packet size in bytes, growing it while the
+// per-packet stage latency is dominated by sync/header overhead and shrinking it
+// while the consumer is starving and a single packet takes too long to produce.
+class batchTuner {
+public:
+    batchTuner(std::size_t target_bytes_, std::size_t bytes_per_row_, int max_rows_);
+
+    // rows to put in the next packet
+    int next_rows() const;
+
+    // feed back the packet just produced: its row count, its latency (in microseconds) and
+    // the occupancy of the outgoing queue when it was pushed (same unit as capacity)
+    void observe(int rows, double latency_us, std::size_t occupancy, std::size_t capacity);
+
+    std::size_t target_bytes() const { return target; }
+    int packets() const { return packet_count; }
+    double average_rows() const;
+
+    // one line summary: "adaptive batch: 12 rows/packet (target 65536 B, avg 11.3 rows, 40 packets)"
+    void report(const char* who) const;
+
+private:
+    std::size_t target;
+    std::size_t bytes_per_row;
+    int max_rows;
+
+    int packet_count;
+    long long rows_sent;
+    double ewma_latency_us;
+};
+
+#endif
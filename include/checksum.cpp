@@ -0,0 +1,198 @@
+#include "checksum.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CHECKSUM_HAVE_SSE42 1
+#endif
+
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+
+static inline uint64_t load64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// -- FNV-1a ------------------------------------------------------------------
+
+static std::size_t fnv1a(const uint8_t* data, std::size_t len, int start_row, int num_rows) {
+    const std::size_t FNV_offset = 1469598103934665603ULL;
+    const std::size_t FNV_prime  = 1099511628211ULL;
+    std::size_t h = FNV_offset;
+
+    for (std::size_t k = 0; k < len; k++) {
+        h ^= static_cast<std::size_t>(data[k]);
+        h *= FNV_prime;
+    }
+
+    h ^= static_cast<std::size_t>(start_row + 0x9e3779b9);
+    h *= FNV_prime;
+    h ^= static_cast<std::size_t>(num_rows + 0x9e3779b9);
+    h *= FNV_prime;
+
+    return h;
+}
+
+// -- CRC32C (castagnoli) -----------------------------------------------------
+
+static uint32_t crc32c_table[8][256];
+
+// slicing-by-8 tables for the reflected polynomial 0x82F63B78
+static bool init_crc32c_table() {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+        crc32c_table[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++)
+        for (int t = 1; t < 8; t++)
+            crc32c_table[t][n] = (crc32c_table[t - 1][n] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][n] & 0xff];
+    return true;
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* p, std::size_t len) {
+    static const bool ready = init_crc32c_table();
+    (void)ready;
+
+    while (len >= 8) {
+        uint64_t v = load64(p) ^ crc;
+        crc = crc32c_table[7][v & 0xff] ^ crc32c_table[6][(v >> 8) & 0xff] ^
+              crc32c_table[5][(v >> 16) & 0xff] ^ crc32c_table[4][(v >> 24) & 0xff] ^
+              crc32c_table[3][(v >> 32) & 0xff] ^ crc32c_table[2][(v >> 40) & 0xff] ^
+              crc32c_table[1][(v >> 48) & 0xff] ^ crc32c_table[0][v >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#ifdef CHECKSUM_HAVE_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t* p, std::size_t len) {
+#if defined(__x86_64__)
+    uint64_t c = crc;
+    while (len >= 8) {
+        c = _mm_crc32_u64(c, load64(p));
+        p += 8;
+        len -= 8;
+    }
+    crc = static_cast<uint32_t>(c);
+#endif
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+static uint32_t crc32c_update(uint32_t crc, const uint8_t* p, std::size_t len) {
+#ifdef CHECKSUM_HAVE_SSE42
+    static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    if (has_sse42)
+        return crc32c_hw(crc, p, len);
+#endif
+    return crc32c_sw(crc, p, len);
+}
+
+static std::size_t crc32c(const uint8_t* data, std::size_t len, int start_row, int num_rows) {
+    int32_t position[2] = { start_row, num_rows };
+
+    uint32_t crc = 0xFFFFFFFFu;
+    crc = crc32c_update(crc, data, len);
+    crc = crc32c_update(crc, reinterpret_cast<const uint8_t*>(position), sizeof(position));
+    return static_cast<std::size_t>(~crc);
+}
+
+// -- wide64 ------------------------------------------------------------------
+// eight accumulators, each stripe lane does a 32x32->64 multiply of the keyed input,
+// there is no dependency between lanes so the loop maps onto simd multiplies (pmuludq)
+
+static const int WIDE_LANES = 8;
+static const std::size_t WIDE_STRIPE = WIDE_LANES * sizeof(uint64_t);
+
+static const uint64_t WIDE_KEYS[WIDE_LANES] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+    0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL
+};
+
+static inline uint64_t avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t mix_word(uint64_t h, uint64_t v) {
+    h ^= (v * PRIME64_2);
+    h = ((h << 27) | (h >> 37)) * PRIME64_1;
+    return h;
+}
+
+static std::size_t wide64(const uint8_t* data, std::size_t len, int start_row, int num_rows) {
+    uint64_t acc[WIDE_LANES] = {
+        PRIME64_3, PRIME64_1, PRIME64_2, PRIME64_1 ^ PRIME64_3,
+        PRIME64_2 ^ PRIME64_3, PRIME64_1 + PRIME64_2, PRIME64_3 + PRIME64_1, PRIME64_2 + PRIME64_3
+    };
+
+    const uint8_t* p = data;
+    std::size_t stripes = len / WIDE_STRIPE;
+
+    for (std::size_t s = 0; s < stripes; s++, p += WIDE_STRIPE) {
+        for (int k = 0; k < WIDE_LANES; k++) {
+            uint64_t v = load64(p + k * sizeof(uint64_t));
+            uint64_t keyed = v ^ WIDE_KEYS[k];
+            acc[k] += v + (keyed & 0xffffffffULL) * (keyed >> 32);
+        }
+    }
+
+    // fold the lanes, then the tail 8 bytes (or fewer) at a time
+    uint64_t h = static_cast<uint64_t>(len) * PRIME64_1;
+    for (int k = 0; k < WIDE_LANES; k++)
+        h = mix_word(h, acc[k]);
+
+    std::size_t rest = len - stripes * WIDE_STRIPE;
+    while (rest >= 8) {
+        h = mix_word(h, load64(p));
+        p += 8;
+        rest -= 8;
+    }
+    if (rest) {
+        uint64_t v = 0;
+        memcpy(&v, p, rest);
+        h = mix_word(h, v);
+    }
+
+    h = mix_word(h, (static_cast<uint64_t>(static_cast<uint32_t>(start_row)) << 32) | static_cast<uint32_t>(num_rows));
+    return static_cast<std::size_t>(avalanche(h));
+}
+
+// ----------------------------------------------------------------------------
+
+std::size_t packet_checksum(checksum_algo algo, const uint8_t* data, std::size_t len, int start_row, int num_rows) {
+    switch (algo) {
+    case CHECKSUM_FNV1A:  return fnv1a(data, len, start_row, num_rows);
+    case CHECKSUM_CRC32C: return crc32c(data, len, start_row, num_rows);
+    case CHECKSUM_WIDE64: return wide64(data, len, start_row, num_rows);
+    case CHECKSUM_NONE:   break;
+    }
+    return 0;
+}
+
+bool checksum_algo_valid(uint8_t algo) {
+    return algo <= CHECKSUM_WIDE64;
+}
+
+const char* checksum_name(checksum_algo algo) {
+    switch (algo) {
+    case CHECKSUM_FNV1A:  return "fnv1a";
+    case CHECKSUM_CRC32C: return "crc32c";
+    case CHECKSUM_WIDE64: return "wide64";
+    case CHECKSUM_NONE:   return "none";
+    }
+    return "unknown";
+}
@@ -0,0 +1,24 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+#include <cstddef>
+#include <cstdint>
+
+// packet checksums. every engine covers the payload and then mixes in start_row and
+// num_rows, so identical pixels in different rows still checksum differently.
+// the value is recorded on the wire next to the hash, a receiver verifies with whatever
+// the sender used.
+enum checksum_algo : uint8_t {
+    CHECKSUM_FNV1A  = 0,    // byte at a time, one serial multiply chain (the original)
+    CHECKSUM_CRC32C = 1,    // sse4.2 crc32 instruction 8 bytes at a time, table driven fallback
+    CHECKSUM_WIDE64 = 2,    // 8 independent 64-bit lanes over 64 byte stripes, vectorizes
+    CHECKSUM_NONE   = 0xFF  // sender skipped this packet (sampled integrity), hash is meaningless
+};
+
+std::size_t packet_checksum(checksum_algo algo, const uint8_t* data, std::size_t len, int start_row, int num_rows);
+
+// false for values no engine here knows (a corrupted or foreign header)
+bool checksum_algo_valid(uint8_t algo);
+
+const char* checksum_name(checksum_algo algo);
+
+#endif
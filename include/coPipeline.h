@@ -0,0 +1,148 @@
+#ifndef COPIPELINE_H
+#define COPIPELINE_H
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <optional>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "placement.h"
+
+// stackless pipeline stages (needs -std=c++20).
+// a stage is a coGenerator<T> that co_yields its packets; the next stage takes the
+// upstream generator and pulls from it, so on one thread handing a packet to the next
+// stage is a resume of the producer instead of a queue push + cross-core wakeup.
+// co_offload() moves any stage onto its own thread without touching the stage code.
+template <typename T>
+class coGenerator {
+public:
+    struct promise_type {
+        std::optional<T> current;
+        std::exception_ptr error;
+
+        coGenerator get_return_object() { return coGenerator(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+
+        std::suspend_always yield_value(T value) {
+            current.emplace(std::move(value));
+            return {};
+        }
+
+        void return_void() {}
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    struct sentinel {};
+
+    class iterator {
+    public:
+        explicit iterator(std::coroutine_handle<promise_type> h) : handle(h) {}
+
+        T& operator*() const { return *handle.promise().current; }
+        iterator& operator++() { advance(handle); return *this; }
+        bool operator==(sentinel) const { return !handle || handle.done(); }
+
+    private:
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    explicit coGenerator(std::coroutine_handle<promise_type> h) : handle(h) {}
+    coGenerator(coGenerator&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+    coGenerator(const coGenerator&) = delete;
+    coGenerator& operator=(const coGenerator&) = delete;
+    ~coGenerator() { if (handle) handle.destroy(); }
+
+    // runs the stage up to its first co_yield
+    iterator begin() { advance(handle); return iterator(handle); }
+    sentinel end() { return {}; }
+
+private:
+    static void advance(std::coroutine_handle<promise_type> h) {
+        h.promise().current.reset();
+        h.resume();
+        if (h.promise().error)
+            std::rethrow_exception(h.promise().error);
+    }
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+
+// bounded hand-off between the thread that drives an offloaded stage and its consumer
+template <typename T>
+struct coChannel {
+    std::deque<T> items;
+    std::mutex mtx;
+    std::condition_variable cv_fill, cv_empty;
+    std::size_t capacity;
+    bool closed = false;      // producer finished
+    bool cancelled = false;   // consumer went away
+
+    explicit coChannel(std::size_t capacity_) : capacity(capacity_) {}
+};
+
+// multithreaded executor: drives the upstream stage on its own thread (pinned to cpu if >= 0)
+// and yields what it produces, at most capacity items ahead of the consumer
+template <typename T>
+coGenerator<T> co_offload(coGenerator<T> upstream, std::size_t capacity, int cpu = -1) {
+    coChannel<T> chan(capacity);
+    std::exception_ptr error;
+
+    std::thread worker([&chan, &upstream, &error] {
+        try {
+            for (T& item : upstream) {
+                std::unique_lock<std::mutex> lock(chan.mtx);
+                chan.cv_empty.wait(lock, [&chan]{ return chan.items.size() < chan.capacity || chan.cancelled; });
+                if (chan.cancelled)
+                    break;
+                chan.items.push_back(std::move(item));
+                chan.cv_fill.notify_one();
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(chan.mtx);
+        chan.closed = true;
+        chan.cv_fill.notify_one();
+    });
+
+    if (cpu >= 0)
+        pin_thread_to_cpu(worker.native_handle(), cpu);
+
+    // stops and joins the worker even if the consumer drops this generator half way
+    struct joiner {
+        coChannel<T>& chan;
+        std::thread& worker;
+        ~joiner() {
+            {
+                std::lock_guard<std::mutex> lock(chan.mtx);
+                chan.cancelled = true;
+            }
+            chan.cv_empty.notify_one();
+            worker.join();
+        }
+    } join_on_exit{chan, worker};
+
+    while (true) {
+        std::optional<T> item;
+        {
+            std::unique_lock<std::mutex> lock(chan.mtx);
+            chan.cv_fill.wait(lock, [&chan]{ return !chan.items.empty() || chan.closed; });
+            if (chan.items.empty())
+                break;
+            item.emplace(std::move(chan.items.front()));
+            chan.items.pop_front();
+        }
+        chan.cv_empty.notify_one();
+        co_yield std::move(*item);
+    }
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+#endif
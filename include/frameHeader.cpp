@@ -0,0 +1,70 @@
+#include "frameHeader.h"
+#include <algorithm>
+#include <cstring>
+
+void serialize_stage_header(char *dst, int32_t start_row, int32_t num_rows, int32_t cols_per_row, uint64_t hash, uint8_t hash_algo, uint8_t is_last, int32_t epoch, int32_t sequence) {
+
+    uint32_t payload_len = is_last ? 0 : static_cast<uint32_t>(std::max(0, num_rows)) * std::max(0, cols_per_row) * 3;
+    size_t off = 0;
+
+    memcpy(dst + off, &payload_len, sizeof(uint32_t)); off += sizeof(uint32_t);
+    memcpy(dst + off, &start_row, sizeof(int32_t)); off += sizeof(int32_t);
+    memcpy(dst + off, &num_rows, sizeof(int32_t));  off += sizeof(int32_t);
+    memcpy(dst + off, &cols_per_row, sizeof(int32_t)); off += sizeof(int32_t);
+    memcpy(dst + off, &epoch, sizeof(int32_t)); off += sizeof(int32_t);
+    memcpy(dst + off, &sequence, sizeof(int32_t)); off += sizeof(int32_t);
+    memcpy(dst + off, &hash, sizeof(uint64_t)); off += sizeof(uint64_t);
+    memcpy(dst + off, &hash_algo, sizeof(uint8_t)); off += sizeof(uint8_t);
+    memcpy(dst + off, &is_last, sizeof(uint8_t)); off += sizeof(uint8_t);
+
+    (void)off;
+}
+
+void deserialize_stage_header(const char *src, uint32_t &payload_len, int32_t &start_row, int32_t &num_rows, int32_t &cols_per_row, uint64_t &hash, uint8_t &hash_algo, uint8_t &is_last, int32_t &epoch, int32_t &sequence) {
+
+    size_t off = 0;
+
+    memcpy(&payload_len, src + off, sizeof(uint32_t)); off += sizeof(uint32_t);
+    memcpy(&start_row, src + off, sizeof(int32_t)); off += sizeof(int32_t);
+    memcpy(&num_rows, src + off, sizeof(int32_t));  off += sizeof(int32_t);
+    memcpy(&cols_per_row, src + off, sizeof(int32_t)); off += sizeof(int32_t);
+    memcpy(&epoch, src + off, sizeof(int32_t)); off += sizeof(int32_t);
+    memcpy(&sequence, src + off, sizeof(int32_t)); off += sizeof(int32_t);
+    memcpy(&hash, src + off, sizeof(uint64_t)); off += sizeof(uint64_t);
+    memcpy(&hash_algo, src + off, sizeof(uint8_t)); off += sizeof(uint8_t);
+    memcpy(&is_last, src + off, sizeof(uint8_t)); off += sizeof(uint8_t);
+
+    (void)off;
+}
+
+void serialize_net_header(char *dst, int32_t start_row, int32_t num_rows, int32_t cols_per_row, int32_t sequence, uint64_t hash, uint8_t hash_algo, uint8_t codec, uint8_t is_last) {
+
+    size_t off = 0;
+
+    memcpy(dst + off, &start_row, sizeof(int32_t)); off += sizeof(int32_t);
+    memcpy(dst + off, &num_rows, sizeof(int32_t));  off += sizeof(int32_t);
+    memcpy(dst + off, &cols_per_row, sizeof(int32_t)); off += sizeof(int32_t);
+    memcpy(dst + off, &sequence, sizeof(int32_t)); off += sizeof(int32_t);
+    memcpy(dst + off, &hash, sizeof(uint64_t)); off += sizeof(uint64_t);
+    memcpy(dst + off, &hash_algo, sizeof(uint8_t)); off += sizeof(uint8_t);
+    memcpy(dst + off, &codec, sizeof(uint8_t)); off += sizeof(uint8_t);
+    memcpy(dst + off, &is_last, sizeof(uint8_t)); off += sizeof(uint8_t);
+
+    (void)off;
+}
+
+void deserialize_net_header(const char *src, int32_t &start_row, int32_t &num_rows, int32_t &cols_per_row, int32_t &sequence, uint64_t &hash, uint8_t &hash_algo, uint8_t &codec, uint8_t &is_last) {
+
+    size_t off = 0;
+
+    memcpy(&start_row, src + off, sizeof(int32_t)); off += sizeof(int32_t);
+    memcpy(&num_rows, src + off, sizeof(int32_t));  off += sizeof(int32_t);
+    memcpy(&cols_per_row, src + off, sizeof(int32_t)); off += sizeof(int32_t);
+    memcpy(&sequence, src + off, sizeof(int32_t)); off += sizeof(int32_t);
+    memcpy(&hash, src + off, sizeof(uint64_t)); off += sizeof(uint64_t);
+    memcpy(&hash_algo, src + off, sizeof(uint8_t)); off += sizeof(uint8_t);
+    memcpy(&codec, src + off, sizeof(uint8_t)); off += sizeof(uint8_t);
+    memcpy(&is_last, src + off, sizeof(uint8_t)); off += sizeof(uint8_t);
+
+    (void)off;
+}
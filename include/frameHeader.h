@@ -0,0 +1,30 @@
+#ifndef FRAMEHEADER_H
+#define FRAMEHEADER_H
+#include <cstddef>
+#include <cstdint>
+
+// the headers in front of every block the stages hand each other, one definition for every
+// program that speaks them. all fields are host order, both ends are always these programs.
+
+// part2 (part2_2 pipes, part2_3 shm slots, include/pipeline.cpp transports):
+//   uint32_t payload_len, int32_t start_row, int32_t num_rows, int32_t cols_per_row, int32_t epoch,
+//   int32_t sequence, uint64_t hash, uint8_t hash_algo, uint8_t is_last
+// followed by payload_len bytes, num_rows * cols_per_row * 3 (none on markers, blocks are not padded).
+// is_last marks the end of an epoch / job, what the epoch of a marker means is up to the program
+const size_t STAGE_HDR_SIZE = sizeof(uint32_t) + sizeof(int32_t)*5 + sizeof(uint64_t) + sizeof(uint8_t)*2;
+
+// payload_len is derived from the rest
+void serialize_stage_header(char *dst, int32_t start_row, int32_t num_rows, int32_t cols_per_row, uint64_t hash, uint8_t hash_algo, uint8_t is_last, int32_t epoch, int32_t sequence = 0);
+void deserialize_stage_header(const char *src, uint32_t &payload_len, int32_t &start_row, int32_t &num_rows, int32_t &cols_per_row, uint64_t &hash, uint8_t &hash_algo, uint8_t &is_last, int32_t &epoch, int32_t &sequence);
+
+// part3 (frames on the A -> B links, behind the length include/tcpStripes.h puts in front):
+//   int32_t start_row, int32_t num_rows, int32_t cols_per_row, int32_t sequence, uint64_t hash,
+//   uint8_t hash_algo, uint8_t codec, uint8_t is_last
+// followed by the payload as codec encoded it (include/netCodec.h). a terminal is a header alone,
+// its sequence is the number of data frames sent on the link
+const size_t NET_HDR_SIZE = sizeof(int32_t)*4 + sizeof(uint64_t) + sizeof(uint8_t)*3;
+
+void serialize_net_header(char *dst, int32_t start_row, int32_t num_rows, int32_t cols_per_row, int32_t sequence, uint64_t hash, uint8_t hash_algo, uint8_t codec, uint8_t is_last);
+void deserialize_net_header(const char *src, int32_t &start_row, int32_t &num_rows, int32_t &cols_per_row, int32_t &sequence, uint64_t &hash, uint8_t &hash_algo, uint8_t &codec, uint8_t &is_last);
+
+#endif
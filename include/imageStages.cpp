@@ -0,0 +1,75 @@
+#include "imageStages.h"
+#include <cstddef>
+
+void smoothen_rows(const image_t* input, int start_row, int num_rows, uint8_t* smooth) {
+    int width = input->width;
+    size_t cols_per_row = static_cast<size_t>(width - 2);
+
+    int dir[9][2] = {
+        {-1,-1}, {-1, 0}, {-1, 1},
+        {0 ,-1}, {0 , 0}, {0 , 1},
+        {1 ,-1}, {1 , 0}, {1 , 1}
+    };
+
+    for (int r_off = 0; r_off < num_rows; r_off++) {
+        int r = start_row + r_off;
+        for (int col = 1, cidx = 0; col <= width - 2; col++, cidx++) {
+            int sumR = 0, sumG = 0, sumB = 0;
+            for (int k = 0; k < 9; ++k) {
+                int ii = r + dir[k][0];
+                int jj = col + dir[k][1];
+                sumR += input->image_pixels[ii][jj][0];
+                sumG += input->image_pixels[ii][jj][1];
+                sumB += input->image_pixels[ii][jj][2];
+            }
+            uint8_t *p = smooth + (r_off * cols_per_row + cidx) * 3;
+            p[0] = static_cast<uint8_t>(sumR / 9);
+            p[1] = static_cast<uint8_t>(sumG / 9);
+            p[2] = static_cast<uint8_t>(sumB / 9);
+        }
+    }
+}
+
+void find_details_rows(const image_t* input, int start_row, int num_rows, const uint8_t* smooth, uint8_t* details) {
+    size_t cols_per_row = static_cast<size_t>(input->width - 2);
+
+    for (int r_off = 0; r_off < num_rows; r_off++) {
+        int row_idx = start_row + r_off;
+        for (size_t cidx = 0; cidx < cols_per_row; cidx++) {
+
+            size_t idx = (r_off * cols_per_row + cidx) * 3;
+            const uint8_t* smooth_p = smooth + idx;
+            const uint8_t* orig_p = input->image_pixels[row_idx][1 + cidx];
+
+            int diffR = orig_p[0] - static_cast<int>(smooth_p[0]);
+            int diffG = orig_p[1] - static_cast<int>(smooth_p[1]);
+            int diffB = orig_p[2] - static_cast<int>(smooth_p[2]);
+
+            details[idx + 0] = static_cast<uint8_t>(diffR < 0 ? 0 : diffR);
+            details[idx + 1] = static_cast<uint8_t>(diffG < 0 ? 0 : diffG);
+            details[idx + 2] = static_cast<uint8_t>(diffB < 0 ? 0 : diffB);
+        }
+    }
+}
+
+void sharpen_rows(const image_t* input, image_t* output, int start_row, int num_rows, const uint8_t* details, int scaling_factor) {
+    size_t cols_per_row = static_cast<size_t>(input->width - 2);
+
+    for (int r_off = 0; r_off < num_rows; ++r_off) {
+        int i = start_row + r_off;
+        for (size_t cidx = 0; cidx < cols_per_row; ++cidx) {
+
+            const uint8_t* diff_p = details + (r_off * cols_per_row + cidx) * 3;
+            const uint8_t* in_p = input->image_pixels[i][1 + cidx];
+            uint8_t* out_p = output->image_pixels[i][1 + cidx];
+
+            int newR = in_p[0] + (scaling_factor * static_cast<int>(diff_p[0]));
+            int newG = in_p[1] + (scaling_factor * static_cast<int>(diff_p[1]));
+            int newB = in_p[2] + (scaling_factor * static_cast<int>(diff_p[2]));
+
+            out_p[0] = static_cast<uint8_t>(newR > 255 ? 255 : newR);
+            out_p[1] = static_cast<uint8_t>(newG > 255 ? 255 : newG);
+            out_p[2] = static_cast<uint8_t>(newB > 255 ? 255 : newB);
+        }
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef IMAGESTAGES_H
+#define IMAGESTAGES_H
+#include <cstdint>
+#include "libppm.h"
+
+// the S1/S2/S3 kernels on a band of rows, independent of how the rows travel.
+// a band is rows [start_row, start_row + num_rows) of the interior (rows 1 .. height-2),
+// packed as num_rows * (width - 2) RGB triplets, i.e. the layout of rowPacket::pixels
+
+// S1: 3x3 box blur of the input
+void smoothen_rows(const image_t* input, int start_row, int num_rows, uint8_t* smooth);
+
+// S2: input - smoothened, clamped at 0
+void find_details_rows(const image_t* input, int start_row, int num_rows, const uint8_t* smooth, uint8_t* details);
+
+// S3: input + scaling_factor * details, clamped at 255, written to output
+void sharpen_rows(const image_t* input, image_t* output, int start_row, int num_rows, const uint8_t* details, int scaling_factor);
+
+#endif
@@ -0,0 +1,97 @@
+#include "integrity.h"
+#include <iostream>
+#include <sstream>
+#include <random>
+#include <utility>
+
+linkIntegrity::linkIntegrity(std::string name_, integrity_policy_t policy_, checksum_algo algo_):
+    name(std::move(name_)), policy(policy_), algo(algo_), seed(std::random_device{}())
+{}
+
+// splitmix64 of the packet number, a lock free coin per packet for the random fraction
+static uint64_t mix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+bool linkIntegrity::pick() {
+    uint64_t n = n_packets++;
+
+    switch (policy.mode) {
+    case INTEGRITY_OFF:
+        return false;
+    case INTEGRITY_FULL:
+        return true;
+    case INTEGRITY_SAMPLED:
+        if (policy.every > 0)
+            return n % static_cast<uint64_t>(policy.every) == 0;
+        return static_cast<double>(mix(seed ^ n) >> 11) * 0x1.0p-53 < policy.fraction;
+    }
+    return true;
+}
+
+void linkIntegrity::seal(rowPacket& pkt, const uint8_t* payload, std::size_t len) {
+    if (!pick()) {
+        pkt.hash_algo = CHECKSUM_NONE;
+        pkt.hash = 0;
+        return;
+    }
+    pkt.hash_algo = algo;
+    pkt.hash = packet_checksum(algo, payload, len, pkt.start_row, pkt.num_rows);
+    n_sealed++;
+}
+
+bool linkIntegrity::check(const rowPacket& pkt, const uint8_t* payload, std::size_t len) {
+    if (policy.mode == INTEGRITY_OFF) {
+        n_skipped++;
+        return true;
+    }
+
+    if (pkt.hash_algo == CHECKSUM_NONE) {
+        if (policy.mode == INTEGRITY_FULL) {
+            n_failed++;
+            return false;
+        }
+        n_skipped++;
+        return true;
+    }
+
+    if (!checksum_algo_valid(pkt.hash_algo) ||
+        packet_checksum(static_cast<checksum_algo>(pkt.hash_algo), payload, len, pkt.start_row, pkt.num_rows) != pkt.hash) {
+        n_failed++;
+        return false;
+    }
+    n_verified++;
+    return true;
+}
+
+void linkIntegrity::report() const {
+    std::ostringstream out;
+    out << "integrity " << name << ": " << integrity_mode_name(policy.mode);
+    if (policy.mode == INTEGRITY_SAMPLED) {
+        if (policy.every > 0)
+            out << " 1/" << policy.every;
+        else
+            out << " " << policy.fraction * 100 << "%";
+    }
+    if (policy.mode != INTEGRITY_OFF)
+        out << " (" << checksum_name(algo) << ")";
+
+    if (n_sealed.load() > 0 || n_verified.load() + n_skipped.load() + n_failed.load() == 0)
+        out << ", sealed " << n_sealed.load() << " of " << n_packets.load();
+    if (n_verified.load() + n_skipped.load() + n_failed.load() > 0)
+        out << ", verified " << n_verified.load() << ", skipped " << n_skipped.load() << ", failed " << n_failed.load();
+    out << "\n";
+    std::cout << out.str() << std::flush;    // stage processes leave with _exit
+}
+
+const char* integrity_mode_name(integrity_mode mode) {
+    switch (mode) {
+    case INTEGRITY_OFF:     return "off";
+    case INTEGRITY_SAMPLED: return "sampled";
+    case INTEGRITY_FULL:    return "full";
+    }
+    return "unknown";
+}
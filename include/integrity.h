@@ -0,0 +1,69 @@
+#ifndef INTEGRITY_H
+#define INTEGRITY_H
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <string>
+
+#include "rowPacket.h"
+#include "checksum.h"
+
+// how much checksumming a link pays for. the sender decides per packet: a packet it picks
+// carries a checksum, any other one goes out as CHECKSUM_NONE, so the receiver needs no
+// agreement with the sender on which packets were sampled.
+enum integrity_mode {
+    INTEGRITY_OFF,      // never checksum
+    INTEGRITY_SAMPLED,  // every Nth packet, or a random fraction of them
+    INTEGRITY_FULL      // every packet, a packet without a checksum is a failure
+};
+
+typedef struct integrity_policy_t {
+    integrity_mode mode;
+    int every;          // sampled: checksum every Nth packet, 0 to use fraction instead
+    double fraction;    // sampled with every == 0: probability that a packet is checksummed
+} integrity_policy_t;
+
+// defaults by kind of link
+const integrity_policy_t INTEGRITY_THREADS = {INTEGRITY_OFF, 0, 0.0};         // queues, the rows never leave the address space
+const integrity_policy_t INTEGRITY_LOCAL_IPC = {INTEGRITY_SAMPLED, 8, 0.0};   // pipes and shm, same machine, kernel or page cache copies
+const integrity_policy_t INTEGRITY_NETWORK = {INTEGRITY_FULL, 1, 0.0};        // tcp, crosses a nic and possibly other machines
+
+
+// one end of a link, counts what it sealed / verified / skipped. thread safe.
+class linkIntegrity {
+public:
+    linkIntegrity(std::string name_, integrity_policy_t policy_, checksum_algo algo_);
+
+    // sender: sets hash and hash_algo of pkt, hash_algo = CHECKSUM_NONE if the policy skips it
+    void seal(rowPacket& pkt, const uint8_t* payload, std::size_t len);
+    void seal(rowPacket& pkt) { seal(pkt, pkt.pixels.data(), pkt.pixels.size()); }
+
+    // receiver: false if pkt carries a checksum that does not match (or none under INTEGRITY_FULL)
+    bool check(const rowPacket& pkt, const uint8_t* payload, std::size_t len);
+    bool check(const rowPacket& pkt) { return check(pkt, pkt.pixels.data(), pkt.pixels.size()); }
+
+    uint64_t verified() const { return n_verified.load(); }
+    uint64_t skipped() const { return n_skipped.load(); }
+    uint64_t failed() const { return n_failed.load(); }
+
+    // one line with the policy and the counters of this end
+    void report() const;
+
+private:
+    bool pick();
+
+    std::string name;
+    integrity_policy_t policy;
+    checksum_algo algo;
+    uint64_t seed;
+
+    std::atomic<uint64_t> n_packets{0};
+    std::atomic<uint64_t> n_sealed{0};
+    std::atomic<uint64_t> n_verified{0};
+    std::atomic<uint64_t> n_skipped{0};
+    std::atomic<uint64_t> n_failed{0};
+};
+
+const char* integrity_mode_name(integrity_mode mode);
+
+#endif
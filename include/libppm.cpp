@@ -25,7 +25,7 @@ uint8_t skip_blanks_comments_while_reading(ifstream *read_stream) {
 struct image_t *read_ppm_file(char *path_to_input_file) {
 	ifstream read_stream(path_to_input_file, ios::binary | ios::in);
 	if (read_stream.is_open()){
-		struct image_t *image = new struct image_t;
+		struct image_t *image = new struct image_t();
 
 		uint8_t val = skip_blanks_comments_while_reading(&read_stream); // 'P'
 		val = read_stream.get();										//'6'
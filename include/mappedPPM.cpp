@@ -0,0 +1,59 @@
+#include "mappedPPM.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+mappedPPM::mappedPPM(const char* path_, int height, int width, bool create) : file_path(path_) {
+    std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+    size_t pixel_bytes = static_cast<size_t>(height) * width * 3;
+    map_bytes = header.size() + pixel_bytes;
+
+    int fd = open(path_, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0644);
+    if (fd < 0) {
+        perror(path_);
+        exit(1);
+    }
+
+    struct stat st;
+    if (create && ftruncate(fd, static_cast<off_t>(map_bytes)) < 0) {
+        perror("ftruncate");
+        exit(1);
+    }
+    if (!create && (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) != map_bytes)) {
+        fprintf(stderr, "%s is no %dx%d image\n", path_, width, height);
+        exit(1);
+    }
+
+    void* p = mmap(nullptr, map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+    base = static_cast<char*>(p);
+
+    if (create)
+        memcpy(base, header.data(), header.size());
+
+    // the view: rows of pointers into the mapping, the pixels are never copied
+    uint8_t* pixels = reinterpret_cast<uint8_t*>(base + header.size());
+    view.height = height;
+    view.width = width;
+    view.image_pixels = new uint8_t**[height];
+    for (int i = 0; i < height; i++) {
+        view.image_pixels[i] = new uint8_t*[width];
+        for (int j = 0; j < width; j++)
+            view.image_pixels[i][j] = pixels + (static_cast<size_t>(i) * width + j) * 3;
+    }
+}
+
+mappedPPM::~mappedPPM() {
+    for (int i = 0; i < view.height; i++)
+        delete[] view.image_pixels[i];
+    delete[] view.image_pixels;
+    munmap(base, map_bytes);
+}
@@ -0,0 +1,32 @@
+#ifndef MAPPEDPPM_H
+#define MAPPEDPPM_H
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "libppm.h"
+
+// a binary PPM file mapped MAP_SHARED, with an image_t whose pixel pointers point into the
+// mapping. every process that maps the same file writes straight into the output file, so
+// a stage can put its results in place and only tell the parent which rows are done.
+// the file has the layout write_ppm_file produces.
+class mappedPPM {
+public:
+    // create: (re)creates path as a height x width image, otherwise maps the existing file,
+    // which has to be that size. exits on error
+    mappedPPM(const char* path_, int height, int width, bool create);
+    ~mappedPPM();
+
+    mappedPPM(const mappedPPM&) = delete;
+    mappedPPM& operator=(const mappedPPM&) = delete;
+
+    image_t* image() { return &view; }
+    const char* path() const { return file_path.c_str(); }
+
+private:
+    std::string file_path;
+    image_t view;
+    char* base;             // header followed by height * width * 3 pixel bytes
+    size_t map_bytes;
+};
+
+#endif
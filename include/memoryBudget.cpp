@@ -0,0 +1,58 @@
+#include "memoryBudget.h"
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+
+memoryBudget::memoryBudget(int num_edges, std::size_t edge_limit_, std::size_t pipeline_limit_):
+    edge_cap(edge_limit_), pipeline_cap(pipeline_limit_),
+    edge_bytes(num_edges, 0), edge_peak(num_edges, 0),
+    total_bytes(0), total_peak(0), waits(0)
+{}
+
+void memoryBudget::acquire(int edge, std::size_t bytes) {
+    std::unique_lock<std::mutex> lock(mtx);
+
+    auto fits = [this, edge, bytes]{
+        if (edge_bytes[edge] == 0)
+            return true;
+        return edge_bytes[edge] + bytes <= edge_cap && total_bytes + bytes <= pipeline_cap;
+    };
+
+    if (!fits()) {
+        waits++;
+        cv.wait(lock, fits);
+    }
+
+    edge_bytes[edge] += bytes;
+    total_bytes += bytes;
+    edge_peak[edge] = std::max(edge_peak[edge], edge_bytes[edge]);
+    total_peak = std::max(total_peak, total_bytes);
+}
+
+void memoryBudget::release(int edge, std::size_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        edge_bytes[edge] -= bytes;
+        total_bytes -= bytes;
+    }
+    // producers of every edge may be waiting on the pipeline limit
+    cv.notify_all();
+}
+
+std::size_t memoryBudget::in_flight(int edge) const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return edge_bytes[edge];
+}
+
+void memoryBudget::report(const char* who) const {
+    std::lock_guard<std::mutex> lock(mtx);
+
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(1) << who << ": memory budget peak";
+    for (std::size_t e = 0; e < edge_peak.size(); e++)
+        line << " edge" << e << " " << edge_peak[e] / 1024.0 << " KiB,";
+    line << " pipeline " << total_peak / 1024.0 << " KiB of " << pipeline_cap / 1024.0 << " KiB"
+         << " (edge limit " << edge_cap / 1024.0 << " KiB, producers blocked " << waits << "x)";
+    std::cout << line.str() << std::endl;
+}
@@ -0,0 +1,40 @@
+#ifndef MEMORYBUDGET_H
+#define MEMORYBUDGET_H
+#include <cstddef>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+// backpressure in bytes instead of packets: every edge of a pipeline has a byte limit and
+// all edges together share a pipeline wide limit. a producer blocks in acquire() until its
+// packet fits both; the consumer gives the bytes back with release() once it popped it.
+// an edge with nothing in flight always admits one packet, so an oversized packet, or a
+// pipeline budget held up in one edge, can't deadlock the stage that would drain it.
+class memoryBudget {
+public:
+    memoryBudget(int num_edges, std::size_t edge_limit_, std::size_t pipeline_limit_);
+
+    void acquire(int edge, std::size_t bytes);
+    void release(int edge, std::size_t bytes);
+
+    std::size_t in_flight(int edge) const;
+    std::size_t edge_limit() const { return edge_cap; }
+
+    // peak bytes per edge and for the whole pipeline, and how often producers had to wait
+    void report(const char* who) const;
+
+private:
+    mutable std::mutex mtx;
+    std::condition_variable cv;
+
+    std::size_t edge_cap;
+    std::size_t pipeline_cap;
+
+    std::vector<std::size_t> edge_bytes;
+    std::vector<std::size_t> edge_peak;
+    std::size_t total_bytes;
+    std::size_t total_peak;
+    long long waits;
+};
+
+#endif
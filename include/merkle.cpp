@@ -0,0 +1,244 @@
+#include "merkle.h"
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+int merkle_band_count(int height, int band_rows) {
+    int interior = std::max(0, height - 2);
+    return (interior + band_rows - 1) / band_rows;
+}
+
+void merkle_band_rows(int height, int band_rows, int band, int& first_row, int& num_rows) {
+    first_row = 1 + band * band_rows;
+    num_rows = std::max(0, std::min(band_rows, (height - 1) - first_row));
+}
+
+uint64_t merkle_leaf(const image_t* image, int band_rows, int band, checksum_algo algo) {
+    int first_row, num_rows;
+    merkle_band_rows(image->height, band_rows, band, first_row, num_rows);
+
+    // pixels are not contiguous in image_t, gather the band first
+    int cols = std::max(0, image->width - 2);
+    std::vector<uint8_t> buf(static_cast<size_t>(num_rows) * cols * 3);
+    uint8_t* dst = buf.data();
+    for (int r = first_row; r < first_row + num_rows; r++) {
+        for (int c = 1; c <= cols; c++) {
+            memcpy(dst, image->image_pixels[r][c], 3);
+            dst += 3;
+        }
+    }
+    return packet_checksum(algo, buf.data(), buf.size(), first_row, num_rows);
+}
+
+// inner node: the checksum engine over both children, the level goes in as "start_row"
+static uint64_t merkle_node(checksum_algo algo, int level, uint64_t left, uint64_t right) {
+    uint64_t pair[2] = { left, right };
+    return packet_checksum(algo, reinterpret_cast<const uint8_t*>(pair), sizeof(pair), level, 2);
+}
+
+void merkle_build_levels(merkleTree& tree) {
+    tree.levels.resize(1);
+    if (tree.levels[0].empty())
+        tree.levels[0].push_back(0);
+
+    while (tree.levels.back().size() > 1) {
+        const std::vector<uint64_t>& below = tree.levels.back();
+        int level = static_cast<int>(tree.levels.size());
+        std::vector<uint64_t> above;
+        for (size_t i = 0; i < below.size(); i += 2)
+            above.push_back(i + 1 < below.size() ? merkle_node(tree.algo, level, below[i], below[i + 1]) : below[i]);
+        tree.levels.push_back(std::move(above));
+    }
+}
+
+merkleTree merkle_tree_of_image(const image_t* image, int band_rows, int threads, checksum_algo algo) {
+    merkleTree tree{algo, band_rows, image->height, image->width, {}};
+    int bands = merkle_band_count(image->height, band_rows);
+    tree.levels.assign(1, std::vector<uint64_t>(bands, 0));
+
+    // bands interleaved over the threads, every thread writes its own leaves
+    threads = std::max(1, std::min(threads, bands));
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&tree, image, band_rows, algo, bands, threads, t]{
+            for (int b = t; b < bands; b += threads)
+                tree.levels[0][b] = merkle_leaf(image, band_rows, b, algo);
+        });
+    }
+    for (std::thread& w : workers)
+        w.join();
+
+    merkle_build_levels(tree);
+    return tree;
+}
+
+bool merkle_diff(const merkleTree& a, const merkleTree& b, std::vector<int>& bad_bands, int& comparisons) {
+    bad_bands.clear();
+    comparisons = 0;
+    if (a.algo != b.algo || a.band_rows != b.band_rows || a.height != b.height || a.width != b.width || a.levels.size() != b.levels.size())
+        return false;
+
+    // (level, index) of nodes that differ, children of a carried up node sit at the same index
+    std::vector<std::pair<size_t, size_t>> todo;
+    todo.push_back({a.levels.size() - 1, 0});
+    while (!todo.empty()) {
+        auto [level, idx] = todo.back();
+        todo.pop_back();
+
+        comparisons++;
+        if (a.levels[level][idx] == b.levels[level][idx])
+            continue;
+        if (level == 0) {
+            bad_bands.push_back(static_cast<int>(idx));
+            continue;
+        }
+        for (size_t child = 2 * idx; child <= 2 * idx + 1 && child < a.levels[level - 1].size(); child++)
+            todo.push_back({level - 1, child});
+    }
+    std::sort(bad_bands.begin(), bad_bands.end());
+    return true;
+}
+
+std::string merkle_hex(uint64_t value) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016" PRIx64, value);
+    return buf;
+}
+
+bool write_merkle_sidecar(const std::string& path, const merkleTree& tree) {
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+        perror("merkle sidecar");
+        return false;
+    }
+    fprintf(f, "merkle %s band_rows %d height %d width %d bands %d\n", checksum_name(tree.algo), tree.band_rows, tree.height, tree.width, tree.bands());
+    for (uint64_t leaf : tree.levels[0])
+        fprintf(f, "%s\n", merkle_hex(leaf).c_str());
+    fprintf(f, "root %s\n", merkle_hex(tree.root()).c_str());
+    return fclose(f) == 0;
+}
+
+bool read_merkle_sidecar(const std::string& path, merkleTree& tree) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f)
+        return false;
+
+    char algo_name[16];
+    int bands;
+    bool ok = fscanf(f, "merkle %15s band_rows %d height %d width %d bands %d", algo_name, &tree.band_rows, &tree.height, &tree.width, &bands) == 5 && bands >= 0;
+
+    tree.algo = CHECKSUM_NONE;
+    for (uint8_t a = 0; ok && checksum_algo_valid(a); a++)
+        if (strcmp(algo_name, checksum_name(static_cast<checksum_algo>(a))) == 0)
+            tree.algo = static_cast<checksum_algo>(a);
+    ok = ok && tree.algo != CHECKSUM_NONE;
+
+    tree.levels.assign(1, std::vector<uint64_t>());
+    for (int b = 0; ok && b < bands; b++) {
+        uint64_t leaf;
+        ok = fscanf(f, " %" SCNx64, &leaf) == 1;
+        tree.levels[0].push_back(leaf);
+    }
+    uint64_t root = 0;
+    ok = ok && fscanf(f, " root %" SCNx64, &root) == 1;
+    fclose(f);
+    if (!ok)
+        return false;
+
+    // the leaves must reproduce the recorded root
+    merkle_build_levels(tree);
+    return tree.root() == root;
+}
+
+
+imageMerkle::imageMerkle(const image_t* image_, int band_rows_, int hasher_threads, checksum_algo algo_):
+    image(image_), tree{algo_, band_rows_, image_->height, image_->width, {}}
+{
+    int bands = merkle_band_count(image->height, band_rows_);
+    tree.levels.assign(1, std::vector<uint64_t>(bands, 0));
+
+    rows_missing.resize(bands);
+    for (int b = 0; b < bands; b++) {
+        int first_row;
+        merkle_band_rows(image->height, band_rows_, b, first_row, rows_missing[b]);
+    }
+
+    for (int t = 0; t < std::max(1, hasher_threads); t++)
+        hashers.emplace_back(&imageMerkle::hasher, this);
+}
+
+imageMerkle::~imageMerkle() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    cv_work.notify_all();
+    for (std::thread& t : hashers)
+        t.join();
+}
+
+void imageMerkle::hasher() {
+    std::unique_lock<std::mutex> lock(mtx);
+    while (true) {
+        cv_work.wait(lock, [this]{ return !ready.empty() || stopping; });
+        if (ready.empty())
+            return;
+
+        int band = ready.front();
+        ready.pop_front();
+        in_progress++;
+
+        lock.unlock();
+        uint64_t leaf = merkle_leaf(image, tree.band_rows, band, tree.algo);
+        lock.lock();
+
+        tree.levels[0][band] = leaf;
+        in_progress--;
+        if (ready.empty() && in_progress == 0)
+            cv_idle.notify_all();
+    }
+}
+
+void imageMerkle::rows_done(int start_row, int num_rows) {
+    bool queued = false;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (int r = std::max(1, start_row); r < start_row + num_rows && r < image->height - 1; r++) {
+            int band = (r - 1) / tree.band_rows;
+            if (rows_missing[band] > 0 && --rows_missing[band] == 0) {
+                ready.push_back(band);
+                queued = true;
+            }
+        }
+    }
+    if (queued)
+        cv_work.notify_all();
+}
+
+const merkleTree& imageMerkle::finish() {
+    std::unique_lock<std::mutex> lock(mtx);
+    if (finished)
+        return tree;
+
+    for (size_t b = 0; b < rows_missing.size(); b++) {
+        if (rows_missing[b] > 0) {
+            rows_missing[b] = 0;
+            ready.push_back(static_cast<int>(b));
+        }
+    }
+    cv_work.notify_all();
+    cv_idle.wait(lock, [this]{ return ready.empty() && in_progress == 0; });
+
+    merkle_build_levels(tree);
+    finished = true;
+    return tree;
+}
+
+void imageMerkle::report(const char* who) const {
+    std::ostringstream out;
+    out << who << ": merkle root " << merkle_hex(tree.root()) << " (" << tree.bands() << " bands of " << tree.band_rows << " rows, " << checksum_name(tree.algo) << ")\n";
+    std::cout << out.str();
+}
@@ -0,0 +1,88 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "libppm.h"
+#include "checksum.h"
+
+// whole image integrity: a hash tree over bands of band_rows rows.
+// a leaf covers the interior pixels (rows 1..height-2, columns 1..width-2, what imgcmp
+// compares) of one band, an inner node the pair of its children, an odd node is carried up.
+// two images match iff their roots match, and a mismatch is narrowed down to the bad bands
+// by walking only the differing subtrees.
+typedef struct merkleTree {
+    checksum_algo algo;
+    int band_rows;
+    int height;
+    int width;
+    std::vector<std::vector<uint64_t>> levels;    // levels[0] the leaves, levels.back() the root
+
+    int bands() const { return levels.empty() ? 0 : static_cast<int>(levels[0].size()); }
+    uint64_t root() const { return levels.empty() ? 0 : levels.back()[0]; }
+} merkleTree;
+
+int merkle_band_count(int height, int band_rows);
+
+// first interior row of band and the number of rows in it
+void merkle_band_rows(int height, int band_rows, int band, int& first_row, int& num_rows);
+
+// the leaf of one band, straight from the image
+uint64_t merkle_leaf(const image_t* image, int band_rows, int band, checksum_algo algo);
+
+// fills the inner levels from levels[0]
+void merkle_build_levels(merkleTree& tree);
+
+// hashes the bands of a finished image on threads threads
+merkleTree merkle_tree_of_image(const image_t* image, int band_rows, int threads, checksum_algo algo = CHECKSUM_WIDE64);
+
+// bands whose leaves differ, found top down; comparisons counts the node compares it took.
+// false if the trees don't have the same shape (size, band_rows or algo)
+bool merkle_diff(const merkleTree& a, const merkleTree& b, std::vector<int>& bad_bands, int& comparisons);
+
+// text sidecar: shape, leaves and root, one hex value per line
+bool write_merkle_sidecar(const std::string& path, const merkleTree& tree);
+bool read_merkle_sidecar(const std::string& path, merkleTree& tree);
+
+std::string merkle_hex(uint64_t value);
+
+
+// builds the tree while the pipeline writes the image. the writer reports rows as they land
+// in the image, a band is hashed on one of the hasher threads as soon as all its rows are in.
+class imageMerkle {
+public:
+    imageMerkle(const image_t* image_, int band_rows_, int hasher_threads, checksum_algo algo_ = CHECKSUM_WIDE64);
+    ~imageMerkle();
+
+    // rows [start_row, start_row + num_rows) of the interior are final. thread safe
+    void rows_done(int start_row, int num_rows);
+
+    // waits for the hashers (bands that never completed are hashed as they are) and builds the tree
+    const merkleTree& finish();
+
+    // "merkle root <hex> (N bands of R rows, wide64)"
+    void report(const char* who) const;
+
+private:
+    void hasher();
+
+    const image_t* image;
+    merkleTree tree;
+    std::vector<int> rows_missing;      // per band
+
+    std::mutex mtx;
+    std::condition_variable cv_work, cv_idle;
+    std::deque<int> ready;              // complete bands waiting for a hasher
+    int in_progress = 0;
+    bool stopping = false;
+    bool finished = false;
+    std::vector<std::thread> hashers;
+};
+
+#endif
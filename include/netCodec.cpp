@@ -0,0 +1,330 @@
+#include "netCodec.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+static const char* const CODEC_NAMES[NET_CODEC_COUNT] = {"raw", "zero-run", "pack", "delta-pack"};
+
+const char* net_codec_name(net_codec codec) {
+    return codec < NET_CODEC_COUNT ? CODEC_NAMES[codec] : "unknown";
+}
+
+
+// LEB128, 7 bits per byte
+static size_t put_varint(uint8_t* dst, size_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        dst[n++] = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+    dst[n++] = static_cast<uint8_t>(value);
+    return n;
+}
+
+static bool get_varint(const uint8_t* src, size_t src_len, size_t& pos, size_t& value) {
+    value = 0;
+    for (int shift = 0; pos < src_len && shift < 64; shift += 7) {
+        uint8_t b = src[pos++];
+        value |= static_cast<size_t>(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// the encoders give up once they reach limit bytes, the size estimate was off and raw is as
+// good. dst holds limit bytes, returns limit when they gave up
+
+// zeros from src on, eight at a time while they last
+static size_t count_zeros(const uint8_t* src, size_t len) {
+    size_t n = 0;
+    uint64_t word;
+    while (n + 8 <= len && (memcpy(&word, src + n, 8), word == 0))
+        n += 8;
+    while (n < len && src[n] == 0)
+        n++;
+    return n;
+}
+
+// (varint zeros, varint literals, literals) until the payload is covered
+static size_t zero_run_encode(const uint8_t* src, size_t len, uint8_t* dst, size_t limit) {
+    size_t n = 0;
+    size_t i = 0;
+    uint8_t token[2 * 10];
+    while (i < len) {
+        size_t zeros = count_zeros(src + i, len - i);
+        size_t literals = 0;
+        // a lone zero between literals costs less as a literal than as a new token
+        while (i + zeros + literals < len && (src[i + zeros + literals] != 0 ||
+               (i + zeros + literals + 1 < len && src[i + zeros + literals + 1] != 0)))
+            literals++;
+
+        size_t t = put_varint(token, zeros);
+        t += put_varint(token + t, literals);
+        if (n + t + literals >= limit)
+            return limit;
+        memcpy(dst + n, token, t);
+        n += t;
+        memcpy(dst + n, src + i + zeros, literals);
+        n += literals;
+        i += zeros + literals;
+    }
+    return n;
+}
+
+static bool zero_run_decode(const uint8_t* src, size_t src_len, uint8_t* out, size_t out_len) {
+    size_t pos = 0;
+    size_t o = 0;
+    while (o < out_len) {
+        size_t zeros, literals;
+        if (!get_varint(src, src_len, pos, zeros) || !get_varint(src, src_len, pos, literals))
+            return false;
+        if (zeros > out_len - o || literals > out_len - o - zeros || literals > src_len - pos)
+            return false;
+        memset(out + o, 0, zeros);
+        o += zeros;
+        memcpy(out + o, src + pos, literals);
+        o += literals;
+        pos += literals;
+    }
+    return pos == src_len;
+}
+
+static int bit_width(uint8_t all) {
+    int width = 0;
+    while (width < 8 && (all >> width) != 0)
+        width++;
+    return width;
+}
+
+static size_t packed_bytes(size_t count, int width) {
+    return 1 + (count * width + 7) / 8;
+}
+
+// per block: one byte with the bit width, then the block's bytes at that width, lowest bits first.
+// eight values at width w are exactly w bytes, whole groups of eight go out as one word
+static size_t pack_encode(const uint8_t* src, size_t len, uint8_t* dst, size_t limit) {
+    size_t n = 0;
+    for (size_t b = 0; b < len; b += NET_PACK_BLOCK) {
+        size_t count = std::min(NET_PACK_BLOCK, len - b);
+        uint8_t all = 0;
+        for (size_t k = 0; k < count; k++)
+            all |= src[b + k];
+        int width = bit_width(all);
+
+        if (n + packed_bytes(count, width) >= limit)
+            return limit;
+        dst[n++] = static_cast<uint8_t>(width);
+        if (width == 0)
+            continue;
+
+        size_t k = 0;
+        for (; k + 8 <= count; k += 8) {
+            uint64_t group = 0;
+            for (int v = 0; v < 8; v++)
+                group |= static_cast<uint64_t>(src[b + k + v]) << (v * width);
+            memcpy(dst + n, &group, width);     // little endian hosts, as the rest of the header
+            n += width;
+        }
+
+        uint64_t acc = 0;
+        int bits = 0;
+        for (; k < count; k++) {
+            acc |= static_cast<uint64_t>(src[b + k]) << bits;
+            bits += width;
+            while (bits >= 8) {
+                dst[n++] = static_cast<uint8_t>(acc);
+                acc >>= 8;
+                bits -= 8;
+            }
+        }
+        if (bits > 0)
+            dst[n++] = static_cast<uint8_t>(acc);
+    }
+    return n;
+}
+
+static bool pack_decode(const uint8_t* src, size_t src_len, uint8_t* out, size_t out_len) {
+    size_t pos = 0;
+    for (size_t b = 0; b < out_len; b += NET_PACK_BLOCK) {
+        size_t count = std::min(NET_PACK_BLOCK, out_len - b);
+        if (pos >= src_len || src[pos] > 8)
+            return false;
+        int width = src[pos++];
+        if ((count * width + 7) / 8 > src_len - pos)
+            return false;
+
+        uint8_t mask = static_cast<uint8_t>((1u << width) - 1);
+        size_t k = 0;
+        for (; width > 0 && k + 8 <= count; k += 8) {
+            uint64_t group = 0;
+            memcpy(&group, src + pos, width);
+            pos += width;
+            for (int v = 0; v < 8; v++)
+                out[b + k + v] = static_cast<uint8_t>(group >> (v * width)) & mask;
+        }
+
+        uint64_t acc = 0;
+        int bits = 0;
+        for (; k < count; k++) {
+            if (bits < width) {
+                acc |= static_cast<uint64_t>(src[pos++]) << bits;
+                bits += 8;
+            }
+            out[b + k] = static_cast<uint8_t>(acc) & mask;
+            acc >>= width;
+            bits -= width;
+        }
+    }
+    return pos == src_len;
+}
+
+// rows are RGB triplets, each channel is predicted by the same channel of the pixel before it
+static uint8_t zigzag_delta(const uint8_t* src, size_t i) {
+    int8_t d = static_cast<int8_t>(src[i] - (i >= 3 ? src[i - 3] : 0));
+    return static_cast<uint8_t>((d << 1) ^ (d >> 7));
+}
+
+// the sizing pass goes eight bytes at a time, these work on every byte of a word on its own
+static const uint64_t LOW_BITS = 0x0101010101010101ULL;
+static const uint64_t HIGH_BITS = 0x8080808080808080ULL;
+
+// zigzag_delta of every byte of a against the same byte of b
+static uint64_t zigzag_delta_word(uint64_t a, uint64_t b) {
+    uint64_t d = ((a | HIGH_BITS) - (b & ~HIGH_BITS)) ^ ((a ^ ~b) & HIGH_BITS);
+    return ((d << 1) & ~LOW_BITS) ^ (((d >> 7) & LOW_BITS) * 0xff);
+}
+
+// lowest bit of every byte set where the byte is not zero
+static uint64_t nonzero_bytes(uint64_t w) {
+    w |= w >> 4;
+    w |= w >> 2;
+    w |= w >> 1;
+    return w & LOW_BITS;
+}
+
+static uint8_t fold_bytes(uint64_t w) {
+    w |= w >> 32;
+    w |= w >> 16;
+    w |= w >> 8;
+    return static_cast<uint8_t>(w);
+}
+
+static void delta_decode(uint8_t* buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        uint8_t z = buf[i];
+        uint8_t d = static_cast<uint8_t>((z >> 1) ^ -(z & 1));
+        buf[i] = static_cast<uint8_t>(d + (i >= 3 ? buf[i - 3] : 0));
+    }
+}
+
+
+net_codec netEncoder::encode(const uint8_t* src, size_t len, uint8_t* dst, size_t& encoded, bool compress) {
+    net_codec best = NET_CODEC_RAW;
+    encoded = len;
+    if (enabled && !compress)
+        idle++;
+
+    if (enabled && compress && len > 0) {
+        deltas.resize(len);
+
+        // sizes: packed ones from the widths of their blocks, zero run from the nonzero bytes and
+        // the runs of them (two token bytes per run, most counts fit a byte)
+        size_t sizes[NET_CODEC_COUNT] = {len, 0, 0, 0};
+        size_t nonzero = 0;
+        size_t runs = 0;
+        uint64_t in_run = 0;    // lowest bit: the byte before was not zero
+        for (size_t b = 0; b < len; b += NET_PACK_BLOCK) {
+            size_t end = std::min(b + NET_PACK_BLOCK, len);
+            uint64_t all = 0, all_deltas = 0;
+            for (size_t k = b; k < end; ) {
+                if (k >= 3 && k + 8 <= end) {
+                    uint64_t word, before;
+                    memcpy(&word, src + k, 8);
+                    memcpy(&before, src + k - 3, 8);
+                    uint64_t z = zigzag_delta_word(word, before);
+                    memcpy(deltas.data() + k, &z, 8);
+                    all |= word;
+                    all_deltas |= z;
+
+                    uint64_t nz = nonzero_bytes(word);
+                    nonzero += __builtin_popcountll(nz);
+                    runs += __builtin_popcountll(nz & ~((nz << 8) | in_run));
+                    in_run = nz >> 56;
+                    k += 8;
+                }
+                else {
+                    uint8_t z = zigzag_delta(src, k);
+                    deltas[k] = z;
+                    all |= src[k];
+                    all_deltas |= z;
+
+                    uint64_t nz = src[k] != 0;
+                    nonzero += nz;
+                    runs += nz & ~in_run;
+                    in_run = nz;
+                    k++;
+                }
+            }
+            sizes[NET_CODEC_PACK] += packed_bytes(end - b, bit_width(fold_bytes(all)));
+            sizes[NET_CODEC_DELTA_PACK] += packed_bytes(end - b, bit_width(fold_bytes(all_deltas)));
+        }
+        sizes[NET_CODEC_ZERO_RUN] = nonzero + 2 * runs + 2;
+
+        for (int c = NET_CODEC_ZERO_RUN; c < NET_CODEC_COUNT; c++)
+            if (sizes[c] < sizes[best])
+                best = static_cast<net_codec>(c);
+
+        switch (best) {
+        case NET_CODEC_RAW:        break;
+        case NET_CODEC_ZERO_RUN:   encoded = zero_run_encode(src, len, dst, len); break;
+        case NET_CODEC_PACK:       encoded = pack_encode(src, len, dst, len); break;
+        case NET_CODEC_DELTA_PACK: encoded = pack_encode(deltas.data(), len, dst, len); break;
+        }
+        if (encoded >= len) {
+            best = NET_CODEC_RAW;
+            encoded = len;
+        }
+    }
+
+    if (best == NET_CODEC_RAW)
+        memcpy(dst, src, len);
+
+    raw_bytes += len;
+    wire_bytes += encoded;
+    wins[best]++;
+    return best;
+}
+
+void netEncoder::report() const {
+    std::ostringstream out;
+    out << "codec " << name << ": " << (enabled ? "smallest of all" : "raw only") << ", " << raw_bytes << " -> " << wire_bytes << " bytes";
+    if (raw_bytes > 0)
+        out << " (" << 100.0 * wire_bytes / raw_bytes << "%)";
+    for (int c = 0; c < NET_CODEC_COUNT; c++)
+        out << (c == 0 ? ", " : " ") << CODEC_NAMES[c] << " " << wins[c];
+    if (idle > 0)
+        out << " (raw " << idle << " times as the link was idle)";
+    std::cout << out.str() << "\n" << std::flush;    // S2 of part3_1 leaves with _exit
+}
+
+bool net_decode(net_codec codec, const uint8_t* src, size_t src_len, uint8_t* out, size_t out_len) {
+    switch (codec) {
+    case NET_CODEC_RAW:
+        if (src_len != out_len)
+            return false;
+        memcpy(out, src, out_len);
+        return true;
+    case NET_CODEC_ZERO_RUN:
+        return zero_run_decode(src, src_len, out, out_len);
+    case NET_CODEC_PACK:
+        return pack_decode(src, src_len, out, out_len);
+    case NET_CODEC_DELTA_PACK:
+        if (!pack_decode(src, src_len, out, out_len))
+            return false;
+        delta_decode(out, out_len);
+        return true;
+    }
+    return false;
+}
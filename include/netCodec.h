@@ -0,0 +1,57 @@
+#ifndef NETCODEC_H
+#define NETCODEC_H
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// payload codecs for rows that cross a network link. every packet goes out with whichever
+// codec gives the fewest bytes, raw included, so a packet never grows; the codec travels in the
+// packet header and the receiver needs no setting of its own. one pass over the payload sizes
+// every codec (exactly for the packed ones, closely for zero run), only the winner encodes.
+//
+//   zero run    runs of zeros as a count, everything else as literals. the details S2 sends
+//               are clamped at 0 and are mostly zeros
+//   pack        blocks of NET_PACK_BLOCK bytes at the bit width of their largest byte, an all
+//               zero block is its width byte alone. small magnitudes
+//   delta pack  each byte minus the same channel of the pixel before it, zigzagged and packed.
+//               smoothed rows change slowly from pixel to pixel
+enum net_codec : uint8_t {
+    NET_CODEC_RAW,
+    NET_CODEC_ZERO_RUN,
+    NET_CODEC_PACK,
+    NET_CODEC_DELTA_PACK
+};
+
+const int NET_CODEC_COUNT = 4;
+const size_t NET_PACK_BLOCK = 32;
+
+const char* net_codec_name(net_codec codec);
+
+// encoding end of a link, keeps its scratch buffers and counts what it saved
+class netEncoder {
+public:
+    // enabled = false sends every payload raw
+    netEncoder(std::string name_, bool enabled_) : name(std::move(name_)), enabled(enabled_) {}
+
+    // encodes len bytes of src into dst (room for len bytes), sets the size used. compress = false
+    // sends it raw, for a link that drains faster than the codec would save
+    net_codec encode(const uint8_t* src, size_t len, uint8_t* dst, size_t& encoded, bool compress = true);
+
+    // one line with the bytes before and after and how often each codec won
+    void report() const;
+
+private:
+    std::string name;
+    bool enabled;
+    std::vector<uint8_t> deltas;    // zigzagged, filled by the sizing pass
+    uint64_t raw_bytes = 0;
+    uint64_t wire_bytes = 0;
+    uint64_t wins[NET_CODEC_COUNT] = {};
+    uint64_t idle = 0;              // sent raw on compress = false
+};
+
+// decodes src into exactly out_len bytes of out, false if src is malformed or decodes to another size
+bool net_decode(net_codec codec, const uint8_t* src, size_t src_len, uint8_t* out, size_t out_len);
+
+#endif
@@ -0,0 +1,161 @@
+#include "packetIO.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// bumped next to the call itself, stages may be threads
+static std::atomic<uint64_t> n_reads{0};
+static std::atomic<uint64_t> n_writes{0};
+static std::atomic<uint64_t> n_vmsplices{0};
+
+pipe_call_counts_t pipe_call_counts() {
+    return { n_reads.load(), n_writes.load(), n_vmsplices.load() };
+}
+
+ssize_t write_all(int fd, const void* buf, size_t count) {
+    const char* p = static_cast<const char*>(buf);
+    size_t written = 0;
+    while (written < count) {
+        n_writes.fetch_add(1, std::memory_order_relaxed);
+        ssize_t w = write(fd, p + written, count - written);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        written += static_cast<size_t>(w);
+    }
+    return static_cast<ssize_t>(written);
+}
+
+ssize_t read_all(int fd, void* buf, size_t count) {
+    char* p = static_cast<char*>(buf);
+    size_t got = 0;
+    while (got < count) {
+        n_reads.fetch_add(1, std::memory_order_relaxed);
+        ssize_t r = read(fd, p + got, count - got);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) return static_cast<ssize_t>(got); // EOF
+        got += static_cast<size_t>(r);
+    }
+    return static_cast<ssize_t>(got);
+}
+
+bool send_all(int fd, const void* buf, size_t len) {
+    const char* p = static_cast<const char*>(buf);
+    while (len) {
+        ssize_t n = ::send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) 
+                continue;
+            perror("send");
+            return false;
+        }
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool recv_all(int fd, void* buf, size_t len) {
+    char* p = static_cast<char*>(buf);
+    size_t remaining = len;
+    while (remaining) {
+        ssize_t n = ::recv(fd, p, remaining, 0);
+        if (n == 0) {
+            // connection closed
+            return false;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("recv");
+            return false;
+        }
+        p += n;
+        remaining -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+
+int set_pipe_capacity(int fd, size_t bytes) {
+    if (fcntl(fd, F_SETPIPE_SZ, static_cast<int>(bytes)) < 0 && errno == EPERM) {
+        long max_size = 0;
+        FILE* f = fopen("/proc/sys/fs/pipe-max-size", "r");
+        if (f) {
+            if (fscanf(f, "%ld", &max_size) != 1)
+                max_size = 0;
+            fclose(f);
+        }
+        if (max_size > 0)
+            fcntl(fd, F_SETPIPE_SZ, static_cast<int>(std::min<long>(max_size, static_cast<long>(bytes))));
+    }
+    return fcntl(fd, F_GETPIPE_SZ);
+}
+
+pipeFrameWriter::pipeFrameWriter(int fd_, size_t frame_bytes, bool zero_copy):
+    fd(fd_), page(static_cast<size_t>(sysconf(_SC_PAGESIZE))), next(0), use_vmsplice(zero_copy)
+{
+    frame_pages = std::max<size_t>(1, (frame_bytes + page - 1) / page);
+
+    // every gifted page takes one pipe slot. a page is refilled only after a full lap of the
+    // ring: at least slots newer pages went in after it, minus the tail a wrap skips and the
+    // frame being filled
+    int pipe_bytes = fcntl(fd, F_GETPIPE_SZ);
+    size_t slots = pipe_bytes > 0 ? static_cast<size_t>(pipe_bytes) / page : 16;
+    ring_pages = use_vmsplice ? slots + 2 * frame_pages : frame_pages;
+
+    void* p = mmap(nullptr, ring_pages * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    ring = static_cast<char*>(p);
+}
+
+pipeFrameWriter::~pipeFrameWriter() {
+    munmap(ring, ring_pages * page);
+}
+
+char* pipeFrameWriter::frame() {
+    if (next + frame_pages > ring_pages)
+        next = 0;
+    return ring + next * page;
+}
+
+ssize_t pipeFrameWriter::commit(size_t len) {
+    char* buf = frame();
+    if (use_vmsplice)
+        next += std::max<size_t>(1, (len + page - 1) / page);
+
+    size_t sent = 0;
+    while (use_vmsplice && sent < len) {
+        iovec iov = { buf + sent, len - sent };
+        n_vmsplices.fetch_add(1, std::memory_order_relaxed);
+        ssize_t n = vmsplice(fd, &iov, 1, SPLICE_F_GIFT);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            // no vmsplice here (or fd is no pipe): copy from now on
+            if (sent == 0 && (errno == ENOSYS || errno == EINVAL || errno == EBADF)) {
+                use_vmsplice = false;
+                break;
+            }
+            return -1;
+        }
+        sent += static_cast<size_t>(n);
+    }
+    if (sent == len)
+        return static_cast<ssize_t>(len);
+
+    return write_all(fd, buf + sent, len - sent) < 0 ? -1 : static_cast<ssize_t>(len);
+}
@@ -0,0 +1,69 @@
+#ifndef PACKETIO_H
+#define PACKETIO_H
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+
+// helpers shared by every transport, so a change to the partial read/write
+// handling is made once (the packet checksums live in checksum.h)
+
+// read/write helpers to counter partial reads/writes, -1 on error,
+// read_all returns fewer than count bytes only on EOF
+ssize_t write_all(int fd, const void* buf, size_t count);
+ssize_t read_all(int fd, void* buf, size_t count);
+
+// same for sockets, false on error or when the peer closed the connection
+bool send_all(int fd, const void* buf, size_t len);
+bool recv_all(int fd, void* buf, size_t len);
+
+// resizes the pipe behind fd (F_SETPIPE_SZ) to hold at least bytes, capped at
+// /proc/sys/fs/pipe-max-size where that is all an unprivileged process may ask for.
+// returns the capacity the pipe ended up with, -1 if fd is no pipe
+int set_pipe_capacity(int fd, size_t bytes);
+
+// system calls made by write_all, read_all and pipeFrameWriter in this process, every
+// partial transfer and EINTR retry included. a forked child starts from its parent's counts
+typedef struct pipe_call_counts_t {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t vmsplices;
+} pipe_call_counts_t;
+
+pipe_call_counts_t pipe_call_counts();
+
+
+// zero copy writes into a pipe. a frame is filled in place and its pages are gifted to the
+// pipe with vmsplice(SPLICE_F_GIFT), so the kernel queues page references instead of copying
+// the bytes. the pipe references those pages until the reader has drained them, so frames
+// are carved out of a ring of pages larger than the pipe can hold and a page is only filled
+// again once it has left the pipe. frames may be shorter than frame_bytes, they only use up
+// the pages they cover. where vmsplice is not available (or fd is no pipe) frames go out
+// through write_all. create it after any F_SETPIPE_SZ on fd, the ring is sized from it.
+class pipeFrameWriter {
+public:
+    pipeFrameWriter(int fd_, size_t frame_bytes, bool zero_copy);
+    ~pipeFrameWriter();
+
+    pipeFrameWriter(const pipeFrameWriter&) = delete;
+    pipeFrameWriter& operator=(const pipeFrameWriter&) = delete;
+
+    // page aligned buffer of at least frame_bytes to fill the next frame in
+    char* frame();
+
+    // sends the first len bytes of frame() and moves on to the next frame, -1 on error
+    ssize_t commit(size_t len);
+
+    // false once vmsplice was found unusable
+    bool zero_copy() const { return use_vmsplice; }
+
+private:
+    int fd;
+    size_t page;
+    size_t frame_pages;     // frame_bytes rounded up to whole pages
+    size_t ring_pages;
+    size_t next;            // first page of the next frame
+    char* ring;
+    bool use_vmsplice;
+};
+
+#endif
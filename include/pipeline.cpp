@@ -0,0 +1,296 @@
+#include "pipeline.h"
+#include "packetIO.h"
+#include "frameHeader.h"
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// packets travel as a part2 stage header (include/frameHeader.h) and their payload
+
+static void serialize_header(char *dst, const rowPacket& pkt) {
+    serialize_stage_header(dst, pkt.start_row, pkt.num_rows, pkt.cols_per_row, static_cast<uint64_t>(pkt.hash), pkt.hash_algo, pkt.is_last ? 1 : 0, pkt.epoch, pkt.sequence);
+}
+
+// fills everything but the payload, sizes pixels for it
+static void deserialize_header(const char *src, rowPacket& pkt) {
+    uint32_t payload_len;
+    uint64_t hash;
+    uint8_t is_last;
+    deserialize_stage_header(src, payload_len, pkt.start_row, pkt.num_rows, pkt.cols_per_row, hash, pkt.hash_algo, is_last, pkt.epoch, pkt.sequence);
+
+    pkt.hash = static_cast<std::size_t>(hash);
+    pkt.is_last = is_last != 0;
+    pkt.pixels.resize(payload_len);
+}
+
+
+// in-process queue, rowPackets are moved, never copied. bounded by bytes, not packets
+class queueTransport : public transport {
+public:
+    queueTransport(memoryBudget& budget_, int edge_) : budget(budget_), edge(edge_) {}
+
+    bool send(rowPacket& pkt) override {
+        budget.acquire(edge, queued_bytes(pkt));
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            q.push_back(std::move(pkt));
+        }
+        cv_fill.notify_one();
+        return true;
+    }
+
+    bool recv(rowPacket& pkt) override {
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv_fill.wait(lock, [this]{ return !q.empty(); });
+            pkt = std::move(q.front());
+            q.pop_front();
+        }
+        budget.release(edge, queued_bytes(pkt));
+        return true;
+    }
+
+    bool cross_process() const override { return false; }
+
+private:
+    static size_t queued_bytes(const rowPacket& pkt) {
+        return sizeof(rowPacket) + pkt.pixels.capacity();
+    }
+
+    std::deque<rowPacket> q;
+    std::mutex mtx;
+    std::condition_variable cv_fill;
+    memoryBudget& budget;
+    int edge;
+};
+
+
+// byte stream: pipe, unix socketpair or tcp connection; header and payload go out in one write
+class streamTransport : public transport {
+public:
+    streamTransport(int read_fd_, int write_fd_) : read_fd(read_fd_), write_fd(write_fd_) {}
+    ~streamTransport() override {
+        if (read_fd >= 0)
+            close(read_fd);
+        if (write_fd >= 0 && write_fd != read_fd)
+            close(write_fd);
+    }
+
+    bool send(rowPacket& pkt) override {
+        frame.resize(STAGE_HDR_SIZE + pkt.pixels.size());
+        serialize_header(frame.data(), pkt);
+        if (!pkt.pixels.empty())
+            memcpy(frame.data() + STAGE_HDR_SIZE, pkt.pixels.data(), pkt.pixels.size());
+
+        return write_all(write_fd, frame.data(), frame.size()) == static_cast<ssize_t>(frame.size());
+    }
+
+    bool recv(rowPacket& pkt) override {
+        char hdr[STAGE_HDR_SIZE];
+        if (read_all(read_fd, hdr, STAGE_HDR_SIZE) != static_cast<ssize_t>(STAGE_HDR_SIZE))
+            return false;
+
+        deserialize_header(hdr, pkt);
+        if (pkt.pixels.empty())
+            return true;
+        return read_all(read_fd, pkt.pixels.data(), pkt.pixels.size()) == static_cast<ssize_t>(pkt.pixels.size());
+    }
+
+    bool cross_process() const override { return true; }
+
+    // with every copy of the other end closed, recv sees eof and send EPIPE
+    void keep_ends(bool reads, bool writes) override {
+        if (!reads && read_fd >= 0) {
+            close(read_fd);
+            read_fd = -1;
+        }
+        if (!writes && write_fd >= 0) {
+            close(write_fd);
+            write_fd = -1;
+        }
+    }
+
+private:
+    int read_fd;
+    int write_fd;
+    std::vector<char> frame;
+};
+
+
+// shmRing (include/shmRing.h) in a MAP_SHARED | MAP_ANONYMOUS mapping, so it survives fork.
+// packets are serialized into the slot and copied back out of it on the other side
+class shmRingTransport : public transport {
+public:
+    shmRingTransport(size_t max_packet_bytes, int capacity, shm_sync_mode sync)
+        : block_bytes(STAGE_HDR_SIZE + max_packet_bytes)
+    {
+        map_size = shm_ring_bytes(capacity, block_bytes);
+        void* p = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        ring = static_cast<shm_ring_t*>(p);
+        shm_ring_init(ring, capacity, block_bytes, sync);
+    }
+
+    ~shmRingTransport() override {
+        munmap(ring, map_size);
+        if (producer_fd >= 0)
+            close(producer_fd);
+    }
+
+    bool send(rowPacket& pkt) override {
+        if (STAGE_HDR_SIZE + pkt.pixels.size() > block_bytes) {
+            fprintf(stderr, "shm transport: packet of %zu bytes does not fit a %zu byte slot\n", pkt.pixels.size(), block_bytes - STAGE_HDR_SIZE);
+            return false;
+        }
+
+        char* slot = shm_ring_acquire(ring);
+        serialize_header(slot, pkt);
+        if (!pkt.pixels.empty())
+            memcpy(slot + STAGE_HDR_SIZE, pkt.pixels.data(), pkt.pixels.size());
+        shm_ring_publish(ring, slot);
+        return true;
+    }
+
+    bool recv(rowPacket& pkt) override {
+        const char* slot = shm_ring_peek_from(ring, producer_fd);
+        if (!slot)
+            return false;
+        deserialize_header(slot, pkt);
+        if (!pkt.pixels.empty())
+            memcpy(pkt.pixels.data(), slot + STAGE_HDR_SIZE, pkt.pixels.size());
+        shm_ring_release(ring, slot);
+        return true;
+    }
+
+    bool cross_process() const override { return true; }
+
+    // the mapping stays, only the consumer needs to know who feeds it
+    void keep_ends(bool reads, bool) override {
+        if (!reads && producer_fd >= 0) {
+            close(producer_fd);
+            producer_fd = -1;
+        }
+    }
+
+    void watch_producer(int pidfd) override {
+        if (producer_fd >= 0)
+            close(producer_fd);
+        producer_fd = pidfd;
+    }
+
+private:
+    size_t block_bytes;
+    size_t map_size;
+    shm_ring_t* ring;
+    int producer_fd = -1;       // pidfd, -1 while the producer is a thread of ours
+};
+
+
+// connected loopback pair: listen on an ephemeral port, connect, accept
+static void tcp_loopback_pair(int& client_fd, int& server_fd) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+
+    if (bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 1) < 0 || getsockname(listen_fd, (sockaddr*)&addr, &len) < 0) {
+        perror("bind/listen");
+        exit(1);
+    }
+
+    client_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (client_fd < 0 || connect(client_fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    server_fd = accept(listen_fd, nullptr, nullptr);
+    if (server_fd < 0) {
+        perror("accept");
+        exit(1);
+    }
+    close(listen_fd);
+
+    // packets are written whole, don't let nagle hold them back
+    int one = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(server_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+
+static const char* const TRANSPORT_NAMES[] = {"queue", "pipe", "shm", "unix", "tcp"};
+
+bool parse_transport_kind(const char* name, transport_kind& kind) {
+    for (int k = TRANSPORT_QUEUE; k <= TRANSPORT_TCP; k++) {
+        if (strcmp(name, TRANSPORT_NAMES[k]) == 0) {
+            kind = static_cast<transport_kind>(k);
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* transport_name(transport_kind kind) {
+    return TRANSPORT_NAMES[kind];
+}
+
+integrity_policy_t default_integrity(transport_kind kind) {
+    switch (kind) {
+    case TRANSPORT_QUEUE: return INTEGRITY_THREADS;
+    case TRANSPORT_PIPE:
+    case TRANSPORT_SHM:
+    case TRANSPORT_UNIX:  return INTEGRITY_LOCAL_IPC;
+    case TRANSPORT_TCP:   return INTEGRITY_NETWORK;
+    }
+    return INTEGRITY_NETWORK;
+}
+
+std::unique_ptr<transport> make_transport(transport_kind kind, size_t max_packet_bytes, int capacity, shm_sync_mode sync, memoryBudget& budget, int edge) {
+    int fds[2];
+
+    switch (kind) {
+    case TRANSPORT_QUEUE:
+        return std::make_unique<queueTransport>(budget, edge);
+
+    case TRANSPORT_PIPE:
+        if (pipe(fds) < 0) {
+            perror("pipe");
+            exit(1);
+        }
+        return std::make_unique<streamTransport>(fds[0], fds[1]);
+
+    case TRANSPORT_SHM:
+        return std::make_unique<shmRingTransport>(max_packet_bytes, capacity, sync);
+
+    case TRANSPORT_UNIX:
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+            perror("socketpair");
+            exit(1);
+        }
+        return std::make_unique<streamTransport>(fds[1], fds[0]);
+
+    case TRANSPORT_TCP:
+        tcp_loopback_pair(fds[0], fds[1]);
+        return std::make_unique<streamTransport>(fds[1], fds[0]);
+    }
+    return nullptr;
+}
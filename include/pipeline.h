@@ -0,0 +1,267 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <concepts>
+#include <memory>
+#include <thread>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "rowPacket.h"
+#include "checksum.h"
+#include "placement.h"
+#include "memoryBudget.h"
+#include "integrity.h"
+#include "shmRing.h"
+
+// a linear pipeline of stage functors connected by pluggable transports (needs -std=c++20).
+//
+//   pipeline<smoothenStage, detailsStage, sharpenStage> p(config, s1, s2, s3);
+//   p.run();
+//
+// the first stage is the source, the last one the sink and everything in between a filter.
+// every stage but the sink runs on its own thread (or forked process), the sink runs on the
+// caller, so with processes the results the sink writes stay visible to the caller.
+// with processes every one of them only keeps its own ends of the edges, a stage that dies
+// breaks the edges it sits on, so a pipeline of processes runs once.
+// the transport of every edge is picked at runtime from pipeline_config_t.
+
+// source: fills out, false once there is nothing left
+template <typename S>
+concept SourceStage = requires(S s, rowPacket& out) { { s(out) } -> std::convertible_to<bool>; };
+
+// filter: builds out from in, false drops the packet
+template <typename S>
+concept FilterStage = requires(S s, rowPacket& in, rowPacket& out) { { s(in, out) } -> std::convertible_to<bool>; };
+
+// sink: consumes in
+template <typename S>
+concept SinkStage = requires(S s, rowPacket& in) { s(in); };
+
+
+// one edge of the pipeline, single producer / single consumer
+class transport {
+public:
+    virtual ~transport() {}
+
+    // may move from pkt, false if the edge is broken
+    virtual bool send(rowPacket& pkt) = 0;
+    virtual bool recv(rowPacket& pkt) = 0;
+
+    // usable between forked processes (all but the in-process queue)
+    virtual bool cross_process() const = 0;
+
+    // after a fork: drops the receiving and / or sending end this process does not use
+    virtual void keep_ends(bool /*reads*/, bool /*writes*/) {}
+
+    // pidfd of the process sending on this edge. edges without an eof of their own (shm) fail
+    // recv once it is gone, the rest close it
+    virtual void watch_producer(int pidfd) { close(pidfd); }
+};
+
+enum transport_kind {
+    TRANSPORT_QUEUE,    // std::deque + condition variables, threads only
+    TRANSPORT_PIPE,     // pipe(2)
+    TRANSPORT_SHM,      // shmRing in a shared anonymous mapping
+    TRANSPORT_UNIX,     // AF_UNIX stream socketpair
+    TRANSPORT_TCP       // loopback TCP connection
+};
+
+bool parse_transport_kind(const char* name, transport_kind& kind);
+const char* transport_name(transport_kind kind);
+
+// off for the in-process queue, sampled for pipes, shm and unix sockets, full for tcp
+integrity_policy_t default_integrity(transport_kind kind);
+
+// max_packet_bytes and capacity size the shm ring and sync picks how it waits, queue edges take their bytes from budget
+// (as edge number edge), pipes and sockets are bounded by their kernel buffers
+std::unique_ptr<transport> make_transport(transport_kind kind, size_t max_packet_bytes, int capacity, shm_sync_mode sync, memoryBudget& budget, int edge);
+
+typedef struct pipeline_config_t {
+    transport_kind transport;
+    bool use_processes;             // fork the non-sink stages instead of starting threads
+    integrity_policy_t integrity;   // which packets get checksummed on send and verified on recv
+    checksum_algo checksum;         // engine used on send, recv goes by the packet header
+    size_t max_packet_bytes;        // largest payload a stage emits
+    int capacity;                   // slots per shm edge
+    shm_sync_mode shm_sync;         // how a shm edge waits when full / empty
+    size_t edge_budget_bytes;       // bytes a queue edge may hold before its producer blocks
+    size_t pipeline_budget_bytes;   // all queue edges together
+    std::vector<int> stage_cpus;    // pin stage k to stage_cpus[k] when not empty
+} pipeline_config_t;
+
+
+template <typename... Stages>
+class pipeline {
+    static constexpr size_t NUM_STAGES = sizeof...(Stages);
+    static_assert(NUM_STAGES >= 2, "a pipeline needs at least a source and a sink");
+
+public:
+    explicit pipeline(const pipeline_config_t& config_, Stages... stages_)
+        : config(config_), stages(std::move(stages_)...),
+          budget(NUM_STAGES - 1, config_.edge_budget_bytes, config_.pipeline_budget_bytes)
+    {
+        for (size_t k = 0; k + 1 < NUM_STAGES; k++) {
+            links.push_back(std::make_unique<linkIntegrity>("edge " + std::to_string(k), config.integrity, config.checksum));
+            edges.push_back(make_transport(config.transport, config.max_packet_bytes, config.capacity, config.shm_sync, budget, static_cast<int>(k)));
+            if (config.use_processes && !edges.back()->cross_process()) {
+                fprintf(stderr, "pipeline: transport %s cannot connect processes\n", transport_name(config.transport));
+                exit(1);
+            }
+        }
+    }
+
+    // pushes everything the source produces through to the sink, returns once the sink saw the end.
+    // false if an edge broke before that (a stage died)
+    bool run() {
+        launch_workers(std::make_index_sequence<NUM_STAGES - 1>{});
+        if (config.use_processes)
+            keep_stage_ends(NUM_STAGES - 1);
+
+        pin_self(NUM_STAGES - 1);
+        run_stage<NUM_STAGES - 1>();
+
+        // the stages still up may wait on the dead one forever (a full shm ring)
+        if (!ended) {
+            fprintf(stderr, "pipeline: edge %zu broke before the end\n", NUM_STAGES - 2);
+            for (pid_t pid : pids)
+                kill(pid, SIGTERM);
+        }
+
+        for (std::thread& t : threads)
+            t.join();
+        for (pid_t pid : pids)
+            waitpid(pid, nullptr, 0);
+        threads.clear();
+        pids.clear();
+        return ended;
+    }
+
+    // packets dropped because of a checksum mismatch (with processes only the sink's drops are seen)
+    int corrupted_packets() const { return corrupted.load(); }
+
+    // high-water marks of the queue edges
+    const memoryBudget& memory() const { return budget; }
+
+private:
+    template <size_t... K>
+    void launch_workers(std::index_sequence<K...>) {
+        (launch_worker<K>(), ...);
+    }
+
+    template <size_t K>
+    void launch_worker() {
+        if (!config.use_processes) {
+            threads.emplace_back([this]{ pin_self(K); run_stage<K>(); });
+            return;
+        }
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0) {
+            keep_stage_ends(K);
+            pin_self(K);
+            run_stage<K>();
+            _exit(0);
+        }
+        pids.push_back(pid);
+
+        // the consumer of edge K is forked after this or is the caller, either way it gets the pidfd
+        int pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+        if (pidfd >= 0)
+            edges[K]->watch_producer(pidfd);
+    }
+
+    // stage k reads edge k - 1 and writes edge k, nothing else
+    void keep_stage_ends(size_t k) {
+        for (size_t e = 0; e < edges.size(); e++)
+            edges[e]->keep_ends(e + 1 == k, e == k);
+    }
+
+    void pin_self(size_t k) {
+        if (k < config.stage_cpus.size())
+            pin_thread_to_cpu(pthread_self(), config.stage_cpus[k]);
+    }
+
+    bool send(size_t edge, rowPacket& pkt) {
+        if (!pkt.is_last)
+            links[edge]->seal(pkt);
+        return edges[edge]->send(pkt);
+    }
+
+    // false once the edge is broken, drops (and counts) corrupted packets
+    bool recv(size_t edge, rowPacket& pkt) {
+        while (edges[edge]->recv(pkt)) {
+            if (pkt.is_last || links[edge]->check(pkt))
+                return true;
+
+            fprintf(stderr, "pipeline: data corrupted in rowPacket(start_row=%d) on edge %zu\n", pkt.start_row, edge);
+            corrupted++;
+        }
+        return false;
+    }
+
+    template <size_t K>
+    void run_stage() {
+        auto& stage = std::get<K>(stages);
+
+        if constexpr (K == 0) {
+            static_assert(SourceStage<decltype(stage)>, "first stage must be a source: bool(rowPacket& out)");
+            while (true) {
+                rowPacket out(false);
+                if (!stage(out))
+                    break;
+                if (!send(0, out))
+                    return;
+            }
+            rowPacket term(true);
+            send(0, term);
+        }
+        else if constexpr (K == NUM_STAGES - 1) {
+            static_assert(SinkStage<decltype(stage)>, "last stage must be a sink: void(rowPacket& in)");
+            rowPacket in(false);
+            while (recv(K - 1, in) && !in.is_last)
+                stage(in);
+            ended = in.is_last;
+            links[K - 1]->report();
+        }
+        else {
+            static_assert(FilterStage<decltype(stage)>, "middle stages must be filters: bool(rowPacket& in, rowPacket& out)");
+            rowPacket in(false);
+            while (recv(K - 1, in)) {
+                if (in.is_last) {
+                    send(K, in);
+                    break;
+                }
+                rowPacket out(false);
+                if (stage(in, out) && !send(K, out))
+                    break;
+            }
+            links[K - 1]->report();
+        }
+    }
+
+    pipeline_config_t config;
+    std::tuple<Stages...> stages;
+    memoryBudget budget;
+    std::vector<std::unique_ptr<transport>> edges;     // edges[k] connects stage k and k+1
+    std::vector<std::unique_ptr<linkIntegrity>> links; // checksum policy and counters of edges[k]
+
+    std::vector<std::thread> threads;
+    std::vector<pid_t> pids;
+    std::atomic<int> corrupted{0};
+    bool ended = false;                                 // the sink saw the end
+};
+
+#endif
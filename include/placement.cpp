@@ -0,0 +1,176 @@
+#include "placement.h"
+#include <sched.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+static const char* CPU_SYSFS = "/sys/devices/system/cpu";
+
+static int read_int_file(const std::string& path, int fallback) {
+    std::ifstream in(path);
+    int v;
+    if (in >> v) 
+        return v;
+    return fallback;
+}
+
+// first cpu of a cpulist such as "0-3,8-11"
+static int first_cpu_of_list(const std::string& path, int fallback) {
+    std::ifstream in(path);
+    std::string list;
+    if (!(in >> list) || list.empty()) 
+        return fallback;
+    return std::atoi(list.c_str());
+}
+
+static int node_of_cpu(int cpu) {
+    std::string dir = std::string(CPU_SYSFS) + "/cpu" + std::to_string(cpu);
+    DIR* d = opendir(dir.c_str());
+    if (!d) 
+        return 0;
+
+    int node = 0;
+    while (dirent* e = readdir(d)) {
+        if (strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' && e->d_name[4] <= '9') {
+            node = std::atoi(e->d_name + 4);
+            break;
+        }
+    }
+    closedir(d);
+    return node;
+}
+
+std::vector<cpu_info_t> read_cpu_topology() {
+    std::vector<cpu_info_t> cpus;
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) 
+        CPU_SET(0, &allowed);
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) 
+            continue;
+
+        std::string base = std::string(CPU_SYSFS) + "/cpu" + std::to_string(cpu);
+
+        cpu_info_t info;
+        info.cpu = cpu;
+        info.core_id = read_int_file(base + "/topology/core_id", cpu);
+        info.package_id = read_int_file(base + "/topology/physical_package_id", 0);
+        info.node = node_of_cpu(cpu);
+
+        // index3 is the L3 on x86; fall back to the package when there is none
+        info.llc_id = first_cpu_of_list(base + "/cache/index3/shared_cpu_list", -1);
+        if (info.llc_id < 0) 
+            info.llc_id = first_cpu_of_list(base + "/topology/package_cpus_list", info.package_id);
+
+        cpus.push_back(info);
+    }
+
+    return cpus;
+}
+
+stage_placement_t plan_stage_placement(int num_stages) {
+    std::vector<cpu_info_t> cpus = read_cpu_topology();
+
+    stage_placement_t plan;
+    plan.node = 0;
+    if (cpus.empty() || num_stages <= 0) 
+        return plan;
+
+    // pick the llc domain with the most cpus, ties go to the lowest id
+    int best_llc = cpus[0].llc_id;
+    size_t best_count = 0;
+    for (const cpu_info_t& c : cpus) {
+        size_t n = std::count_if(cpus.begin(), cpus.end(), [&](const cpu_info_t& o) { return o.llc_id == c.llc_id; });
+        if (n > best_count) { 
+            best_count = n; 
+            best_llc = c.llc_id; 
+        }
+    }
+
+    std::vector<cpu_info_t> domain;
+    for (const cpu_info_t& c : cpus)
+        if (c.llc_id == best_llc) 
+            domain.push_back(c);
+
+    std::sort(domain.begin(), domain.end(), [](const cpu_info_t& a, const cpu_info_t& b) {
+        if (a.core_id != b.core_id) 
+            return a.core_id < b.core_id;
+        return a.cpu < b.cpu;
+    });
+
+    // one cpu per physical core first, then the smt siblings
+    std::vector<int> order, siblings;
+    for (size_t k = 0; k < domain.size(); k++) {
+        bool first_on_core = (k == 0 || domain[k].core_id != domain[k - 1].core_id);
+        (first_on_core ? order : siblings).push_back(domain[k].cpu);
+    }
+    order.insert(order.end(), siblings.begin(), siblings.end());
+
+    for (int s = 0; s < num_stages; s++)
+        plan.stage_cpus.push_back(order[s % order.size()]);
+
+    plan.all_cpus = plan.stage_cpus;
+    std::sort(plan.all_cpus.begin(), plan.all_cpus.end());
+    plan.all_cpus.erase(std::unique(plan.all_cpus.begin(), plan.all_cpus.end()), plan.all_cpus.end());
+
+    plan.node = domain[0].node;
+    return plan;
+}
+
+bool pin_thread_to_cpu(pthread_t thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+bool pin_process_to_cpus(pid_t pid, const std::vector<int>& cpus) {
+    if (cpus.empty()) 
+        return false;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) 
+        CPU_SET(cpu, &set);
+
+    if (sched_setaffinity(pid, sizeof(set), &set) != 0) {
+        perror("sched_setaffinity");
+        return false;
+    }
+    return true;
+}
+
+void first_touch(void* addr, size_t len) {
+    long page = sysconf(_SC_PAGESIZE);
+    if (page <= 0) 
+        page = 4096;
+
+    volatile uint8_t* p = static_cast<volatile uint8_t*>(addr);
+    for (size_t off = 0; off < len; off += static_cast<size_t>(page)) 
+        p[off] = 0;
+}
+
+void print_placement(const stage_placement_t& placement, const char* const stage_names[]) {
+    std::vector<cpu_info_t> cpus = read_cpu_topology();
+
+    std::cout << "Placement (node " << placement.node << "):";
+    for (size_t s = 0; s < placement.stage_cpus.size(); s++) {
+        int cpu = placement.stage_cpus[s];
+        auto it = std::find_if(cpus.begin(), cpus.end(), [&](const cpu_info_t& c) { return c.cpu == cpu; });
+
+        std::cout << "  " << stage_names[s] << "->cpu" << cpu;
+        if (it != cpus.end()) 
+            std::cout << " (core " << it->core_id << ", pkg " << it->package_id << ", llc " << it->llc_id << ")";
+    }
+    std::cout << std::endl;
+}
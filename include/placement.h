@@ -0,0 +1,38 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+#include <vector>
+#include <pthread.h>
+#include <sys/types.h>
+
+// one logical cpu as described under /sys/devices/system/cpu/cpuN
+typedef struct cpu_info_t {
+    int cpu;
+    int core_id;
+    int package_id;
+    int node;       // numa node, 0 when the kernel exposes none
+    int llc_id;     // last level cache domain (first cpu sharing it)
+} cpu_info_t;
+
+// cpus chosen for the stages of one pipeline, all inside one cache domain / node
+typedef struct stage_placement_t {
+    std::vector<int> stage_cpus;    // stage_cpus[k] runs stage k
+    std::vector<int> all_cpus;      // union, for the coordinating thread/process
+    int node;
+} stage_placement_t;
+
+std::vector<cpu_info_t> read_cpu_topology();
+
+// place num_stages stages on distinct physical cores of the largest shared-LLC domain,
+// neighbours first so adjacent stages share L2/L3; falls back to SMT siblings and
+// finally wraps around when the domain is smaller than the pipeline
+stage_placement_t plan_stage_placement(int num_stages);
+
+bool pin_thread_to_cpu(pthread_t thread, int cpu);
+bool pin_process_to_cpus(pid_t pid, const std::vector<int>& cpus);
+
+// write one byte per page from the calling thread so the pages get allocated on its node
+void first_touch(void* addr, size_t len);
+
+void print_placement(const stage_placement_t& placement, const char* const stage_names[]);
+
+#endif
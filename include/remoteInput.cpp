@@ -0,0 +1,192 @@
+#include "remoteInput.h"
+#include "checksum.h"
+#include "packetIO.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+
+uint64_t image_content_hash(const image_t* img) {
+    std::vector<uint8_t> row(static_cast<size_t>(img->width) * 3);
+    uint64_t hash = (static_cast<uint64_t>(img->width) << 32) ^ static_cast<uint32_t>(img->height);
+    for (int i = 0; i < img->height; i++) {
+        copy_row_out(img, i, row.data());
+        hash = hash * 0x100000001b3ULL ^ packet_checksum(CHECKSUM_CRC32C, row.data(), row.size(), i, 1);
+    }
+    return hash;
+}
+
+image_t* alloc_image(int height, int width, bool shared) {
+    size_t bytes = static_cast<size_t>(height) * width * 3;
+    uint8_t* pixels = nullptr;
+    if (shared) {
+        void* p = mmap(nullptr, std::max<size_t>(bytes, 1), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        pixels = static_cast<uint8_t*>(p);
+    }
+    else {
+        pixels = new uint8_t[bytes]();
+    }
+
+    image_t* img = new image_t;
+    img->height = height;
+    img->width = width;
+    img->image_pixels = new uint8_t**[height];
+    for (int i = 0; i < height; i++) {
+        img->image_pixels[i] = new uint8_t*[width];
+        for (int j = 0; j < width; j++)
+            img->image_pixels[i][j] = pixels + (static_cast<size_t>(i) * width + j) * 3;
+    }
+    return img;
+}
+
+void copy_row_out(const image_t* img, int row, uint8_t* dst) {
+    for (int j = 0; j < img->width; j++)
+        memcpy(dst + 3 * j, img->image_pixels[row][j], 3);
+}
+
+void copy_row_in(image_t* img, int row, const uint8_t* src) {
+    for (int j = 0; j < img->width; j++)
+        memcpy(img->image_pixels[row][j], src + 3 * j, 3);
+}
+
+
+// request: uint8_t has_copy, int32_t width, int32_t height, uint64_t hash
+static const size_t REQUEST_BYTES = INPUT_REQUEST_BYTES;
+// reply: int32_t width, int32_t height, uint8_t forward
+static const size_t REPLY_BYTES = sizeof(int32_t) * 2 + sizeof(uint8_t);
+
+bool input_wanted(const uint8_t* request, const image_t* img, const uint64_t* content_hash) {
+    uint8_t has_copy;
+    int32_t width, height;
+    uint64_t hash;
+    memcpy(&has_copy, request, 1);
+    memcpy(&width, request + 1, 4);
+    memcpy(&height, request + 5, 4);
+    memcpy(&hash, request + 9, 8);
+
+    if (!has_copy || width != img->width || height != img->height)
+        return true;
+    return hash != (content_hash ? *content_hash : image_content_hash(img));
+}
+
+void input_reply(const image_t* img, bool forward, std::vector<uint8_t>& reply) {
+    size_t row_bytes = static_cast<size_t>(img->width) * 3;
+    reply.resize(REPLY_BYTES + (forward ? 2 * row_bytes : 0));
+
+    int32_t dims[2] = {img->width, img->height};
+    uint8_t fwd = forward ? 1 : 0;
+    memcpy(reply.data(), dims, sizeof(dims));
+    memcpy(reply.data() + sizeof(dims), &fwd, 1);
+    if (!forward)
+        return;
+
+    copy_row_out(img, 0, reply.data() + REPLY_BYTES);
+    copy_row_out(img, img->height - 1, reply.data() + REPLY_BYTES + row_bytes);
+}
+
+bool serve_input(int fd, const image_t* img, bool& forward) {
+    uint8_t request[REQUEST_BYTES];
+    if (!recv_all(fd, request, REQUEST_BYTES))
+        return false;
+
+    forward = input_wanted(request, img, nullptr);
+
+    std::vector<uint8_t> reply;
+    input_reply(img, forward, reply);
+    return send_all(fd, reply.data(), reply.size());
+}
+
+image_t* request_input(int fd, image_t* local, bool shared, bool& forwarded) {
+    uint8_t request[REQUEST_BYTES] = {};
+    if (local) {
+        uint8_t has_copy = 1;
+        uint64_t hash = image_content_hash(local);
+        memcpy(request, &has_copy, 1);
+        memcpy(request + 1, &local->width, 4);
+        memcpy(request + 5, &local->height, 4);
+        memcpy(request + 9, &hash, 8);
+    }
+    if (!send_all(fd, request, REQUEST_BYTES))
+        return nullptr;
+
+    uint8_t reply[REPLY_BYTES];
+    if (!recv_all(fd, reply, REPLY_BYTES))
+        return nullptr;
+    int32_t dims[2];
+    memcpy(dims, reply, sizeof(dims));
+    forwarded = reply[sizeof(dims)] != 0;
+
+    if (!forwarded)
+        return local;
+    if (dims[0] <= 0 || dims[1] <= 0) {
+        fprintf(stderr, "remote input: A announced a %dx%d image\n", dims[0], dims[1]);
+        return nullptr;
+    }
+
+    image_t* img = alloc_image(dims[1], dims[0], shared);
+    std::vector<uint8_t> row(static_cast<size_t>(img->width) * 3);
+    for (int i : {0, img->height - 1}) {
+        if (!recv_all(fd, row.data(), row.size()))
+            return nullptr;
+        copy_row_in(img, i, row.data());
+    }
+    return img;
+}
+
+
+// section: uint32_t encoded bytes, uint8_t codec, uint64_t crc32c of the rows, encoded rows
+static const size_t SECTION_HDR = sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint64_t);
+
+size_t input_section_bytes(int num_rows, int width) {
+    return SECTION_HDR + static_cast<size_t>(num_rows) * width * 3;
+}
+
+size_t put_input_rows(const image_t* img, int start_row, int num_rows, netEncoder& codec, bool compress, uint8_t* dst, std::vector<uint8_t>& scratch) {
+    size_t row_bytes = static_cast<size_t>(img->width) * 3;
+    scratch.resize(row_bytes * num_rows);
+    for (int r = 0; r < num_rows; r++)
+        copy_row_out(img, start_row + r, scratch.data() + r * row_bytes);
+
+    size_t encoded = 0;
+    uint8_t used = codec.encode(scratch.data(), scratch.size(), dst + SECTION_HDR, encoded, compress);
+    uint32_t len = static_cast<uint32_t>(encoded);
+    uint64_t hash = packet_checksum(CHECKSUM_CRC32C, scratch.data(), scratch.size(), start_row, num_rows);
+
+    memcpy(dst, &len, 4);
+    memcpy(dst + 4, &used, 1);
+    memcpy(dst + 5, &hash, 8);
+    return SECTION_HDR + encoded;
+}
+
+size_t take_input_rows(const uint8_t* src, size_t len, image_t* img, image_t* also, int start_row, int num_rows, std::vector<uint8_t>& scratch) {
+    if (len < SECTION_HDR || start_row < 1 || num_rows < 0 || start_row + num_rows > img->height - 1)
+        return 0;
+
+    uint32_t encoded;
+    uint8_t used;
+    uint64_t hash;
+    memcpy(&encoded, src, 4);
+    memcpy(&used, src + 4, 1);
+    memcpy(&hash, src + 5, 8);
+    if (encoded > len - SECTION_HDR)
+        return 0;
+
+    size_t row_bytes = static_cast<size_t>(img->width) * 3;
+    scratch.resize(row_bytes * num_rows);
+    if (!net_decode(static_cast<net_codec>(used), src + SECTION_HDR, encoded, scratch.data(), scratch.size()))
+        return 0;
+    if (packet_checksum(CHECKSUM_CRC32C, scratch.data(), scratch.size(), start_row, num_rows) != hash)
+        return 0;
+
+    for (int r = 0; r < num_rows; r++) {
+        copy_row_in(img, start_row + r, scratch.data() + r * row_bytes);
+        if (also)
+            copy_row_in(also, start_row + r, scratch.data() + r * row_bytes);
+    }
+    return SECTION_HDR + encoded;
+}
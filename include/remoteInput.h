@@ -0,0 +1,56 @@
+#ifndef REMOTEINPUT_H
+#define REMOTEINPUT_H
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "libppm.h"
+#include "netCodec.h"
+
+// the input image of the split deployment (part3) sent along with the bands, so B needs no
+// copy of it staged beforehand.
+//
+// B opens the exchange on the first connection of the link, before any frame:
+//   B -> A   uint8_t has_copy, int32_t width, int32_t height, uint64_t content hash of its copy
+//   A -> B   int32_t width, int32_t height, uint8_t forward, then rows 0 and height-1 if forward
+// A forwards unless B's copy has the size and content hash of its own. while forwarding, every
+// data frame carries the input rows of its band, full width, between header and payload.
+// B's stages only read the rows of their own band (the halo rows of the blur are S1's, which
+// stays on A), so a band's input rows always arrive with it and never ahead of it.
+
+// crc32c of every row, chained
+uint64_t image_content_hash(const image_t* img);
+
+// height x width image with contiguous pixels. shared: the pixels live in a MAP_SHARED mapping,
+// rows a forked child fills in are seen by its parent. exits on error
+image_t* alloc_image(int height, int width, bool shared);
+
+// row of img, full width, to / from width * 3 packed bytes
+void copy_row_out(const image_t* img, int row, uint8_t* dst);
+void copy_row_in(image_t* img, int row, const uint8_t* src);
+
+// A: answers B's request on fd, sets forward. false if the exchange failed
+bool serve_input(int fd, const image_t* img, bool& forward);
+
+// the same two steps for a server that reads the request on its own loop (include/bandServer.h).
+// content_hash is image_content_hash(img), nullptr hashes img only if the request needs it
+const size_t INPUT_REQUEST_BYTES = sizeof(uint8_t) + sizeof(int32_t) * 2 + sizeof(uint64_t);
+bool input_wanted(const uint8_t* request, const image_t* img, const uint64_t* content_hash);
+void input_reply(const image_t* img, bool forward, std::vector<uint8_t>& reply);
+
+// B: asks for the input on fd. local is B's own copy or nullptr. returns local if A found it
+// to match, otherwise an image of A's size with rows 0 and height-1 filled in, the rest come
+// with the bands. nullptr if the exchange failed
+image_t* request_input(int fd, image_t* local, bool shared, bool& forwarded);
+
+// bytes the input rows of a band take in a frame at most
+size_t input_section_bytes(int num_rows, int width);
+
+// A: the input rows of a band into dst (room for input_section_bytes), returns the bytes used.
+// encoded like the payload, with a checksum of their own: the packet's only covers the payload
+size_t put_input_rows(const image_t* img, int start_row, int num_rows, netEncoder& codec, bool compress, uint8_t* dst, std::vector<uint8_t>& scratch);
+
+// B: reads the input rows of a band from src into img (and into also, when not nullptr), returns
+// the bytes they took, 0 if they don't decode or don't match their checksum
+size_t take_input_rows(const uint8_t* src, size_t len, image_t* img, image_t* also, int start_row, int num_rows, std::vector<uint8_t>& scratch);
+
+#endif
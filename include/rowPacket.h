@@ -14,13 +14,19 @@ public:
     int cols_per_row;     
     std::vector<uint8_t> pixels; 
     std::size_t hash;     
+    uint8_t hash_algo;    // checksum_algo that produced hash
     bool is_last;         // sentinel packet
+    int sequence;         // order in which the producer emitted it
+    int epoch;            // job the packet belongs to, -1 on the shutdown sentinel
 
 
     rowPacket(int start_row_, int num_rows_, int cols_per_row_);
 
     explicit rowPacket(bool is_last_flag);
 
+    // descriptor_only: no pixel storage, the rows live in a buffer shared by the stages
+    rowPacket(int start_row_, int num_rows_, int cols_per_row_, bool descriptor_only);
+
     // helper to get pointer to RGB triplet for given row_offset (0..num_rows-1) and col_index (0..cols_per_row-1)
     inline uint8_t* pixel_ptr(int row_offset, int col_index) {
         size_t idx = (static_cast<size_t>(row_offset) * cols_per_row + static_cast<size_t>(col_index)) * 3;
@@ -0,0 +1,203 @@
+#include "shmRing.h"
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <new>
+#include <sched.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static const uint32_t SPIN_LIMIT = 4000;        // polls before an adaptive wait sleeps, a few microseconds
+static const uint32_t POLL_YIELD_EVERY = 1024;  // a polling side still yields now and then, so an oversubscribed box makes progress
+static const long PEER_CHECK_NS = 50000000;     // a sleeper watching its peer wakes this often to see whether it is still there
+
+static const size_t RING_HDR_SIZE = sizeof(shm_ring_t);     // whole cache lines, the first slot starts on its own
+static const size_t SLOT_HDR_SIZE = 64;                     // the sequence of a slot, alone on its line
+
+static const char* const SYNC_NAMES[] = {"block", "adaptive", "poll"};
+
+bool parse_shm_sync_mode(const char* name, shm_sync_mode& mode) {
+    for (int m = SHM_SYNC_BLOCK; m <= SHM_SYNC_POLL; m++) {
+        if (strcmp(name, SYNC_NAMES[m]) == 0) {
+            mode = static_cast<shm_sync_mode>(m);
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* shm_sync_name(shm_sync_mode mode) {
+    return SYNC_NAMES[mode];
+}
+
+static size_t slot_size(size_t block_bytes) {
+    return SLOT_HDR_SIZE + ((block_bytes + 63) & ~static_cast<size_t>(63));
+}
+
+static char* slot(shm_ring_t* ring, uint64_t pos) {
+    return reinterpret_cast<char*>(ring) + RING_HDR_SIZE + (pos % ring->slots) * ring->slot_size;
+}
+
+static std::atomic<uint32_t>& sequence(char* slot) {
+    return *reinterpret_cast<std::atomic<uint32_t>*>(slot);
+}
+
+// the sequence of the slot a block (as handed out) lives in
+static std::atomic<uint32_t>& sequence_of(const char* block) {
+    return sequence(const_cast<char*>(block) - SLOT_HDR_SIZE);
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// the mapping is MAP_SHARED, so the futexes are the process-shared (non private) kind
+// true if the wait timed out
+static bool futex_wait(std::atomic<uint32_t>& word, uint32_t seen, const timespec* timeout) {
+    if (syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, seen, timeout, nullptr, 0) == -1) {
+        if (errno == ETIMEDOUT)
+            return true;
+        if (errno != EAGAIN && errno != EINTR) {
+            perror("futex wait");
+            _exit(1);
+        }
+    }
+    return false;
+}
+
+static void futex_wake(std::atomic<uint32_t>& word) {
+    if (syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0) == -1) {
+        perror("futex wake");
+        _exit(1);
+    }
+}
+
+// one round of waiting for seq to move away from seen. a sleeper announces itself before its
+// last look at seq and the other side stores seq before it looks for sleepers (both seq_cst),
+// so either the sleeper sees the new value or the other side sees the sleeper; futex_wait
+// itself gives up if seq moved in between. a side that watches its peer sleeps PEER_CHECK_NS
+// at most; true when it is time to look at the peer (a sleep ran out, a poller yields)
+static bool backoff(const shm_ring_t* ring, std::atomic<uint32_t>& seq, uint32_t seen, std::atomic<uint32_t>& sleepers, uint32_t& spins, bool watching) {
+    spins++;
+    if (ring->mode == SHM_SYNC_POLL) {
+        if (spins % POLL_YIELD_EVERY == 0) {
+            sched_yield();
+            return true;
+        }
+        cpu_relax();
+        return false;
+    }
+    if (spins <= ring->spin_limit) {
+        cpu_relax();
+        return false;
+    }
+
+    static const timespec peer_check = {0, PEER_CHECK_NS};
+    bool timed_out = false;
+    sleepers.fetch_add(1, std::memory_order_seq_cst);
+    if (seq.load(std::memory_order_seq_cst) == seen)
+        timed_out = futex_wait(seq, seen, watching ? &peer_check : nullptr);
+    sleepers.fetch_sub(1, std::memory_order_seq_cst);
+    return timed_out;
+}
+
+static void advance(std::atomic<uint32_t>& seq, uint32_t value, std::atomic<uint32_t>& sleepers) {
+    seq.store(value, std::memory_order_seq_cst);
+    if (sleepers.load(std::memory_order_seq_cst) != 0)
+        futex_wake(seq);
+}
+
+// a pidfd turns readable once its process exited
+static bool process_exited(int pidfd) {
+    pollfd p = {pidfd, POLLIN, 0};
+    return poll(&p, 1, 0) > 0;
+}
+
+// claims the next position whose slot sequence is position + ready, waits while it lags behind.
+// with a peer pidfd (-1: none) it gives up, nullptr, once the peer exited and the slot still lags
+static char* claim(shm_ring_t* ring, std::atomic<uint64_t>& position, uint32_t ready, std::atomic<uint32_t>& sleepers, int peer_fd) {
+    uint32_t spins = 0;
+    bool peer_gone = false;
+    uint64_t pos = position.load(std::memory_order_relaxed);
+
+    while (true) {
+        char* s = slot(ring, pos);
+        uint32_t seq = sequence(s).load(std::memory_order_acquire);
+        int32_t diff = static_cast<int32_t>(seq - static_cast<uint32_t>(pos + ready));
+
+        if (diff == 0) {
+            if (position.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                return s + SLOT_HDR_SIZE;
+        }
+        else if (diff < 0) {
+            // this was the look after the peer exited, whatever it published before is in
+            if (peer_gone)
+                return nullptr;
+            if (backoff(ring, sequence(s), seq, sleepers, spins, peer_fd >= 0) && peer_fd >= 0)
+                peer_gone = process_exited(peer_fd);
+            pos = position.load(std::memory_order_relaxed);
+        }
+        else {
+            // another side of our kind got there first
+            pos = position.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+size_t shm_ring_bytes(int slots, size_t block_bytes) {
+    return RING_HDR_SIZE + static_cast<size_t>(slots) * slot_size(block_bytes);
+}
+
+void shm_ring_init(shm_ring_t* ring, int slots, size_t block_bytes, shm_sync_mode mode) {
+    ring->slots = static_cast<uint32_t>(slots);
+    ring->slot_size = static_cast<uint32_t>(slot_size(block_bytes));
+    ring->mode = mode;
+
+    // polling only pays when the other side runs at the same time
+    ring->spin_limit = (mode == SHM_SYNC_ADAPTIVE && sysconf(_SC_NPROCESSORS_ONLN) > 1) ? SPIN_LIMIT : 0;
+
+    new (&ring->head) std::atomic<uint64_t>(0);
+    new (&ring->head_sleepers) std::atomic<uint32_t>(0);
+    new (&ring->tail) std::atomic<uint64_t>(0);
+    new (&ring->tail_sleepers) std::atomic<uint32_t>(0);
+
+    for (uint32_t i = 0; i < ring->slots; i++)
+        new (&sequence(slot(ring, i))) std::atomic<uint32_t>(i);
+}
+
+char* shm_ring_acquire(shm_ring_t* ring) {
+    return claim(ring, ring->head, 0, ring->head_sleepers, -1);
+}
+
+// claimed at position p, the slot still reads p
+void shm_ring_publish(shm_ring_t* ring, char* block) {
+    std::atomic<uint32_t>& seq = sequence_of(block);
+    advance(seq, seq.load(std::memory_order_relaxed) + 1, ring->tail_sleepers);
+}
+
+const char* shm_ring_peek(shm_ring_t* ring) {
+    return claim(ring, ring->tail, 1, ring->tail_sleepers, -1);
+}
+
+const char* shm_ring_peek_from(shm_ring_t* ring, int producer_pidfd) {
+    return claim(ring, ring->tail, 1, ring->tail_sleepers, producer_pidfd);
+}
+
+// claimed at position p, the slot reads p + 1; free for position p + slots
+void shm_ring_release(shm_ring_t* ring, const char* block) {
+    std::atomic<uint32_t>& seq = sequence_of(block);
+    advance(seq, seq.load(std::memory_order_relaxed) + ring->slots - 1, ring->head_sleepers);
+}
+
+size_t shm_ring_occupancy(const shm_ring_t* ring) {
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    return head > tail ? static_cast<size_t>(head - tail) : 0;
+}
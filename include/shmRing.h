@@ -0,0 +1,73 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// ring of fixed size blocks in a shared mapping, any number of producer and consumer processes.
+// blocks are used where they lie: a producer acquires a free slot, builds the block straight
+// into it and publishes it, a consumer peeks at a published block, reads it in place and
+// releases the slot. nothing is staged in a private buffer on either side.
+//
+// every slot carries a sequence number (bounded mpmc queue after Vyukov): producers claim
+// positions with a CAS on head, consumers with a CAS on tail, and the slot's sequence says
+// whether position p is free (p), published (p + 1) or still being read. blocks come out in
+// the order their positions were claimed; with several producers or consumers nothing orders
+// the work done between claim and publish / release.
+//
+// the ring synchronizes itself, no semaphores: a side that finds its slot not ready polls its
+// sequence for a while, then sleeps on it with futex(2). the other side only enters the kernel
+// to wake it when someone actually sleeps, so a steady stream of blocks costs no system calls.
+
+enum shm_sync_mode {
+    SHM_SYNC_BLOCK,         // futex wait as soon as the ring is full / empty
+    SHM_SYNC_ADAPTIVE,      // poll a few microseconds first, then futex wait (no polling on a single cpu)
+    SHM_SYNC_POLL           // busy-poll, never sleep. for stages pinned to cores of their own
+};
+
+bool parse_shm_sync_mode(const char* name, shm_sync_mode& mode);
+const char* shm_sync_name(shm_sync_mode mode);
+
+// head of the mapping, followed by the slots (a cache line with the sequence, then the block).
+// each side's position sits on its own cache line with its count of sleepers
+typedef struct shm_ring_t {
+    uint32_t slots;
+    uint32_t slot_size;             // sequence line + block size rounded up to whole cache lines
+    uint32_t spin_limit;            // polls before a wait sleeps
+    uint32_t mode;                  // shm_sync_mode
+
+    // producers: next position to claim, producers asleep on a slot that is still in use
+    alignas(64) std::atomic<uint64_t> head;
+    std::atomic<uint32_t> head_sleepers;
+
+    // consumers: next position to claim, consumers asleep on a slot not published yet
+    alignas(64) std::atomic<uint64_t> tail;
+    std::atomic<uint32_t> tail_sleepers;
+} shm_ring_t;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring positions are shared between processes");
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "slot sequences double as futex words");
+
+// bytes to map for a ring of slots blocks of block_bytes each
+size_t shm_ring_bytes(int slots, size_t block_bytes);
+
+// lays out an empty ring at the start of a mapping of shm_ring_bytes(slots, block_bytes),
+// before any side uses it
+void shm_ring_init(shm_ring_t* ring, int slots, size_t block_bytes, shm_sync_mode mode);
+
+// producer: waits for a free slot and returns its block, not visible before publish
+char* shm_ring_acquire(shm_ring_t* ring);
+void shm_ring_publish(shm_ring_t* ring, char* block);
+
+// consumer: waits for the oldest unclaimed published block, it stays valid until release
+const char* shm_ring_peek(shm_ring_t* ring);
+
+// consumer: as shm_ring_peek, for a ring with one producer process behind producer_pidfd
+// (a pidfd, -1 waits like shm_ring_peek). nullptr once it exited and nothing is left to read
+const char* shm_ring_peek_from(shm_ring_t* ring, int producer_pidfd);
+void shm_ring_release(shm_ring_t* ring, const char* block);
+
+// blocks claimed by producers and not yet claimed by consumers, roughly (both sides move)
+size_t shm_ring_occupancy(const shm_ring_t* ring);
+
+#endif
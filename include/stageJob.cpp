@@ -0,0 +1,139 @@
+#include "stageJob.h"
+#include "packetIO.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <initializer_list>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static_assert(sizeof(stage_job_t) <= PIPE_BUF, "a job descriptor must be written atomically");
+
+stage_job_t make_stage_job(int32_t job, const char* path, const char* output, int input_fd, int height, int width, int iterations) {
+    stage_job_t d;
+    memset(&d, 0, sizeof(d));
+
+    for (const char* p : {path, output}) {
+        if (strlen(p) >= STAGE_JOB_PATH_MAX) {
+            fprintf(stderr, "stage job: path longer than %zu bytes: %s\n", STAGE_JOB_PATH_MAX - 1, p);
+            exit(1);
+        }
+    }
+    d.job = job;
+    d.height = height;
+    d.width = width;
+    d.iterations = iterations;
+    d.input_fd = input_fd;
+    d.input_bytes = static_cast<uint64_t>(height) * width * 3;
+    strcpy(d.path, path);
+    strcpy(d.output, output);
+    return d;
+}
+
+bool send_stage_job(int fd, const stage_job_t& job) {
+    return write_all(fd, &job, sizeof(job)) == static_cast<ssize_t>(sizeof(job));
+}
+
+bool recv_stage_job(int fd, stage_job_t& job) {
+    if (read_all(fd, &job, sizeof(job)) != static_cast<ssize_t>(sizeof(job)))
+        return false;
+    job.path[STAGE_JOB_PATH_MAX - 1] = '\0';
+    job.output[STAGE_JOB_PATH_MAX - 1] = '\0';
+    return true;
+}
+
+int create_stage_input(const char* name) {
+    int fd = memfd_create(name, MFD_CLOEXEC);
+    if (fd == -1) {
+        perror("memfd_create");
+        exit(1);
+    }
+    return fd;
+}
+
+bool stage_job_input(int fd, const image_t* input_image) {
+    size_t row_bytes = static_cast<size_t>(input_image->width) * 3;
+    size_t input_bytes = row_bytes * input_image->height;
+
+    if (ftruncate(fd, static_cast<off_t>(input_bytes)) == -1) {
+        perror("ftruncate");
+        return false;
+    }
+    if (input_bytes == 0)
+        return true;
+    void* p = mmap(nullptr, input_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    uint8_t* dst = static_cast<uint8_t*>(p);
+    for (int i = 0; i < input_image->height; i++)
+        for (int j = 0; j < input_image->width; j++)
+            memcpy(dst + i * row_bytes + j * 3, input_image->image_pixels[i][j], 3);
+
+    munmap(p, input_bytes);
+    return true;
+}
+
+// an image_t whose pixel pointers point into a packed height * width * 3 buffer
+static image_t* image_view(uint8_t* pixels, int height, int width) {
+    image_t* view = new image_t;
+    view->height = height;
+    view->width = width;
+    view->image_pixels = new uint8_t**[height];
+    for (int i = 0; i < height; i++) {
+        view->image_pixels[i] = new uint8_t*[width];
+        for (int j = 0; j < width; j++)
+            view->image_pixels[i][j] = pixels + (static_cast<size_t>(i) * width + j) * 3;
+    }
+    return view;
+}
+
+image_t* map_job_image(const stage_job_t& job) {
+    struct stat st;
+    if (fstat(job.input_fd, &st) == -1) {
+        perror("stage job: input");
+        return nullptr;
+    }
+    if (job.height < 0 || job.width < 0 || job.input_bytes != static_cast<uint64_t>(job.height) * job.width * 3
+        || static_cast<uint64_t>(st.st_size) < job.input_bytes) {
+        fprintf(stderr, "stage job %d: staged input is %lld bytes, expected %dx%d\n", job.job, static_cast<long long>(st.st_size), job.width, job.height);
+        return nullptr;
+    }
+
+    void* p = nullptr;
+    if (job.input_bytes > 0) {
+        p = mmap(nullptr, job.input_bytes, PROT_READ, MAP_SHARED, job.input_fd, 0);
+        if (p == MAP_FAILED) {
+            perror("mmap input");
+            return nullptr;
+        }
+    }
+    return image_view(static_cast<uint8_t*>(p), job.height, job.width);
+}
+
+void unmap_job_image(const stage_job_t& job, image_t* image) {
+    if (!image)
+        return;
+    if (job.input_bytes > 0)
+        munmap(image->image_pixels[0][0], job.input_bytes);
+    for (int i = 0; i < image->height; i++)
+        delete[] image->image_pixels[i];
+    delete[] image->image_pixels;
+    delete image;
+}
+
+void free_job_image(image_t* image) {
+    if (!image)
+        return;
+    for (int i = 0; i < image->height; i++) {
+        for (int j = 0; j < image->width; j++)
+            delete[] image->image_pixels[i][j];
+        delete[] image->image_pixels[i];
+    }
+    delete[] image->image_pixels;
+    delete image;
+}
@@ -0,0 +1,51 @@
+#ifndef STAGEJOB_H
+#define STAGEJOB_H
+#include <cstddef>
+#include <cstdint>
+#include "libppm.h"
+
+// resident stage processes: they are forked once, before any image is read, and then get one
+// descriptor per image over a control pipe. fork (and copying the page tables of a loaded
+// image) stays off the critical path and back to back jobs run on warm processes.
+// closing the control pipe shuts the stage down.
+//
+// the parent reads each image once and stages its pixels in an anonymous memfd it created
+// before forking, the stages map that read-only instead of parsing the file again.
+
+const size_t STAGE_JOB_PATH_MAX = 1024;
+
+typedef struct stage_job_t {
+    int32_t job;                        // 0, 1, 2 .. in the order the parent sends them
+    int32_t height;
+    int32_t width;
+    int32_t iterations;                 // epochs to run over the image
+    int32_t input_fd;                   // memfd holding the input pixels, inherited from the parent
+    uint64_t input_bytes;               // height * width * 3, packed rows
+    char path[STAGE_JOB_PATH_MAX];      // input image, only for messages
+    char output[STAGE_JOB_PATH_MAX];    // output image, created by the parent for S3 to map
+} stage_job_t;
+
+// exits if a path does not fit the descriptor
+stage_job_t make_stage_job(int32_t job, const char* path, const char* output, int input_fd, int height, int width, int iterations);
+
+// a descriptor is smaller than PIPE_BUF, so it goes through a pipe in one piece.
+// recv_stage_job is false once the control pipe is closed (or broken)
+bool send_stage_job(int fd, const stage_job_t& job);
+bool recv_stage_job(int fd, stage_job_t& job);
+
+// the memfd the parent stages every job's input in, exits if it can't be created. create it
+// before forking the stages
+int create_stage_input(const char* name);
+
+// copies input_image into fd as packed rows, false on error. no stage may still read the
+// previous job's input
+bool stage_job_input(int fd, const image_t* input_image);
+
+// maps job.input_fd read-only as an image_t, nullptr if it does not hold the job's pixels
+image_t* map_job_image(const stage_job_t& job);
+void unmap_job_image(const stage_job_t& job, image_t* image);
+
+// frees an image from read_ppm_file
+void free_job_image(image_t* image);
+
+#endif
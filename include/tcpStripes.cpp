@@ -0,0 +1,266 @@
+#include "tcpStripes.h"
+#include "packetIO.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <linux/sockios.h>
+#include <arpa/inet.h>
+
+static const uint32_t STRIPE_MAGIC = 0x53545250;    // "STRP"
+
+// hello: uint32_t magic, uint32_t value (connections wanted on the first connection, the
+// connection's index on the others), network byte order. the reply to the first hello is the
+// agreed count, same order
+static bool send_word_pair(int fd, uint32_t a, uint32_t b) {
+    uint32_t words[2] = {htonl(a), htonl(b)};
+    return send_all(fd, words, sizeof(words));
+}
+
+bool stripes_parse_hello(const uint8_t* hello, uint32_t& value) {
+    uint32_t words[2];
+    memcpy(words, hello, sizeof(words));
+    if (ntohl(words[0]) != STRIPE_MAGIC) {
+        fprintf(stderr, "stripes: bad hello\n");
+        return false;
+    }
+    value = ntohl(words[1]);
+    return true;
+}
+
+uint32_t stripes_agreed_reply(uint32_t agreed) {
+    return htonl(agreed);
+}
+
+static bool recv_hello(int fd, uint32_t& value) {
+    uint8_t hello[STRIPE_HELLO_BYTES];
+    if (!recv_all(fd, hello, sizeof(hello))) {
+        fprintf(stderr, "stripes: bad hello\n");
+        return false;
+    }
+    return stripes_parse_hello(hello, value);
+}
+
+bool stripes_accept(int server_fd, int max_connections, std::vector<int>& fds) {
+    uint32_t wanted = 0;
+    int fd = accept(server_fd, nullptr, nullptr);
+    if (fd < 0) {
+        perror("accept");
+        return false;
+    }
+    fds.push_back(fd);
+    if (!recv_hello(fd, wanted))
+        return false;
+
+    uint32_t agreed = std::max<uint32_t>(1, std::min<uint32_t>(wanted, static_cast<uint32_t>(max_connections)));
+    uint32_t reply = stripes_agreed_reply(agreed);
+    if (!send_all(fd, &reply, sizeof(reply)))
+        return false;
+
+    for (uint32_t k = 1; k < agreed; k++) {
+        uint32_t index = 0;
+        fd = accept(server_fd, nullptr, nullptr);
+        if (fd < 0) {
+            perror("accept");
+            return false;
+        }
+        fds.push_back(fd);
+        if (!recv_hello(fd, index) || index != k) {
+            fprintf(stderr, "stripes: connection %u came in as %u\n", k, index);
+            return false;
+        }
+    }
+    return true;
+}
+
+static int connect_one(const sockaddr_in& addr) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(fd, (const sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool stripes_connect(const sockaddr_in& addr, int wanted, std::vector<int>& fds) {
+    int fd = connect_one(addr);
+    if (fd < 0)
+        return false;
+    fds.push_back(fd);
+
+    uint32_t agreed = 0;
+    if (!send_word_pair(fd, STRIPE_MAGIC, static_cast<uint32_t>(std::max(1, wanted))) || !recv_all(fd, &agreed, sizeof(agreed)))
+        return false;
+    agreed = ntohl(agreed);
+
+    for (uint32_t k = 1; k < agreed; k++) {
+        fd = connect_one(addr);
+        if (fd < 0)
+            return false;
+        fds.push_back(fd);
+        if (!send_word_pair(fd, STRIPE_MAGIC, k))
+            return false;
+    }
+    return true;
+}
+
+void stripes_close(std::vector<int>& fds) {
+    for (int fd : fds)
+        close(fd);
+    fds.clear();
+}
+
+
+// unsent bytes in the socket buffer of fd, 0 where the kernel won't say
+static int queued_bytes(int fd) {
+    int queued = 0;
+    if (ioctl(fd, SIOCOUTQ, &queued) < 0)
+        queued = 0;
+    return queued;
+}
+
+size_t stripeSender::backlog() const {
+    int least = -1;
+    for (int fd : fds) {
+        int queued = queued_bytes(fd);
+        if (least < 0 || queued < least)
+            least = queued;
+    }
+    return static_cast<size_t>(std::max(0, least));
+}
+
+size_t stripeSender::pick() {
+    size_t best = next;
+    if (policy == STRIPE_LEAST_QUEUED) {
+        // starting at next, so ties still go round robin
+        int best_queued = -1;
+        for (size_t k = 0; k < fds.size(); k++) {
+            size_t c = (next + k) % fds.size();
+            int queued = queued_bytes(fds[c]);
+            if (best_queued < 0 || queued < best_queued) {
+                best = c;
+                best_queued = queued;
+            }
+        }
+    }
+    next = (best + 1) % fds.size();
+    return best;
+}
+
+// length and frame in one sendmsg, a short write continues where it stopped
+static bool send_frame(int fd, const char* frame, size_t len) {
+    uint32_t prefix = static_cast<uint32_t>(len);
+    iovec iov[2] = {{&prefix, sizeof(prefix)}, {const_cast<char*>(frame), len}};
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("sendmsg");
+            return false;
+        }
+        while (msg.msg_iovlen > 0 && static_cast<size_t>(n) >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = static_cast<char*>(msg.msg_iov->iov_base) + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+bool stripeSender::send(const char* frame, size_t len) {
+    size_t c = pick();
+    sent[c]++;
+    return send_frame(fds[c], frame, len);
+}
+
+bool stripeSender::send_to_all(const char* frame, size_t len) {
+    for (int fd : fds)
+        if (!send_frame(fd, frame, len))
+            return false;
+    return true;
+}
+
+
+stripeReceiver::stripeReceiver(const std::vector<int>& fds_, size_t max_frame_bytes_, int32_t max_frames_)
+    : fds(fds_), max_frame_bytes(max_frame_bytes_), max_frames(max_frames_), open(fds_.size(), true)
+{
+    for (int fd : fds)
+        polled.push_back(pollfd{fd, POLLIN, 0});
+}
+
+int stripeReceiver::next(std::vector<char>& frame) {
+    while (true) {
+        // serve what the last poll found before polling again, one frame per connection
+        for (; ready_at < polled.size(); ready_at++) {
+            if (!open[ready_at] || !(polled[ready_at].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            int conn = static_cast<int>(ready_at++);
+            uint32_t len = 0;
+            if (!recv_all(fds[conn], &len, sizeof(len)))
+                return -1;
+            if (len > max_frame_bytes) {
+                fprintf(stderr, "stripes: frame of %u bytes on connection %d, at most %zu expected\n", len, conn, max_frame_bytes);
+                return -1;
+            }
+            frame.resize(len);
+            if (!recv_all(fds[conn], frame.data(), len))
+                return -1;
+            return conn;
+        }
+
+        for (size_t c = 0; c < polled.size(); c++) {
+            polled[c].fd = open[c] ? fds[c] : -1;
+            polled[c].revents = 0;
+        }
+        if (poll(polled.data(), polled.size(), -1) < 0 && errno != EINTR) {
+            perror("poll");
+            return -1;
+        }
+        ready_at = 0;
+    }
+}
+
+bool stripeReceiver::take(int32_t sequence) {
+    // the sequence comes off the wire, it must not size seen beyond what a stream can have
+    if (sequence < 0 || sequence >= max_frames)
+        return false;
+    if (static_cast<size_t>(sequence) >= seen.size())
+        seen.resize(static_cast<size_t>(sequence) + 1, false);
+    if (seen[sequence])
+        return false;
+    seen[sequence] = true;
+    received++;
+    return true;
+}
+
+void stripeReceiver::end_of(int conn, int32_t announced) {
+    if (!open[conn])
+        return;
+    open[conn] = false;
+    ended++;
+    if (total >= 0 && total != announced)
+        totals_agree = false;
+    total = announced;
+}
+
+bool stripeReceiver::complete() const {
+    return done() && totals_agree && received == total;
+}
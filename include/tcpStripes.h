@@ -0,0 +1,111 @@
+#ifndef TCPSTRIPES_H
+#define TCPSTRIPES_H
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <poll.h>
+#include <netinet/in.h>
+
+// one logical link of the split deployment (part3) over N parallel TCP connections, so a
+// single congestion window and a single receiving core stop bounding it.
+//
+// N is agreed when the link comes up: the connecting side opens the first connection and asks
+// for the count it wants, the listening side answers with that count capped at its own maximum
+// and the connecting side opens the remaining connections. every connection starts with a
+// small hello, so a stray client can't slip in.
+//
+// frames are written whole to one connection each, behind a uint32_t with their length (host
+// order, both ends are this program), so a frame carries only the bytes it uses. the sender
+// numbers them (the sequence lives in the program's frame header) and ends the link with a
+// terminal frame on every connection that carries the number of data frames. the receiver takes frames from whichever connection
+// has one, so they arrive in any order: the stages place rows by start_row.
+
+enum stripe_policy {
+    STRIPE_ROUND_ROBIN,     // connection after connection
+    STRIPE_LEAST_QUEUED     // the connection with the fewest unsent bytes in its socket buffer
+};
+
+// listening side: accepts the first connection from server_fd, agrees on a count of at most
+// max_connections and accepts the rest. false if the handshake fails
+bool stripes_accept(int server_fd, int max_connections, std::vector<int>& fds);
+
+// connecting side: asks for wanted connections, fds holds as many as the peer agreed to
+bool stripes_connect(const sockaddr_in& addr, int wanted, std::vector<int>& fds);
+
+void stripes_close(std::vector<int>& fds);
+
+// the same handshake for a server that runs it on its own event loop (include/bandServer.h):
+// the bytes of a hello, its value (false if it is not one) and the reply agreeing to a count
+const size_t STRIPE_HELLO_BYTES = 2 * sizeof(uint32_t);
+bool stripes_parse_hello(const uint8_t* hello, uint32_t& value);
+uint32_t stripes_agreed_reply(uint32_t agreed);
+
+// bytes of the length in front of every frame
+const size_t STRIPE_PREFIX_BYTES = sizeof(uint32_t);
+
+
+class stripeSender {
+public:
+    stripeSender(const std::vector<int>& fds_, stripe_policy policy_) : fds(fds_), policy(policy_) {}
+
+    // writes one whole frame of len bytes to the connection the policy picks, false on error
+    bool send(const char* frame, size_t len);
+
+    // the same frame on every connection, for the terminal
+    bool send_to_all(const char* frame, size_t len);
+
+    // bytes still unsent on the connection with the fewest, what the next frame queues behind
+    // under STRIPE_LEAST_QUEUED
+    size_t backlog() const;
+
+    // data frames handed to each connection so far
+    const std::vector<long>& frames_per_connection() const { return sent; }
+
+private:
+    size_t pick();
+
+    std::vector<int> fds;
+    stripe_policy policy;
+    size_t next = 0;
+    std::vector<long> sent = std::vector<long>(fds.size(), 0);
+};
+
+
+// receiving side of a link
+class stripeReceiver {
+public:
+    // a frame longer than max_frame_bytes_ breaks the link. a stream has at most max_frames_ data
+    // frames, a sequence past them is refused
+    stripeReceiver(const std::vector<int>& fds_, size_t max_frame_bytes_, int32_t max_frames_);
+
+    // the next whole frame from any connection still open, frame is resized to it. returns the
+    // connection it came from, -1 once a connection broke
+    int next(std::vector<char>& frame);
+
+    // the program saw a data frame with sequence, false for a duplicate or one out of range
+    bool take(int32_t sequence);
+
+    // the program saw the terminal on connection conn, announcing total data frames
+    void end_of(int conn, int32_t total);
+
+    // every connection sent its terminal
+    bool done() const { return ended == static_cast<int>(fds.size()); }
+
+    // done, the terminals agree and every sequence below their total arrived
+    bool complete() const;
+
+private:
+    std::vector<int> fds;
+    size_t max_frame_bytes;
+    int32_t max_frames;
+    std::vector<pollfd> polled;
+    std::vector<bool> open;
+    std::vector<bool> seen;     // by sequence
+    size_t ready_at = 0;        // where to look in polled for the next readable connection
+    int32_t received = 0;
+    int32_t total = -1;
+    bool totals_agree = true;
+    int ended = 0;
+};
+
+#endif
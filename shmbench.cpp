@@ -0,0 +1,186 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "include/shmRing.h"
+
+// per packet hand-off latency of a shm edge between two processes, for every shmRing sync
+// mode and for the process-shared semaphore pair the shm pipelines used before.
+// a ping-pong: the parent publishes a block on one ring, the child copies it back on another,
+// half a round trip is one hand-off
+
+const int DEFAULT_PACKETS = 20000;
+const size_t DEFAULT_PAYLOAD = 64;
+const int WARMUP_PACKETS = 500;
+
+typedef struct sem_pair_t {
+    sem_t empty;
+    sem_t full;
+} sem_pair_t;
+
+static void* map_shared(size_t bytes) {
+    void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return p;
+}
+
+// round trip times in ns, one per packet after the warm-up
+static std::vector<double> ping_pong_ring(shm_sync_mode mode, int packets, size_t payload) {
+    size_t ring_bytes = shm_ring_bytes(1, payload);
+    char* p = static_cast<char*>(map_shared(2 * ring_bytes));
+    shm_ring_t* ping = reinterpret_cast<shm_ring_t*>(p);
+    shm_ring_t* pong = reinterpret_cast<shm_ring_t*>(p + ring_bytes);
+    shm_ring_init(ping, 1, payload, mode);
+    shm_ring_init(pong, 1, payload, mode);
+
+    int total = WARMUP_PACKETS + packets;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        for (int i = 0; i < total; i++) {
+            const char* in = shm_ring_peek(ping);
+            char* out = shm_ring_acquire(pong);
+            memcpy(out, in, payload);
+            shm_ring_release(ping, in);
+            shm_ring_publish(pong, out);
+        }
+        _exit(0);
+    }
+
+    std::vector<double> rtt;
+    rtt.reserve(packets);
+
+    for (int i = 0; i < total; i++) {
+        auto start = std::chrono::steady_clock::now();
+
+        char* out = shm_ring_acquire(ping);
+        memset(out, i & 0xff, payload);
+        shm_ring_publish(ping, out);
+
+        const char* in = shm_ring_peek(pong);
+        if (static_cast<unsigned char>(in[0]) != (i & 0xff)) {
+            std::cerr << "shmbench: packet " << i << " came back wrong\n";
+            exit(1);
+        }
+        shm_ring_release(pong, in);
+
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        if (i >= WARMUP_PACKETS)
+            rtt.push_back(elapsed.count());
+    }
+
+    waitpid(pid, nullptr, 0);
+    munmap(p, 2 * ring_bytes);
+    return rtt;
+}
+
+static std::vector<double> ping_pong_semaphores(int packets, size_t payload) {
+    size_t block = (sizeof(sem_pair_t) + payload + 63) & ~static_cast<size_t>(63);
+    char* p = static_cast<char*>(map_shared(2 * block));
+    sem_pair_t* ping = reinterpret_cast<sem_pair_t*>(p);
+    sem_pair_t* pong = reinterpret_cast<sem_pair_t*>(p + block);
+    char* ping_data = p + sizeof(sem_pair_t);
+    char* pong_data = p + block + sizeof(sem_pair_t);
+
+    for (sem_pair_t* s : {ping, pong}) {
+        if (sem_init(&s->empty, 1, 1) != 0 || sem_init(&s->full, 1, 0) != 0) {
+            perror("sem_init");
+            exit(1);
+        }
+    }
+
+    int total = WARMUP_PACKETS + packets;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        for (int i = 0; i < total; i++) {
+            sem_wait(&ping->full);
+            sem_wait(&pong->empty);
+            memcpy(pong_data, ping_data, payload);
+            sem_post(&ping->empty);
+            sem_post(&pong->full);
+        }
+        _exit(0);
+    }
+
+    std::vector<double> rtt;
+    rtt.reserve(packets);
+
+    for (int i = 0; i < total; i++) {
+        auto start = std::chrono::steady_clock::now();
+
+        sem_wait(&ping->empty);
+        memset(ping_data, i & 0xff, payload);
+        sem_post(&ping->full);
+
+        sem_wait(&pong->full);
+        if (static_cast<unsigned char>(pong_data[0]) != (i & 0xff)) {
+            std::cerr << "shmbench: packet " << i << " came back wrong\n";
+            exit(1);
+        }
+        sem_post(&pong->empty);
+
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        if (i >= WARMUP_PACKETS)
+            rtt.push_back(elapsed.count());
+    }
+
+    waitpid(pid, nullptr, 0);
+    for (sem_pair_t* s : {ping, pong}) {
+        sem_destroy(&s->empty);
+        sem_destroy(&s->full);
+    }
+    munmap(p, 2 * block);
+    return rtt;
+}
+
+static void report(const char* name, std::vector<double> rtt) {
+    std::sort(rtt.begin(), rtt.end());
+    auto at = [&rtt](double q) { return rtt[std::min(rtt.size() - 1, static_cast<size_t>(q * rtt.size()))] / 2; };
+
+    double sum = 0;
+    for (double t : rtt)
+        sum += t;
+
+    std::cout << "  " << name << std::string(12 - strlen(name), ' ')
+              << "mean " << sum / rtt.size() / 2 << " ns,  p50 " << at(0.50) << " ns,  p99 " << at(0.99) << " ns\n";
+}
+
+int main(int argc, char **argv) {
+    if (argc > 3) {
+        std::cout << "usage: ./shmbench [packets] [payload-bytes]\n";
+        return 0;
+    }
+
+    int packets = argc > 1 ? std::atoi(argv[1]) : DEFAULT_PACKETS;
+    size_t payload = argc > 2 ? static_cast<size_t>(std::atol(argv[2])) : DEFAULT_PAYLOAD;
+    if (packets <= 0 || payload == 0) {
+        std::cerr << "shmbench: packets and payload must be positive\n";
+        return 1;
+    }
+
+    std::cout << "shm hand-off latency, " << packets << " packets of " << payload << " bytes, " << sysconf(_SC_NPROCESSORS_ONLN) << " cpus online\n";
+
+    report("semaphores", ping_pong_semaphores(packets, payload));
+    for (shm_sync_mode mode : {SHM_SYNC_BLOCK, SHM_SYNC_ADAPTIVE, SHM_SYNC_POLL})
+        report(shm_sync_name(mode), ping_pong_ring(mode, packets, payload));
+
+    return 0;
+}